@@ -0,0 +1,102 @@
+use std::collections::HashMap;
+
+/// Accesses of one item, coalesced.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Access {
+    /// Unix time of the latest access.
+    pub last_access: i64,
+    /// Number of accesses.
+    pub count: i64,
+}
+
+/// Item accesses recorded in memory until they are flushed to the db in one transaction.
+///
+/// Accesses of the same item are coalesced, so the log grows with the number of distinct items
+/// accessed rather than the number of accesses. Accesses not yet flushed are lost if the process
+/// exits without flushing, which only makes tiering decisions slightly less accurate.
+#[derive(Debug, Default)]
+pub struct AccessLog {
+    pending: HashMap<String, Access>,
+}
+
+impl AccessLog {
+    /// Records an access of the item with `hash` at unix time `at`.
+    pub fn record(&mut self, hash: &str, at: i64) {
+        self.pending
+            .entry(hash.to_owned())
+            .and_modify(|access| {
+                access.last_access = access.last_access.max(at);
+                access.count += 1;
+            })
+            .or_insert(Access {
+                last_access: at,
+                count: 1,
+            });
+    }
+
+    /// Merges accesses taken out of the log back in, e.g. after a failed flush.
+    pub fn restore(&mut self, hash: &str, restored: Access) {
+        self.pending
+            .entry(hash.to_owned())
+            .and_modify(|access| {
+                access.last_access = access.last_access.max(restored.last_access);
+                access.count += restored.count;
+            })
+            .or_insert(restored);
+    }
+
+    /// Number of distinct items with pending accesses.
+    pub fn len(&self) -> usize {
+        self.pending.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.pending.is_empty()
+    }
+
+    /// Removes and returns all pending accesses.
+    pub fn take(&mut self) -> Vec<(String, Access)> {
+        self.pending.drain().collect()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[tokio::test]
+    async fn record_coalesces() {
+        // GIVEN
+        let mut log = AccessLog::default();
+
+        // WHEN
+        log.record("a", 20);
+        log.record("a", 10);
+        log.record("b", 30);
+
+        // THEN
+        assert_eq!(log.len(), 2);
+        let mut accesses = log.take();
+        accesses.sort_by(|access_1, access_2| access_1.0.cmp(&access_2.0));
+        assert_eq!(
+            accesses,
+            vec![
+                (
+                    String::from("a"),
+                    Access {
+                        last_access: 20,
+                        count: 2
+                    }
+                ),
+                (
+                    String::from("b"),
+                    Access {
+                        last_access: 30,
+                        count: 1
+                    }
+                ),
+            ]
+        );
+        assert!(log.is_empty());
+    }
+}
@@ -0,0 +1,583 @@
+use crate::{
+    backend::CHUNK_SIZE,
+    error::{Error, ErrorKind, Result},
+};
+use flate2::read::{DeflateDecoder, MultiGzDecoder};
+use sha2::{Digest, Sha224};
+use std::{
+    fs,
+    io::{self, BufRead, BufReader, Read, Seek, SeekFrom, Write},
+    path::{Path, PathBuf},
+};
+use tokio::{sync::mpsc, task::JoinHandle};
+use uuid::Uuid;
+
+/// Number of leading bytes of a member kept to detect its type.
+const HEAD_SIZE: usize = 64 * 1024;
+
+const GZIP_MAGIC: [u8; 2] = [0x1f, 0x8b];
+const ZIP_LOCAL_HEADER: u32 = 0x0403_4b50;
+const ZIP_CENTRAL_HEADER: u32 = 0x0201_4b50;
+const ZIP_END_OF_CENTRAL_DIR: u32 = 0x0605_4b50;
+const ZIP_LOCAL_HEADER_LEN: usize = 30;
+const ZIP_CENTRAL_HEADER_LEN: usize = 46;
+const ZIP_END_OF_CENTRAL_DIR_LEN: usize = 22;
+
+/// Where an archive is read from.
+pub enum ArchiveSource {
+    /// An archive file, either a zip or a possibly gzipped tar.
+    File(PathBuf),
+    /// A possibly gzipped tar read front to back, e.g. from a pipe.
+    ///
+    /// Zip archives cannot be streamed, as their index is at the end.
+    Stream(Box<dyn Read + Send>),
+}
+
+/// A regular file of an archive, copied to a temporary file.
+#[derive(Debug)]
+pub struct ArchiveMember {
+    /// Path of the member within the archive.
+    pub name: PathBuf,
+    /// Temporary file holding the content of the member.
+    pub temp: PathBuf,
+    pub hash: String,
+    /// Leading bytes of the content, to detect its type.
+    pub head: Vec<u8>,
+}
+
+impl ArchiveMember {
+    /// Removes the temporary file of a member that is not imported.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the temporary file cannot be removed.
+    pub fn discard(self) -> Result<()> {
+        fs::remove_file(self.temp)?;
+        Ok(())
+    }
+}
+
+/// Copies the regular files of an archive to temporary files in `temp_dir` on a blocking thread,
+/// hashing them on the way.
+///
+/// Members are sent in archive order, at most `capacity` ahead of the receiver. Members that
+/// cannot be read, e.g. encrypted zip entries, are sent as `ErrorKind::Unsupported` and
+/// skipped. Closing the receiver stops the copy. The archive itself is only read.
+///
+/// The returned task fails if the archive cannot be read, with
+/// - `ErrorKind::Unsupported` for zip64 archives, or a zip archive in a stream.
+/// - `ErrorKind::IO` for any other error.
+pub fn extract(
+    source: ArchiveSource,
+    temp_dir: PathBuf,
+    capacity: usize,
+) -> (
+    mpsc::Receiver<Result<ArchiveMember>>,
+    JoinHandle<Result<()>>,
+) {
+    let (sender, receiver) = mpsc::channel(capacity);
+    let handle = tokio::task::spawn_blocking(move || {
+        let mut send = |member: Result<ArchiveMember>| match sender.blocking_send(member) {
+            Ok(()) => true,
+            Err(mpsc::error::SendError(member)) => {
+                if let Ok(member) = member {
+                    let _ = member.discard();
+                }
+                false
+            }
+        };
+        read_members(source, &temp_dir, &mut send)
+    });
+    (receiver, handle)
+}
+
+/// Copies the members of an archive, passing each to `send` until it returns false.
+fn read_members(
+    source: ArchiveSource,
+    temp_dir: &Path,
+    send: &mut dyn FnMut(Result<ArchiveMember>) -> bool,
+) -> Result<()> {
+    let mut buffer = vec![0; CHUNK_SIZE];
+    match source {
+        ArchiveSource::File(path) => {
+            let mut file = fs::File::open(path)?;
+            let mut magic = [0; 4];
+            let read = file.read(&mut magic)?;
+            file.rewind()?;
+            if is_zip(&magic[..read]) {
+                read_zip(BufReader::new(file), temp_dir, &mut buffer, send)
+            } else {
+                read_tar(Box::new(file), temp_dir, &mut buffer, send)
+            }
+        }
+        ArchiveSource::Stream(reader) => read_tar(reader, temp_dir, &mut buffer, send),
+    }
+}
+
+fn is_zip(magic: &[u8]) -> bool {
+    magic == ZIP_LOCAL_HEADER.to_le_bytes() || magic == ZIP_END_OF_CENTRAL_DIR.to_le_bytes()
+}
+
+fn read_tar(
+    reader: Box<dyn Read + Send>,
+    temp_dir: &Path,
+    buffer: &mut [u8],
+    send: &mut dyn FnMut(Result<ArchiveMember>) -> bool,
+) -> Result<()> {
+    let mut reader = BufReader::new(reader);
+    let magic = reader.fill_buf()?;
+    if magic.len() >= 4 && is_zip(&magic[..4]) {
+        return Err(Error {
+            msg: String::from("Zip archives cannot be read from a stream."),
+            kind: ErrorKind::Unsupported,
+        });
+    }
+    let gzipped = magic.starts_with(&GZIP_MAGIC);
+    let reader: Box<dyn Read> = if gzipped {
+        Box::new(MultiGzDecoder::new(reader))
+    } else {
+        Box::new(reader)
+    };
+
+    let mut archive = tar::Archive::new(reader);
+    for entry in archive.entries()? {
+        let mut entry = entry?;
+        if !entry.header().entry_type().is_file() {
+            continue;
+        }
+        let name = entry.path()?.into_owned();
+        let member = copy_member(&mut entry, name, temp_dir, buffer)?;
+        if !send(Ok(member)) {
+            return Ok(());
+        }
+    }
+    Ok(())
+}
+
+/// An entry of the central directory of a zip archive.
+struct ZipEntry {
+    name: String,
+    flags: u16,
+    method: u16,
+    crc: u32,
+    compressed_size: u64,
+    local_header_offset: u64,
+}
+
+fn read_zip<R>(
+    mut reader: R,
+    temp_dir: &Path,
+    buffer: &mut [u8],
+    send: &mut dyn FnMut(Result<ArchiveMember>) -> bool,
+) -> Result<()>
+where
+    R: Read + Seek,
+{
+    for entry in zip_central_directory(&mut reader)? {
+        if entry.name.ends_with('/') {
+            continue;
+        }
+        let member = match read_zip_entry(&mut reader, &entry, temp_dir, buffer) {
+            Err(error) if error.kind != ErrorKind::Unsupported => return Err(error),
+            member => member,
+        };
+        if !send(member) {
+            return Ok(());
+        }
+    }
+    Ok(())
+}
+
+fn zip_central_directory<R>(reader: &mut R) -> Result<Vec<ZipEntry>>
+where
+    R: Read + Seek,
+{
+    // The end of central directory record is followed by a comment of at most 64 KiB
+    let len = reader.seek(SeekFrom::End(0))?;
+    let tail_len = len.min((ZIP_END_OF_CENTRAL_DIR_LEN + usize::from(u16::MAX)) as u64);
+    reader.seek(SeekFrom::Start(len - tail_len))?;
+    let mut tail = vec![0; tail_len as usize];
+    reader.read_exact(&mut tail)?;
+    let end = (0..(tail.len() + 1).saturating_sub(ZIP_END_OF_CENTRAL_DIR_LEN))
+        .rev()
+        .find(|&pos| u32_at(&tail, pos) == ZIP_END_OF_CENTRAL_DIR)
+        .ok_or_else(|| invalid_zip("its end of central directory is missing"))?;
+    let count = u16_at(&tail, end + 10);
+    let size = u32_at(&tail, end + 12);
+    let offset = u32_at(&tail, end + 16);
+    if count == u16::MAX || size == u32::MAX || offset == u32::MAX {
+        return Err(zip64_unsupported());
+    }
+
+    reader.seek(SeekFrom::Start(u64::from(offset)))?;
+    let mut directory = vec![0; size as usize];
+    reader.read_exact(&mut directory)?;
+    let mut entries = Vec::with_capacity(usize::from(count));
+    let mut pos = 0;
+    for _ in 0..count {
+        if directory.len() < pos + ZIP_CENTRAL_HEADER_LEN
+            || u32_at(&directory, pos) != ZIP_CENTRAL_HEADER
+        {
+            return Err(invalid_zip("its central directory is truncated"));
+        }
+        let compressed_size = u32_at(&directory, pos + 20);
+        let local_header_offset = u32_at(&directory, pos + 42);
+        if compressed_size == u32::MAX || local_header_offset == u32::MAX {
+            return Err(zip64_unsupported());
+        }
+        let name_start = pos + ZIP_CENTRAL_HEADER_LEN;
+        let name_end = name_start + usize::from(u16_at(&directory, pos + 28));
+        let Some(name) = directory.get(name_start..name_end) else {
+            return Err(invalid_zip("its central directory is truncated"));
+        };
+        entries.push(ZipEntry {
+            name: String::from_utf8_lossy(name).into_owned(),
+            flags: u16_at(&directory, pos + 8),
+            method: u16_at(&directory, pos + 10),
+            crc: u32_at(&directory, pos + 16),
+            compressed_size: u64::from(compressed_size),
+            local_header_offset: u64::from(local_header_offset),
+        });
+        pos = name_end
+            + usize::from(u16_at(&directory, pos + 30))
+            + usize::from(u16_at(&directory, pos + 32));
+    }
+    Ok(entries)
+}
+
+fn read_zip_entry<R>(
+    reader: &mut R,
+    entry: &ZipEntry,
+    temp_dir: &Path,
+    buffer: &mut [u8],
+) -> Result<ArchiveMember>
+where
+    R: Read + Seek,
+{
+    if entry.flags & 1 != 0 {
+        return Err(Error {
+            msg: format!("Zip entry {} is encrypted.", entry.name),
+            kind: ErrorKind::Unsupported,
+        });
+    }
+
+    reader.seek(SeekFrom::Start(entry.local_header_offset))?;
+    let mut header = [0; ZIP_LOCAL_HEADER_LEN];
+    reader.read_exact(&mut header)?;
+    if u32_at(&header, 0) != ZIP_LOCAL_HEADER {
+        return Err(invalid_zip("a local header is missing"));
+    }
+    // Widened first, since both lengths may be up to u16::MAX
+    let skip = i64::from(u16_at(&header, 26)) + i64::from(u16_at(&header, 28));
+    reader.seek(SeekFrom::Current(skip))?;
+    let data = reader.take(entry.compressed_size);
+    let mut content: CrcReader<Box<dyn Read + '_>> = match entry.method {
+        0 => CrcReader::new(Box::new(data)),
+        8 => CrcReader::new(Box::new(DeflateDecoder::new(data))),
+        method => {
+            return Err(Error {
+                msg: format!("Zip entry {} uses compression method {method}.", entry.name),
+                kind: ErrorKind::Unsupported,
+            })
+        }
+    };
+
+    let member = copy_member(&mut content, PathBuf::from(&entry.name), temp_dir, buffer)?;
+    if content.crc.finalize() != entry.crc {
+        member.discard()?;
+        return Err(invalid_zip(&format!("entry {} is corrupted", entry.name)));
+    }
+    Ok(member)
+}
+
+/// Computes the CRC-32 of everything read through it.
+struct CrcReader<R> {
+    inner: R,
+    crc: crc32fast::Hasher,
+}
+
+impl<R> CrcReader<R> {
+    fn new(inner: R) -> Self {
+        CrcReader {
+            inner,
+            crc: crc32fast::Hasher::new(),
+        }
+    }
+}
+
+impl<R> Read for CrcReader<R>
+where
+    R: Read,
+{
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let read = self.inner.read(buf)?;
+        self.crc.update(&buf[..read]);
+        Ok(read)
+    }
+}
+
+/// Copies a member to a new temporary file in `temp_dir`, which is removed again on failure.
+fn copy_member(
+    reader: &mut dyn Read,
+    name: PathBuf,
+    temp_dir: &Path,
+    buffer: &mut [u8],
+) -> Result<ArchiveMember> {
+    let temp = temp_dir.join(Uuid::new_v4().to_string());
+    match write_member(reader, &temp, buffer) {
+        Ok((hash, head)) => Ok(ArchiveMember {
+            name,
+            temp,
+            hash,
+            head,
+        }),
+        Err(error) => {
+            let _ = fs::remove_file(&temp);
+            Err(error)
+        }
+    }
+}
+
+fn write_member(
+    reader: &mut dyn Read,
+    temp: &Path,
+    buffer: &mut [u8],
+) -> Result<(String, Vec<u8>)> {
+    let mut file = fs::File::create(temp)?;
+    let mut hasher = Sha224::new();
+    let mut head = Vec::new();
+    loop {
+        let read = match reader.read(buffer) {
+            Ok(0) => break,
+            Ok(read) => read,
+            Err(error) if error.kind() == io::ErrorKind::Interrupted => continue,
+            Err(error) => return Err(error.into()),
+        };
+        let chunk = &buffer[..read];
+        hasher.update(chunk);
+        let head_missing = HEAD_SIZE - head.len();
+        head.extend_from_slice(&chunk[..chunk.len().min(head_missing)]);
+        file.write_all(chunk)?;
+    }
+    file.sync_all()?;
+    Ok((hex::encode(hasher.finalize()), head))
+}
+
+fn u16_at(bytes: &[u8], pos: usize) -> u16 {
+    u16::from_le_bytes([bytes[pos], bytes[pos + 1]])
+}
+
+fn u32_at(bytes: &[u8], pos: usize) -> u32 {
+    u32::from_le_bytes([bytes[pos], bytes[pos + 1], bytes[pos + 2], bytes[pos + 3]])
+}
+
+fn invalid_zip(reason: &str) -> Error {
+    Error {
+        msg: format!("Zip archive is invalid, {reason}."),
+        kind: ErrorKind::IO,
+    }
+}
+
+fn zip64_unsupported() -> Error {
+    Error {
+        msg: String::from("Zip64 archives are not supported."),
+        kind: ErrorKind::Unsupported,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_utils::TempFolder;
+    use flate2::{write::DeflateEncoder, Compression};
+    use test_context::test_context;
+
+    /// Writes a zip archive of `(name, content, deflated)` entries.
+    fn write_zip(path: &Path, entries: &[(&str, &[u8], bool)]) -> Result<()> {
+        let mut archive = Vec::new();
+        let mut directory = Vec::new();
+        for (name, content, deflated) in entries {
+            let data = if *deflated {
+                let mut encoder = DeflateEncoder::new(Vec::new(), Compression::default());
+                encoder.write_all(content)?;
+                encoder.finish()?
+            } else {
+                content.to_vec()
+            };
+            let method: u16 = if *deflated { 8 } else { 0 };
+            let crc = crc32fast::hash(content);
+            let offset = archive.len() as u32;
+            // Local header: version, flags, method, time, date, crc, sizes, name and extra length
+            archive.extend_from_slice(&ZIP_LOCAL_HEADER.to_le_bytes());
+            for field in [20, 0, method, 0, 0] {
+                archive.extend_from_slice(&field.to_le_bytes());
+            }
+            for field in [crc, data.len() as u32, content.len() as u32] {
+                archive.extend_from_slice(&field.to_le_bytes());
+            }
+            for field in [name.len() as u16, 0] {
+                archive.extend_from_slice(&field.to_le_bytes());
+            }
+            archive.extend_from_slice(name.as_bytes());
+            archive.extend_from_slice(&data);
+
+            directory.extend_from_slice(&ZIP_CENTRAL_HEADER.to_le_bytes());
+            for field in [20, 20, 0, method, 0, 0] {
+                directory.extend_from_slice(&field.to_le_bytes());
+            }
+            for field in [crc, data.len() as u32, content.len() as u32] {
+                directory.extend_from_slice(&field.to_le_bytes());
+            }
+            for field in [name.len() as u16, 0, 0, 0, 0] {
+                directory.extend_from_slice(&field.to_le_bytes());
+            }
+            for field in [0, offset] {
+                directory.extend_from_slice(&field.to_le_bytes());
+            }
+            directory.extend_from_slice(name.as_bytes());
+        }
+        let directory_offset = archive.len() as u32;
+        archive.extend_from_slice(&directory);
+        archive.extend_from_slice(&ZIP_END_OF_CENTRAL_DIR.to_le_bytes());
+        let count = entries.len() as u16;
+        for field in [0, 0, count, count] {
+            archive.extend_from_slice(&field.to_le_bytes());
+        }
+        for field in [directory.len() as u32, directory_offset] {
+            archive.extend_from_slice(&field.to_le_bytes());
+        }
+        archive.extend_from_slice(&0u16.to_le_bytes());
+        fs::write(path, archive)?;
+        Ok(())
+    }
+
+    fn tar_bytes(entries: &[(&str, &[u8])]) -> Result<Vec<u8>> {
+        let mut builder = tar::Builder::new(Vec::new());
+        let mut header = tar::Header::new_gnu();
+        header.set_entry_type(tar::EntryType::Directory);
+        header.set_size(0);
+        builder.append_data(&mut header, "folder/", io::empty())?;
+        for (name, content) in entries {
+            let mut header = tar::Header::new_gnu();
+            header.set_size(content.len() as u64);
+            builder.append_data(&mut header, name, *content)?;
+        }
+        Ok(builder.into_inner()?)
+    }
+
+    fn read_all(source: ArchiveSource, temp_dir: &Path) -> Vec<Result<ArchiveMember>> {
+        let mut members = Vec::new();
+        let mut send = |member| {
+            members.push(member);
+            true
+        };
+        if let Err(error) = read_members(source, temp_dir, &mut send) {
+            members.push(Err(error));
+        }
+        members
+    }
+
+    fn hash(content: &[u8]) -> String {
+        hex::encode(Sha224::digest(content))
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn read_tar_members(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let archive = tar_bytes(&[("folder/a.mp4", b"first"), ("b.mp4", b"second")])?;
+        let mut encoder = flate2::write::GzEncoder::new(Vec::new(), Compression::default());
+        encoder.write_all(&archive)?;
+        let gzipped = encoder.finish()?;
+        let archive_path = ctx.path.join("archive.tar");
+        fs::write(&archive_path, &archive)?;
+
+        // WHEN
+        let from_file = read_all(ArchiveSource::File(archive_path.clone()), &ctx.path);
+        let from_stream = read_all(
+            ArchiveSource::Stream(Box::new(io::Cursor::new(gzipped))),
+            &ctx.path,
+        );
+
+        // THEN
+        for members in [from_file, from_stream] {
+            let members = members.into_iter().collect::<Result<Vec<_>>>()?;
+            // The folder entry is skipped
+            assert_eq!(members.len(), 2);
+            assert_eq!(members[0].name, PathBuf::from("folder/a.mp4"));
+            assert_eq!(members[0].hash, hash(b"first"));
+            assert_eq!(members[0].head, b"first");
+            assert_eq!(fs::read(&members[0].temp)?, b"first");
+            assert_eq!(members[1].name, PathBuf::from("b.mp4"));
+            assert_eq!(members[1].hash, hash(b"second"));
+        }
+        // The archive is left untouched
+        assert_eq!(fs::read(&archive_path)?, archive);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn read_zip_members(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let archive_path = ctx.path.join("archive.zip");
+        write_zip(
+            &archive_path,
+            &[
+                ("folder/", b"", false),
+                ("folder/a.mp4", b"stored content", false),
+                ("b.mp4", b"deflated content, deflated content", true),
+            ],
+        )?;
+
+        // WHEN
+        let members = read_all(ArchiveSource::File(archive_path.clone()), &ctx.path);
+        let streamed = read_all(
+            ArchiveSource::Stream(Box::new(fs::File::open(&archive_path)?)),
+            &ctx.path,
+        );
+
+        // THEN
+        let members = members.into_iter().collect::<Result<Vec<_>>>()?;
+        assert_eq!(members.len(), 2);
+        assert_eq!(members[0].name, PathBuf::from("folder/a.mp4"));
+        assert_eq!(members[0].hash, hash(b"stored content"));
+        assert_eq!(members[1].name, PathBuf::from("b.mp4"));
+        assert_eq!(
+            fs::read(&members[1].temp)?,
+            b"deflated content, deflated content"
+        );
+        // Zip archives need seeking
+        assert_eq!(streamed.len(), 1);
+        assert!(streamed[0]
+            .as_ref()
+            .is_err_and(|error| error.kind == ErrorKind::Unsupported));
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn extract_stops_when_closed(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let archive = tar_bytes(&[("a.mp4", b"a"), ("b.mp4", b"b"), ("c.mp4", b"c")])?;
+        let temp_dir = ctx.path.join("incoming");
+        fs::create_dir(&temp_dir)?;
+        let source = ArchiveSource::Stream(Box::new(io::Cursor::new(archive)));
+
+        // WHEN
+        let (mut receiver, handle) = extract(source, temp_dir.clone(), 1);
+        let first = receiver.recv().await.expect("A member should be sent.")?;
+        receiver.close();
+        while let Some(member) = receiver.recv().await {
+            member?.discard()?;
+        }
+        handle.await.expect("Extraction should not panic.")?;
+
+        // THEN
+        assert_eq!(first.name, PathBuf::from("a.mp4"));
+        // Only the received member is left
+        assert_eq!(fs::read_dir(&temp_dir)?.count(), 1);
+        first.discard()?;
+        Ok(())
+    }
+}
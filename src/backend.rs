@@ -0,0 +1,292 @@
+use crate::{
+    error::{Error, ErrorKind, Result},
+    store::Store,
+};
+use async_trait::async_trait;
+use futures::future;
+use sha2::{Digest, Sha224};
+use std::{
+    fmt, fs,
+    io::{Read, Seek, SeekFrom, Write},
+    ops::Range,
+    path::PathBuf,
+};
+use tokio::io::{AsyncRead, AsyncReadExt};
+
+/// Size of the chunks streamed into a backend.
+pub const CHUNK_SIZE: usize = 8 * 1024 * 1024;
+
+/// Name of an object in a storage backend.
+#[derive(Clone, Debug, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub struct ObjectKey {
+    pub hash: String,
+    pub ext: String,
+}
+
+impl fmt::Display for ObjectKey {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{}.{}", self.hash, self.ext)
+    }
+}
+
+/// Where the content addressed objects of a repo are kept.
+///
+/// Objects are immutable and named by the SHA-224 of their content, so writing an object that
+/// already exists is a no-op.
+#[async_trait]
+pub trait Backend: Send + Sync {
+    /// Streams `reader` into the backend, hashing it on the way.
+    ///
+    /// Returns the key the content is stored under.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if reading `reader` or writing the object failed.
+    async fn put(
+        &self,
+        reader: &mut (dyn AsyncRead + Unpin + Send),
+        ext: &str,
+    ) -> Result<ObjectKey>;
+
+    /// Reads `range` of an object. The range is truncated at the end of the object.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::FileNotFound` if the object does not exist.
+    /// - `ErrorKind::IO` if reading the object failed.
+    async fn get_range(&self, key: &ObjectKey, range: Range<u64>) -> Result<Vec<u8>>;
+
+    /// Reads several ranges of an object concurrently.
+    ///
+    /// # Errors
+    ///
+    /// See `get_range`.
+    async fn get_ranges(&self, key: &ObjectKey, ranges: &[Range<u64>]) -> Result<Vec<Vec<u8>>> {
+        future::try_join_all(
+            ranges
+                .iter()
+                .map(|range| self.get_range(key, range.clone())),
+        )
+        .await
+    }
+
+    /// Whether an object exists.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the backend cannot be queried.
+    async fn exists(&self, key: &ObjectKey) -> Result<bool>;
+
+    /// Deletes an object. Deleting a nonexistent object succeeds.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the object cannot be deleted.
+    async fn delete(&self, key: &ObjectKey) -> Result<()>;
+
+    /// Lists objects whose hash starts with `prefix`, ordered by hash.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the backend cannot be listed.
+    async fn list(&self, prefix: &str) -> Result<Vec<ObjectKey>>;
+}
+
+/// Reads `reader` to the end, hashing every chunk and passing it on to `write`.
+///
+/// Returns the hex encoded SHA-224 of the content.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if reading failed, or any error returned by `write`.
+pub async fn copy_hashed<W>(
+    reader: &mut (dyn AsyncRead + Unpin + Send),
+    mut write: W,
+) -> Result<String>
+where
+    W: FnMut(&[u8]) -> Result<()>,
+{
+    let mut hasher = Sha224::new();
+    let mut buffer = vec![0; CHUNK_SIZE];
+    loop {
+        let read = reader.read(&mut buffer).await?;
+        if read == 0 {
+            break;
+        }
+        hasher.update(&buffer[..read]);
+        write(&buffer[..read])?;
+    }
+    Ok(hex::encode(hasher.finalize()))
+}
+
+/// Reads an object back from `backend` and computes its hash, e.g. to verify a copy.
+///
+/// # Errors
+///
+/// See `Backend::get_range`.
+pub async fn hash_object(backend: &dyn Backend, key: &ObjectKey) -> Result<String> {
+    copy_object(backend, key, |_| Ok(())).await
+}
+
+/// Reads an object from `backend` chunk by chunk, hashing every chunk and passing it on to
+/// `write`.
+///
+/// Returns the hex encoded SHA-224 of the content.
+///
+/// # Errors
+///
+/// See `Backend::get_range`, or any error returned by `write`.
+pub async fn copy_object<W>(backend: &dyn Backend, key: &ObjectKey, mut write: W) -> Result<String>
+where
+    W: FnMut(&[u8]) -> Result<()>,
+{
+    let mut hasher = Sha224::new();
+    let mut offset = 0;
+    loop {
+        let chunk = backend
+            .get_range(key, offset..offset + CHUNK_SIZE as u64)
+            .await?;
+        hasher.update(&chunk);
+        write(&chunk)?;
+        offset += chunk.len() as u64;
+        if chunk.len() < CHUNK_SIZE {
+            break;
+        }
+    }
+    Ok(hex::encode(hasher.finalize()))
+}
+
+/// The directory store is the default backend.
+///
+/// Objects are streamed into a temporary file on the receiving volume and moved into place once
+/// their hash is known, see `Store::receiving_volume`.
+#[async_trait]
+impl Backend for Store {
+    async fn put(
+        &self,
+        reader: &mut (dyn AsyncRead + Unpin + Send),
+        ext: &str,
+    ) -> Result<ObjectKey> {
+        let volume = self.receiving_volume()?;
+        let temp_path = self.temp_path(volume)?;
+        let mut file = fs::File::create(&temp_path)?;
+        let result = copy_hashed(reader, |chunk| Ok(file.write_all(chunk)?))
+            .await
+            .and_then(|hash| {
+                file.sync_all()?;
+                Ok(hash)
+            });
+        drop(file);
+        let hash = match result {
+            Ok(hash) => hash,
+            Err(error) => {
+                fs::remove_file(&temp_path)?;
+                return Err(error);
+            }
+        };
+
+        if self.locate(&hash, ext).is_some() {
+            fs::remove_file(&temp_path)?;
+        } else {
+            self.insert_received(volume, &temp_path, &hash, ext)?;
+        }
+        Ok(ObjectKey {
+            hash,
+            ext: ext.to_owned(),
+        })
+    }
+
+    async fn get_range(&self, key: &ObjectKey, range: Range<u64>) -> Result<Vec<u8>> {
+        read_file_range(locate_or_not_found(self, key)?, range).await
+    }
+
+    async fn exists(&self, key: &ObjectKey) -> Result<bool> {
+        Ok(self.locate(&key.hash, &key.ext).is_some())
+    }
+
+    async fn delete(&self, key: &ObjectKey) -> Result<()> {
+        if let Some(path) = self.locate(&key.hash, &key.ext) {
+            fs::remove_file(path)?;
+        }
+        Ok(())
+    }
+
+    async fn list(&self, prefix: &str) -> Result<Vec<ObjectKey>> {
+        Ok(self
+            .objects_with_prefix(prefix)?
+            .into_iter()
+            .map(|(hash, ext)| ObjectKey { hash, ext })
+            .collect())
+    }
+}
+
+/// Reads `range` of the file at `path` on the blocking thread pool. The range is truncated at the
+/// end of the file.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if reading the file failed.
+pub async fn read_file_range(path: PathBuf, range: Range<u64>) -> Result<Vec<u8>> {
+    tokio::task::spawn_blocking(move || -> Result<Vec<u8>> {
+        let mut file = fs::File::open(path)?;
+        file.seek(SeekFrom::Start(range.start))?;
+        let mut buffer = Vec::new();
+        file.take(range.end.saturating_sub(range.start))
+            .read_to_end(&mut buffer)?;
+        Ok(buffer)
+    })
+    .await
+    .expect("Read task panicked.")
+}
+
+fn locate_or_not_found(store: &Store, key: &ObjectKey) -> Result<PathBuf> {
+    store.locate(&key.hash, &key.ext).ok_or_else(|| Error {
+        msg: format!("Item {key} cannot be found in the store."),
+        kind: ErrorKind::FileNotFound,
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{config::Config, test_utils::TempFolder};
+    use test_context::test_context;
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_directory_backend(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        fs::create_dir(ctx.path.join("store"))?;
+        let store = Store::new(&ctx.path, &Config::default());
+        let content = b"some content";
+
+        // WHEN
+        let key = store.put(&mut content.as_slice(), "mp4").await?;
+
+        // THEN
+        assert_eq!(key.hash, hex::encode(Sha224::digest(content)));
+        assert!(store.exists(&key).await?);
+        assert_eq!(store.get_range(&key, 5..100).await?, b"content");
+        assert_eq!(
+            store.get_ranges(&key, &[0..4, 5..7]).await?,
+            vec![b"some".to_vec(), b"co".to_vec()]
+        );
+        assert_eq!(store.list(&key.hash[..3]).await?, vec![key.clone()]);
+        assert_eq!(store.list("xyz").await?, Vec::new());
+
+        // WHEN
+        // Putting the same content again is a no-op.
+        let duplicate_key = store.put(&mut content.as_slice(), "mp4").await?;
+
+        // THEN
+        assert_eq!(duplicate_key, key);
+        assert_eq!(store.list("").await?.len(), 1);
+
+        // WHEN
+        store.delete(&key).await?;
+
+        // THEN
+        assert!(!store.exists(&key).await?);
+        Ok(())
+    }
+}
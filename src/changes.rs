@@ -0,0 +1,158 @@
+use std::sync::{
+    atomic::{AtomicU64, Ordering},
+    Arc,
+};
+use tokio::sync::broadcast;
+
+/// Number of events a subscriber can fall behind before it misses events.
+pub const CHANGE_FEED_CAPACITY: usize = 1024;
+
+/// A change to the repo, published once it is committed to the db.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub enum Change {
+    CollectionAdded {
+        collection_id: i64,
+        title: String,
+    },
+    CollectionRetitled {
+        collection_id: i64,
+        title: String,
+    },
+    /// The last item of a collection was deleted, and the collection with it.
+    CollectionDeleted {
+        collection_id: i64,
+    },
+    ItemAdded {
+        hash: String,
+        ext: String,
+        collection_id: i64,
+    },
+    ItemDeleted {
+        hash: String,
+        collection_id: i64,
+    },
+    TagAdded {
+        collection_id: i64,
+        tag: String,
+    },
+    TagRemoved {
+        collection_id: i64,
+        tag: String,
+    },
+}
+
+impl Change {
+    /// Collection the change is about.
+    pub fn collection_id(&self) -> i64 {
+        match self {
+            Change::CollectionAdded { collection_id, .. }
+            | Change::CollectionRetitled { collection_id, .. }
+            | Change::CollectionDeleted { collection_id }
+            | Change::ItemAdded { collection_id, .. }
+            | Change::ItemDeleted { collection_id, .. }
+            | Change::TagAdded { collection_id, .. }
+            | Change::TagRemoved { collection_id, .. } => *collection_id,
+        }
+    }
+}
+
+/// Version of the db as seen by an open repo, to tell whether results read from it are current.
+///
+/// Neither part alone is enough: sequence numbers only count changes of this repo, and the data
+/// version only changes with commits of other connections.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct DbVersion {
+    /// `ChangeFeed::last_seq` of the repo.
+    pub seq: u64,
+    /// `PRAGMA data_version` of a connection that never writes, so that every commit counts,
+    /// including those of other processes.
+    pub data_version: i64,
+}
+
+/// A change with its position in the feed.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct ChangeEvent {
+    /// Increases by one with every event published by the same repo, starting at 1.
+    pub seq: u64,
+    pub change: Change,
+}
+
+/// Publishes changes to any number of subscribers, e.g. caches that patch themselves instead of
+/// reloading.
+///
+/// Subscribers that fall more than `CHANGE_FEED_CAPACITY` events behind receive
+/// `RecvError::Lagged` and must reload whatever they derived from the repo. Sequence numbers are
+/// not persisted, so they only order events of one open repo.
+///
+/// Clones publish to and read from the same feed.
+#[derive(Clone, Debug)]
+pub struct ChangeFeed {
+    sender: broadcast::Sender<ChangeEvent>,
+    last_seq: Arc<AtomicU64>,
+}
+
+impl Default for ChangeFeed {
+    fn default() -> Self {
+        let (sender, _) = broadcast::channel(CHANGE_FEED_CAPACITY);
+        ChangeFeed {
+            sender,
+            last_seq: Arc::new(AtomicU64::new(0)),
+        }
+    }
+}
+
+impl ChangeFeed {
+    /// Receives every event published from now on.
+    pub fn subscribe(&self) -> broadcast::Receiver<ChangeEvent> {
+        self.sender.subscribe()
+    }
+
+    /// Sequence number of the latest event, or 0 if none was published.
+    ///
+    /// A subscriber that takes a snapshot of the repo right after subscribing can skip events up
+    /// to this number.
+    pub fn last_seq(&self) -> u64 {
+        self.last_seq.load(Ordering::Acquire)
+    }
+
+    pub fn publish<T>(&mut self, changes: T)
+    where
+        T: IntoIterator<Item = Change>,
+    {
+        for change in changes {
+            let seq = self.last_seq.fetch_add(1, Ordering::AcqRel) + 1;
+            // Sending only fails if nobody is subscribed, which is fine
+            let _ = self.sender.send(ChangeEvent { seq, change });
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[tokio::test]
+    async fn publish_in_order() {
+        // GIVEN
+        let mut feed = ChangeFeed::default();
+        feed.publish([Change::CollectionDeleted { collection_id: 1 }]);
+        let mut receiver = feed.subscribe();
+
+        // WHEN
+        feed.publish([
+            Change::CollectionDeleted { collection_id: 2 },
+            Change::CollectionDeleted { collection_id: 3 },
+        ]);
+
+        // THEN
+        assert_eq!(feed.last_seq(), 3);
+        assert_eq!(
+            receiver.recv().await.ok(),
+            Some(ChangeEvent {
+                seq: 2,
+                change: Change::CollectionDeleted { collection_id: 2 },
+            })
+        );
+        assert_eq!(receiver.recv().await.map(|event| event.seq).ok(), Some(3));
+    }
+}
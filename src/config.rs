@@ -0,0 +1,332 @@
+use crate::{
+    error::{Error, ErrorKind, Result},
+    query::QueryCache,
+    store::{Placement, StoreLayout, Volume},
+    write_buffer::WriteBuffer,
+};
+use std::{
+    fmt, fs,
+    path::{Path, PathBuf},
+    time::Duration,
+};
+
+/// Name of the repo configuration file, relative to the repo root.
+pub const CONFIG_FILE_NAME: &str = "vorg.conf";
+
+/// Repo level settings, persisted in `vorg.conf` at the repo root.
+///
+/// The file consists of `key = value` lines. Empty lines and lines starting with `#` are
+/// ignored. Repos created before the configuration file existed have no `vorg.conf`, in which
+/// case every setting takes its default value.
+#[derive(Clone, Debug, PartialEq)]
+pub struct Config {
+    /// Root folders the file store is spread over, given by one `store.volume` line each.
+    ///
+    /// Defaults to the `store` folder of the repo.
+    pub store_volumes: Vec<Volume>,
+    /// How the volume of a new object is chosen.
+    pub store_placement: Placement,
+    /// Layout of the file store that new objects are written with.
+    pub store_layout: StoreLayout,
+    /// Layout the file store is being migrated away from.
+    ///
+    /// This is only set while a reshard is running or has been interrupted. While set, lookups
+    /// fall back to this layout for objects that have not been moved yet.
+    pub previous_store_layout: Option<StoreLayout>,
+    /// Bumped whenever a reshard changes `store_layout` or `previous_store_layout`, so that open
+    /// handles of any process notice the change.
+    pub store_generation: u64,
+    /// Folder of the cold tier. Relative paths are relative to the repo root.
+    pub cold_store: Option<PathBuf>,
+    /// S3 bucket of the cold tier. Requires the `s3` feature.
+    pub cold_bucket: Option<String>,
+    /// Endpoint of the S3 compatible service hosting `cold_bucket`, if not AWS.
+    pub cold_endpoint: Option<String>,
+    /// Items not accessed for this many days are moved to the cold tier.
+    pub cold_after_days: u64,
+    /// Items smaller than this many bytes always stay in the hot tier.
+    pub cold_min_size: u64,
+    /// Buffered metadata writes are flushed once this many are pending.
+    pub write_buffer_max_pending: u64,
+    /// Buffered metadata writes are flushed once the oldest is this many milliseconds old.
+    ///
+    /// Together with `write_buffer_max_pending` this bounds the writes lost on a crash.
+    pub write_buffer_max_delay_ms: u64,
+    /// Number of query results kept in memory. 0 disables the query cache.
+    pub query_cache_capacity: u64,
+    /// Maximum number of read connections open at once. Further reads wait for a connection to
+    /// be handed back. 0 opens up to one connection per core.
+    pub read_pool_size: u64,
+    /// Bytes of memory used to sort store listings during integrity checks. Larger listings are
+    /// sorted on disk.
+    pub check_sort_memory: u64,
+    /// Number of random store objects a quick check stats in folders that did not change.
+    pub check_spot_checks: u64,
+    /// Milliseconds a file in a watched folder must stay unchanged before it is imported.
+    pub watch_settle_ms: u64,
+}
+
+impl Default for Config {
+    fn default() -> Self {
+        Config {
+            store_volumes: vec![Volume::default()],
+            store_placement: Placement::default(),
+            store_layout: StoreLayout::default(),
+            previous_store_layout: None,
+            store_generation: 0,
+            cold_store: None,
+            cold_bucket: None,
+            cold_endpoint: None,
+            cold_after_days: 30,
+            cold_min_size: 0,
+            write_buffer_max_pending: 256,
+            write_buffer_max_delay_ms: 1000,
+            query_cache_capacity: 64,
+            read_pool_size: 0,
+            check_sort_memory: 64 << 20,
+            check_spot_checks: 64,
+            watch_settle_ms: 2000,
+        }
+    }
+}
+
+impl Config {
+    /// Loads the configuration of the repo at `repo_path`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the configuration file exists but cannot be read.
+    /// - `ErrorKind::Config` if the configuration file is malformed.
+    pub fn load<T>(repo_path: T) -> Result<Self>
+    where
+        T: AsRef<Path>,
+    {
+        let config_path = repo_path.as_ref().join(CONFIG_FILE_NAME);
+        if !config_path.exists() {
+            return Ok(Config::default());
+        }
+        Config::parse(&fs::read_to_string(config_path)?)
+    }
+
+    /// Parses the content of a configuration file.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Config` if a line is malformed, a key is unknown or a value is invalid.
+    pub fn parse(content: &str) -> Result<Self> {
+        let mut config = Config::default();
+        let mut store_volumes = Vec::new();
+        for (index, line) in content.lines().enumerate() {
+            let line = line.trim();
+            if line.is_empty() || line.starts_with('#') {
+                continue;
+            }
+            let Some((key, value)) = line.split_once('=') else {
+                return Err(Error {
+                    msg: format!("Line {} of {CONFIG_FILE_NAME} is not a setting.", index + 1),
+                    kind: ErrorKind::Config,
+                });
+            };
+            let value = value.trim();
+            let key = key.trim();
+            match key {
+                "store.volume" => store_volumes.push(value.parse()?),
+                "store.placement" => config.store_placement = value.parse()?,
+                "store.layout" => config.store_layout = value.parse()?,
+                "store.previous_layout" => config.previous_store_layout = Some(value.parse()?),
+                "store.generation" => config.store_generation = parse_number(key, value)?,
+                "tier.cold_store" => config.cold_store = Some(PathBuf::from(value)),
+                "tier.cold_bucket" => config.cold_bucket = Some(value.to_owned()),
+                "tier.cold_endpoint" => config.cold_endpoint = Some(value.to_owned()),
+                "tier.cold_after_days" => config.cold_after_days = parse_number(key, value)?,
+                "tier.cold_min_size" => config.cold_min_size = parse_number(key, value)?,
+                "write_buffer.max_pending" => {
+                    config.write_buffer_max_pending = parse_number(key, value)?;
+                }
+                "write_buffer.max_delay_ms" => {
+                    config.write_buffer_max_delay_ms = parse_number(key, value)?;
+                }
+                "query_cache.capacity" => config.query_cache_capacity = parse_number(key, value)?,
+                "read_pool.size" => config.read_pool_size = parse_number(key, value)?,
+                "check.sort_memory" => config.check_sort_memory = parse_number(key, value)?,
+                "check.spot_checks" => config.check_spot_checks = parse_number(key, value)?,
+                "watch.settle_ms" => config.watch_settle_ms = parse_number(key, value)?,
+                key => {
+                    return Err(Error {
+                        msg: format!("Unknown setting \"{key}\" in {CONFIG_FILE_NAME}."),
+                        kind: ErrorKind::Config,
+                    });
+                }
+            }
+        }
+        if !store_volumes.is_empty() {
+            config.store_volumes = store_volumes;
+        }
+        Ok(config)
+    }
+
+    /// Persists the configuration into the repo at `repo_path`.
+    ///
+    /// The file is written to a temporary file first and renamed into place, so that a crash
+    /// never leaves a half written configuration behind.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the configuration file cannot be written.
+    pub fn save<T>(&self, repo_path: T) -> Result<()>
+    where
+        T: AsRef<Path>,
+    {
+        let repo_path = repo_path.as_ref();
+        let temp_path = repo_path.join(format!("{CONFIG_FILE_NAME}.tmp"));
+        fs::write(&temp_path, self.to_string())?;
+        fs::rename(temp_path, repo_path.join(CONFIG_FILE_NAME))?;
+        Ok(())
+    }
+
+    /// An empty write buffer with the configured limits.
+    pub fn write_buffer(&self) -> WriteBuffer {
+        WriteBuffer::new(
+            usize::try_from(self.write_buffer_max_pending).unwrap_or(usize::MAX),
+            Duration::from_millis(self.write_buffer_max_delay_ms),
+        )
+    }
+
+    /// An empty query cache with the configured capacity.
+    pub fn query_cache(&self) -> QueryCache {
+        QueryCache::new(usize::try_from(self.query_cache_capacity).unwrap_or(usize::MAX))
+    }
+}
+
+fn parse_number(key: &str, value: &str) -> Result<u64> {
+    value.parse().map_err(|_| Error {
+        msg: format!("Setting \"{key}\" in {CONFIG_FILE_NAME} must be a number."),
+        kind: ErrorKind::Config,
+    })
+}
+
+impl fmt::Display for Config {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        writeln!(f, "# vorg repository configuration")?;
+        for volume in &self.store_volumes {
+            writeln!(f, "store.volume = {volume}")?;
+        }
+        writeln!(f, "store.placement = {}", self.store_placement)?;
+        writeln!(f, "store.layout = {}", self.store_layout)?;
+        if let Some(previous_store_layout) = &self.previous_store_layout {
+            writeln!(f, "store.previous_layout = {previous_store_layout}")?;
+        }
+        writeln!(f, "store.generation = {}", self.store_generation)?;
+        if let Some(cold_store) = &self.cold_store {
+            writeln!(f, "tier.cold_store = {}", cold_store.display())?;
+        }
+        if let Some(cold_bucket) = &self.cold_bucket {
+            writeln!(f, "tier.cold_bucket = {cold_bucket}")?;
+        }
+        if let Some(cold_endpoint) = &self.cold_endpoint {
+            writeln!(f, "tier.cold_endpoint = {cold_endpoint}")?;
+        }
+        writeln!(f, "tier.cold_after_days = {}", self.cold_after_days)?;
+        writeln!(f, "tier.cold_min_size = {}", self.cold_min_size)?;
+        writeln!(
+            f,
+            "write_buffer.max_pending = {}",
+            self.write_buffer_max_pending
+        )?;
+        writeln!(
+            f,
+            "write_buffer.max_delay_ms = {}",
+            self.write_buffer_max_delay_ms
+        )?;
+        writeln!(f, "query_cache.capacity = {}", self.query_cache_capacity)?;
+        writeln!(f, "read_pool.size = {}", self.read_pool_size)?;
+        writeln!(f, "check.sort_memory = {}", self.check_sort_memory)?;
+        writeln!(f, "check.spot_checks = {}", self.check_spot_checks)?;
+        writeln!(f, "watch.settle_ms = {}", self.watch_settle_ms)?;
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[tokio::test]
+    async fn parse_round_trip() -> Result<()> {
+        // GIVEN
+        let config = Config {
+            store_volumes: vec!["store".parse()?, "2 /mnt/disk 2/vorg".parse()?],
+            store_placement: "free_space".parse()?,
+            store_layout: "2/2".parse()?,
+            previous_store_layout: Some("2".parse()?),
+            store_generation: 3,
+            cold_store: Some(PathBuf::from("/mnt/archive/vorg")),
+            cold_bucket: None,
+            cold_endpoint: None,
+            cold_after_days: 60,
+            cold_min_size: 1 << 20,
+            write_buffer_max_pending: 16,
+            write_buffer_max_delay_ms: 250,
+            query_cache_capacity: 0,
+            read_pool_size: 4,
+            check_sort_memory: 1 << 20,
+            check_spot_checks: 8,
+            watch_settle_ms: 500,
+        };
+
+        // WHEN
+        let parsed = Config::parse(&config.to_string())?;
+
+        // THEN
+        assert_eq!(parsed, config);
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn parse_defaults() -> Result<()> {
+        // WHEN
+        let config = Config::parse("# nothing here\n\n")?;
+
+        // THEN
+        assert_eq!(config, Config::default());
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn parse_volumes() -> Result<()> {
+        // WHEN
+        let config = Config::parse("store.volume = /mnt/a\nstore.volume = 3 /mnt/b\n")?;
+
+        // THEN
+        assert_eq!(
+            config.store_volumes,
+            vec![
+                Volume {
+                    path: "/mnt/a".into(),
+                    weight: 1
+                },
+                Volume {
+                    path: "/mnt/b".into(),
+                    weight: 3
+                },
+            ]
+        );
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn parse_unknown_key() {
+        // WHEN
+        let result = Config::parse("store.fanout = 3");
+
+        // THEN
+        assert!(result.is_err());
+        if let Err(error) = result {
+            assert_eq!(error.kind, ErrorKind::Config);
+            assert_eq!(
+                error.to_string(),
+                "Unknown setting \"store.fanout\" in vorg.conf."
+            );
+        }
+    }
+}
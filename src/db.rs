@@ -1,18 +1,56 @@
 use crate::{
+    changes::{Change, ChangeEvent, ChangeFeed},
     error::{Error, ErrorKind, Result},
+    farm::{FarmFile, FarmLink, LinkKind, ViewFarm},
+    item_set::{ItemSet, Symbol},
+    manifest::ManifestEntry,
+    query::{Page, Query},
+    sample::{self, Reservoir, Rng},
+    saved_search::{IdSet, SavedSearch},
+    similar::{self, SimilarCollection},
+    stats::Stats,
     utils::{self, ListCompareResult},
+    view::ViewFile,
+    write_buffer::PendingWrites,
 };
+use futures::{Stream, TryStreamExt};
 use sqlx::{
     migrate::MigrateDatabase,
-    sqlite::{SqliteConnectOptions, SqliteRow},
-    ConnectOptions, Connection, Row, Sqlite, SqliteConnection,
+    sqlite::{SqliteArguments, SqliteConnectOptions, SqliteJournalMode, SqliteRow},
+    ConnectOptions, Connection, FromRow, Row, Sqlite, SqliteConnection,
 };
-use std::{fs, path::Path, str::FromStr};
+use std::{
+    collections::{BTreeSet, HashMap, HashSet},
+    fs,
+    ops::RangeInclusive,
+    path::{Path, PathBuf},
+    str::FromStr,
+    time::Duration,
+};
+use tokio::sync::broadcast;
+
+/// How long a connection waits for the write transaction of another connection to finish
+/// before it fails with `database is locked`. Imports hold one while they hash a batch of files.
+const BUSY_TIMEOUT: Duration = Duration::from_secs(60);
+
+/// Version of the db schema, see `DB::migrate` and the schemas in the README.
+const SCHEMA_VERSION: i64 = 3;
+
+/// How often `DB::scan_item_set` scans in parallel before it reads from a single snapshot.
+const SCAN_ATTEMPTS: usize = 3;
 
 pub struct DB {
     connection: SqliteConnection,
+    /// Path of the db, to open extra read-only connections.
+    path: String,
+    changes: ChangeFeed,
+    /// Changes of the open batch, published once the batch commits.
+    batch: Option<Vec<Change>>,
+    /// Number of nested transactions open, including the batch.
+    transaction_depth: usize,
 }
 
+#[derive(Clone, Debug, PartialEq)]
 pub struct Item {
     pub hash: String,
     pub title: String,
@@ -21,7 +59,19 @@ pub struct Item {
     pub tags: Vec<String>,
 }
 
-impl sqlx::FromRow<'_, SqliteRow> for Item {
+/// Progress of a resumable folder import, see `Repo::import_session`.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct ImportSession {
+    pub session_id: i64,
+    /// Files imported so far, over every run of the session.
+    pub imported: u64,
+    /// Unsupported files and duplicates skipped so far, over every run of the session.
+    pub skipped: u64,
+    /// Whether the session was started by an earlier run.
+    pub resumed: bool,
+}
+
+impl FromRow<'_, SqliteRow> for Item {
     fn from_row(row: &SqliteRow) -> sqlx::Result<Self> {
         Ok(Item {
             hash: row.try_get("hash")?,
@@ -37,7 +87,7 @@ impl DB {
     /// Create or connect to a vorg db.
     ///
     /// If the db does not exist, this creates a new vorg db.
-    /// If the db does exist, this connects to the db.
+    /// If the db does exist, this connects to the db and migrates it to the current schema.
     ///
     /// # Errors
     /// - `ErrorKind::DB` when encountered database error either when creating a new database or
@@ -53,24 +103,45 @@ impl DB {
         let db_path_string = db_path.to_string_lossy().into_owned();
 
         // Check for db existence
-        if Sqlite::database_exists(&db_path_string).await? {
+        let connection = if Sqlite::database_exists(&db_path_string).await? {
             // Database exists
-            let mut connection = SqliteConnectOptions::from_str(&db_path_string)?
-                .connect()
-                .await?;
-            DB::validate_db(&mut connection)
-                .await
-                .map(|_| DB { connection })
+            connect_options(&db_path_string)?.connect().await?
         } else {
             // Database does not exist, create a new one
             let db_path_parent = db_path
                 .parent()
                 .expect("Database's path should have a parent, i.e. not root.");
             fs::create_dir_all(db_path_parent)?;
-            DB::create_db(&db_path_string)
-                .await
-                .map(|connection| DB { connection })
-        }
+            DB::create_db(&db_path_string).await?
+        };
+        let mut db = DB {
+            connection,
+            path: db_path_string,
+            changes: ChangeFeed::default(),
+            batch: None,
+            transaction_depth: 0,
+        };
+        db.migrate().await?;
+        DB::validate_db(&mut db.connection).await?;
+        Ok(db)
+    }
+
+    /// Opens a read-only connection to the existing db at `db_path`, see `ReadPool`.
+    ///
+    /// The db is not validated again, since the repo validated it when it was opened.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the db cannot be opened.
+    pub async fn open_reader(db_path: &str) -> Result<Self> {
+        let connection = connect_options(db_path)?.read_only(true).connect().await?;
+        Ok(DB {
+            connection,
+            path: db_path.to_owned(),
+            changes: ChangeFeed::default(),
+            batch: None,
+            transaction_depth: 0,
+        })
     }
 
     /// Creates a new sqlite db to be used as vorg db.
@@ -81,11 +152,15 @@ impl DB {
     async fn create_db(db_path_str: &str) -> Result<SqliteConnection> {
         // Create database and connect to it
         Sqlite::create_database(db_path_str).await?;
-        let mut connection = SqliteConnection::connect(db_path_str).await?;
+        // WAL lets readers go on while another process writes. The mode is stored in the db.
+        let mut connection = connect_options(db_path_str)?
+            .journal_mode(SqliteJournalMode::Wal)
+            .connect()
+            .await?;
 
-        // Initialize tables
+        // Initialize the V2 tables, `migrate` adds the rest
         sqlx::query(
-        "
+            "
             CREATE TABLE tags (
                 tag_id INTEGER PRIMARY KEY NOT NULL,
                 name TEXT NOT NULL
@@ -121,73 +196,402 @@ impl DB {
                     VALUES('delete', old.collection_id, old.title);
             END;
             CREATE TRIGGER title_update AFTER UPDATE ON collections BEGIN
-                INSERT INTO title_fts(fts_idx, rowid, title) VALUES('delete', old.collection_id, old.title);
+                INSERT INTO title_fts(title_fts, rowid, title)
+                    VALUES('delete', old.collection_id, old.title);
                 INSERT INTO title_fts(rowid, title) VALUES (new.collection_id, new.title);
             END;
             CREATE UNIQUE INDEX hash_index ON items (hash);
             CREATE UNIQUE INDEX tag_index ON tags (name);
-            "
-        ).execute(&mut connection).await?;
+            ",
+        )
+        .execute(&mut connection)
+        .await?;
 
         Ok(connection)
     }
 
+    /// Brings the schema of the db up to `SCHEMA_VERSION`, which is recorded as its
+    /// `user_version`.
+    ///
+    /// Dbs of V2 repos, created before the schema was versioned, have a `user_version` of 0. They
+    /// get the tables, indices and triggers added since, every statement guarded so that it is
+    /// a no-op if it was applied before. What the new tables derive from existing data is then
+    /// filled in: tag bands, statistics, and a first access of every item at the time of the
+    /// migration. The store manifest starts empty and is filled when the repo is opened, see
+    /// `is_manifest_unfilled`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the db is of a newer schema, or it cannot be migrated. The migration
+    ///   is then rolled back.
+    async fn migrate(&mut self) -> Result<()> {
+        if self.get_schema_version().await? == SCHEMA_VERSION {
+            return Ok(());
+        }
+        self.begin_transaction().await?;
+        let result = async {
+            // Read again with the write lock held, in case another process migrated meanwhile
+            let version = self.get_schema_version().await?;
+            if version == SCHEMA_VERSION {
+                return Ok(());
+            }
+            if version > SCHEMA_VERSION {
+                return Err(Error {
+                    msg: format!(
+                        "Database schema V{version} is newer than the supported V{SCHEMA_VERSION}."
+                    ),
+                    kind: ErrorKind::DB,
+                });
+            }
+            sqlx::query(
+                "
+                DROP TRIGGER IF EXISTS title_update;
+                CREATE TRIGGER title_update AFTER UPDATE ON collections BEGIN
+                    INSERT INTO title_fts(title_fts, rowid, title)
+                        VALUES('delete', old.collection_id, old.title);
+                    INSERT INTO title_fts(rowid, title) VALUES (new.collection_id, new.title);
+                END;
+                CREATE TABLE IF NOT EXISTS item_access (
+                    item_id INTEGER PRIMARY KEY NOT NULL,
+                    last_access INTEGER NOT NULL,
+                    access_count INTEGER NOT NULL,
+                    FOREIGN KEY (item_id) REFERENCES items(item_id)
+                );
+                CREATE TABLE IF NOT EXISTS store_manifest (
+                    hash VARCHAR(64) PRIMARY KEY NOT NULL,
+                    ext TEXT NOT NULL,
+                    dir TEXT NOT NULL,
+                    name TEXT NOT NULL,
+                    size INTEGER NOT NULL,
+                    mtime INTEGER NOT NULL
+                );
+                CREATE TABLE IF NOT EXISTS store_dirs (
+                    dir TEXT PRIMARY KEY NOT NULL,
+                    mtime INTEGER NOT NULL
+                );
+                CREATE TABLE IF NOT EXISTS import_sessions (
+                    session_id INTEGER PRIMARY KEY NOT NULL,
+                    source TEXT NOT NULL,
+                    imported INTEGER NOT NULL,
+                    skipped INTEGER NOT NULL
+                );
+                CREATE TABLE IF NOT EXISTS import_session_dirs (
+                    session_id INTEGER NOT NULL,
+                    dir TEXT NOT NULL,
+                    PRIMARY KEY (session_id, dir),
+                    FOREIGN KEY (session_id) REFERENCES import_sessions(session_id)
+                );
+                CREATE TABLE IF NOT EXISTS import_session_files (
+                    session_id INTEGER NOT NULL,
+                    dir TEXT NOT NULL,
+                    name TEXT NOT NULL,
+                    PRIMARY KEY (session_id, dir, name),
+                    FOREIGN KEY (session_id) REFERENCES import_sessions(session_id)
+                );
+                CREATE TABLE IF NOT EXISTS view_farms (
+                    farm_id INTEGER PRIMARY KEY NOT NULL,
+                    dir TEXT NOT NULL,
+                    tags TEXT NOT NULL,
+                    title TEXT,
+                    symlink INTEGER NOT NULL
+                );
+                CREATE TABLE IF NOT EXISTS view_farm_links (
+                    farm_id INTEGER NOT NULL,
+                    name TEXT NOT NULL,
+                    hash VARCHAR(64) NOT NULL,
+                    ext TEXT NOT NULL,
+                    collection_id INTEGER NOT NULL,
+                    PRIMARY KEY (farm_id, name),
+                    FOREIGN KEY (farm_id) REFERENCES view_farms(farm_id)
+                );
+                CREATE TABLE IF NOT EXISTS change_generation (
+                    generation INTEGER NOT NULL
+                );
+                INSERT INTO change_generation
+                    SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM change_generation);
+                CREATE TRIGGER IF NOT EXISTS generation_collection_insert
+                    AFTER INSERT ON collections BEGIN
+                    UPDATE change_generation SET generation = generation + 1;
+                END;
+                CREATE TRIGGER IF NOT EXISTS generation_collection_delete
+                    AFTER DELETE ON collections BEGIN
+                    UPDATE change_generation SET generation = generation + 1;
+                END;
+                CREATE TRIGGER IF NOT EXISTS generation_collection_update
+                    AFTER UPDATE ON collections BEGIN
+                    UPDATE change_generation SET generation = generation + 1;
+                END;
+                CREATE TRIGGER IF NOT EXISTS generation_tag_insert
+                    AFTER INSERT ON collection_tag BEGIN
+                    UPDATE change_generation SET generation = generation + 1;
+                END;
+                CREATE TRIGGER IF NOT EXISTS generation_tag_delete
+                    AFTER DELETE ON collection_tag BEGIN
+                    UPDATE change_generation SET generation = generation + 1;
+                END;
+                CREATE TABLE IF NOT EXISTS saved_searches (
+                    search_id INTEGER PRIMARY KEY NOT NULL,
+                    name TEXT NOT NULL,
+                    tags TEXT NOT NULL,
+                    title TEXT,
+                    results BLOB NOT NULL,
+                    generation INTEGER NOT NULL
+                );
+                CREATE TABLE IF NOT EXISTS tag_bands (
+                    collection_id INTEGER NOT NULL,
+                    band INTEGER NOT NULL,
+                    bucket INTEGER NOT NULL,
+                    PRIMARY KEY (collection_id, band),
+                    FOREIGN KEY (collection_id) REFERENCES collections(collection_id)
+                );
+                CREATE TABLE IF NOT EXISTS stats (
+                    kind TEXT NOT NULL,
+                    key TEXT NOT NULL,
+                    value INTEGER NOT NULL,
+                    PRIMARY KEY (kind, key)
+                );
+                CREATE TRIGGER IF NOT EXISTS stats_collection_insert
+                    AFTER INSERT ON collections BEGIN
+                    INSERT INTO stats(kind, key, value) VALUES ('collections', '', 1)
+                        ON CONFLICT (kind, key) DO UPDATE SET value = value + excluded.value;
+                END;
+                CREATE TRIGGER IF NOT EXISTS stats_collection_delete
+                    AFTER DELETE ON collections BEGIN
+                    INSERT INTO stats(kind, key, value) VALUES ('collections', '', -1)
+                        ON CONFLICT (kind, key) DO UPDATE SET value = value + excluded.value;
+                END;
+                CREATE TRIGGER IF NOT EXISTS stats_item_insert AFTER INSERT ON items BEGIN
+                    INSERT INTO stats(kind, key, value) VALUES ('items', '', 1), ('ext', new.ext, 1)
+                        ON CONFLICT (kind, key) DO UPDATE SET value = value + excluded.value;
+                END;
+                CREATE TRIGGER IF NOT EXISTS stats_item_delete AFTER DELETE ON items BEGIN
+                    INSERT INTO stats(kind, key, value)
+                        VALUES ('items', '', -1), ('ext', old.ext, -1)
+                        ON CONFLICT (kind, key) DO UPDATE SET value = value + excluded.value;
+                END;
+                CREATE TRIGGER IF NOT EXISTS stats_object_insert
+                    AFTER INSERT ON store_manifest BEGIN
+                    INSERT INTO stats(kind, key, value) VALUES ('store_bytes', '', new.size)
+                        ON CONFLICT (kind, key) DO UPDATE SET value = value + excluded.value;
+                END;
+                CREATE TRIGGER IF NOT EXISTS stats_object_update
+                    AFTER UPDATE OF size ON store_manifest BEGIN
+                    INSERT INTO stats(kind, key, value)
+                        VALUES ('store_bytes', '', new.size - old.size)
+                        ON CONFLICT (kind, key) DO UPDATE SET value = value + excluded.value;
+                END;
+                CREATE TRIGGER IF NOT EXISTS stats_object_delete
+                    AFTER DELETE ON store_manifest BEGIN
+                    INSERT INTO stats(kind, key, value) VALUES ('store_bytes', '', -old.size)
+                        ON CONFLICT (kind, key) DO UPDATE SET value = value + excluded.value;
+                END;
+                CREATE TRIGGER IF NOT EXISTS stats_tag_insert AFTER INSERT ON collection_tag BEGIN
+                    INSERT INTO stats(kind, key, value)
+                        SELECT 'tag', name, 1 FROM tags WHERE tag_id = new.tag_id
+                        UNION ALL
+                        SELECT 'namespace', substr(name, 1, max(instr(name, ':') - 1, 0)), 1
+                        FROM tags WHERE tag_id = new.tag_id
+                        ON CONFLICT (kind, key) DO UPDATE SET value = value + excluded.value;
+                END;
+                CREATE TRIGGER IF NOT EXISTS stats_tag_delete AFTER DELETE ON collection_tag BEGIN
+                    INSERT INTO stats(kind, key, value)
+                        SELECT 'tag', name, -1 FROM tags WHERE tag_id = old.tag_id
+                        UNION ALL
+                        SELECT 'namespace', substr(name, 1, max(instr(name, ':') - 1, 0)), -1
+                        FROM tags WHERE tag_id = old.tag_id
+                        ON CONFLICT (kind, key) DO UPDATE SET value = value + excluded.value;
+                END;
+                CREATE INDEX IF NOT EXISTS manifest_dir_index ON store_manifest (dir);
+                CREATE UNIQUE INDEX IF NOT EXISTS import_source_index ON import_sessions (source);
+                CREATE INDEX IF NOT EXISTS item_collection_index ON items (collection_id);
+                CREATE INDEX IF NOT EXISTS tag_collection_index
+                    ON collection_tag (tag_id, collection_id);
+                CREATE UNIQUE INDEX IF NOT EXISTS farm_dir_index ON view_farms (dir);
+                CREATE INDEX IF NOT EXISTS farm_link_collection_index
+                    ON view_farm_links (farm_id, collection_id);
+                CREATE UNIQUE INDEX IF NOT EXISTS saved_search_name_index ON saved_searches (name);
+                CREATE INDEX IF NOT EXISTS tag_band_index
+                    ON tag_bands (band, bucket, collection_id);
+                ",
+            )
+            .execute(&mut self.connection)
+            .await?;
+            let collection_ids: Vec<i64> = sqlx::query("SELECT collection_id FROM collections")
+                .try_map(|row: SqliteRow| row.try_get("collection_id"))
+                .fetch_all(&mut self.connection)
+                .await?;
+            for collection_id in collection_ids {
+                self.update_tag_bands(collection_id).await?;
+            }
+            // Accesses before the migration were not recorded, so it counts as the first one,
+            // like an import does. Otherwise every item would be tiered right away.
+            sqlx::query(
+                "
+                INSERT OR IGNORE INTO item_access(item_id, last_access, access_count)
+                SELECT item_id, ?, 0 FROM items
+                ",
+            )
+            .bind(utils::unix_time())
+            .execute(&mut self.connection)
+            .await?;
+            self.recount_stats().await?;
+            sqlx::query(&format!("PRAGMA user_version = {SCHEMA_VERSION}"))
+                .execute(&mut self.connection)
+                .await?;
+            Ok(())
+        }
+        .await;
+        self.end_transaction(result).await
+    }
+
+    async fn get_schema_version(&mut self) -> Result<i64> {
+        let version = sqlx::query("PRAGMA user_version")
+            .try_map(|row: SqliteRow| row.try_get("user_version"))
+            .fetch_one(&mut self.connection)
+            .await?;
+        Ok(version)
+    }
+
     /// Validates the strcture of a vorg db.
     ///
     /// If valid, returns no error.
     /// If not valid, returns a `InvalidDatabase` error with a message describing why.
     async fn validate_db(connection: &mut SqliteConnection) -> Result<()> {
-        static EXPECTED_TABLE_NAMES: [&str; 9] = [
+        static EXPECTED_TABLE_NAMES: [&str; 21] = [
+            "change_generation",
             "collection_tag",
             "collections",
+            "import_session_dirs",
+            "import_session_files",
+            "import_sessions",
+            "item_access",
             "items",
+            "saved_searches",
+            "stats",
+            "store_dirs",
+            "store_manifest",
+            "tag_bands",
             "tags",
             "title_fts",
             "title_fts_config",
             "title_fts_data",
             "title_fts_docsize",
             "title_fts_idx",
+            "view_farm_links",
+            "view_farms",
+        ];
+        static EXPECTED_INDICES: [&str; 10] = [
+            "farm_dir_index",
+            "farm_link_collection_index",
+            "hash_index",
+            "import_source_index",
+            "item_collection_index",
+            "manifest_dir_index",
+            "saved_search_name_index",
+            "tag_band_index",
+            "tag_collection_index",
+            "tag_index",
+        ];
+        static EXPECTED_TRIGGERS: [&str; 17] = [
+            "generation_collection_delete",
+            "generation_collection_insert",
+            "generation_collection_update",
+            "generation_tag_delete",
+            "generation_tag_insert",
+            "stats_collection_delete",
+            "stats_collection_insert",
+            "stats_item_delete",
+            "stats_item_insert",
+            "stats_object_delete",
+            "stats_object_insert",
+            "stats_object_update",
+            "stats_tag_delete",
+            "stats_tag_insert",
+            "title_delete",
+            "title_insert",
+            "title_update",
         ];
-        static EXPECTED_INDICES: [&str; 2] = ["hash_index", "tag_index"];
-        static EXPECTED_TRIGGERS: [&str; 3] = ["title_delete", "title_insert", "title_update"];
-        static VERIFY_COLUMNS: [bool; 9] =
-            [true, true, true, true, false, false, false, false, false];
-        static EXPECTED_COLUMNS: [(usize, [(&str, &str); 4]); 4] = [
+        static VERIFY_COLUMNS: [bool; 21] = [
+            true, true, true, true, true, true, true, true, true, true, true, true, true, true,
+            false, false, false, false, false, true, true,
+        ];
+        static EXPECTED_COLUMNS: [&[(&str, &str)]; 16] = [
+            // change_generation
+            &[("generation", "INTEGER")],
             // collection_tag
-            (
-                2,
-                [
-                    ("collection_id", "INTEGER"),
-                    ("tag_id", "INTEGER"),
-                    ("", ""),
-                    ("", ""),
-                ],
-            ),
+            &[("collection_id", "INTEGER"), ("tag_id", "INTEGER")],
             // collections
-            (
-                2,
-                [
-                    ("collection_id", "INTEGER"),
-                    ("title", "TEXT"),
-                    ("", ""),
-                    ("", ""),
-                ],
-            ),
+            &[("collection_id", "INTEGER"), ("title", "TEXT")],
+            // import_session_dirs
+            &[("dir", "TEXT"), ("session_id", "INTEGER")],
+            // import_session_files
+            &[("dir", "TEXT"), ("name", "TEXT"), ("session_id", "INTEGER")],
+            // import_sessions
+            &[
+                ("imported", "INTEGER"),
+                ("session_id", "INTEGER"),
+                ("skipped", "INTEGER"),
+                ("source", "TEXT"),
+            ],
+            // item_access
+            &[
+                ("access_count", "INTEGER"),
+                ("item_id", "INTEGER"),
+                ("last_access", "INTEGER"),
+            ],
             // items
-            (
-                4,
-                [
-                    ("collection_id", "INTEGER"),
-                    ("ext", "TEXT"),
-                    ("hash", "VARCHAR(64)"),
-                    ("item_id", "INTEGER"),
-                ],
-            ),
+            &[
+                ("collection_id", "INTEGER"),
+                ("ext", "TEXT"),
+                ("hash", "VARCHAR(64)"),
+                ("item_id", "INTEGER"),
+            ],
+            // saved_searches
+            &[
+                ("generation", "INTEGER"),
+                ("name", "TEXT"),
+                ("results", "BLOB"),
+                ("search_id", "INTEGER"),
+                ("tags", "TEXT"),
+                ("title", "TEXT"),
+            ],
+            // stats
+            &[("key", "TEXT"), ("kind", "TEXT"), ("value", "INTEGER")],
+            // store_dirs
+            &[("dir", "TEXT"), ("mtime", "INTEGER")],
+            // store_manifest
+            &[
+                ("dir", "TEXT"),
+                ("ext", "TEXT"),
+                ("hash", "VARCHAR(64)"),
+                ("mtime", "INTEGER"),
+                ("name", "TEXT"),
+                ("size", "INTEGER"),
+            ],
+            // tag_bands
+            &[
+                ("band", "INTEGER"),
+                ("bucket", "INTEGER"),
+                ("collection_id", "INTEGER"),
+            ],
             // tags
-            (
-                2,
-                [("name", "TEXT"), ("tag_id", "INTEGER"), ("", ""), ("", "")],
-            ),
+            &[("name", "TEXT"), ("tag_id", "INTEGER")],
+            // view_farm_links
+            &[
+                ("collection_id", "INTEGER"),
+                ("ext", "TEXT"),
+                ("farm_id", "INTEGER"),
+                ("hash", "VARCHAR(64)"),
+                ("name", "TEXT"),
+            ],
+            // view_farms
+            &[
+                ("dir", "TEXT"),
+                ("farm_id", "INTEGER"),
+                ("symlink", "INTEGER"),
+                ("tags", "TEXT"),
+                ("title", "TEXT"),
+            ],
         ];
 
         let result = sqlx::query!(
@@ -238,13 +642,7 @@ impl DB {
         let mut columns_index = 0;
         for (index, table) in EXPECTED_TABLE_NAMES.iter().enumerate() {
             if VERIFY_COLUMNS[index] {
-                DB::validate_table(
-                    connection,
-                    table,
-                    &EXPECTED_COLUMNS[columns_index].1,
-                    EXPECTED_COLUMNS[columns_index].0,
-                )
-                .await?;
+                DB::validate_table(connection, table, EXPECTED_COLUMNS[columns_index]).await?;
                 columns_index += 1;
             }
         }
@@ -323,7 +721,6 @@ impl DB {
         connection: &mut SqliteConnection,
         table_name: &str,
         expected_columns: &[(&str, &str)],
-        expected_column_count: usize,
     ) -> Result<()> {
         let columns: Vec<(String, String)> =
             sqlx::query("SELECT name,type FROM pragma_table_info(?) ORDER BY name")
@@ -340,7 +737,7 @@ impl DB {
         // Compare columns
         let compare_result = utils::compare_lists(
             &columns,
-            &expected_columns[..expected_column_count],
+            expected_columns,
             |column| &column.0,
             |column_1, column_2| column_1.1 == column_2.1,
         );
@@ -379,21 +776,146 @@ impl DB {
     }
 
     /// Start a new SQL transaction
+    ///
+    /// Outside of a batch, this takes the write lock of the db right away, waiting for other
+    /// connections to finish writing. Within a batch, it is a savepoint, see `begin_batch`.
+    /// Other processes wait for the lock until it is released, so every transaction must end
+    /// with `end_transaction`, even if one of its writes fails.
     async fn begin_transaction(&mut self) -> Result<()> {
-        sqlx::query!("BEGIN TRANSACTION")
-            .execute(&mut self.connection)
-            .await?;
+        let statement = if self.transaction_depth == 0 {
+            "BEGIN IMMEDIATE"
+        } else {
+            "SAVEPOINT tx"
+        };
+        sqlx::query(statement).execute(&mut self.connection).await?;
+        self.transaction_depth += 1;
         Ok(())
     }
 
     /// Commit SQL transaction
+    ///
+    /// Within a batch, the writes are only committed with the batch. If committing fails, the
+    /// transaction is still open and must be rolled back.
     async fn commit_transaction(&mut self) -> Result<()> {
-        sqlx::query!("COMMIT TRANSACTION")
+        let statement = if self.transaction_depth == 1 {
+            "COMMIT"
+        } else {
+            "RELEASE tx"
+        };
+        sqlx::query(statement).execute(&mut self.connection).await?;
+        self.transaction_depth -= 1;
+        Ok(())
+    }
+
+    /// Roll back SQL transaction
+    async fn rollback_transaction(&mut self) -> Result<()> {
+        self.transaction_depth -= 1;
+        if self.transaction_depth == 0 {
+            sqlx::query("ROLLBACK")
+                .execute(&mut self.connection)
+                .await?;
+            return Ok(());
+        }
+        sqlx::query("ROLLBACK TO tx")
             .execute(&mut self.connection)
             .await?;
+        sqlx::query("RELEASE tx")
+            .execute(&mut self.connection)
+            .await?;
+        Ok(())
+    }
+
+    /// Ends the transaction started by `begin_transaction` with the `result` of its writes:
+    /// commits it if they succeeded, and otherwise rolls it back and returns their error.
+    ///
+    /// Every transaction ends here, so that a failed write neither leaves a savepoint open nor
+    /// holds the write lock of the db until the connection is closed.
+    async fn end_transaction<T>(&mut self, result: Result<T>) -> Result<T> {
+        let value = match result {
+            Ok(value) => value,
+            Err(error) => {
+                self.rollback_transaction().await?;
+                return Err(error);
+            }
+        };
+        if let Err(error) = self.commit_transaction().await {
+            self.rollback_transaction().await?;
+            return Err(error);
+        }
+        Ok(value)
+    }
+
+    /// Starts a read transaction, so that every read until `end_snapshot` sees the db as it was
+    /// when this returns, whatever other connections commit meanwhile.
+    ///
+    /// With WAL, the snapshot holds back no writer, but it keeps the WAL from being checkpointed
+    /// past it, so it must end with `end_snapshot` once the reads are done.
+    pub async fn begin_snapshot(&mut self) -> Result<()> {
+        sqlx::query("BEGIN").execute(&mut self.connection).await?;
+        self.transaction_depth += 1;
+        // A deferred transaction only takes its snapshot with its first read
+        let result = sqlx::query("SELECT 1 FROM items LIMIT 1")
+            .execute(&mut self.connection)
+            .await;
+        if let Err(error) = result {
+            self.end_snapshot().await?;
+            return Err(error.into());
+        }
+        Ok(())
+    }
+
+    /// Ends the read transaction started by `begin_snapshot`.
+    pub async fn end_snapshot(&mut self) -> Result<()> {
+        self.rollback_transaction().await
+    }
+
+    /// Whether a transaction or snapshot is open on the connection.
+    pub fn in_transaction(&self) -> bool {
+        self.transaction_depth > 0
+    }
+
+    /// Groups all writes until `commit_batch` into a single transaction, so that many small
+    /// writes share one commit.
+    ///
+    /// Changes are published once the batch commits.
+    pub async fn begin_batch(&mut self) -> Result<()> {
+        self.begin_transaction().await?;
+        self.batch = Some(Vec::new());
+        Ok(())
+    }
+
+    /// Commits the writes since `begin_batch` and publishes their changes.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the batch cannot be committed. It is rolled back then.
+    pub async fn commit_batch(&mut self) -> Result<()> {
+        let changes = self.batch.take();
+        self.end_transaction(Ok(())).await?;
+        if let Some(changes) = changes {
+            self.changes.publish(changes);
+        }
         Ok(())
     }
 
+    /// Rolls back the writes since `begin_batch`, e.g. after one of them failed. Their changes
+    /// are never published.
+    pub async fn rollback_batch(&mut self) -> Result<()> {
+        self.batch = None;
+        self.rollback_transaction().await
+    }
+
+    /// Publishes committed changes, or holds them back until the open batch commits.
+    fn publish<T>(&mut self, changes: T)
+    where
+        T: IntoIterator<Item = Change>,
+    {
+        match &mut self.batch {
+            Some(batch) => batch.extend(changes),
+            None => self.changes.publish(changes),
+        }
+    }
+
     /// Add a new collection in db
     async fn add_collection(&mut self, title: &str) -> Result<i64> {
         let collection_id = sqlx::query!(
@@ -417,7 +939,7 @@ impl DB {
     ) -> Result<i64> {
         let item_id = sqlx::query!(
             "
-            INSERT OR ROLLBACK INTO items(collection_id, hash, ext)
+            INSERT INTO items(collection_id, hash, ext)
             VALUES (?, ?, ?)
             RETURNING item_id
             ",
@@ -447,31 +969,329 @@ impl DB {
         )
         .execute(&mut self.connection)
         .await?;
+        self.update_tag_bands(collection_id).await?;
+        Ok(())
+    }
+
+    /// Recompute the LSH buckets of a collection from its tags, see `similar::band_buckets`.
+    async fn update_tag_bands(&mut self, collection_id: i64) -> Result<()> {
+        let tag_ids = self.get_collection_tag_ids(collection_id).await?;
+        sqlx::query("DELETE FROM tag_bands WHERE collection_id = ?")
+            .bind(collection_id)
+            .execute(&mut self.connection)
+            .await?;
+        let buckets = similar::band_buckets(&tag_ids);
+        if buckets.is_empty() {
+            return Ok(());
+        }
+        let mut sql = String::from("INSERT INTO tag_bands(collection_id, band, bucket) VALUES ");
+        sql.push_str(&vec!["(?, ?, ?)"; buckets.len()].join(", "));
+        let mut statement = sqlx::query(&sql);
+        for (band, bucket) in buckets.into_iter().enumerate() {
+            statement = statement.bind(collection_id).bind(band as i64).bind(bucket);
+        }
+        statement.execute(&mut self.connection).await?;
         Ok(())
     }
 
+    async fn get_collection_tag_ids(&mut self, collection_id: i64) -> Result<Vec<i64>> {
+        let tag_ids = sqlx::query(
+            "
+            SELECT tag_id FROM collection_tag
+            WHERE collection_id = ?
+            ORDER BY tag_id
+            ",
+        )
+        .bind(collection_id)
+        .try_map(|row: SqliteRow| row.try_get("tag_id"))
+        .fetch_all(&mut self.connection)
+        .await?;
+        Ok(tag_ids)
+    }
+
     /// Import a file into the database with an Incomplete tag.
     pub async fn import_file(&mut self, title: &str, hash: &str, ext: &str) -> Result<()> {
         self.begin_transaction().await?;
-        // Add collection
-        let collection_id = self.add_collection(title).await?;
-        // Add item to collection
-        let Ok(item_id) = self.add_item_to_collection(collection_id, hash, ext).await else {
-            return Err(Error {
-                msg: String::from("The item to import already exists in the database."),
-                kind: ErrorKind::Duplicate,
-            });
-        };
-        // Add tag
-        self.add_tag_to_collection(item_id, "meta:Incomplete")
+        let result = async {
+            // Add collection
+            let collection_id = self.add_collection(title).await?;
+            // Add item to collection, rolling the collection back with the duplicate
+            let Ok(item_id) = self.add_item_to_collection(collection_id, hash, ext).await else {
+                return Err(Error {
+                    msg: String::from("The item to import already exists in the database."),
+                    kind: ErrorKind::Duplicate,
+                });
+            };
+            // Add tag
+            self.add_tag_to_collection(collection_id, "meta:Incomplete")
+                .await?;
+            // Importing counts as the first access, so that fresh imports are not tiered right
+            // away
+            sqlx::query(
+                "
+                INSERT INTO item_access(item_id, last_access, access_count)
+                VALUES (?, ?, 0)
+                ",
+            )
+            .bind(item_id)
+            .bind(utils::unix_time())
+            .execute(&mut self.connection)
+            .await?;
+            Ok(collection_id)
+        }
+        .await;
+        let collection_id = self.end_transaction(result).await?;
+        self.publish([
+            Change::CollectionAdded {
+                collection_id,
+                title: title.to_owned(),
+            },
+            Change::ItemAdded {
+                hash: hash.to_owned(),
+                ext: ext.to_owned(),
+                collection_id,
+            },
+            Change::TagAdded {
+                collection_id,
+                tag: String::from("meta:Incomplete"),
+            },
+        ]);
+        Ok(())
+    }
+
+    /// Delete an item, and its collection if the collection has no other items.
+    ///
+    /// The item is removed from the store manifest in the same transaction. Returns whether the
+    /// item existed.
+    pub async fn delete_item(&mut self, hash: &str) -> Result<bool> {
+        self.begin_transaction().await?;
+        let result = async {
+            sqlx::query(
+                "
+                DELETE FROM item_access
+                WHERE item_id IN (SELECT item_id FROM items WHERE hash = ?)
+                ",
+            )
+            .bind(hash)
+            .execute(&mut self.connection)
+            .await?;
+            let collection_id: Option<i64> =
+                sqlx::query("DELETE FROM items WHERE hash = ? RETURNING collection_id")
+                    .bind(hash)
+                    .try_map(|row: SqliteRow| row.try_get("collection_id"))
+                    .fetch_optional(&mut self.connection)
+                    .await?;
+            let Some(collection_id) = collection_id else {
+                return Ok(Vec::new());
+            };
+            sqlx::query("DELETE FROM store_manifest WHERE hash = ?")
+                .bind(hash)
+                .execute(&mut self.connection)
+                .await?;
+            let mut changes = vec![Change::ItemDeleted {
+                hash: hash.to_owned(),
+                collection_id,
+            }];
+            let collection_empty: bool = sqlx::query(
+                "SELECT NOT EXISTS (SELECT 1 FROM items WHERE collection_id = ?) AS empty",
+            )
+            .bind(collection_id)
+            .try_map(|row: SqliteRow| row.try_get("empty"))
+            .fetch_one(&mut self.connection)
             .await?;
-        self.commit_transaction().await?;
+            if collection_empty {
+                for statement in [
+                    "DELETE FROM collection_tag WHERE collection_id = ?",
+                    "DELETE FROM tag_bands WHERE collection_id = ?",
+                ] {
+                    sqlx::query(statement)
+                        .bind(collection_id)
+                        .execute(&mut self.connection)
+                        .await?;
+                }
+                sqlx::query("DELETE FROM collections WHERE collection_id = ?")
+                    .bind(collection_id)
+                    .execute(&mut self.connection)
+                    .await?;
+                changes.push(Change::CollectionDeleted { collection_id });
+            } else {
+                // Triggers only count changes to collections and tags
+                sqlx::query("UPDATE change_generation SET generation = generation + 1")
+                    .execute(&mut self.connection)
+                    .await?;
+            }
+            Ok(changes)
+        }
+        .await;
+        let changes = self.end_transaction(result).await?;
+        if changes.is_empty() {
+            return Ok(false);
+        }
+        self.publish(changes);
+        Ok(true)
+    }
+
+    /// Apply writes taken out of a `WriteBuffer` in a single transaction.
+    ///
+    /// Writes to unknown collections or items are ignored, so that one stale write cannot keep
+    /// the rest of the batch from being applied. Writes that changed anything except accesses are
+    /// published to subscribers once committed. The LSH buckets of retagged collections are
+    /// updated in the same transaction.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if a write fails. The transaction is rolled back then, so that none of
+    ///   `writes` is applied and they can be retried as a whole.
+    pub async fn apply_writes(&mut self, writes: &PendingWrites) -> Result<()> {
+        let mut changes = Vec::new();
+        let mut tagged = BTreeSet::new();
+        self.begin_transaction().await?;
+        let result = async {
+            for (collection_id, title) in &writes.titles {
+                let retitled =
+                    sqlx::query("UPDATE collections SET title = ? WHERE collection_id = ?")
+                        .bind(title)
+                        .bind(collection_id)
+                        .execute(&mut self.connection)
+                        .await?
+                        .rows_affected()
+                        > 0;
+                if retitled {
+                    changes.push(Change::CollectionRetitled {
+                        collection_id: *collection_id,
+                        title: title.clone(),
+                    });
+                }
+            }
+            for (collection_id, tag, present) in &writes.tags {
+                let result = if *present {
+                    sqlx::query("INSERT OR IGNORE INTO tags(name) VALUES (?)")
+                        .bind(tag)
+                        .execute(&mut self.connection)
+                        .await?;
+                    sqlx::query(
+                        "
+                        INSERT OR IGNORE INTO collection_tag(collection_id, tag_id)
+                        SELECT c.collection_id, t.tag_id FROM collections c, tags t
+                        WHERE c.collection_id = ? AND t.name = ?
+                        ",
+                    )
+                    .bind(collection_id)
+                    .bind(tag)
+                    .execute(&mut self.connection)
+                    .await?
+                } else {
+                    sqlx::query(
+                        "
+                        DELETE FROM collection_tag
+                        WHERE collection_id = ?
+                        AND tag_id = (SELECT tag_id FROM tags WHERE name = ?)
+                        ",
+                    )
+                    .bind(collection_id)
+                    .bind(tag)
+                    .execute(&mut self.connection)
+                    .await?
+                };
+                if result.rows_affected() > 0 {
+                    let collection_id = *collection_id;
+                    tagged.insert(collection_id);
+                    let tag = tag.clone();
+                    changes.push(if *present {
+                        Change::TagAdded { collection_id, tag }
+                    } else {
+                        Change::TagRemoved { collection_id, tag }
+                    });
+                }
+            }
+            for collection_id in tagged {
+                self.update_tag_bands(collection_id).await?;
+            }
+            for (hash, access) in &writes.accesses {
+                sqlx::query(
+                    "
+                    INSERT INTO item_access(item_id, last_access, access_count)
+                    SELECT item_id, ?, ? FROM items WHERE hash = ?
+                    ON CONFLICT(item_id) DO UPDATE SET
+                        last_access = max(last_access, excluded.last_access),
+                        access_count = access_count + excluded.access_count
+                    ",
+                )
+                .bind(access.last_access)
+                .bind(access.count)
+                .bind(hash)
+                .execute(&mut self.connection)
+                .await?;
+            }
+            Ok(())
+        }
+        .await;
+        self.end_transaction(result).await?;
+        self.publish(changes);
         Ok(())
     }
 
-    /// Get files that satisfy the given filter.
+    /// Path of the db.
+    pub fn path(&self) -> &str {
+        &self.path
+    }
+
+    /// The feed changes committed through this connection are published to.
+    pub fn change_feed(&self) -> ChangeFeed {
+        self.changes.clone()
+    }
+
+    /// Receives a `ChangeEvent` for every change committed from now on, see `ChangeFeed`.
+    pub fn subscribe(&self) -> broadcast::Receiver<ChangeEvent> {
+        self.changes.subscribe()
+    }
+
+    /// Sequence number of the latest published change.
+    pub fn last_change_seq(&self) -> u64 {
+        self.changes.last_seq()
+    }
+
+    /// Get the hash and ext of items last accessed before `before`, ordered by hash.
     ///
-    /// TODO: Add filtering.
+    /// Every item has a recorded access from its import or from the migration of its db. Items
+    /// without one are left out rather than taken for never accessed.
+    pub async fn get_items_accessed_before(
+        &mut self,
+        before: i64,
+    ) -> Result<Vec<(String, String)>> {
+        let items: Vec<(String, String)> = sqlx::query(
+            "
+            SELECT hash, ext FROM items i
+            JOIN item_access a ON a.item_id = i.item_id
+            WHERE a.last_access < ?
+            ORDER BY hash
+            ",
+        )
+        .bind(before)
+        .try_map(|row: SqliteRow| Ok((row.try_get("hash")?, row.try_get("ext")?)))
+        .fetch_all(&mut self.connection)
+        .await?;
+        Ok(items)
+    }
+
+    /// Get the hash and ext of items last accessed at or after `since`, ordered by hash.
+    pub async fn get_items_accessed_since(&mut self, since: i64) -> Result<Vec<(String, String)>> {
+        let items: Vec<(String, String)> = sqlx::query(
+            "
+            SELECT hash, ext FROM items i
+            JOIN item_access a ON a.item_id = i.item_id
+            WHERE a.last_access >= ?
+            ORDER BY hash
+            ",
+        )
+        .bind(since)
+        .try_map(|row: SqliteRow| Ok((row.try_get("hash")?, row.try_get("ext")?)))
+        .fetch_all(&mut self.connection)
+        .await?;
+        Ok(items)
+    }
+
+    /// Get all files, ordered by hash.
     pub async fn get_items(&mut self) -> Result<Vec<Item>> {
         // Access items table
         let items_query = "
@@ -483,313 +1303,2552 @@ impl DB {
         let mut items = sqlx::query_as::<_, Item>(items_query)
             .fetch_all(&mut self.connection)
             .await?;
-
-        for item in items.iter_mut() {
-            let tags = sqlx::query!(
-                "
-                SELECT name FROM tags t
-                JOIN collection_tag ct
-                ON ct.tag_id = t.tag_id
-                JOIN collections c
-                ON c.collection_id = ct.collection_id
-                WHERE c.collection_id = ?
-                ",
-                item.collection_id
-            )
-            .map(|row| row.name)
-            .fetch_all(&mut self.connection)
-            .await?;
-            item.tags = tags;
-        }
-
+        self.load_tags(&mut items).await?;
         Ok(items)
     }
-}
-
-#[cfg(test)]
-mod tests {
-    use super::*;
-    use rstest::rstest;
-    use test_context::{test_context, AsyncTestContext};
-    use tokio::time::{sleep, Duration};
-    use uuid::Uuid;
 
-    struct TempFolder {
-        pub path: std::path::PathBuf,
+    /// Stream the hash and ext of every item, ordered by hash.
+    pub fn stream_item_keys(&mut self) -> impl Stream<Item = Result<(String, String)>> + '_ {
+        sqlx::query("SELECT hash, ext FROM items ORDER BY hash")
+            .try_map(|row: SqliteRow| Ok((row.try_get("hash")?, row.try_get("ext")?)))
+            .fetch(&mut self.connection)
+            .map_err(Error::from)
     }
 
-    #[async_trait::async_trait]
-    impl AsyncTestContext for TempFolder {
-        async fn setup() -> TempFolder {
-            let uuid = Uuid::new_v4();
-            let temp_dir_path =
-                String::from("temp-") + uuid.hyphenated().encode_lower(&mut Uuid::encode_buffer());
-            let temp_dir = std::path::PathBuf::from(temp_dir_path);
-            fs::create_dir(&temp_dir).expect("Failed to create temp dir for testing.");
-            TempFolder { path: temp_dir }
-        }
+    /// Get all files as a compact `ItemSet`, ordered by hash.
+    pub async fn get_item_set(&mut self) -> Result<ItemSet> {
+        load_item_set(&mut self.connection, i64::MIN..=i64::MAX, "hash").await
+    }
 
-        async fn teardown(self) {
-            if let Err(_) = fs::remove_dir_all(&self.path) {
-                // If the first try failed, wait a bit and retry
-                sleep(Duration::from_millis(200)).await;
-                fs::remove_dir_all(&self.path).expect("Failed to teardown temp test directory.")
-            };
+    /// Get all files as a compact `ItemSet`, ordered by collection id, reading with up to
+    /// `partitions` connections in parallel.
+    ///
+    /// The collection id space is split into equal ranges. Each range is read and decoded on
+    /// its own read-only connection in its own task, and the partial sets are appended in
+    /// order. Nothing is shared between partitions, so the scan scales with the number of cores.
+    ///
+    /// Partitions read from snapshots of their own, so the scan is retried if anything was
+    /// committed while it ran, as told by the data version of this connection. If commits keep
+    /// coming for `SCAN_ATTEMPTS` scans, the set is read from a single snapshot on this
+    /// connection instead.
+    pub async fn scan_item_set(&mut self, partitions: usize) -> Result<ItemSet> {
+        for _ in 0..SCAN_ATTEMPTS {
+            let data_version = self.get_data_version().await?;
+            let set = self.scan_partitions(partitions).await?;
+            if self.get_data_version().await? == data_version {
+                return Ok(set);
+            }
         }
+        self.begin_snapshot().await?;
+        let set = load_item_set(
+            &mut self.connection,
+            i64::MIN..=i64::MAX,
+            "c.collection_id, hash",
+        )
+        .await;
+        self.end_snapshot().await?;
+        set
     }
 
-    #[test_context(TempFolder)]
-    #[tokio::test]
-    async fn test_create_db_success(ctx: &TempFolder) -> Result<()> {
-        // GIVEN
-        let db_path = ctx.path.join("vorg.db");
+    async fn scan_partitions(&mut self, partitions: usize) -> Result<ItemSet> {
+        let (min_id, max_id): (Option<i64>, Option<i64>) = sqlx::query(
+            "SELECT min(collection_id) AS min_id, max(collection_id) AS max_id FROM collections",
+        )
+        .try_map(|row: SqliteRow| Ok((row.try_get("min_id")?, row.try_get("max_id")?)))
+        .fetch_one(&mut self.connection)
+        .await?;
+        let (Some(min_id), Some(max_id)) = (min_id, max_id) else {
+            return Ok(ItemSet::default());
+        };
 
-        // WHEN
-        DB::new(&db_path).await?;
+        let partitions = i64::try_from(partitions.max(1)).unwrap_or(i64::MAX);
+        let partition_len = ((max_id - min_id) / partitions + 1).max(1);
+        let mut scans = Vec::new();
+        let mut start = min_id;
+        while start <= max_id {
+            let end = start.saturating_add(partition_len - 1).min(max_id);
+            let path = self.path.clone();
+            scans.push(tokio::spawn(async move {
+                let mut connection = connect_options(&path)?.read_only(true).connect().await?;
+                load_item_set(&mut connection, start..=end, "c.collection_id, hash").await
+            }));
+            if end == max_id {
+                break;
+            }
+            start = end + 1;
+        }
 
-        // THEN
-        // Verify a connection can be opened
-        let mut db = SqliteConnection::connect(&db_path.to_string_lossy()).await?;
+        let mut set = ItemSet::default();
+        for scan in scans {
+            set.append(scan.await.expect("Scan task panicked.")?);
+        }
+        Ok(set)
+    }
 
-        // Verify required tables
-        let num_rows = sqlx::query!(
+    /// Record an object in the store manifest, replacing any entry with the same hash.
+    pub async fn add_store_object(&mut self, entry: &ManifestEntry) -> Result<()> {
+        insert_manifest_entry(&mut self.connection, entry).await
+    }
+
+    /// Record where an object of the store manifest moved to, e.g. by a reshard. Objects not in
+    /// the manifest are left to the next manifest check.
+    pub async fn move_store_object(&mut self, entry: &ManifestEntry) -> Result<()> {
+        sqlx::query(
             "
-            SELECT tbl_name FROM sqlite_master
-            WHERE type='table'
-            AND tbl_name IN (
-                'tags', 'items', 'collections', 'collection_tag', 'title_fts'
-            );
+            UPDATE store_manifest
+            SET dir = ?, name = ?, size = ?, mtime = ?
+            WHERE hash = ?
             ",
         )
-        .fetch_all(&mut db)
-        .await?
-        .len();
-        assert_eq!(num_rows, 5);
+        .bind(&entry.dir)
+        .bind(&entry.name)
+        .bind(entry.size)
+        .bind(entry.mtime)
+        .bind(&entry.hash)
+        .execute(&mut self.connection)
+        .await?;
+        Ok(())
+    }
 
-        // Verify required indices
-        let num_rows = sqlx::query!(
+    /// Remove an object from the store manifest, e.g. once it moved to the cold tier.
+    pub async fn remove_store_object(&mut self, hash: &str) -> Result<()> {
+        sqlx::query("DELETE FROM store_manifest WHERE hash = ?")
+            .bind(hash)
+            .execute(&mut self.connection)
+            .await?;
+        Ok(())
+    }
+
+    /// Get the manifest entry of an object, if any.
+    pub async fn get_store_object(&mut self, hash: &str) -> Result<Option<ManifestEntry>> {
+        let entry = sqlx::query("SELECT * FROM store_manifest WHERE hash = ?")
+            .bind(hash)
+            .try_map(manifest_entry)
+            .fetch_optional(&mut self.connection)
+            .await?;
+        Ok(entry)
+    }
+
+    /// Get the manifest entries of the objects in the store folder `dir`.
+    pub async fn get_dir_objects(&mut self, dir: &str) -> Result<Vec<ManifestEntry>> {
+        let entries = sqlx::query("SELECT * FROM store_manifest WHERE dir = ?")
+            .bind(dir)
+            .try_map(manifest_entry)
+            .fetch_all(&mut self.connection)
+            .await?;
+        Ok(entries)
+    }
+
+    /// Get up to `count` random manifest entries.
+    pub async fn sample_store_objects(&mut self, count: u64) -> Result<Vec<ManifestEntry>> {
+        let entries = sqlx::query("SELECT * FROM store_manifest ORDER BY random() LIMIT ?")
+            .bind(i64::try_from(count).unwrap_or(i64::MAX))
+            .try_map(manifest_entry)
+            .fetch_all(&mut self.connection)
+            .await?;
+        Ok(entries)
+    }
+
+    /// Get the distinct sizes of the items with an object in the store manifest.
+    pub async fn get_item_sizes(&mut self) -> Result<HashSet<i64>> {
+        let sizes = sqlx::query(
+            "SELECT DISTINCT m.size FROM items i JOIN store_manifest m ON m.hash = i.hash",
+        )
+        .try_map(|row: SqliteRow| row.try_get("size"))
+        .fetch_all(&mut self.connection)
+        .await?;
+        Ok(sizes.into_iter().collect())
+    }
+
+    /// Whether the store manifest was never filled: the db has items, but the manifest records
+    /// no object and no folder. This is the case right after a V2 db was migrated, whose store
+    /// predates the manifest.
+    pub async fn is_manifest_unfilled(&mut self) -> Result<bool> {
+        let unfilled = sqlx::query(
             "
-            SELECT tbl_name FROM sqlite_master
-            WHERE type='index'
-            AND name IN (
-                'hash_index', 'tag_index'
-            );
+            SELECT EXISTS (SELECT 1 FROM items)
+                AND NOT EXISTS (SELECT 1 FROM store_manifest)
+                AND NOT EXISTS (SELECT 1 FROM store_dirs) AS unfilled
             ",
         )
-        .fetch_all(&mut db)
-        .await?
-        .len();
-        assert_eq!(num_rows, 2);
+        .try_map(|row: SqliteRow| row.try_get("unfilled"))
+        .fetch_one(&mut self.connection)
+        .await?;
+        Ok(unfilled)
+    }
+
+    /// Get the hash and ext of every item the store manifest has no object for.
+    pub async fn get_items_without_store_object(&mut self) -> Result<Vec<(String, String)>> {
+        let items = sqlx::query(
+            "
+            SELECT hash, ext FROM items i
+            WHERE NOT EXISTS (SELECT 1 FROM store_manifest m WHERE m.hash = i.hash)
+            ",
+        )
+        .try_map(|row: SqliteRow| Ok((row.try_get("hash")?, row.try_get("ext")?)))
+        .fetch_all(&mut self.connection)
+        .await?;
+        Ok(items)
+    }
+
+    /// Get the number of items without a store manifest entry, e.g. those in the cold tier.
+    pub async fn count_items_without_store_object(&mut self) -> Result<i64> {
+        let count = sqlx::query(
+            "
+            SELECT COUNT(*) AS count FROM items i
+            WHERE NOT EXISTS (SELECT 1 FROM store_manifest m WHERE m.hash = i.hash)
+            ",
+        )
+        .try_map(|row: SqliteRow| row.try_get("count"))
+        .fetch_one(&mut self.connection)
+        .await?;
+        Ok(count)
+    }
+
+    /// Whether an item with `hash` exists, wherever its object is stored.
+    pub async fn has_item(&mut self, hash: &str) -> Result<bool> {
+        let item = sqlx::query("SELECT item_id FROM items WHERE hash = ?")
+            .bind(hash)
+            .fetch_optional(&mut self.connection)
+            .await?;
+        Ok(item.is_some())
+    }
+
+    /// Get the mtime of every store folder as of its last rescan.
+    pub async fn get_store_dirs(&mut self) -> Result<HashMap<String, i64>> {
+        let dirs = sqlx::query("SELECT dir, mtime FROM store_dirs")
+            .try_map(|row: SqliteRow| Ok((row.try_get("dir")?, row.try_get("mtime")?)))
+            .fetch_all(&mut self.connection)
+            .await?;
+        Ok(dirs.into_iter().collect())
+    }
+
+    /// Record the result of rescanning the store folder `dir` in a single transaction.
+    ///
+    /// `objects` are added or updated and entries of `removed` hashes still in `dir` are
+    /// deleted. The folder is recorded with `mtime`, or forgotten if it is `None` so that the
+    /// next check rescans it.
+    pub async fn update_store_dir(
+        &mut self,
+        dir: &str,
+        mtime: Option<i64>,
+        objects: &[ManifestEntry],
+        removed: &[String],
+    ) -> Result<()> {
+        self.begin_transaction().await?;
+        let result = async {
+            for entry in objects {
+                insert_manifest_entry(&mut self.connection, entry).await?;
+            }
+            for hash in removed {
+                sqlx::query("DELETE FROM store_manifest WHERE hash = ? AND dir = ?")
+                    .bind(hash)
+                    .bind(dir)
+                    .execute(&mut self.connection)
+                    .await?;
+            }
+            match mtime {
+                Some(mtime) => {
+                    sqlx::query("INSERT OR REPLACE INTO store_dirs(dir, mtime) VALUES (?, ?)")
+                        .bind(dir)
+                        .bind(mtime)
+                        .execute(&mut self.connection)
+                        .await?;
+                }
+                None => {
+                    sqlx::query("DELETE FROM store_dirs WHERE dir = ?")
+                        .bind(dir)
+                        .execute(&mut self.connection)
+                        .await?;
+                }
+            }
+            Ok(())
+        }
+        .await;
+        self.end_transaction(result).await?;
+        Ok(())
+    }
+
+    /// Forget store folders that no longer exist, together with the objects recorded in them.
+    pub async fn remove_store_dirs(&mut self, dirs: &[String]) -> Result<()> {
+        self.begin_transaction().await?;
+        let result = async {
+            for dir in dirs {
+                sqlx::query("DELETE FROM store_manifest WHERE dir = ?")
+                    .bind(dir)
+                    .execute(&mut self.connection)
+                    .await?;
+                sqlx::query("DELETE FROM store_dirs WHERE dir = ?")
+                    .bind(dir)
+                    .execute(&mut self.connection)
+                    .await?;
+            }
+            Ok(())
+        }
+        .await;
+        self.end_transaction(result).await?;
+        Ok(())
+    }
+
+    /// Stream every hash that is not both an item and a store object with the same ext,
+    /// ordered by hash.
+    ///
+    /// Yields the hash, the ext of the item if there is one, and the ext of the store object if
+    /// there is one.
+    pub fn stream_manifest_diff(
+        &mut self,
+    ) -> impl Stream<Item = Result<(String, Option<String>, Option<String>)>> + '_ {
+        sqlx::query(
+            "
+            SELECT i.hash AS hash, i.ext AS item_ext, m.ext AS object_ext
+            FROM items i LEFT JOIN store_manifest m ON m.hash = i.hash
+            WHERE m.ext IS NULL OR m.ext != i.ext
+            UNION ALL
+            SELECT hash, NULL, ext FROM store_manifest
+            WHERE hash NOT IN (SELECT hash FROM items)
+            ORDER BY hash
+            ",
+        )
+        .try_map(|row: SqliteRow| {
+            Ok((
+                row.try_get("hash")?,
+                row.try_get("item_ext")?,
+                row.try_get("object_ext")?,
+            ))
+        })
+        .fetch(&mut self.connection)
+        .map_err(Error::from)
+    }
+
+    /// Get the unfinished import session of the folder `source`, if any.
+    pub async fn get_import_session(&mut self, source: &str) -> Result<Option<ImportSession>> {
+        let session = sqlx::query(
+            "SELECT session_id, imported, skipped FROM import_sessions WHERE source = ?",
+        )
+        .bind(source)
+        .try_map(|row: SqliteRow| {
+            Ok(ImportSession {
+                session_id: row.try_get("session_id")?,
+                imported: u64::try_from(row.try_get::<i64, _>("imported")?).unwrap_or(0),
+                skipped: u64::try_from(row.try_get::<i64, _>("skipped")?).unwrap_or(0),
+                resumed: true,
+            })
+        })
+        .fetch_optional(&mut self.connection)
+        .await?;
+        Ok(session)
+    }
+
+    /// Resume the unfinished import session of the folder `source`, or start one with `source`
+    /// as its only folder left to import.
+    pub async fn open_import_session(&mut self, source: &str) -> Result<ImportSession> {
+        if let Some(session) = self.get_import_session(source).await? {
+            return Ok(session);
+        }
+        self.begin_transaction().await?;
+        let result = async {
+            let session_id: i64 = sqlx::query(
+                "
+                INSERT INTO import_sessions(source, imported, skipped) VALUES (?, 0, 0)
+                RETURNING session_id
+                ",
+            )
+            .bind(source)
+            .try_map(|row: SqliteRow| row.try_get("session_id"))
+            .fetch_one(&mut self.connection)
+            .await?;
+            sqlx::query("INSERT INTO import_session_dirs(session_id, dir) VALUES (?, ?)")
+                .bind(session_id)
+                .bind(source)
+                .execute(&mut self.connection)
+                .await?;
+            Ok(session_id)
+        }
+        .await;
+        let session_id: i64 = self.end_transaction(result).await?;
+        Ok(ImportSession {
+            session_id,
+            ..ImportSession::default()
+        })
+    }
+
+    /// Get the folders an import session has left to import.
+    pub async fn get_session_dirs(&mut self, session_id: i64) -> Result<Vec<String>> {
+        let dirs = sqlx::query("SELECT dir FROM import_session_dirs WHERE session_id = ?")
+            .bind(session_id)
+            .try_map(|row: SqliteRow| row.try_get("dir"))
+            .fetch_all(&mut self.connection)
+            .await?;
+        Ok(dirs)
+    }
+
+    /// Get the names of the files an import session is done with in the folder `dir`.
+    pub async fn get_session_files(
+        &mut self,
+        session_id: i64,
+        dir: &str,
+    ) -> Result<HashSet<String>> {
+        let names: Vec<String> =
+            sqlx::query("SELECT name FROM import_session_files WHERE session_id = ? AND dir = ?")
+                .bind(session_id)
+                .bind(dir)
+                .try_map(|row: SqliteRow| row.try_get("name"))
+                .fetch_all(&mut self.connection)
+                .await?;
+        Ok(names.into_iter().collect())
+    }
+
+    /// Record that an import session is done with the files `names` in the folder `dir`, of
+    /// which `imported` were imported and `skipped` were skipped, in a single transaction.
+    pub async fn record_session_files(
+        &mut self,
+        session_id: i64,
+        dir: &str,
+        names: &[String],
+        imported: u64,
+        skipped: u64,
+    ) -> Result<()> {
+        self.begin_transaction().await?;
+        let result = async {
+            for name in names {
+                sqlx::query(
+                    "
+                    INSERT OR IGNORE INTO import_session_files(session_id, dir, name)
+                    VALUES (?, ?, ?)
+                    ",
+                )
+                .bind(session_id)
+                .bind(dir)
+                .bind(name)
+                .execute(&mut self.connection)
+                .await?;
+            }
+            sqlx::query(
+                "
+                UPDATE import_sessions SET imported = imported + ?, skipped = skipped + ?
+                WHERE session_id = ?
+                ",
+            )
+            .bind(i64::try_from(imported).unwrap_or(i64::MAX))
+            .bind(i64::try_from(skipped).unwrap_or(i64::MAX))
+            .bind(session_id)
+            .execute(&mut self.connection)
+            .await?;
+            Ok(())
+        }
+        .await;
+        self.end_transaction(result).await?;
+        Ok(())
+    }
+
+    /// Record that an import session is done with the folder `dir`, and has its subfolders
+    /// `subdirs` left to import, in a single transaction.
+    pub async fn finish_session_dir(
+        &mut self,
+        session_id: i64,
+        dir: &str,
+        subdirs: &[String],
+    ) -> Result<()> {
+        self.begin_transaction().await?;
+        let result = async {
+            for subdir in subdirs {
+                sqlx::query(
+                    "INSERT OR IGNORE INTO import_session_dirs(session_id, dir) VALUES (?, ?)",
+                )
+                .bind(session_id)
+                .bind(subdir)
+                .execute(&mut self.connection)
+                .await?;
+            }
+            sqlx::query("DELETE FROM import_session_files WHERE session_id = ? AND dir = ?")
+                .bind(session_id)
+                .bind(dir)
+                .execute(&mut self.connection)
+                .await?;
+            sqlx::query("DELETE FROM import_session_dirs WHERE session_id = ? AND dir = ?")
+                .bind(session_id)
+                .bind(dir)
+                .execute(&mut self.connection)
+                .await?;
+            Ok(())
+        }
+        .await;
+        self.end_transaction(result).await?;
+        Ok(())
+    }
+
+    /// Delete a finished import session.
+    pub async fn finish_import_session(&mut self, session_id: i64) -> Result<()> {
+        self.begin_transaction().await?;
+        let result = async {
+            for table in [
+                "import_session_files",
+                "import_session_dirs",
+                "import_sessions",
+            ] {
+                let statement = format!("DELETE FROM {table} WHERE session_id = ?");
+                sqlx::query(&statement)
+                    .bind(session_id)
+                    .execute(&mut self.connection)
+                    .await?;
+            }
+            Ok(())
+        }
+        .await;
+        self.end_transaction(result).await?;
+        Ok(())
+    }
+
+    /// Get the names of all tags, in order.
+    pub async fn get_tag_names(&mut self) -> Result<Vec<String>> {
+        let names = sqlx::query("SELECT name FROM tags ORDER BY name")
+            .try_map(|row: SqliteRow| row.try_get("name"))
+            .fetch_all(&mut self.connection)
+            .await?;
+        Ok(names)
+    }
+
+    /// Get the first `limit` files of the collections tagged `tag`, ordered by title.
+    ///
+    /// The tag is found by name and its collections by the tag's index on `collection_tag`, so
+    /// this only touches the matching rows.
+    pub async fn get_tag_view(&mut self, tag: &str, limit: u32) -> Result<Vec<ViewFile>> {
+        let files = sqlx::query(
+            "
+            SELECT c.title, i.hash, i.ext, m.size, m.mtime
+            FROM tags t
+            JOIN collection_tag ct ON ct.tag_id = t.tag_id
+            JOIN collections c ON c.collection_id = ct.collection_id
+            JOIN items i ON i.collection_id = c.collection_id
+            LEFT JOIN store_manifest m ON m.hash = i.hash
+            WHERE t.name = ?
+            ORDER BY c.title, i.hash
+            LIMIT ?
+            ",
+        )
+        .bind(tag)
+        .bind(limit)
+        .try_map(view_file)
+        .fetch_all(&mut self.connection)
+        .await?;
+        Ok(files)
+    }
+
+    /// Get the first `limit` files of the collections whose title matches the FTS5 `phrase`,
+    /// ordered by title.
+    pub async fn get_search_view(&mut self, phrase: &str, limit: u32) -> Result<Vec<ViewFile>> {
+        let files = sqlx::query(
+            "
+            SELECT c.title, i.hash, i.ext, m.size, m.mtime
+            FROM title_fts f
+            JOIN collections c ON c.collection_id = f.rowid
+            JOIN items i ON i.collection_id = c.collection_id
+            LEFT JOIN store_manifest m ON m.hash = i.hash
+            WHERE title_fts MATCH ?
+            ORDER BY c.title, i.hash
+            LIMIT ?
+            ",
+        )
+        .bind(phrase)
+        .bind(limit)
+        .try_map(view_file)
+        .fetch_all(&mut self.connection)
+        .await?;
+        Ok(files)
+    }
+
+    /// Save a view farm kept in the folder `dir`. Tags are stored one per line.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Duplicate` if a view farm is kept in `dir` already.
+    pub async fn add_view_farm(&mut self, dir: &str, query: &Query, link: LinkKind) -> Result<i64> {
+        let farm_id = sqlx::query(
+            "
+            INSERT INTO view_farms(dir, tags, title, symlink) VALUES (?, ?, ?, ?)
+            RETURNING farm_id
+            ",
+        )
+        .bind(dir)
+        .bind(query.tags.join("\n"))
+        .bind(&query.title)
+        .bind(link == LinkKind::Symbolic)
+        .try_map(|row: SqliteRow| row.try_get("farm_id"))
+        .fetch_one(&mut self.connection)
+        .await;
+        match farm_id {
+            Err(sqlx::Error::Database(error)) if error.is_unique_violation() => Err(Error {
+                msg: format!("A view farm is kept in {dir} already."),
+                kind: ErrorKind::Duplicate,
+            }),
+            result => Ok(result?),
+        }
+    }
+
+    /// Get every view farm.
+    pub async fn get_view_farms(&mut self) -> Result<Vec<ViewFarm>> {
+        let farms = sqlx::query("SELECT * FROM view_farms ORDER BY farm_id")
+            .try_map(|row: SqliteRow| {
+                let dir: String = row.try_get("dir")?;
+                let tags: String = row.try_get("tags")?;
+                let symlink: bool = row.try_get("symlink")?;
+                Ok(ViewFarm {
+                    farm_id: row.try_get("farm_id")?,
+                    dir: PathBuf::from(dir),
+                    query: Query {
+                        tags: tags.lines().map(str::to_owned).collect(),
+                        title: row.try_get("title")?,
+                    },
+                    link: if symlink {
+                        LinkKind::Symbolic
+                    } else {
+                        LinkKind::Hard
+                    },
+                })
+            })
+            .fetch_all(&mut self.connection)
+            .await?;
+        Ok(farms)
+    }
+
+    /// Remove a view farm and its recorded links, in a single transaction.
+    pub async fn remove_view_farm(&mut self, farm_id: i64) -> Result<()> {
+        self.begin_transaction().await?;
+        let result = async {
+            for statement in [
+                "DELETE FROM view_farm_links WHERE farm_id = ?",
+                "DELETE FROM view_farms WHERE farm_id = ?",
+            ] {
+                sqlx::query(statement)
+                    .bind(farm_id)
+                    .execute(&mut self.connection)
+                    .await?;
+            }
+            Ok(())
+        }
+        .await;
+        self.end_transaction(result).await?;
+        Ok(())
+    }
+
+    /// Get the recorded links of a view farm, or only those of one collection.
+    pub async fn get_farm_links(
+        &mut self,
+        farm_id: i64,
+        collection_id: Option<i64>,
+    ) -> Result<Vec<FarmLink>> {
+        let links = sqlx::query(
+            "
+            SELECT * FROM view_farm_links
+            WHERE farm_id = ? AND (? IS NULL OR collection_id = ?)
+            ",
+        )
+        .bind(farm_id)
+        .bind(collection_id)
+        .bind(collection_id)
+        .try_map(|row: SqliteRow| {
+            Ok(FarmLink {
+                name: row.try_get("name")?,
+                hash: row.try_get("hash")?,
+                ext: row.try_get("ext")?,
+                collection_id: row.try_get("collection_id")?,
+            })
+        })
+        .fetch_all(&mut self.connection)
+        .await?;
+        Ok(links)
+    }
+
+    /// Get the recorded links of a view farm to the object `hash`.
+    ///
+    /// Links are found through the collections of the items with `hash`, so that the lookup uses
+    /// the indexes on items and on the links of a collection.
+    pub async fn get_object_farm_links(
+        &mut self,
+        farm_id: i64,
+        hash: &str,
+    ) -> Result<Vec<FarmLink>> {
+        let links = sqlx::query(
+            "
+            SELECT l.* FROM items i
+            JOIN view_farm_links l ON l.farm_id = ? AND l.collection_id = i.collection_id
+            WHERE i.hash = ? AND l.hash = i.hash
+            ",
+        )
+        .bind(farm_id)
+        .bind(hash)
+        .try_map(|row: SqliteRow| {
+            Ok(FarmLink {
+                name: row.try_get("name")?,
+                hash: row.try_get("hash")?,
+                ext: row.try_get("ext")?,
+                collection_id: row.try_get("collection_id")?,
+            })
+        })
+        .fetch_all(&mut self.connection)
+        .await?;
+        Ok(links)
+    }
+
+    /// Get those of `names` that are used by links of a view farm.
+    pub async fn get_taken_farm_names(
+        &mut self,
+        farm_id: i64,
+        names: &[String],
+    ) -> Result<HashSet<String>> {
+        let mut taken = HashSet::new();
+        for name in names {
+            let exists: bool = sqlx::query(
+                "
+                SELECT EXISTS (
+                    SELECT 1 FROM view_farm_links WHERE farm_id = ? AND name = ?
+                ) AS taken
+                ",
+            )
+            .bind(farm_id)
+            .bind(name)
+            .try_map(|row: SqliteRow| row.try_get("taken"))
+            .fetch_one(&mut self.connection)
+            .await?;
+            if exists {
+                taken.insert(name.clone());
+            }
+        }
+        Ok(taken)
+    }
+
+    /// Record removed and added links of a view farm, in a single transaction.
+    pub async fn update_farm_links(
+        &mut self,
+        farm_id: i64,
+        removed: &[FarmLink],
+        added: &[FarmLink],
+    ) -> Result<()> {
+        self.begin_transaction().await?;
+        let result = async {
+            for link in removed {
+                sqlx::query("DELETE FROM view_farm_links WHERE farm_id = ? AND name = ?")
+                    .bind(farm_id)
+                    .bind(&link.name)
+                    .execute(&mut self.connection)
+                    .await?;
+            }
+            for link in added {
+                sqlx::query(
+                    "
+                    INSERT OR REPLACE INTO view_farm_links(farm_id, name, hash, ext, collection_id)
+                    VALUES (?, ?, ?, ?, ?)
+                    ",
+                )
+                .bind(farm_id)
+                .bind(&link.name)
+                .bind(&link.hash)
+                .bind(&link.ext)
+                .bind(link.collection_id)
+                .execute(&mut self.connection)
+                .await?;
+            }
+            Ok(())
+        }
+        .await;
+        self.end_transaction(result).await?;
+        Ok(())
+    }
+
+    /// Get the items that satisfy `query`, or only those of one collection, ordered by title.
+    pub async fn get_farm_files(
+        &mut self,
+        query: &Query,
+        collection_id: Option<i64>,
+    ) -> Result<Vec<FarmFile>> {
+        let mut sql = String::from(
+            "
+            SELECT c.collection_id, c.title, i.hash, i.ext
+            FROM collections c
+            JOIN items i ON c.collection_id = i.collection_id
+            WHERE 1
+            ",
+        );
+        push_query_filters(&mut sql, query, collection_id.is_some());
+        sql.push_str("ORDER BY c.title, i.hash");
+        let files = bind_query_filters(sqlx::query(&sql), query, collection_id)
+            .try_map(|row: SqliteRow| {
+                Ok(FarmFile {
+                    collection_id: row.try_get("collection_id")?,
+                    title: row.try_get("title")?,
+                    hash: row.try_get("hash")?,
+                    ext: row.try_get("ext")?,
+                })
+            })
+            .fetch_all(&mut self.connection)
+            .await?;
+        Ok(files)
+    }
+
+    /// Get the number of changes made to collections, their items and their tags so far, as
+    /// counted by triggers and `delete_item`. Saved search and query results record it to tell
+    /// whether they are current.
+    pub async fn get_generation(&mut self) -> Result<i64> {
+        let generation = sqlx::query("SELECT generation FROM change_generation")
+            .try_map(|row: SqliteRow| row.try_get("generation"))
+            .fetch_one(&mut self.connection)
+            .await?;
+        Ok(generation)
+    }
+
+    /// Get the data version of the connection, which changes whenever another connection
+    /// commits.
+    pub async fn get_data_version(&mut self) -> Result<i64> {
+        let data_version = sqlx::query("PRAGMA data_version")
+            .try_map(|row: SqliteRow| row.try_get("data_version"))
+            .fetch_one(&mut self.connection)
+            .await?;
+        Ok(data_version)
+    }
+
+    /// Switches the db to WAL, unless it uses WAL already. Dbs of older repos were created
+    /// without it. Returns whether the db uses WAL.
+    ///
+    /// Switching needs the only connection to the db, so it fails if another process has it
+    /// open. It is then left as it is, to be switched when it is next opened alone.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the journal mode cannot be read.
+    pub async fn use_wal(&mut self) -> Result<bool> {
+        let journal_mode: String = sqlx::query("PRAGMA journal_mode")
+            .try_map(|row: SqliteRow| row.try_get("journal_mode"))
+            .fetch_one(&mut self.connection)
+            .await?;
+        if journal_mode.eq_ignore_ascii_case("wal") {
+            return Ok(true);
+        }
+        let journal_mode: String = match sqlx::query("PRAGMA journal_mode = WAL")
+            .try_map(|row: SqliteRow| row.try_get("journal_mode"))
+            .fetch_one(&mut self.connection)
+            .await
+        {
+            Err(sqlx::Error::Database(_)) => return Ok(false),
+            result => result?,
+        };
+        Ok(journal_mode.eq_ignore_ascii_case("wal"))
+    }
+
+    /// Save a search with its current results, in a single transaction. Tags are stored one per
+    /// line.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Duplicate` if a search is saved as `name` already.
+    pub async fn add_saved_search(&mut self, name: &str, query: &Query) -> Result<SavedSearch> {
+        self.begin_transaction().await?;
+        let result = async {
+            let generation = self.get_generation().await?;
+            let results = IdSet::from_ids(self.get_matching_collections(query, None).await?);
+            let search_id: sqlx::Result<i64> = sqlx::query(
+                "
+                INSERT INTO saved_searches(name, tags, title, results, generation)
+                VALUES (?, ?, ?, ?, ?)
+                RETURNING search_id
+                ",
+            )
+            .bind(name)
+            .bind(query.tags.join("\n"))
+            .bind(&query.title)
+            .bind(results.encode())
+            .bind(generation)
+            .try_map(|row: SqliteRow| row.try_get("search_id"))
+            .fetch_one(&mut self.connection)
+            .await;
+            match search_id {
+                Err(sqlx::Error::Database(error)) if error.is_unique_violation() => Err(Error {
+                    msg: format!("A search is saved as {name} already."),
+                    kind: ErrorKind::Duplicate,
+                }),
+                result => Ok((result?, results)),
+            }
+        }
+        .await;
+        let (search_id, results) = self.end_transaction(result).await?;
+        Ok(SavedSearch {
+            search_id,
+            name: name.to_owned(),
+            query: query.clone(),
+            results,
+            dirty: false,
+        })
+    }
+
+    /// Get every saved search with its results as of `generation`, see `get_generation`.
+    ///
+    /// Stored results of another generation, or that cannot be decoded, are recomputed and
+    /// marked dirty.
+    pub async fn get_saved_searches(&mut self, generation: i64) -> Result<Vec<SavedSearch>> {
+        let rows = sqlx::query("SELECT * FROM saved_searches ORDER BY name")
+            .try_map(|row: SqliteRow| {
+                let tags: String = row.try_get("tags")?;
+                let results: Vec<u8> = row.try_get("results")?;
+                let stored: i64 = row.try_get("generation")?;
+                let search = SavedSearch {
+                    search_id: row.try_get("search_id")?,
+                    name: row.try_get("name")?,
+                    query: Query {
+                        tags: tags.lines().map(str::to_owned).collect(),
+                        title: row.try_get("title")?,
+                    },
+                    results: IdSet::default(),
+                    dirty: true,
+                };
+                let current = IdSet::decode(&results).filter(|_| stored == generation);
+                Ok((search, current))
+            })
+            .fetch_all(&mut self.connection)
+            .await?;
+
+        let mut searches = Vec::with_capacity(rows.len());
+        for (mut search, current) in rows {
+            match current {
+                Some(results) => {
+                    search.results = results;
+                    search.dirty = false;
+                }
+                None => {
+                    let ids = self.get_matching_collections(&search.query, None).await?;
+                    search.results = IdSet::from_ids(ids);
+                }
+            }
+            searches.push(search);
+        }
+        Ok(searches)
+    }
+
+    /// Store the results of the dirty `searches` as of `generation`, in a single transaction.
+    pub async fn update_saved_searches(
+        &mut self,
+        searches: &[SavedSearch],
+        generation: i64,
+    ) -> Result<()> {
+        self.begin_transaction().await?;
+        let result = async {
+            for search in searches.iter().filter(|search| search.dirty) {
+                sqlx::query(
+                    "UPDATE saved_searches SET results = ?, generation = ? WHERE search_id = ?",
+                )
+                .bind(search.results.encode())
+                .bind(generation)
+                .bind(search.search_id)
+                .execute(&mut self.connection)
+                .await?;
+            }
+            Ok(())
+        }
+        .await;
+        self.end_transaction(result).await?;
+        Ok(())
+    }
+
+    /// Remove a saved search. Returns whether it existed.
+    pub async fn remove_saved_search(&mut self, name: &str) -> Result<bool> {
+        let result = sqlx::query("DELETE FROM saved_searches WHERE name = ?")
+            .bind(name)
+            .execute(&mut self.connection)
+            .await?;
+        Ok(result.rows_affected() > 0)
+    }
+
+    /// Get the ids of the collections that satisfy `query`, or whether one collection does.
+    pub async fn get_matching_collections(
+        &mut self,
+        query: &Query,
+        collection_id: Option<i64>,
+    ) -> Result<Vec<i64>> {
+        let mut sql = String::from("SELECT c.collection_id FROM collections c WHERE 1\n");
+        push_query_filters(&mut sql, query, collection_id.is_some());
+        let ids = bind_query_filters(sqlx::query(&sql), query, collection_id)
+            .try_map(|row: SqliteRow| row.try_get("collection_id"))
+            .fetch_all(&mut self.connection)
+            .await?;
+        Ok(ids)
+    }
+
+    /// Get `count` collections picked uniformly at random among those that satisfy `query`, in
+    /// random order, or all of them if fewer match.
+    ///
+    /// Random ids between the smallest and largest collection id are probed with indexed lookups
+    /// and kept if they match, so when most collections match, this takes about `count` lookups
+    /// and no sort. Filters that match too few collections for probing, i.e. no sample within
+    /// `PROBES_PER_SAMPLE` tries on average, are sampled by a reservoir over their matches.
+    pub async fn sample_collections(
+        &mut self,
+        query: &Query,
+        count: usize,
+        rng: &mut Rng,
+    ) -> Result<Vec<i64>> {
+        let range: (Option<i64>, Option<i64>) = sqlx::query(
+            "SELECT min(collection_id) AS low, max(collection_id) AS high FROM collections",
+        )
+        .try_map(|row: SqliteRow| Ok((row.try_get("low")?, row.try_get("high")?)))
+        .fetch_one(&mut self.connection)
+        .await?;
+        let (Some(low), Some(high)) = range else {
+            return Ok(Vec::new());
+        };
+        if count == 0 {
+            return Ok(Vec::new());
+        }
+
+        let span = high.abs_diff(low).saturating_add(1);
+        let mut sampled = Vec::with_capacity(count);
+        let mut picked = HashSet::new();
+        for _ in 0..count.saturating_mul(sample::PROBES_PER_SAMPLE) {
+            let collection_id = low.wrapping_add(rng.below(span) as i64);
+            if picked.contains(&collection_id) {
+                continue;
+            }
+            let matches = !self
+                .get_matching_collections(query, Some(collection_id))
+                .await?
+                .is_empty();
+            if matches {
+                picked.insert(collection_id);
+                sampled.push(collection_id);
+                if sampled.len() == count {
+                    return Ok(sampled);
+                }
+            }
+        }
+
+        let mut sql = String::from("SELECT c.collection_id FROM collections c WHERE 1\n");
+        push_query_filters(&mut sql, query, false);
+        let mut reservoir = Reservoir::new(count);
+        let mut ids = bind_query_filters(sqlx::query(&sql), query, None)
+            .try_map(|row: SqliteRow| row.try_get::<i64, _>("collection_id"))
+            .fetch(&mut self.connection);
+        while let Some(collection_id) = ids.try_next().await? {
+            reservoir.push(collection_id, rng);
+        }
+        Ok(reservoir.into_sample(rng))
+    }
+
+    /// Get the items of some collections, in the order of `collection_ids` and by hash.
+    pub async fn get_collection_items(&mut self, collection_ids: &[i64]) -> Result<Vec<Item>> {
+        let mut items = Vec::new();
+        for &collection_id in collection_ids {
+            let mut collection_items = sqlx::query_as::<_, Item>(
+                "
+                SELECT hash, title, ext, c.collection_id
+                FROM collections c
+                JOIN items i ON c.collection_id = i.collection_id
+                WHERE c.collection_id = ?
+                ORDER BY hash
+                ",
+            )
+            .bind(collection_id)
+            .fetch_all(&mut self.connection)
+            .await?;
+            items.append(&mut collection_items);
+        }
+        self.load_tags(&mut items).await?;
+        Ok(items)
+    }
+
+    /// Get up to `limit` collections whose tags are most similar to those of `collection_id`,
+    /// most similar first.
+    ///
+    /// Candidates are the collections that share an LSH bucket with it in any band, at most
+    /// `CANDIDATES_PER_BAND` per band, so the cost does not grow with the number of collections.
+    /// Candidates are then ranked by the exact Jaccard similarity of their tags.
+    pub async fn get_similar_collections(
+        &mut self,
+        collection_id: i64,
+        limit: usize,
+    ) -> Result<Vec<SimilarCollection>> {
+        let tag_ids = self.get_collection_tag_ids(collection_id).await?;
+        let mut candidates: HashMap<i64, Vec<i64>> = HashMap::new();
+        for (band, bucket) in similar::band_buckets(&tag_ids).into_iter().enumerate() {
+            let ids: Vec<i64> = sqlx::query(
+                "
+                SELECT collection_id FROM tag_bands
+                WHERE band = ? AND bucket = ? AND collection_id != ?
+                LIMIT ?
+                ",
+            )
+            .bind(band as i64)
+            .bind(bucket)
+            .bind(collection_id)
+            .bind(similar::CANDIDATES_PER_BAND)
+            .try_map(|row: SqliteRow| row.try_get("collection_id"))
+            .fetch_all(&mut self.connection)
+            .await?;
+            for id in ids {
+                candidates.entry(id).or_default();
+            }
+        }
+        if candidates.is_empty() {
+            return Ok(Vec::new());
+        }
+
+        // `similar::rank` expects the tags of each candidate sorted
+        let sql = format!(
+            "
+            SELECT collection_id, tag_id FROM collection_tag
+            WHERE collection_id IN ({})
+            ORDER BY collection_id, tag_id
+            ",
+            vec!["?"; candidates.len()].join(", ")
+        );
+        let mut statement = sqlx::query(&sql);
+        for &id in candidates.keys() {
+            statement = statement.bind(id);
+        }
+        let rows: Vec<(i64, i64)> = statement
+            .try_map(|row: SqliteRow| Ok((row.try_get("collection_id")?, row.try_get("tag_id")?)))
+            .fetch_all(&mut self.connection)
+            .await?;
+        for (id, tag_id) in rows {
+            candidates.entry(id).or_default().push(tag_id);
+        }
+
+        let mut similar = Vec::new();
+        for (collection_id, similarity) in similar::rank(&tag_ids, &candidates, limit) {
+            let title = sqlx::query("SELECT title FROM collections WHERE collection_id = ?")
+                .bind(collection_id)
+                .try_map(|row: SqliteRow| row.try_get("title"))
+                .fetch_one(&mut self.connection)
+                .await?;
+            similar.push(SimilarCollection {
+                collection_id,
+                title,
+                similarity,
+            });
+        }
+        Ok(similar)
+    }
+
+    /// Get the statistics kept up to date by triggers.
+    pub async fn get_stats(&mut self) -> Result<Stats> {
+        let rows: Vec<(String, String, i64)> = sqlx::query("SELECT kind, key, value FROM stats")
+            .try_map(|row: SqliteRow| {
+                Ok((
+                    row.try_get("kind")?,
+                    row.try_get("key")?,
+                    row.try_get("value")?,
+                ))
+            })
+            .fetch_all(&mut self.connection)
+            .await?;
+        Ok(Stats::from_rows(rows))
+    }
+
+    /// Recount the statistics from scratch, in a single transaction. Returns whether the kept
+    /// statistics differed from the recount.
+    pub async fn recount_stats(&mut self) -> Result<bool> {
+        self.begin_transaction().await?;
+        let result = async {
+            let kept = self.get_stats().await?;
+            sqlx::query("DELETE FROM stats")
+                .execute(&mut self.connection)
+                .await?;
+            sqlx::query(
+                "
+                INSERT INTO stats(kind, key, value)
+                SELECT 'collections', '', COUNT(*) FROM collections
+                UNION ALL
+                SELECT 'items', '', COUNT(*) FROM items
+                UNION ALL
+                SELECT 'store_bytes', '', COALESCE(SUM(size), 0) FROM store_manifest
+                UNION ALL
+                SELECT 'ext', ext, COUNT(*) FROM items GROUP BY ext
+                UNION ALL
+                SELECT 'tag', t.name, COUNT(*) FROM collection_tag ct
+                JOIN tags t ON t.tag_id = ct.tag_id
+                GROUP BY t.name
+                UNION ALL
+                SELECT 'namespace', substr(t.name, 1, max(instr(t.name, ':') - 1, 0)), COUNT(*)
+                FROM collection_tag ct
+                JOIN tags t ON t.tag_id = ct.tag_id
+                GROUP BY 2
+                ",
+            )
+            .execute(&mut self.connection)
+            .await?;
+            let recounted = self.get_stats().await?;
+            Ok(kept != recounted)
+        }
+        .await;
+        self.end_transaction(result).await
+    }
+
+    /// Get one page of the files that satisfy `query`, ordered by hash.
+    pub async fn query_items(&mut self, query: &Query, page: &Page) -> Result<Vec<Item>> {
+        let mut sql = String::from(
+            "
+            SELECT hash, title, ext, c.collection_id
+            FROM collections c
+            JOIN items i ON c.collection_id = i.collection_id
+            WHERE 1
+            ",
+        );
+        push_query_filters(&mut sql, query, false);
+        if page.after.is_some() {
+            sql.push_str("AND hash > ?\n");
+        }
+        sql.push_str("ORDER BY hash LIMIT ?");
+
+        let mut items_query = bind_query_filters(sqlx::query(&sql), query, None);
+        if let Some(after) = &page.after {
+            items_query = items_query.bind(after);
+        }
+        let mut items = items_query
+            .bind(page.limit)
+            .try_map(|row: SqliteRow| Item::from_row(&row))
+            .fetch_all(&mut self.connection)
+            .await?;
+        self.load_tags(&mut items).await?;
+        Ok(items)
+    }
+
+    async fn load_tags(&mut self, items: &mut [Item]) -> Result<()> {
+        for item in items.iter_mut() {
+            let tags = sqlx::query!(
+                "
+                SELECT name FROM tags t
+                JOIN collection_tag ct
+                ON ct.tag_id = t.tag_id
+                JOIN collections c
+                ON c.collection_id = ct.collection_id
+                WHERE c.collection_id = ?
+                ",
+                item.collection_id
+            )
+            .map(|row| row.name)
+            .fetch_all(&mut self.connection)
+            .await?;
+            item.tags = tags;
+        }
+        Ok(())
+    }
+}
+
+/// Options of every connection to the db at `path`.
+fn connect_options(path: &str) -> Result<SqliteConnectOptions> {
+    Ok(SqliteConnectOptions::from_str(path)?.busy_timeout(BUSY_TIMEOUT))
+}
+
+async fn insert_manifest_entry(
+    connection: &mut SqliteConnection,
+    entry: &ManifestEntry,
+) -> Result<()> {
+    sqlx::query(
+        "
+        INSERT INTO store_manifest(hash, ext, dir, name, size, mtime)
+        VALUES (?, ?, ?, ?, ?, ?)
+        ON CONFLICT (hash) DO UPDATE SET
+            ext = excluded.ext,
+            dir = excluded.dir,
+            name = excluded.name,
+            size = excluded.size,
+            mtime = excluded.mtime
+        ",
+    )
+    .bind(&entry.hash)
+    .bind(&entry.ext)
+    .bind(&entry.dir)
+    .bind(&entry.name)
+    .bind(entry.size)
+    .bind(entry.mtime)
+    .execute(connection)
+    .await?;
+    Ok(())
+}
+
+/// Appends the filters of `query` to the `WHERE` clause of a query over `collections c`. Bind
+/// their parameters with `bind_query_filters`.
+///
+/// Every filter is an indexed lookup: title words through FTS5 and each tag through the tag's
+/// index on `collection_tag`. With `one_collection`, the filters are checked for a single
+/// collection only, so that the cost does not grow with the number of matches.
+fn push_query_filters(sql: &mut String, query: &Query, one_collection: bool) {
+    if one_collection {
+        sql.push_str("AND c.collection_id = ?\n");
+        if query.title.is_some() {
+            sql.push_str(
+                "
+                AND EXISTS (
+                    SELECT 1 FROM title_fts
+                    WHERE title_fts MATCH ? AND rowid = c.collection_id
+                )
+                ",
+            );
+        }
+        for _ in &query.tags {
+            sql.push_str(
+                "
+                AND EXISTS (
+                    SELECT 1 FROM collection_tag ct
+                    JOIN tags t ON t.tag_id = ct.tag_id
+                    WHERE ct.collection_id = c.collection_id AND t.name = ?
+                )
+                ",
+            );
+        }
+    } else {
+        if query.title.is_some() {
+            sql.push_str(
+                "AND c.collection_id IN (SELECT rowid FROM title_fts WHERE title_fts MATCH ?)\n",
+            );
+        }
+        for _ in &query.tags {
+            sql.push_str(
+                "
+                AND c.collection_id IN (
+                    SELECT ct.collection_id FROM collection_tag ct
+                    JOIN tags t ON t.tag_id = ct.tag_id
+                    WHERE t.name = ?
+                )
+                ",
+            );
+        }
+    }
+}
+
+/// Binds the parameters of the filters added by `push_query_filters`.
+fn bind_query_filters<'q>(
+    mut statement: sqlx::query::Query<'q, Sqlite, SqliteArguments<'q>>,
+    query: &'q Query,
+    collection_id: Option<i64>,
+) -> sqlx::query::Query<'q, Sqlite, SqliteArguments<'q>> {
+    if let Some(collection_id) = collection_id {
+        statement = statement.bind(collection_id);
+    }
+    if let Some(title_phrase) = query.title_phrase() {
+        statement = statement.bind(title_phrase);
+    }
+    for tag in &query.tags {
+        statement = statement.bind(tag);
+    }
+    statement
+}
+
+fn view_file(row: SqliteRow) -> sqlx::Result<ViewFile> {
+    let size: Option<i64> = row.try_get("size")?;
+    Ok(ViewFile {
+        title: row.try_get("title")?,
+        hash: row.try_get("hash")?,
+        ext: row.try_get("ext")?,
+        size: size.and_then(|size| u64::try_from(size).ok()),
+        mtime: row.try_get("mtime")?,
+    })
+}
+
+fn manifest_entry(row: SqliteRow) -> sqlx::Result<ManifestEntry> {
+    Ok(ManifestEntry {
+        hash: row.try_get("hash")?,
+        ext: row.try_get("ext")?,
+        dir: row.try_get("dir")?,
+        name: row.try_get("name")?,
+        size: row.try_get("size")?,
+        mtime: row.try_get("mtime")?,
+    })
+}
+
+/// Reads the items of the collections in `collection_ids` into an `ItemSet`.
+///
+/// Rows are streamed straight into the set, and tags are loaded with one query for all
+/// collections rather than one per item.
+async fn load_item_set(
+    connection: &mut SqliteConnection,
+    collection_ids: RangeInclusive<i64>,
+    order_by: &str,
+) -> Result<ItemSet> {
+    let mut set = ItemSet::default();
+    let mut collection_tags: HashMap<i64, Vec<Symbol>> = HashMap::new();
+    let mut rows = sqlx::query(
+        "
+        SELECT ct.collection_id, t.name
+        FROM collection_tag ct
+        JOIN tags t ON t.tag_id = ct.tag_id
+        WHERE ct.collection_id BETWEEN ? AND ?
+        ",
+    )
+    .bind(collection_ids.start())
+    .bind(collection_ids.end())
+    .fetch(&mut *connection);
+    while let Some(row) = rows.try_next().await? {
+        let collection_id: i64 = row.try_get("collection_id")?;
+        let tag = set.intern(row.try_get("name")?);
+        collection_tags.entry(collection_id).or_default().push(tag);
+    }
+    drop(rows);
+
+    let items_query = format!(
+        "
+        SELECT hash, title, ext, c.collection_id
+        FROM collections c
+        JOIN items i ON c.collection_id = i.collection_id
+        WHERE c.collection_id BETWEEN ? AND ?
+        ORDER BY {order_by}
+        "
+    );
+    let mut rows = sqlx::query(&items_query)
+        .bind(collection_ids.start())
+        .bind(collection_ids.end())
+        .fetch(&mut *connection);
+    while let Some(row) = rows.try_next().await? {
+        let collection_id: i64 = row.try_get("collection_id")?;
+        let tags = collection_tags
+            .get(&collection_id)
+            .map_or(&[][..], Vec::as_slice);
+        set.push(
+            row.try_get("hash")?,
+            row.try_get("title")?,
+            row.try_get("ext")?,
+            collection_id,
+            tags,
+        )?;
+    }
+    Ok(set)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{access::Access, stats::INCOMPLETE_TAG, test_utils::TempFolder};
+    use rstest::rstest;
+    use std::collections::BTreeMap;
+    use test_context::{test_context, AsyncTestContext};
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_create_db_success(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+
+        // WHEN
+        DB::new(&db_path).await?;
+
+        // THEN
+        // Verify a connection can be opened
+        let mut db = SqliteConnection::connect(&db_path.to_string_lossy()).await?;
+
+        // Verify required tables
+        let num_rows = sqlx::query!(
+            "
+            SELECT tbl_name FROM sqlite_master
+            WHERE type='table'
+            AND tbl_name IN (
+                'tags', 'items', 'collections', 'collection_tag', 'title_fts'
+            );
+            ",
+        )
+        .fetch_all(&mut db)
+        .await?
+        .len();
+        assert_eq!(num_rows, 5);
+
+        // Verify required indices
+        let num_rows = sqlx::query!(
+            "
+            SELECT tbl_name FROM sqlite_master
+            WHERE type='index'
+            AND name IN (
+                'hash_index', 'tag_index'
+            );
+            ",
+        )
+        .fetch_all(&mut db)
+        .await?
+        .len();
+        assert_eq!(num_rows, 2);
+
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_create_db_failed_db(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+
+        // Create a folder at the target db
+        fs::create_dir_all(&db_path)?;
+
+        // WHEN
+        let result = DB::new(&db_path).await;
+
+        // THEN
+        assert!(result.is_err());
+        if let Err(error) = result {
+            assert!(matches!(error.kind, ErrorKind::DB));
+        }
+
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_create_db_failed_io(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("parent").join("vorg.db");
+
+        // Create a file at the parent path
+        let parent_path = db_path.parent().ok_or(Error {
+            kind: ErrorKind::IO,
+            msg: String::from("Failed to get db path parent."),
+        })?;
+        fs::File::create(parent_path)?;
+
+        // WHEN
+        let result = DB::new(&db_path).await;
+
+        // THEN
+        assert!(result.is_err());
+        if let Err(error) = result {
+            assert!(matches!(error.kind, ErrorKind::IO));
+        }
+
+        Ok(())
+    }
+
+    /// Copies the fixture db `name` into `dir`, since opening a db may migrate it and leaves
+    /// WAL files next to it.
+    fn copy_fixture(name: &str, dir: &Path) -> Result<PathBuf> {
+        let path = dir.join(name);
+        fs::copy(Path::new("resources/db").join(name), &path)?;
+        Ok(path)
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_open_db_success(ctx: &TempFolder) -> Result<()> {
+        DB::new(copy_fixture("valid.db", &ctx.path)?).await?;
+
+        Ok(())
+    }
+
+    #[rstest]
+    #[case(
+        "invalid_unexpected_table.db",
+        "Unexpected table \"table_unexpected\" exists in the database."
+    )]
+    #[case(
+        "invalid_missing_table.db",
+        "Table \"items\" is missing from the database."
+    )]
+    #[case(
+        "invalid_unexpected_column.db",
+        "Unexpected column \"studio_id\" in table \"items\"."
+    )]
+    #[case(
+        "invalid_missing_column.db",
+        "Column \"ext\" is missing from table \"items\"."
+    )]
+    #[case(
+        "invalid_wrong_column_type.db",
+        "Column \"hash\" in table \"items\" should have type \"VARCHAR(64)\"."
+    )]
+    #[case(
+        "invalid_missing_index.db",
+        "Database has unexpected or missing indices."
+    )]
+    #[case(
+        "invalid_missing_trigger.db",
+        "Database has unexpected or missing triggers."
+    )]
+    #[tokio::test]
+    async fn test_open_db_error(#[case] fixture: &str, #[case] err_msg: &str) -> Result<()> {
+        let ctx = TempFolder::setup().await;
+        // GIVEN
+        let db_path = copy_fixture(fixture, &ctx.path)?;
+
+        // WHEN
+        let result = DB::new(db_path).await;
+
+        // THEN
+        assert!(result.is_err());
+        if let Err(error) = result {
+            assert_eq!(error.kind, ErrorKind::DB);
+            assert_eq!(error.to_string(), err_msg);
+        }
+
+        ctx.teardown().await;
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_migrate_v2_db(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = copy_fixture("valid_v2.db", &ctx.path)?;
+        let mut connection = SqliteConnection::connect(&db_path.to_string_lossy()).await?;
+        sqlx::query(
+            "
+            INSERT INTO collections(collection_id, title) VALUES (1, 'Title 0'), (2, 'Title 1');
+            INSERT INTO items(collection_id, ext, hash) VALUES
+                (1, 'mp4', '09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79'),
+                (2, 'mkv', '4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633');
+            INSERT INTO tags(tag_id, name) VALUES (1, 'studio:X');
+            INSERT INTO collection_tag(collection_id, tag_id) VALUES (1, 1), (2, 1);
+            ",
+        )
+        .execute(&mut connection)
+        .await?;
+        connection.close().await?;
+
+        // WHEN
+        let mut db = DB::new(&db_path).await?;
+        // The V2 title trigger names a column title_fts lacks
+        db.apply_writes(&PendingWrites {
+            titles: vec![(1, String::from("New title"))],
+            tags: Vec::new(),
+            accesses: Vec::new(),
+        })
+        .await?;
+        drop(db);
+        // Opening a migrated db again leaves it alone
+        let mut db = DB::new(&db_path).await?;
+
+        // THEN
+        assert_eq!(db.get_schema_version().await?, SCHEMA_VERSION);
+        let stats = db.get_stats().await?;
+        assert_eq!(stats.collections, 2);
+        assert_eq!(stats.items, 2);
+        assert_eq!(
+            stats.collections_per_tag,
+            BTreeMap::from([(String::from("studio:X"), 2)])
+        );
+        let similar = db.get_similar_collections(1, 10).await?;
+        assert_eq!(similar[0].collection_id, 2);
+        assert_eq!(similar[0].similarity, 1.0);
+        let renamed = Query {
+            tags: Vec::new(),
+            title: Some(String::from("New title")),
+        };
+        let page = Page {
+            after: None,
+            limit: 10,
+        };
+        assert_eq!(db.query_items(&renamed, &page).await?.len(), 1);
+        // The migration counts as the first access of existing items
+        let migrated_at = utils::unix_time();
+        assert!(db
+            .get_items_accessed_before(migrated_at - 60)
+            .await?
+            .is_empty());
+        assert_eq!(
+            db.get_items_accessed_before(migrated_at + 1).await?.len(),
+            2
+        );
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_import_file(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+
+        // WHEN
+        // Import file
+        let title = "Test title";
+        let ext = "mp4";
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let result = db.import_file(&title, &hash, &ext).await;
+
+        // THEN
+        assert!(result.is_ok());
+        // Test file has been imported
+        let mut connection = SqliteConnection::connect(&db_path.to_string_lossy()).await?;
+        let item_exists_query = "
+        SELECT hash FROM collections c, items i, collection_tag ct, tags t
+        WHERE c.collection_id=ct.collection_id
+        AND ct.tag_id=t.tag_id
+        AND i.collection_id=c.collection_id
+        AND t.name='meta:Incomplete'
+        AND title=?
+        AND ext=?
+        AND hash=?
+        ";
+        assert_eq!(
+            sqlx::query(item_exists_query)
+                .bind(title)
+                .bind(ext)
+                .bind(hash)
+                .fetch_all(&mut connection)
+                .await?
+                .len(),
+            1
+        );
+
+        // WHEN
+        // Test duplicate import
+        let duplicate_title = "Another title";
+        let result = db.import_file(duplicate_title, &hash, &ext).await;
+
+        // THEN
+        assert!(result.is_err());
+        assert_eq!(
+            result.unwrap_err().to_string(),
+            "The item to import already exists in the database."
+        );
+        // Make sure no redundant collection is created.
+        assert_eq!(
+            sqlx::query!(
+                "
+                SELECT title FROM collections
+                WHERE title = ?
+                ",
+                duplicate_title
+            )
+            .fetch_all(&mut connection)
+            .await?
+            .len(),
+            0
+        );
+
+        // WHEN
+        // Test reusing tag
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        let title2 = "Some title";
+        let result = db.import_file(&title2, &hash2, &ext).await;
+
+        // THEN
+        assert!(result.is_ok());
+        assert_eq!(
+            sqlx::query(item_exists_query)
+                .bind(title2)
+                .bind(ext)
+                .bind(hash2)
+                .fetch_all(&mut connection)
+                .await?
+                .len(),
+            1
+        );
+
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_get_items(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+
+        // Import file
+        let title = "Test title";
+        let ext = "mp4";
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let result = db.import_file(&title, &hash, &ext).await;
+        assert!(result.is_ok());
+
+        // WHEN
+        let items = db.get_items().await?;
+
+        // THEN
+        assert_eq!(items.len(), 1);
+        assert_eq!(items[0].title, title);
+        assert_eq!(items[0].ext, ext);
+        assert_eq!(items[0].hash, hash);
+        assert_eq!(items[0].tags.len(), 1);
+        assert_eq!(items[0].tags[0], "meta:Incomplete");
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_apply_writes(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        db.import_file("Test title", hash, "mp4").await?;
+        db.import_file("Another title", hash2, "mp4").await?;
+        let later = utils::unix_time() + 1000;
+
+        // WHEN
+        db.apply_writes(&PendingWrites {
+            titles: vec![(1, String::from("New title"))],
+            tags: vec![
+                (1, String::from("meta:Incomplete"), false),
+                (1, String::from("tag:A"), true),
+                (42, String::from("tag:A"), true),
+            ],
+            accesses: vec![(
+                String::from(hash),
+                Access {
+                    last_access: later,
+                    count: 2,
+                },
+            )],
+        })
+        .await?;
+
+        // THEN
+        let items = db.get_items().await?;
+        assert_eq!(items[0].hash, hash);
+        assert_eq!(items[0].title, "New title");
+        assert_eq!(items[0].tags, vec![String::from("tag:A")]);
+        assert_eq!(items[1].tags, vec![String::from("meta:Incomplete")]);
+        assert_eq!(
+            db.get_items_accessed_since(later).await?,
+            vec![(String::from(hash), String::from("mp4"))]
+        );
+        assert_eq!(
+            db.get_items_accessed_before(later).await?,
+            vec![(String::from(hash2), String::from("mp4"))]
+        );
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_store_manifest(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        let hash3 = "50a04dc1cbd3d8edd5ad7acbcaad95362fe1c47c212f7b6b2b66d8bc";
+        db.import_file("Test title", hash, "mp4").await?;
+        db.import_file("Another title", hash2, "mp4").await?;
+        let entry = |hash: &str, ext: &str| ManifestEntry {
+            hash: String::from(hash),
+            ext: String::from(ext),
+            dir: format!("store/{}", &hash[..2]),
+            name: format!("{}.{ext}", &hash[2..]),
+            size: 3026,
+            mtime: 1,
+        };
+        db.add_store_object(&entry(hash, "mp4")).await?;
+
+        // WHEN
+        db.update_store_dir("store/4e", Some(2), &[entry(hash2, "mkv")], &[])
+            .await?;
+        db.update_store_dir("store/50", Some(3), &[entry(hash3, "mp4")], &[])
+            .await?;
+        db.update_store_dir("store/09", None, &[], &[String::from(hash)])
+            .await?;
+
+        // THEN
+        assert_eq!(
+            db.get_store_dirs().await?,
+            HashMap::from([(String::from("store/4e"), 2), (String::from("store/50"), 3)])
+        );
+        assert_eq!(db.get_dir_objects("store/09").await?, Vec::new());
+        assert_eq!(db.get_store_object(hash2).await?, Some(entry(hash2, "mkv")));
+        assert_eq!(db.get_item_sizes().await?, HashSet::from([3026]));
+        let diffs: Vec<_> = db.stream_manifest_diff().try_collect().await?;
+        assert_eq!(
+            diffs,
+            vec![
+                (String::from(hash), Some(String::from("mp4")), None),
+                (
+                    String::from(hash2),
+                    Some(String::from("mp4")),
+                    Some(String::from("mkv"))
+                ),
+                (String::from(hash3), None, Some(String::from("mp4"))),
+            ]
+        );
+        // Deleting an item drops its manifest entry, and forgotten folders drop theirs
+        db.delete_item(hash2).await?;
+        db.remove_store_dirs(&[String::from("store/50")]).await?;
+        assert_eq!(db.sample_store_objects(10).await?, Vec::new());
+        assert_eq!(
+            db.get_store_dirs().await?,
+            HashMap::from([(String::from("store/4e"), 2)])
+        );
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_import_session(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let session = db.open_import_session("/source").await?;
+        let names = [String::from("a.mp4"), String::from("b.txt")];
+
+        // WHEN
+        db.record_session_files(session.session_id, "/source", &names, 1, 1)
+            .await?;
+        let resumed = db.open_import_session("/source").await?;
+        let done = db.get_session_files(session.session_id, "/source").await?;
+        db.finish_session_dir(
+            session.session_id,
+            "/source",
+            &[String::from("/source/sub")],
+        )
+        .await?;
+        let dirs = db.get_session_dirs(session.session_id).await?;
+        db.finish_import_session(session.session_id).await?;
+
+        // THEN
+        assert!(!session.resumed);
+        assert_eq!(
+            resumed,
+            ImportSession {
+                session_id: session.session_id,
+                imported: 1,
+                skipped: 1,
+                resumed: true,
+            }
+        );
+        assert_eq!(done, HashSet::from(names));
+        assert_eq!(dirs, vec![String::from("/source/sub")]);
+        assert_eq!(
+            db.get_session_files(session.session_id, "/source").await?,
+            HashSet::new()
+        );
+        assert_eq!(db.get_import_session("/source").await?, None);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_batch(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        let mut receiver = db.subscribe();
+
+        // WHEN
+        db.begin_batch().await?;
+        db.import_file("Test title", hash, "mp4").await?;
+        let duplicate = db.import_file("Duplicate", hash, "mp4").await;
+        db.import_file("Another title", hash2, "mp4").await?;
+        let published_early = receiver.try_recv().is_ok();
+        db.commit_batch().await?;
+
+        // THEN
+        assert_eq!(
+            duplicate.map_err(|error| error.kind).err(),
+            Some(ErrorKind::Duplicate)
+        );
+        // Changes are only published once the batch commits
+        assert!(!published_early);
+        assert_eq!(db.last_change_seq(), 6);
+        // The duplicate left nothing behind
+        let items = db.get_items().await?;
+        assert_eq!(
+            items
+                .iter()
+                .map(|item| item.title.as_str())
+                .collect::<Vec<_>>(),
+            vec!["Test title", "Another title"]
+        );
+        let collections: i64 = sqlx::query("SELECT count(*) AS count FROM collections")
+            .try_map(|row: SqliteRow| row.try_get("count"))
+            .fetch_one(&mut db.connection)
+            .await?;
+        assert_eq!(collections, 2);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_change_feed(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let mut receiver = db.subscribe();
+
+        // WHEN
+        db.import_file("Test title", hash, "mp4").await?;
+        db.apply_writes(&PendingWrites {
+            titles: vec![(1, String::from("New title"))],
+            tags: vec![
+                (1, String::from("meta:Incomplete"), false),
+                (1, String::from("tag:A"), false),
+            ],
+            accesses: Vec::new(),
+        })
+        .await?;
+        db.delete_item(hash).await?;
+
+        // THEN
+        let mut events = Vec::new();
+        while let Ok(event) = receiver.try_recv() {
+            events.push(event);
+        }
+        assert_eq!(
+            events.iter().map(|event| event.seq).collect::<Vec<_>>(),
+            (1..=7).collect::<Vec<_>>()
+        );
+        assert_eq!(
+            events
+                .into_iter()
+                .map(|event| event.change)
+                .collect::<Vec<_>>(),
+            vec![
+                Change::CollectionAdded {
+                    collection_id: 1,
+                    title: String::from("Test title"),
+                },
+                Change::ItemAdded {
+                    hash: String::from(hash),
+                    ext: String::from("mp4"),
+                    collection_id: 1,
+                },
+                Change::TagAdded {
+                    collection_id: 1,
+                    tag: String::from("meta:Incomplete"),
+                },
+                Change::CollectionRetitled {
+                    collection_id: 1,
+                    title: String::from("New title"),
+                },
+                // Removing tag:A, which the collection does not have, is not a change
+                Change::TagRemoved {
+                    collection_id: 1,
+                    tag: String::from("meta:Incomplete"),
+                },
+                Change::ItemDeleted {
+                    hash: String::from(hash),
+                    collection_id: 1,
+                },
+                Change::CollectionDeleted { collection_id: 1 },
+            ]
+        );
+        assert_eq!(db.last_change_seq(), 7);
+        assert!(db.get_items().await?.is_empty());
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_query_items(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        let hash3 = "a94a8fe5ccb19ba61c4c0873d391e987982fbbd3b2f3a3b5c1d1ad2e";
+        db.import_file("Morning walk", hash, "mp4").await?;
+        db.import_file("Evening walk", hash2, "mp4").await?;
+        db.import_file("Evening swim", hash3, "mp4").await?;
+        db.apply_writes(&PendingWrites {
+            titles: Vec::new(),
+            tags: vec![
+                (1, String::from("tag:A"), true),
+                (2, String::from("tag:A"), true),
+            ],
+            accesses: Vec::new(),
+        })
+        .await?;
+        let first_page = Page {
+            after: None,
+            limit: 1,
+        };
+
+        // WHEN
+        let tagged = Query {
+            tags: vec![String::from("tag:A"), String::from("meta:Incomplete")],
+            title: None,
+        };
+        let page_1 = db.query_items(&tagged, &first_page).await?;
+        let page_2 = db
+            .query_items(
+                &tagged,
+                &Page {
+                    after: Some(String::from(hash)),
+                    limit: 1,
+                },
+            )
+            .await?;
+        let evening = db
+            .query_items(
+                &Query {
+                    tags: Vec::new(),
+                    title: Some(String::from("evening")),
+                },
+                &Page {
+                    after: None,
+                    limit: 10,
+                },
+            )
+            .await?;
 
+        // THEN
+        assert_eq!(page_1.len(), 1);
+        assert_eq!(page_1[0].hash, hash);
+        assert_eq!(page_2.len(), 1);
+        assert_eq!(page_2[0].hash, hash2);
+        assert_eq!(
+            evening
+                .iter()
+                .map(|item| item.hash.as_str())
+                .collect::<Vec<_>>(),
+            vec![hash2, hash3]
+        );
         Ok(())
     }
 
     #[test_context(TempFolder)]
     #[tokio::test]
-    async fn test_create_db_failed_db(ctx: &TempFolder) -> Result<()> {
+    async fn test_views(ctx: &TempFolder) -> Result<()> {
         // GIVEN
         let db_path = ctx.path.join("vorg.db");
-
-        // Create a folder at the target db
-        fs::create_dir_all(&db_path)?;
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        db.import_file("Morning walk", hash, "mp4").await?;
+        db.import_file("Evening walk", hash2, "mkv").await?;
+        db.apply_writes(&PendingWrites {
+            titles: Vec::new(),
+            tags: vec![
+                (1, String::from("studio:X"), true),
+                (2, String::from("tag:A"), true),
+            ],
+            accesses: Vec::new(),
+        })
+        .await?;
+        db.add_store_object(&ManifestEntry {
+            hash: String::from(hash),
+            ext: String::from("mp4"),
+            dir: String::from("09"),
+            name: format!("{hash}.mp4"),
+            size: 42,
+            mtime: 1000,
+        })
+        .await?;
 
         // WHEN
-        let result = DB::new(&db_path).await;
+        let tags = db.get_tag_names().await?;
+        let studio = db.get_tag_view("studio:X", 10).await?;
+        let walks = db.get_search_view("\"walk\"", 10).await?;
+        let first_walk = db.get_search_view("\"walk\"", 1).await?;
 
         // THEN
-        assert!(result.is_err());
-        if let Err(error) = result {
-            assert!(matches!(error.kind, ErrorKind::DB));
-        }
-
+        assert_eq!(tags, vec!["studio:X", "tag:A"]);
+        assert_eq!(
+            studio,
+            vec![ViewFile {
+                title: String::from("Morning walk"),
+                hash: String::from(hash),
+                ext: String::from("mp4"),
+                size: Some(42),
+                mtime: Some(1000),
+            }]
+        );
+        assert_eq!(
+            walks
+                .iter()
+                .map(|file| file.title.as_str())
+                .collect::<Vec<_>>(),
+            vec!["Evening walk", "Morning walk"]
+        );
+        assert_eq!(walks[0].size, None);
+        assert_eq!(first_walk, walks[..1]);
         Ok(())
     }
 
     #[test_context(TempFolder)]
     #[tokio::test]
-    async fn test_create_db_failed_io(ctx: &TempFolder) -> Result<()> {
+    async fn test_view_farms(ctx: &TempFolder) -> Result<()> {
         // GIVEN
-        let db_path = ctx.path.join("parent").join("vorg.db");
-
-        // Create a file at the parent path
-        let parent_path = db_path.parent().ok_or(Error {
-            kind: ErrorKind::IO,
-            msg: String::from("Failed to get db path parent."),
-        })?;
-        fs::File::create(parent_path)?;
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        db.import_file("Morning walk", hash, "mp4").await?;
+        db.import_file("Evening walk", hash2, "mp4").await?;
+        db.apply_writes(&PendingWrites {
+            titles: Vec::new(),
+            tags: vec![(1, String::from("studio:X"), true)],
+            accesses: Vec::new(),
+        })
+        .await?;
+        let query = Query {
+            tags: vec![String::from("meta:Incomplete"), String::from("studio:X")],
+            title: Some(String::from("walk")),
+        };
+        let link = FarmLink {
+            name: String::from("Morning walk.mp4"),
+            hash: String::from(hash),
+            ext: String::from("mp4"),
+            collection_id: 1,
+        };
 
         // WHEN
-        let result = DB::new(&db_path).await;
+        let farm_id = db.add_view_farm("/farms/x", &query, LinkKind::Hard).await?;
+        let duplicate = db
+            .add_view_farm("/farms/x", &query, LinkKind::Symbolic)
+            .await;
+        let farms = db.get_view_farms().await?;
+        let files = db.get_farm_files(&query, None).await?;
+        let other_files = db.get_farm_files(&query, Some(2)).await?;
+        db.update_farm_links(farm_id, &[], &[link.clone()]).await?;
+        let links = db.get_farm_links(farm_id, Some(1)).await?;
+        let taken = db
+            .get_taken_farm_names(farm_id, &[link.name.clone(), String::from("other.mp4")])
+            .await?;
+        db.remove_view_farm(farm_id).await?;
 
         // THEN
-        assert!(result.is_err());
-        if let Err(error) = result {
-            assert!(matches!(error.kind, ErrorKind::IO));
-        }
-
+        assert_eq!(
+            duplicate.map_err(|error| error.kind),
+            Err(ErrorKind::Duplicate)
+        );
+        assert_eq!(
+            farms,
+            vec![ViewFarm {
+                farm_id,
+                dir: PathBuf::from("/farms/x"),
+                query: query.clone(),
+                link: LinkKind::Hard,
+            }]
+        );
+        assert_eq!(
+            files,
+            vec![FarmFile {
+                collection_id: 1,
+                title: String::from("Morning walk"),
+                hash: String::from(hash),
+                ext: String::from("mp4"),
+            }]
+        );
+        assert!(other_files.is_empty());
+        assert_eq!(links, vec![link.clone()]);
+        assert_eq!(taken, HashSet::from([link.name]));
+        assert!(db.get_view_farms().await?.is_empty());
+        assert!(db.get_farm_links(farm_id, None).await?.is_empty());
         Ok(())
     }
 
+    #[test_context(TempFolder)]
     #[tokio::test]
-    async fn test_open_db_success() -> Result<()> {
-        DB::new("resources/db/valid.db").await?;
+    async fn test_saved_searches(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        db.import_file("Morning walk", hash, "mp4").await?;
+        db.import_file("Evening walk", hash2, "mp4").await?;
+        let query = Query {
+            tags: vec![String::from("meta:Incomplete")],
+            title: Some(String::from("walk")),
+        };
+
+        // WHEN
+        let search = db.add_saved_search("walks", &query).await?;
+        let duplicate = db.add_saved_search("walks", &query).await;
+        let generation = db.get_generation().await?;
+        db.delete_item(hash).await?;
+        let stale = db.get_saved_searches(db.get_generation().await?).await?;
+        db.update_saved_searches(&stale, db.get_generation().await?)
+            .await?;
+        let current = db.get_saved_searches(db.get_generation().await?).await?;
+        let matching = db.get_matching_collections(&query, Some(2)).await?;
+        let items = db.get_collection_items(&[2]).await?;
+        let removed = db.remove_saved_search("walks").await?;
 
+        // THEN
+        assert_eq!(search.results, IdSet::from_ids(vec![1, 2]));
+        assert_eq!(
+            duplicate.map_err(|error| error.kind),
+            Err(ErrorKind::Duplicate)
+        );
+        assert!(db.get_generation().await? > generation);
+        // Results of an older generation are recomputed
+        assert_eq!(stale[0].results, IdSet::from_ids(vec![2]));
+        assert!(stale[0].dirty);
+        assert_eq!(current[0].results, IdSet::from_ids(vec![2]));
+        assert!(!current[0].dirty);
+        assert_eq!(current[0].query, query);
+        assert_eq!(matching, vec![2]);
+        assert_eq!(items[0].hash, hash2);
+        assert_eq!(items[0].tags, vec![String::from("meta:Incomplete")]);
+        assert!(removed);
+        assert!(db.get_saved_searches(generation).await?.is_empty());
         Ok(())
     }
 
-    #[rstest]
-    #[case(
-        "resources/db/invalid_unexpected_table.db",
-        "Unexpected table \"table_unexpected\" exists in the database."
-    )]
-    #[case(
-        "resources/db/invalid_missing_table.db",
-        "Table \"items\" is missing from the database."
-    )]
-    #[case(
-        "resources/db/invalid_unexpected_column.db",
-        "Unexpected column \"studio_id\" in table \"items\"."
-    )]
-    #[case(
-        "resources/db/invalid_missing_column.db",
-        "Column \"ext\" is missing from table \"items\"."
-    )]
-    #[case(
-        "resources/db/invalid_wrong_column_type.db",
-        "Column \"hash\" in table \"items\" should have type \"VARCHAR(64)\"."
-    )]
-    #[case(
-        "resources/db/invalid_missing_index.db",
-        "Database has unexpected or missing indices."
-    )]
-    #[case(
-        "resources/db/invalid_missing_trigger.db",
-        "Database has unexpected or missing triggers."
-    )]
+    #[test_context(TempFolder)]
     #[tokio::test]
-    async fn test_open_db_error(#[case] db_path: &str, #[case] err_msg: &str) {
+    async fn test_similar_collections(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hashes = [
+            "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79",
+            "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633",
+            "a94a8fe5ccb19ba61c4c0873d391e987982fbbd3b2f3a3b5c1d1ad2e",
+        ];
+        for (index, hash) in hashes.iter().enumerate() {
+            db.import_file(&format!("Title {index}"), hash, "mp4")
+                .await?;
+        }
+        let tags = ["studio:X", "actor:A", "actor:B"];
+        let mut writes = Vec::new();
+        for collection_id in [1, 2] {
+            for tag in tags {
+                writes.push((collection_id, String::from(tag), true));
+            }
+        }
+        writes.push((3, String::from("actor:C"), true));
+        db.apply_writes(&PendingWrites {
+            titles: Vec::new(),
+            tags: writes,
+            accesses: Vec::new(),
+        })
+        .await?;
+
         // WHEN
-        let result = DB::new(db_path).await;
+        let similar = db.get_similar_collections(1, 10).await?;
+        db.delete_item(hashes[1]).await?;
+        let after_delete = db.get_similar_collections(1, 10).await?;
 
         // THEN
-        assert!(result.is_err());
-        if let Err(error) = result {
-            assert_eq!(error.kind, ErrorKind::DB);
-            assert_eq!(error.to_string(), err_msg);
-        }
+        // Identical tag sets share every bucket
+        assert_eq!(
+            similar[0],
+            SimilarCollection {
+                collection_id: 2,
+                title: String::from("Title 1"),
+                similarity: 1.0,
+            }
+        );
+        // 3 only shares meta:Incomplete, so it is a candidate at best, ranked by exact similarity
+        assert!(similar[1..]
+            .iter()
+            .all(|collection| collection.collection_id == 3 && collection.similarity == 0.2));
+        assert!(after_delete
+            .iter()
+            .all(|collection| collection.collection_id == 3));
+        Ok(())
     }
 
     #[test_context(TempFolder)]
     #[tokio::test]
-    async fn test_import_file(ctx: &TempFolder) -> Result<()> {
+    async fn test_sample_collections(ctx: &TempFolder) -> Result<()> {
         // GIVEN
         let db_path = ctx.path.join("vorg.db");
         let mut db = DB::new(&db_path).await.unwrap();
+        let hashes = [
+            "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79",
+            "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633",
+            "a94a8fe5ccb19ba61c4c0873d391e987982fbbd3b2f3a3b5c1d1ad2e",
+        ];
+        for (index, hash) in hashes.iter().enumerate() {
+            db.import_file(&format!("Title {index}"), hash, "mp4")
+                .await?;
+        }
+        db.apply_writes(&PendingWrites {
+            titles: Vec::new(),
+            tags: vec![
+                (1, String::from("tag:A"), true),
+                (3, String::from("tag:A"), true),
+            ],
+            accesses: Vec::new(),
+        })
+        .await?;
+        let tagged = Query {
+            tags: vec![String::from("tag:A")],
+            title: None,
+        };
+        let mut rng = Rng::seeded(1);
 
         // WHEN
-        // Import file
-        let title = "Test title";
-        let ext = "mp4";
-        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
-        let result = db.import_file(&title, &hash, &ext).await;
+        let one = db
+            .sample_collections(&Query::default(), 1, &mut rng)
+            .await?;
+        let mut all_tagged = db.sample_collections(&tagged, 5, &mut rng).await?;
+        let none = db.sample_collections(&tagged, 0, &mut rng).await?;
 
         // THEN
-        assert!(result.is_ok());
-        // Test file has been imported
-        let mut connection = SqliteConnection::connect(&db_path.to_string_lossy()).await?;
-        let item_exists_query = "
-        SELECT hash FROM collections c, items i, collection_tag ct, tags t
-        WHERE c.collection_id=ct.collection_id
-        AND ct.tag_id=t.tag_id
-        AND i.collection_id=c.collection_id
-        AND t.name='meta:Incomplete'
-        AND title=?
-        AND ext=?
-        AND hash=?
-        ";
-        assert_eq!(
-            sqlx::query(item_exists_query)
-                .bind(title)
-                .bind(ext)
-                .bind(hash)
-                .fetch_all(&mut connection)
-                .await?
-                .len(),
-            1
-        );
+        assert_eq!(one.len(), 1);
+        assert!((1..=3).contains(&one[0]));
+        // Fewer matches than requested, so every match is returned
+        all_tagged.sort();
+        assert_eq!(all_tagged, vec![1, 3]);
+        assert!(none.is_empty());
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_stats(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        let entry = |hash: &str, ext: &str, size: i64| ManifestEntry {
+            hash: String::from(hash),
+            ext: String::from(ext),
+            dir: format!("store/{}", &hash[..2]),
+            name: format!("{}.{ext}", &hash[2..]),
+            size,
+            mtime: 1,
+        };
 
         // WHEN
-        // Test duplicate import
-        let duplicate_title = "Another title";
-        let result = db.import_file(duplicate_title, &hash, &ext).await;
+        db.import_file("Test title", hash, "mp4").await?;
+        db.import_file("Another title", hash2, "mkv").await?;
+        db.add_store_object(&entry(hash, "mp4", 100)).await?;
+        db.add_store_object(&entry(hash, "mp4", 150)).await?;
+        db.add_store_object(&entry(hash2, "mkv", 50)).await?;
+        db.apply_writes(&PendingWrites {
+            titles: Vec::new(),
+            tags: vec![
+                (1, String::from("studio:X"), true),
+                (1, String::from(INCOMPLETE_TAG), false),
+            ],
+            accesses: Vec::new(),
+        })
+        .await?;
+        db.delete_item(hash2).await?;
+        let stats = db.get_stats().await?;
+        let drifted = db.recount_stats().await?;
+        sqlx::query("UPDATE stats SET value = 5 WHERE kind = 'items'")
+            .execute(&mut db.connection)
+            .await?;
+        let drifted_after_edit = db.recount_stats().await?;
 
         // THEN
-        assert!(result.is_err());
-        assert_eq!(
-            result.unwrap_err().to_string(),
-            "The item to import already exists in the database."
-        );
-        // Make sure no redundant collection is created.
         assert_eq!(
-            sqlx::query!(
-                "
-                SELECT title FROM collections
-                WHERE title = ?
-                ",
-                duplicate_title
-            )
-            .fetch_all(&mut connection)
-            .await?
-            .len(),
-            0
+            stats,
+            Stats {
+                collections: 1,
+                items: 1,
+                store_bytes: 150,
+                items_per_ext: BTreeMap::from([(String::from("mp4"), 1)]),
+                tags_per_namespace: BTreeMap::from([(String::from("studio"), 1)]),
+                collections_per_tag: BTreeMap::from([(String::from("studio:X"), 1)]),
+            }
         );
+        assert_eq!(stats.incomplete(), 0);
+        assert!(!drifted);
+        assert!(drifted_after_edit);
+        assert_eq!(db.get_stats().await?, stats);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_concurrent_connections(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut writer = DB::new(&db_path).await.unwrap();
+        let mut other = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        writer.begin_batch().await?;
+        writer.import_file("Test title", hash, "mp4").await?;
 
         // WHEN
-        // Test reusing tag
+        // Reads see the last commit while the batch is open
+        let generation = other.get_generation().await?;
+        // Writes wait for the batch instead of failing
+        let (imported, committed) =
+            tokio::join!(other.import_file("Another title", hash2, "mp4"), async {
+                tokio::time::sleep(std::time::Duration::from_millis(200)).await;
+                writer.commit_batch().await
+            });
+
+        // THEN
+        assert_eq!(generation, 0);
+        imported?;
+        committed?;
+        assert_eq!(other.get_items().await?.len(), 2);
+        assert!(writer.use_wal().await?);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_failed_transaction_releases_lock(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut writer = DB::new(&db_path).await.unwrap();
+        let mut other = DB::new(&db_path).await.unwrap();
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
         let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
-        let title2 = "Some title";
-        let result = db.import_file(&title2, &hash2, &ext).await;
+        let names = vec![String::from("a.mp4")];
+
+        // WHEN
+        // Fails on its first insert, since the session does not exist
+        let failed = writer.record_session_files(42, "dir", &names, 1, 0).await;
+        writer.begin_batch().await?;
+        writer.import_file("Test title", hash, "mp4").await?;
+        let failed_in_batch = writer.record_session_files(42, "dir", &names, 1, 0).await;
+        writer.commit_batch().await?;
 
         // THEN
-        assert!(result.is_ok());
+        assert_eq!(failed.map_err(|error| error.kind), Err(ErrorKind::DB));
         assert_eq!(
-            sqlx::query(item_exists_query)
-                .bind(title2)
-                .bind(ext)
-                .bind(hash2)
-                .fetch_all(&mut connection)
-                .await?
-                .len(),
-            1
+            failed_in_batch.map_err(|error| error.kind),
+            Err(ErrorKind::DB)
         );
-
+        assert_eq!(writer.transaction_depth, 0);
+        // The write lock is free, so another connection writes without waiting
+        let imported = tokio::time::timeout(
+            Duration::from_secs(5),
+            other.import_file("Another title", hash2, "mp4"),
+        )
+        .await;
+        assert!(matches!(imported, Ok(Ok(()))));
+        assert_eq!(other.get_items().await?.len(), 2);
         Ok(())
     }
 
     #[test_context(TempFolder)]
     #[tokio::test]
-    async fn test_get_items(ctx: &TempFolder) -> Result<()> {
+    async fn test_get_item_set(ctx: &TempFolder) -> Result<()> {
         // GIVEN
         let db_path = ctx.path.join("vorg.db");
         let mut db = DB::new(&db_path).await.unwrap();
-
-        // Import file
-        let title = "Test title";
-        let ext = "mp4";
         let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
-        let result = db.import_file(&title, &hash, &ext).await;
-        assert!(result.is_ok());
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        db.import_file("Test title", hash2, "mp4").await?;
+        db.import_file("Another title", hash, "mp4").await?;
 
         // WHEN
-        let items = db.get_items().await?;
+        let set = db.get_item_set().await?;
 
         // THEN
-        assert_eq!(items.len(), 1);
-        assert_eq!(items[0].title, title);
-        assert_eq!(items[0].ext, ext);
-        assert_eq!(items[0].hash, hash);
-        assert_eq!(items[0].tags.len(), 1);
-        assert_eq!(items[0].tags[0], "meta:Incomplete");
+        let items: Vec<Item> = set.iter().map(|item| item.to_item()).collect();
+        assert_eq!(items, db.get_items().await?);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_scan_item_set(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await.unwrap();
+        let hashes = [
+            "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633",
+            "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79",
+            "a94a8fe5ccb19ba61c4c0873d391e987982fbbd3b2f3a3b5c1d1ad2e",
+        ];
+        for (index, hash) in hashes.iter().enumerate() {
+            db.import_file(&format!("Title {index}"), hash, "mp4")
+                .await?;
+        }
+
+        for partitions in [1, 2, 8] {
+            // WHEN
+            let set = db.scan_item_set(partitions).await?;
+
+            // THEN
+            // Items come in collection id order, i.e. import order
+            assert_eq!(
+                set.iter().map(|item| item.hash()).collect::<Vec<_>>(),
+                hashes
+            );
+            assert!(set.iter().all(|item| item.tags().eq(["meta:Incomplete"])));
+        }
         Ok(())
     }
 }
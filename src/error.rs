@@ -27,6 +27,8 @@ pub enum ErrorKind {
     Duplicate,
     /// Wrong arguments to the commandline util.
     WrongArguments,
+    /// Repo configuration is malformed or invalid.
+    Config,
 }
 
 impl error::Error for Error {}
@@ -57,6 +59,16 @@ impl From<magic::MagicError> for Error {
     }
 }
 
+#[cfg(feature = "s3")]
+impl From<object_store::Error> for Error {
+    fn from(value: object_store::Error) -> Self {
+        Error {
+            msg: value.to_string(),
+            kind: ErrorKind::IO,
+        }
+    }
+}
+
 /// This trait should only be used for generic IO errors that does not fall into any of the other
 /// error categories.
 impl From<std::io::Error> for Error {
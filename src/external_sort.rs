@@ -0,0 +1,291 @@
+use crate::error::{Error, ErrorKind, Result};
+use std::{
+    cmp::Reverse,
+    collections::BinaryHeap,
+    fs,
+    io::{self, BufRead, BufReader, BufWriter, Lines, Write},
+    mem,
+    path::PathBuf,
+};
+
+/// Maximum number of runs merged at once, to stay well below file descriptor limits.
+const MAX_MERGE_WIDTH: usize = 64;
+
+/// Records that can be spilled to a sorted run file, one line per record.
+pub trait SpillRecord: Ord + Sized {
+    /// Approximate memory taken by the record, used to enforce the memory cap of a sort.
+    fn memory_size(&self) -> usize;
+
+    /// Writes the record as a single line, including the trailing newline.
+    fn write_line(&self, writer: &mut dyn Write) -> io::Result<()>;
+
+    /// Parses a line written by `write_line`, without its trailing newline.
+    fn read_line(line: &str) -> Option<Self>;
+}
+
+/// Sorts more records than fit in memory.
+///
+/// Records are buffered until they take `memory_cap` bytes, then sorted and spilled to a run
+/// file in `run_dir`. `finish` merges the runs. If everything fits in memory, nothing is written
+/// to disk.
+pub struct ExternalSorter<T> {
+    run_dir: PathBuf,
+    memory_cap: usize,
+    buffer: Vec<T>,
+    buffer_size: usize,
+    runs: Vec<PathBuf>,
+    next_run: usize,
+}
+
+impl<T> ExternalSorter<T>
+where
+    T: SpillRecord,
+{
+    /// `run_dir` is created on the first spill and removed once the sorted records are dropped.
+    pub fn new(run_dir: PathBuf, memory_cap: usize) -> Self {
+        ExternalSorter {
+            run_dir,
+            memory_cap,
+            buffer: Vec::new(),
+            buffer_size: 0,
+            runs: Vec::new(),
+            next_run: 0,
+        }
+    }
+
+    /// Adds a record, spilling the buffer to a run file if it exceeds the memory cap.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the run file cannot be written.
+    pub fn push(&mut self, record: T) -> Result<()> {
+        self.buffer_size += record.memory_size();
+        self.buffer.push(record);
+        if self.buffer_size > self.memory_cap {
+            self.spill()?;
+        }
+        Ok(())
+    }
+
+    fn spill(&mut self) -> Result<()> {
+        self.buffer.sort_unstable();
+        let buffer = mem::take(&mut self.buffer);
+        self.write_run(buffer.into_iter().map(Ok))?;
+        self.buffer_size = 0;
+        Ok(())
+    }
+
+    fn write_run<I>(&mut self, records: I) -> Result<()>
+    where
+        I: Iterator<Item = Result<T>>,
+    {
+        fs::create_dir_all(&self.run_dir)?;
+        let run_path = self.run_dir.join(format!("run-{}", self.next_run));
+        self.next_run += 1;
+        self.runs.push(run_path.clone());
+        let mut writer = BufWriter::new(fs::File::create(run_path)?);
+        for record in records {
+            record?.write_line(&mut writer)?;
+        }
+        writer.flush()?;
+        Ok(())
+    }
+
+    /// Returns all records pushed so far in ascending order.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the last run cannot be written or a run cannot be opened.
+    pub fn finish(mut self) -> Result<SortedRecords<T>> {
+        if self.runs.is_empty() {
+            let mut buffer = mem::take(&mut self.buffer);
+            buffer.sort_unstable();
+            return Ok(SortedRecords {
+                memory: buffer.into_iter(),
+                runs: Vec::new(),
+                heap: BinaryHeap::new(),
+                merging: false,
+                run_dir: None,
+            });
+        }
+        if !self.buffer.is_empty() {
+            self.spill()?;
+        }
+        // Merge runs in groups until they can all be merged at once
+        while self.runs.len() > MAX_MERGE_WIDTH {
+            let group: Vec<PathBuf> = self.runs.drain(..MAX_MERGE_WIDTH).collect();
+            let merged = SortedRecords::merge(&group, None)?;
+            self.write_run(merged)?;
+            for run_path in group {
+                fs::remove_file(run_path)?;
+            }
+        }
+        // From here on the sorted records own the run files
+        let runs = mem::take(&mut self.runs);
+        SortedRecords::merge(&runs, Some(self.run_dir.clone()))
+    }
+}
+
+impl<T> Drop for ExternalSorter<T> {
+    fn drop(&mut self) {
+        if !self.runs.is_empty() {
+            let _ = fs::remove_dir_all(&self.run_dir);
+        }
+    }
+}
+
+/// Records returned by `ExternalSorter::finish`, merged lazily from the sorted runs.
+pub struct SortedRecords<T> {
+    memory: std::vec::IntoIter<T>,
+    runs: Vec<Lines<BufReader<fs::File>>>,
+    /// Next record of every run that is not exhausted yet.
+    heap: BinaryHeap<Reverse<(T, usize)>>,
+    /// Whether records come from run files rather than from memory.
+    merging: bool,
+    run_dir: Option<PathBuf>,
+}
+
+impl<T> SortedRecords<T>
+where
+    T: SpillRecord,
+{
+    /// Merges sorted run files. `run_dir` is removed once the records are dropped, if given.
+    fn merge(run_paths: &[PathBuf], run_dir: Option<PathBuf>) -> Result<Self> {
+        let mut records = SortedRecords {
+            memory: Vec::new().into_iter(),
+            runs: Vec::new(),
+            heap: BinaryHeap::new(),
+            merging: true,
+            run_dir,
+        };
+        for run_path in run_paths {
+            records
+                .runs
+                .push(BufReader::new(fs::File::open(run_path)?).lines());
+            let run = records.runs.len() - 1;
+            if let Some(record) = records.read_run(run)? {
+                records.heap.push(Reverse((record, run)));
+            }
+        }
+        Ok(records)
+    }
+
+    fn read_run(&mut self, run: usize) -> Result<Option<T>> {
+        let Some(line) = self.runs[run].next() else {
+            return Ok(None);
+        };
+        let line = line?;
+        T::read_line(&line).map(Some).ok_or_else(|| Error {
+            msg: format!("Sort run contains an invalid record: {line}"),
+            kind: ErrorKind::IO,
+        })
+    }
+}
+
+impl<T> Iterator for SortedRecords<T>
+where
+    T: SpillRecord,
+{
+    type Item = Result<T>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if !self.merging {
+            return self.memory.next().map(Ok);
+        }
+        let Reverse((record, run)) = self.heap.pop()?;
+        match self.read_run(run) {
+            Ok(Some(next_record)) => self.heap.push(Reverse((next_record, run))),
+            Ok(None) => (),
+            Err(error) => return Some(Err(error)),
+        }
+        Some(Ok(record))
+    }
+}
+
+impl<T> Drop for SortedRecords<T> {
+    fn drop(&mut self) {
+        if let Some(run_dir) = &self.run_dir {
+            let _ = fs::remove_dir_all(run_dir);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_utils::TempFolder;
+    use test_context::test_context;
+
+    #[derive(Debug, PartialEq, Eq, PartialOrd, Ord)]
+    struct Line(String);
+
+    impl SpillRecord for Line {
+        fn memory_size(&self) -> usize {
+            self.0.len()
+        }
+
+        fn write_line(&self, writer: &mut dyn Write) -> io::Result<()> {
+            writeln!(writer, "{}", self.0)
+        }
+
+        fn read_line(line: &str) -> Option<Self> {
+            Some(Line(line.to_owned()))
+        }
+    }
+
+    fn sort(run_dir: PathBuf, memory_cap: usize, lines: &[&str]) -> Result<Vec<String>> {
+        let mut sorter = ExternalSorter::new(run_dir, memory_cap);
+        for line in lines {
+            sorter.push(Line(String::from(*line)))?;
+        }
+        sorter
+            .finish()?
+            .map(|line| line.map(|line| line.0))
+            .collect()
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn sort_in_memory(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let run_dir = ctx.path.join("runs");
+
+        // WHEN
+        let sorted = sort(run_dir.clone(), 1024, &["c", "a", "b"])?;
+
+        // THEN
+        assert_eq!(sorted, vec!["a", "b", "c"]);
+        assert!(!run_dir.exists());
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn sort_with_spilled_runs(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let run_dir = ctx.path.join("runs");
+        let lines = ["f", "b", "e", "a", "d", "c", "b", "g"];
+        let mut expected = lines.to_vec();
+        expected.sort();
+
+        // WHEN
+        // Every other record spills a run
+        let sorted = sort(run_dir.clone(), 1, &lines)?;
+        let many_lines: Vec<String> = (0..1000).rev().map(|index| format!("{index:04}")).collect();
+        let many_lines: Vec<&str> = many_lines.iter().map(String::as_str).collect();
+        // More runs than can be merged at once
+        let many_sorted = sort(run_dir.clone(), 1, &many_lines)?;
+
+        // THEN
+        assert_eq!(sorted, expected);
+        assert_eq!(
+            many_sorted,
+            (0..1000)
+                .map(|index| format!("{index:04}"))
+                .collect::<Vec<_>>()
+        );
+        // Run files are removed once the sorted records are dropped
+        assert!(!run_dir.exists());
+        Ok(())
+    }
+}
@@ -0,0 +1,229 @@
+use crate::{
+    error::{Error, ErrorKind, Result},
+    query::Query,
+    view,
+};
+use std::{
+    collections::{HashMap, HashSet},
+    fs, io,
+    path::{Path, PathBuf},
+};
+
+/// How the files of a view farm point into the store.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum LinkKind {
+    /// Hard links, which keep working when the store moves but must be on the same filesystem.
+    Hard,
+    /// Symbolic links, which may point across filesystems but break when objects move.
+    Symbolic,
+}
+
+/// A saved query whose results are kept as a folder of links into the store, named by title.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct ViewFarm {
+    pub farm_id: i64,
+    pub dir: PathBuf,
+    pub query: Query,
+    pub link: LinkKind,
+}
+
+/// A link in a view farm, as recorded in the db.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct FarmLink {
+    pub name: String,
+    pub hash: String,
+    pub ext: String,
+    pub collection_id: i64,
+}
+
+/// An item that matches the query of a view farm.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct FarmFile {
+    pub collection_id: i64,
+    pub title: String,
+    pub hash: String,
+    pub ext: String,
+}
+
+/// Changes that turn the recorded links of a view farm into links to the matching items.
+#[derive(Debug, Default, PartialEq, Eq)]
+pub struct FarmPlan {
+    /// Recorded links that still match, under a name that still fits their title.
+    pub keep: Vec<FarmLink>,
+    pub remove: Vec<FarmLink>,
+    pub add: Vec<FarmLink>,
+}
+
+/// Plans how to update the links of some collections of a view farm, or of all of them.
+///
+/// `recorded` are the links of those collections, and `files` the items of those collections
+/// that match the query. `taken` are names used by other links of the farm. Links are kept
+/// whenever possible, so that an update only touches the items that changed. New links are
+/// named by title, or by title and hash if the name is taken.
+pub fn plan(recorded: Vec<FarmLink>, files: &[FarmFile], taken: &HashSet<String>) -> FarmPlan {
+    let wanted: HashMap<&str, &FarmFile> = files
+        .iter()
+        .map(|file| (file.hash.as_str(), file))
+        .collect();
+    let mut plan = FarmPlan::default();
+    let mut used = HashSet::new();
+    for link in recorded {
+        let fits = wanted.get(link.hash.as_str()).is_some_and(|file| {
+            file.collection_id == link.collection_id
+                && (link.name == view::title_name(&file.title, &file.ext)
+                    || link.name == view::hashed_name(&file.title, &file.hash, &file.ext))
+        });
+        if fits && used.insert(link.name.clone()) {
+            plan.keep.push(link);
+        } else {
+            plan.remove.push(link);
+        }
+    }
+
+    let kept: HashSet<&str> = plan.keep.iter().map(|link| link.hash.as_str()).collect();
+    for file in files {
+        if kept.contains(file.hash.as_str()) {
+            continue;
+        }
+        let mut name = view::title_name(&file.title, &file.ext);
+        if used.contains(&name) || taken.contains(&name) {
+            name = view::hashed_name(&file.title, &file.hash, &file.ext);
+        }
+        used.insert(name.clone());
+        plan.add.push(FarmLink {
+            name,
+            hash: file.hash.clone(),
+            ext: file.ext.clone(),
+            collection_id: file.collection_id,
+        });
+    }
+    plan
+}
+
+/// Creates a link of `kind` at `path` to the store object `target`, replacing whatever is at
+/// `path`, e.g. a link created by an update that was interrupted before recording it.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if the link cannot be created, e.g. a hard link across filesystems.
+pub fn create_link(target: &Path, path: &Path, kind: LinkKind) -> Result<()> {
+    remove_link(path)?;
+    match kind {
+        LinkKind::Hard => fs::hard_link(target, path).map_err(|error| Error {
+            msg: format!("Cannot hard link {}: {error}.", path.display()),
+            kind: ErrorKind::IO,
+        }),
+        // Symbolic links resolve relative to their folder, so they point at absolute paths
+        LinkKind::Symbolic => Ok(symlink(&fs::canonicalize(target)?, path)?),
+    }
+}
+
+/// Removes the link at `path`, if any.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if the link exists but cannot be removed.
+pub fn remove_link(path: &Path) -> Result<()> {
+    match fs::remove_file(path) {
+        Err(error) if error.kind() != io::ErrorKind::NotFound => Err(error.into()),
+        _ => Ok(()),
+    }
+}
+
+#[cfg(unix)]
+fn symlink(target: &Path, path: &Path) -> io::Result<()> {
+    std::os::unix::fs::symlink(target, path)
+}
+
+#[cfg(windows)]
+fn symlink(target: &Path, path: &Path) -> io::Result<()> {
+    std::os::windows::fs::symlink_file(target, path)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_utils::TempFolder;
+    use test_context::test_context;
+
+    fn file(collection_id: i64, title: &str, hash: &str) -> FarmFile {
+        FarmFile {
+            collection_id,
+            title: title.to_owned(),
+            hash: hash.to_owned(),
+            ext: String::from("mp4"),
+        }
+    }
+
+    fn link(collection_id: i64, name: &str, hash: &str) -> FarmLink {
+        FarmLink {
+            name: name.to_owned(),
+            hash: hash.to_owned(),
+            ext: String::from("mp4"),
+            collection_id,
+        }
+    }
+
+    #[test]
+    fn keep_links_that_still_fit() {
+        // GIVEN
+        let recorded = vec![
+            link(1, "walk.mp4", "aaaaaaaaaa"),
+            link(2, "old title.mp4", "bbbbbbbbbb"),
+            link(3, "untagged.mp4", "cccccccccc"),
+        ];
+        let files = vec![
+            file(1, "walk", "aaaaaaaaaa"),
+            file(2, "new title", "bbbbbbbbbb"),
+            file(4, "walk", "dddddddddd"),
+            file(5, "swim", "eeeeeeeeee"),
+        ];
+        let taken = HashSet::from([String::from("swim.mp4")]);
+
+        // WHEN
+        let plan = plan(recorded, &files, &taken);
+
+        // THEN
+        assert_eq!(plan.keep, vec![link(1, "walk.mp4", "aaaaaaaaaa")]);
+        // Retitled collections are relinked, unmatched ones unlinked
+        assert_eq!(
+            plan.remove,
+            vec![
+                link(2, "old title.mp4", "bbbbbbbbbb"),
+                link(3, "untagged.mp4", "cccccccccc"),
+            ]
+        );
+        assert_eq!(
+            plan.add,
+            vec![
+                link(2, "new title.mp4", "bbbbbbbbbb"),
+                link(4, "walk (dddddddd).mp4", "dddddddddd"),
+                link(5, "swim (eeeeeeee).mp4", "eeeeeeeeee"),
+            ]
+        );
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn create_and_replace_links(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let target = ctx.path.join("object.mp4");
+        fs::write(&target, "content")?;
+        let hard = ctx.path.join("hard.mp4");
+        let symbolic = ctx.path.join("symbolic.mp4");
+        fs::write(&symbolic, "stale")?;
+
+        // WHEN
+        create_link(&target, &hard, LinkKind::Hard)?;
+        create_link(&target, &symbolic, LinkKind::Symbolic)?;
+        remove_link(&ctx.path.join("missing.mp4"))?;
+
+        // THEN
+        assert_eq!(fs::read_to_string(&hard)?, "content");
+        assert_eq!(fs::read_to_string(&symbolic)?, "content");
+        assert!(fs::symlink_metadata(&symbolic)?.file_type().is_symlink());
+        remove_link(&hard)?;
+        assert!(!hard.exists());
+        Ok(())
+    }
+}
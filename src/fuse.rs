@@ -0,0 +1,612 @@
+use crate::{
+    error::{Error, ErrorKind, Result},
+    view::{self, ViewFile, ViewVersion},
+    Repo,
+};
+use fuser::{
+    consts::FOPEN_KEEP_CACHE, FileAttr, FileType, Filesystem, MountOption, ReplyAttr, ReplyData,
+    ReplyDirectory, ReplyEmpty, ReplyEntry, ReplyOpen, Request, FUSE_ROOT_ID,
+};
+use std::{
+    collections::HashMap,
+    ffi::OsStr,
+    fs,
+    os::unix::fs::FileExt,
+    path::Path,
+    sync::{Arc, Mutex, MutexGuard},
+    time::{Duration, SystemTime, UNIX_EPOCH},
+};
+use tokio::runtime::Handle;
+
+/// How long the kernel may cache folders and their attributes. They change with the db.
+const DIR_TTL: Duration = Duration::from_secs(1);
+/// How long the kernel may cache file attributes. Store objects are content addressed and never
+/// change.
+const FILE_TTL: Duration = Duration::from_secs(3600);
+
+const TAGS_INO: u64 = 2;
+const SEARCH_INO: u64 = 3;
+
+/// Inode reported for folder entries that have not been looked up, as libfuse does when it
+/// does not know an inode. The kernel looks entries up by name before using them.
+const UNKNOWN_INO: u64 = 0xffff_ffff;
+
+/// Most files listed in a tag or search folder, the first by title. Larger views are cut off,
+/// searching within them narrows them down.
+const MAX_LISTED_FILES: u32 = 10_000;
+
+/// What an inode stands for.
+#[derive(Clone, Debug, PartialEq, Eq, Hash)]
+enum Node {
+    Root,
+    /// `tags/`, which lists every tag.
+    Tags,
+    /// `search/`, which is empty but has a folder for any text looked up in it.
+    Search,
+    Tag(String),
+    SearchResults(String),
+    /// A store object, shared by every folder listing it.
+    File {
+        hash: String,
+        ext: String,
+    },
+}
+
+impl Node {
+    fn kind(&self) -> FileType {
+        match self {
+            Node::File { .. } => FileType::RegularFile,
+            _ => FileType::Directory,
+        }
+    }
+}
+
+struct Inode {
+    node: Node,
+    /// Number of lookups the kernel holds on the inode, see `Filesystem::forget`.
+    lookups: u64,
+    /// Attributes of a file, taken from the listing it was looked up in.
+    attr: Option<FileAttr>,
+}
+
+/// An entry of a folder listing.
+struct Entry {
+    name: String,
+    node: Node,
+    /// Size and modification time of a file.
+    file: Option<(u64, SystemTime)>,
+}
+
+/// Entries of a folder as of a version of the repo.
+struct Listing {
+    version: ViewVersion,
+    entries: Vec<Entry>,
+    by_name: HashMap<String, usize>,
+}
+
+/// Read-only filesystem over the tag and search views of a repo, see `Repo::mount`.
+///
+/// Requests are received on the mount thread and answered from tasks on the runtime, so that a
+/// slow query does not hold up other requests. Folders are listed from the repo when they are
+/// first looked at and after any change to it. Inodes, with the attributes of files and the
+/// listings of folders, only live while the kernel holds a lookup on them, so memory follows
+/// what the kernel caches rather than what has been browsed since mounting.
+struct VorgFs {
+    shared: Arc<Shared>,
+    runtime: Handle,
+}
+
+/// What the requests of a `VorgFs` share with the tasks answering them.
+struct Shared {
+    repo: Repo,
+    state: Mutex<State>,
+    uid: u32,
+    gid: u32,
+}
+
+struct State {
+    inodes: HashMap<u64, Inode>,
+    by_node: HashMap<Node, u64>,
+    next_ino: u64,
+    listings: HashMap<u64, Listing>,
+    open_files: HashMap<u64, Arc<fs::File>>,
+    next_fh: u64,
+}
+
+/// Mounts the views of `repo` at `mountpoint` and serves them on this thread until unmounted.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if the filesystem cannot be mounted.
+pub fn mount(repo: &Repo, runtime: Handle, mountpoint: &Path) -> Result<()> {
+    let options = [
+        MountOption::RO,
+        MountOption::FSName(String::from("vorg")),
+        MountOption::DefaultPermissions,
+    ];
+    fuser::mount2(VorgFs::new(repo.clone(), runtime), mountpoint, &options)?;
+    Ok(())
+}
+
+impl VorgFs {
+    fn new(repo: Repo, runtime: Handle) -> Self {
+        VorgFs {
+            shared: Arc::new(Shared {
+                repo,
+                state: Mutex::new(State::new()),
+                // SAFETY: getuid and getgid cannot fail and have no preconditions.
+                uid: unsafe { libc::getuid() },
+                gid: unsafe { libc::getgid() },
+            }),
+            runtime,
+        }
+    }
+}
+
+impl State {
+    fn new() -> Self {
+        let mut state = State {
+            inodes: HashMap::new(),
+            by_node: HashMap::new(),
+            next_ino: FUSE_ROOT_ID,
+            listings: HashMap::new(),
+            open_files: HashMap::new(),
+            next_fh: 1,
+        };
+        for node in [Node::Root, Node::Tags, Node::Search] {
+            state.intern(node);
+        }
+        debug_assert_eq!(state.by_node[&Node::Tags], TAGS_INO);
+        debug_assert_eq!(state.by_node[&Node::Search], SEARCH_INO);
+        state
+    }
+
+    /// Inode of `node`, allocated on first use.
+    fn intern(&mut self, node: Node) -> u64 {
+        if let Some(&ino) = self.by_node.get(&node) {
+            return ino;
+        }
+        let ino = self.next_ino;
+        self.next_ino += 1;
+        self.by_node.insert(node.clone(), ino);
+        self.inodes.insert(
+            ino,
+            Inode {
+                node,
+                lookups: 0,
+                attr: None,
+            },
+        );
+        ino
+    }
+
+    fn node(&self, ino: u64) -> Option<&Node> {
+        self.inodes.get(&ino).map(|inode| &inode.node)
+    }
+
+    fn parent(&self, ino: u64) -> u64 {
+        match self.node(ino) {
+            Some(Node::Tag(_)) => TAGS_INO,
+            Some(Node::SearchResults(_)) => SEARCH_INO,
+            _ => FUSE_ROOT_ID,
+        }
+    }
+
+    /// Drops `count` lookups of `ino`, and the inode once none are left. The root folders are
+    /// kept for the lifetime of the mount.
+    fn forget(&mut self, ino: u64, count: u64) {
+        let Some(inode) = self.inodes.get_mut(&ino) else {
+            return;
+        };
+        inode.lookups = inode.lookups.saturating_sub(count);
+        if inode.lookups > 0 || ino <= SEARCH_INO {
+            return;
+        }
+        if let Some(inode) = self.inodes.remove(&ino) {
+            self.by_node.remove(&inode.node);
+        }
+        self.listings.remove(&ino);
+    }
+}
+
+impl Shared {
+    fn state(&self) -> MutexGuard<'_, State> {
+        self.state
+            .lock()
+            .expect("Filesystem state lock is poisoned.")
+    }
+
+    fn attr(&self, state: &State, ino: u64) -> Option<(Duration, FileAttr)> {
+        let inode = state.inodes.get(&ino)?;
+        match inode.node {
+            Node::File { .. } => Some((FILE_TTL, inode.attr?)),
+            _ => Some((DIR_TTL, self.dir_attr(ino))),
+        }
+    }
+
+    fn dir_attr(&self, ino: u64) -> FileAttr {
+        self.new_attr(ino, FileType::Directory, 0, UNIX_EPOCH)
+    }
+
+    fn new_attr(&self, ino: u64, kind: FileType, size: u64, mtime: SystemTime) -> FileAttr {
+        let (perm, nlink) = match kind {
+            FileType::Directory => (0o555, 2),
+            _ => (0o444, 1),
+        };
+        FileAttr {
+            ino,
+            size,
+            blocks: size.div_ceil(512),
+            atime: mtime,
+            mtime,
+            ctime: mtime,
+            crtime: mtime,
+            kind,
+            perm,
+            nlink,
+            uid: self.uid,
+            gid: self.gid,
+            rdev: 0,
+            blksize: 4096,
+            flags: 0,
+        }
+    }
+
+    /// Replies to a lookup of `ino`, which counts as one more lookup the kernel holds on it.
+    fn reply_entry(&self, state: &mut State, ino: u64, reply: ReplyEntry) {
+        match self.attr(state, ino) {
+            Some((ttl, attr)) => {
+                if let Some(inode) = state.inodes.get_mut(&ino) {
+                    inode.lookups += 1;
+                }
+                reply.entry(&ttl, &attr, 0);
+            }
+            None => reply.error(libc::ENOENT),
+        }
+    }
+
+    /// Lists the folder `ino` unless it is listed as of the current version of the repo.
+    ///
+    /// Returns false if `ino` is not a folder.
+    async fn refresh(&self, ino: u64) -> Result<bool> {
+        let Some(node) = self.state().node(ino).cloned() else {
+            return Ok(false);
+        };
+        // Taken before listing, so that a change made meanwhile does not outlive its version
+        let version = self.repo.view_version().await?;
+        if self
+            .state()
+            .listings
+            .get(&ino)
+            .is_some_and(|listing| listing.version == version)
+        {
+            return Ok(true);
+        }
+        let entries = match node {
+            Node::Root => vec![
+                Entry {
+                    name: String::from("tags"),
+                    node: Node::Tags,
+                    file: None,
+                },
+                Entry {
+                    name: String::from("search"),
+                    node: Node::Search,
+                    file: None,
+                },
+            ],
+            Node::Tags => self
+                .repo
+                .get_tags()
+                .await?
+                .into_iter()
+                .map(|tag| Entry {
+                    name: view::sanitize(&tag),
+                    node: Node::Tag(tag),
+                    file: None,
+                })
+                .collect(),
+            Node::Search => Vec::new(),
+            Node::Tag(tag) => {
+                let files = self.repo.get_tag_view(&tag, MAX_LISTED_FILES).await?;
+                self.file_entries(files).await
+            }
+            Node::SearchResults(text) => {
+                let files = self.repo.get_search_view(&text, MAX_LISTED_FILES).await?;
+                self.file_entries(files).await
+            }
+            Node::File { .. } => return Ok(false),
+        };
+        let mut by_name = HashMap::with_capacity(entries.len());
+        for (index, entry) in entries.iter().enumerate() {
+            by_name.entry(entry.name.clone()).or_insert(index);
+        }
+        let mut state = self.state();
+        // The kernel may have forgotten the folder while it was listed
+        if state.inodes.contains_key(&ino) {
+            state.listings.insert(
+                ino,
+                Listing {
+                    version,
+                    entries,
+                    by_name,
+                },
+            );
+        }
+        Ok(true)
+    }
+
+    /// Entries of `files`.
+    ///
+    /// Sizes come from the store manifest. Objects missing from it are stat'ed in the store,
+    /// and objects that are not in the hot store at all are left out, since they cannot be read
+    /// through.
+    async fn file_entries(&self, files: Vec<ViewFile>) -> Vec<Entry> {
+        let mut found = Vec::with_capacity(files.len());
+        for file in files {
+            if let (Some(size), Some(mtime)) = (file.size, file.mtime) {
+                if let Ok(mtime) = u64::try_from(mtime) {
+                    found.push((file, size, UNIX_EPOCH + Duration::from_nanos(mtime)));
+                }
+                continue;
+            }
+            let Ok(path) = self.repo.locate(&file.hash, &file.ext).await else {
+                continue;
+            };
+            let Ok(metadata) = tokio::fs::metadata(path).await else {
+                continue;
+            };
+            let mtime = metadata.modified().unwrap_or(UNIX_EPOCH);
+            found.push((file, metadata.len(), mtime));
+        }
+        let view_files: Vec<ViewFile> = found.iter().map(|(file, _, _)| file.clone()).collect();
+        let names = view::file_names(&view_files);
+        found
+            .into_iter()
+            .zip(names)
+            .map(|((file, size, mtime), name)| Entry {
+                name,
+                node: Node::File {
+                    hash: file.hash,
+                    ext: file.ext,
+                },
+                file: Some((size, mtime)),
+            })
+            .collect()
+    }
+
+    async fn lookup(&self, parent: u64, name: String, reply: ReplyEntry) {
+        match self.refresh(parent).await {
+            Ok(true) => {}
+            Ok(false) => return reply.error(libc::ENOTDIR),
+            Err(error) => return reply.error(errno(&error)),
+        }
+        let mut state = self.state();
+        let Some(listing) = state.listings.get(&parent) else {
+            // Forgotten since it was listed
+            return reply.error(libc::ENOENT);
+        };
+        let Some(&index) = listing.by_name.get(&name) else {
+            return reply.error(libc::ENOENT);
+        };
+        let entry = &listing.entries[index];
+        let (node, file) = (entry.node.clone(), entry.file);
+        let ino = state.intern(node);
+        if let Some((size, mtime)) = file {
+            let attr = self.new_attr(ino, FileType::RegularFile, size, mtime);
+            if let Some(inode) = state.inodes.get_mut(&ino) {
+                inode.attr = Some(attr);
+            }
+        }
+        self.reply_entry(&mut state, ino, reply);
+    }
+
+    async fn readdir(&self, ino: u64, offset: i64, mut reply: ReplyDirectory) {
+        match self.refresh(ino).await {
+            Ok(true) => {}
+            Ok(false) => return reply.error(libc::ENOTDIR),
+            Err(error) => return reply.error(errno(&error)),
+        }
+        let state = self.state();
+        let Some(listing) = state.listings.get(&ino) else {
+            return reply.error(libc::ENOENT);
+        };
+        let parent = state.parent(ino);
+        let dots = [(".", ino), ("..", parent)]
+            .into_iter()
+            .map(|(name, ino)| (name, ino, FileType::Directory));
+        let entries = listing.entries.iter().map(|entry| {
+            let ino = state
+                .by_node
+                .get(&entry.node)
+                .copied()
+                .unwrap_or(UNKNOWN_INO);
+            (entry.name.as_str(), ino, entry.node.kind())
+        });
+        let skip = usize::try_from(offset).unwrap_or(0);
+        for (index, (name, ino, kind)) in dots.chain(entries).enumerate().skip(skip) {
+            // The offset of an entry is where the next listing call resumes
+            if reply.add(ino, index as i64 + 1, kind, name) {
+                break;
+            }
+        }
+        reply.ok();
+    }
+
+    async fn open(&self, hash: String, ext: String, reply: ReplyOpen) {
+        let file = match self.repo.locate(&hash, &ext).await {
+            Ok(path) => tokio::fs::File::open(path).await.map_err(Error::from),
+            Err(error) => Err(error),
+        };
+        let file = match file {
+            Ok(file) => file.into_std().await,
+            Err(error) => return reply.error(errno(&error)),
+        };
+        self.repo.mark_viewed(&hash);
+        let fh = {
+            let mut state = self.state();
+            let fh = state.next_fh;
+            state.next_fh += 1;
+            state.open_files.insert(fh, Arc::new(file));
+            fh
+        };
+        // Objects never change, so their pages stay valid across opens
+        reply.opened(fh, FOPEN_KEEP_CACHE);
+    }
+}
+
+/// Reads up to `size` bytes of `file` at `offset`, fewer only at the end of the file.
+fn read_at(file: &fs::File, offset: u64, size: u32) -> std::io::Result<Vec<u8>> {
+    let mut buffer = vec![0; size as usize];
+    let mut filled = 0;
+    while filled < buffer.len() {
+        match file.read_at(&mut buffer[filled..], offset + filled as u64) {
+            Ok(0) => break,
+            Ok(read) => filled += read,
+            Err(error) if error.kind() == std::io::ErrorKind::Interrupted => {}
+            Err(error) => return Err(error),
+        }
+    }
+    buffer.truncate(filled);
+    Ok(buffer)
+}
+
+fn errno(error: &Error) -> i32 {
+    if error.kind == ErrorKind::FileNotFound {
+        return libc::ENOENT;
+    }
+    eprintln!("{}", error.msg);
+    libc::EIO
+}
+
+impl Filesystem for VorgFs {
+    fn lookup(&mut self, _req: &Request<'_>, parent: u64, name: &OsStr, reply: ReplyEntry) {
+        let Some(name) = name.to_str() else {
+            return reply.error(libc::ENOENT);
+        };
+        if parent == SEARCH_INO {
+            // Any text can be searched for, the folder is listed when it is read
+            let mut state = self.shared.state();
+            let ino = state.intern(Node::SearchResults(name.to_owned()));
+            return self.shared.reply_entry(&mut state, ino, reply);
+        }
+        let shared = Arc::clone(&self.shared);
+        let name = name.to_owned();
+        self.runtime
+            .spawn(async move { shared.lookup(parent, name, reply).await });
+    }
+
+    fn forget(&mut self, _req: &Request<'_>, ino: u64, nlookup: u64) {
+        self.shared.state().forget(ino, nlookup);
+    }
+
+    fn getattr(&mut self, _req: &Request<'_>, ino: u64, reply: ReplyAttr) {
+        let state = self.shared.state();
+        match self.shared.attr(&state, ino) {
+            Some((ttl, attr)) => reply.attr(&ttl, &attr),
+            None => reply.error(libc::ENOENT),
+        }
+    }
+
+    fn readdir(
+        &mut self,
+        _req: &Request<'_>,
+        ino: u64,
+        _fh: u64,
+        offset: i64,
+        reply: ReplyDirectory,
+    ) {
+        let shared = Arc::clone(&self.shared);
+        self.runtime
+            .spawn(async move { shared.readdir(ino, offset, reply).await });
+    }
+
+    fn open(&mut self, _req: &Request<'_>, ino: u64, flags: i32, reply: ReplyOpen) {
+        let Some(Node::File { hash, ext }) = self.shared.state().node(ino).cloned() else {
+            return reply.error(libc::EISDIR);
+        };
+        if flags & libc::O_ACCMODE != libc::O_RDONLY {
+            return reply.error(libc::EROFS);
+        }
+        let shared = Arc::clone(&self.shared);
+        self.runtime
+            .spawn(async move { shared.open(hash, ext, reply).await });
+    }
+
+    fn read(
+        &mut self,
+        _req: &Request<'_>,
+        _ino: u64,
+        fh: u64,
+        offset: i64,
+        size: u32,
+        _flags: i32,
+        _lock_owner: Option<u64>,
+        reply: ReplyData,
+    ) {
+        let file = self.shared.state().open_files.get(&fh).cloned();
+        let (Some(file), Ok(offset)) = (file, u64::try_from(offset)) else {
+            return reply.error(libc::EBADF);
+        };
+        // Read straight from the store object, on the blocking pool so that a slow disk does not
+        // hold up other requests
+        self.runtime
+            .spawn_blocking(move || match read_at(&file, offset, size) {
+                Ok(data) => reply.data(&data),
+                Err(error) => reply.error(error.raw_os_error().unwrap_or(libc::EIO)),
+            });
+    }
+
+    fn release(
+        &mut self,
+        _req: &Request<'_>,
+        _ino: u64,
+        fh: u64,
+        _flags: i32,
+        _lock_owner: Option<u64>,
+        _flush: bool,
+        reply: ReplyEmpty,
+    ) {
+        self.shared.state().open_files.remove(&fh);
+        reply.ok();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn forget_inodes() {
+        // GIVEN
+        let mut state = State::new();
+        let tag = state.intern(Node::Tag(String::from("tag:A")));
+        state
+            .inodes
+            .get_mut(&tag)
+            .expect("Inode should exist.")
+            .lookups = 2;
+        state
+            .inodes
+            .get_mut(&TAGS_INO)
+            .expect("Inode should exist.")
+            .lookups = 1;
+
+        // WHEN
+        state.forget(tag, 1);
+        let after_one = state.node(tag).cloned();
+        state.forget(tag, 1);
+        state.forget(TAGS_INO, 1);
+
+        // THEN
+        assert_eq!(after_one, Some(Node::Tag(String::from("tag:A"))));
+        assert_eq!(state.node(tag), None);
+        assert!(!state
+            .by_node
+            .contains_key(&Node::Tag(String::from("tag:A"))));
+        // The root folders are never forgotten
+        assert_eq!(state.node(TAGS_INO), Some(&Node::Tags));
+        // A forgotten node gets a new inode when it is looked up again
+        assert_ne!(state.intern(Node::Tag(String::from("tag:A"))), tag);
+    }
+}
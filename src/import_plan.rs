@@ -0,0 +1,230 @@
+use crate::error::Result;
+use sha2::{Digest, Sha224};
+use std::{
+    fmt, fs,
+    io::{self, Read, Write},
+    path::Path,
+    time::{Duration, Instant},
+};
+
+/// Number of bytes read to measure the throughput of hashing or copying.
+pub const SAMPLE_BYTES: u64 = 256 << 20;
+
+/// What importing a file or folder would do, see `Repo::plan_import`.
+#[derive(Debug, Default)]
+pub struct ImportPlan {
+    pub supported_files: u64,
+    pub supported_bytes: u64,
+    pub unsupported_files: u64,
+    pub unsupported_bytes: u64,
+    /// Supported files whose content is in the store already, included in `supported_files`.
+    pub duplicate_files: u64,
+    pub duplicate_bytes: u64,
+    /// Supported files that may be duplicates of items whose size is unknown, e.g. those in the
+    /// cold tier, but were not hashed to find out. They are counted as new.
+    pub unchecked_files: u64,
+    pub unchecked_bytes: u64,
+    /// Bytes of new files expected to be copied rather than renamed into the store, because they
+    /// are on a different device than the volume they will be placed on.
+    pub copy_bytes: u64,
+    pub hash_throughput: Throughput,
+    pub copy_throughput: Throughput,
+}
+
+impl ImportPlan {
+    /// Expected duration of the import, from the measured throughputs.
+    ///
+    /// Every supported file is hashed, including duplicates, and `copy_bytes` are copied.
+    /// Returns `None` if a throughput needed for the estimate could not be measured.
+    pub fn estimated_duration(&self) -> Option<Duration> {
+        let hashing = self.hash_throughput.time_for(self.supported_bytes)?;
+        let copying = self.copy_throughput.time_for(self.copy_bytes)?;
+        Some(hashing + copying)
+    }
+}
+
+impl fmt::Display for ImportPlan {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        writeln!(
+            f,
+            "supported: {} files, {} bytes",
+            self.supported_files, self.supported_bytes
+        )?;
+        writeln!(
+            f,
+            "unsupported: {} files, {} bytes",
+            self.unsupported_files, self.unsupported_bytes
+        )?;
+        writeln!(
+            f,
+            "duplicates: {} files, {} bytes",
+            self.duplicate_files, self.duplicate_bytes
+        )?;
+        writeln!(
+            f,
+            "not checked for duplicates: {} files, {} bytes",
+            self.unchecked_files, self.unchecked_bytes
+        )?;
+        writeln!(f, "copied across devices: {} bytes", self.copy_bytes)?;
+        writeln!(f, "hash throughput: {}", self.hash_throughput)?;
+        writeln!(f, "copy throughput: {}", self.copy_throughput)?;
+        match self.estimated_duration() {
+            Some(duration) => writeln!(f, "estimated duration: {}s", duration.as_secs()),
+            None => writeln!(f, "estimated duration: unknown"),
+        }
+    }
+}
+
+/// Bytes processed in some time.
+#[derive(Clone, Copy, Debug, Default, PartialEq)]
+pub struct Throughput {
+    pub bytes: u64,
+    pub elapsed: Duration,
+}
+
+impl Throughput {
+    pub fn add(&mut self, other: Throughput) {
+        self.bytes += other.bytes;
+        self.elapsed += other.elapsed;
+    }
+
+    /// Time needed for `bytes` at this throughput. Nothing takes no time, but anything else needs
+    /// a measurement.
+    pub fn time_for(&self, bytes: u64) -> Option<Duration> {
+        if bytes == 0 {
+            return Some(Duration::ZERO);
+        }
+        if self.bytes == 0 {
+            return None;
+        }
+        #[allow(clippy::cast_precision_loss)]
+        Some(self.elapsed.mul_f64(bytes as f64 / self.bytes as f64))
+    }
+}
+
+impl fmt::Display for Throughput {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        if self.bytes == 0 || self.elapsed.is_zero() {
+            return write!(f, "not measured");
+        }
+        #[allow(clippy::cast_precision_loss)]
+        let megabytes_per_second = self.bytes as f64 / self.elapsed.as_secs_f64() / 1_000_000.0;
+        write!(f, "{megabytes_per_second:.1} MB/s")
+    }
+}
+
+/// Id of the device holding `metadata`'s file, to tell whether a rename can move it.
+#[cfg(unix)]
+pub fn device_id(metadata: &fs::Metadata) -> u64 {
+    std::os::unix::fs::MetadataExt::dev(metadata)
+}
+
+/// Id of the device holding `metadata`'s file.
+///
+/// Not supported on this platform, every file is assumed to be on the same device.
+#[cfg(not(unix))]
+pub fn device_id(_metadata: &fs::Metadata) -> u64 {
+    0
+}
+
+/// Hashes up to `limit` bytes of `file` and measures how long that took.
+///
+/// Returns the hash of the bytes read, which is the hash of the whole file if it is no longer
+/// than `limit`.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if the file cannot be read.
+pub fn measure_hash(file: &Path, limit: u64) -> Result<(String, Throughput)> {
+    let start = Instant::now();
+    let mut hasher = Sha224::new();
+    let bytes = io::copy(&mut fs::File::open(file)?.take(limit), &mut hasher)?;
+    let hash = hex::encode(hasher.finalize());
+    Ok((
+        hash,
+        Throughput {
+            bytes,
+            elapsed: start.elapsed(),
+        },
+    ))
+}
+
+/// Copies up to `limit` bytes of `file` to `temp_path`, including syncing them to disk, and
+/// measures how long that took. The copy is removed again.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if the file cannot be read or the copy cannot be written.
+pub fn measure_copy(file: &Path, temp_path: &Path, limit: u64) -> Result<Throughput> {
+    let start = Instant::now();
+    let mut copy = fs::File::create(temp_path)?;
+    let result = io::copy(&mut fs::File::open(file)?.take(limit), &mut copy)
+        .and_then(|bytes| copy.flush().and_then(|()| copy.sync_all()).map(|()| bytes));
+    let elapsed = start.elapsed();
+    drop(copy);
+    fs::remove_file(temp_path)?;
+    Ok(Throughput {
+        bytes: result?,
+        elapsed,
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_utils::TempFolder;
+    use test_context::test_context;
+
+    #[tokio::test]
+    async fn estimate_from_throughputs() {
+        // GIVEN
+        let mut plan = ImportPlan {
+            supported_bytes: 4000,
+            copy_bytes: 1000,
+            ..ImportPlan::default()
+        };
+
+        // WHEN
+        let unmeasured = plan.estimated_duration();
+        plan.hash_throughput.add(Throughput {
+            bytes: 100,
+            elapsed: Duration::from_secs(1),
+        });
+        let copy_unmeasured = plan.estimated_duration();
+        plan.copy_throughput.add(Throughput {
+            bytes: 100,
+            elapsed: Duration::from_secs(2),
+        });
+        let estimated = plan.estimated_duration();
+
+        // THEN
+        assert_eq!(unmeasured, None);
+        assert_eq!(copy_unmeasured, None);
+        // 40s of hashing and 20s of copying
+        assert_eq!(estimated, Some(Duration::from_secs(60)));
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn measure_without_leaving_copies(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let file = ctx.path.join("a.mp4");
+        fs::write(&file, "some content")?;
+        let temp_path = ctx.path.join("copy");
+
+        // WHEN
+        let (hash, hashed) = measure_hash(&file, 4)?;
+        let copied = measure_copy(&file, &temp_path, SAMPLE_BYTES)?;
+
+        // THEN
+        assert_eq!(hashed.bytes, 4);
+        assert_eq!(hash, hex::encode(Sha224::digest("some")));
+        assert_eq!(copied.bytes, 12);
+        assert!(!temp_path.exists());
+        assert_eq!(
+            device_id(&fs::metadata(&file)?),
+            device_id(&fs::metadata(&ctx.path)?)
+        );
+        Ok(())
+    }
+}
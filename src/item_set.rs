@@ -0,0 +1,351 @@
+use crate::{
+    db::Item,
+    error::{Error, ErrorKind, Result},
+};
+use std::{
+    collections::{HashMap, HashSet},
+    ops::Range,
+};
+
+/// Size of a binary SHA-224 digest.
+pub const DIGEST_LEN: usize = 28;
+
+/// Id of an interned string in a `SymbolTable`.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+pub struct Symbol(u32);
+
+/// Stores each distinct string once and hands out small ids for them.
+#[derive(Debug, Default)]
+pub struct SymbolTable {
+    names: Vec<Box<str>>,
+    ids: HashMap<Box<str>, Symbol>,
+}
+
+impl SymbolTable {
+    pub fn intern(&mut self, name: &str) -> Symbol {
+        if let Some(symbol) = self.ids.get(name) {
+            return *symbol;
+        }
+        let symbol = Symbol(u32::try_from(self.names.len()).expect("Too many symbols."));
+        self.names.push(name.into());
+        self.ids.insert(name.into(), symbol);
+        symbol
+    }
+
+    pub fn resolve(&self, symbol: Symbol) -> &str {
+        &self.names[symbol.0 as usize]
+    }
+
+    pub fn len(&self) -> usize {
+        self.names.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.names.is_empty()
+    }
+}
+
+#[derive(Debug)]
+struct CompactItem {
+    digest: [u8; DIGEST_LEN],
+    ext: Symbol,
+    collection_id: i64,
+    title: Range<u32>,
+    tags: Range<u32>,
+}
+
+/// A compact, read-only list of items, e.g. a whole catalogue.
+///
+/// Compared to `Vec<Item>`, which costs several allocations per item, hashes are stored as binary
+/// digests, exts and tags are interned in a symbol table shared by all items of the set, and
+/// titles are packed into a single string. Loading a catalogue therefore only allocates a handful
+/// of growing buffers plus one entry per distinct tag and ext.
+#[derive(Debug, Default)]
+pub struct ItemSet {
+    items: Vec<CompactItem>,
+    titles: String,
+    tags: Vec<Symbol>,
+    symbols: SymbolTable,
+}
+
+impl ItemSet {
+    /// Interns a tag or ext into the symbol table of this set.
+    pub fn intern(&mut self, name: &str) -> Symbol {
+        self.symbols.intern(name)
+    }
+
+    /// Appends an item. `tags` must have been interned into this set.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if `hash` is not a hex encoded SHA-224 digest.
+    pub fn push(
+        &mut self,
+        hash: &str,
+        title: &str,
+        ext: &str,
+        collection_id: i64,
+        tags: &[Symbol],
+    ) -> Result<()> {
+        let mut digest = [0; DIGEST_LEN];
+        hex::decode_to_slice(hash, &mut digest).map_err(|_| Error {
+            msg: format!("Item hash {hash} is not a SHA-224 digest."),
+            kind: ErrorKind::DB,
+        })?;
+        let ext = self.intern(ext);
+        let title_start = offset(self.titles.len());
+        self.titles.push_str(title);
+        let tags_start = offset(self.tags.len());
+        self.tags.extend_from_slice(tags);
+        self.items.push(CompactItem {
+            digest,
+            ext,
+            collection_id,
+            title: title_start..offset(self.titles.len()),
+            tags: tags_start..offset(self.tags.len()),
+        });
+        Ok(())
+    }
+
+    /// Moves the items of `other` to the end of this set.
+    ///
+    /// Titles are copied as one block and only the symbols of `other` are re-interned, so this is
+    /// about as fast as copying the memory of `other`.
+    pub fn append(&mut self, other: ItemSet) {
+        if self.is_empty() && self.symbols.is_empty() {
+            *self = other;
+            return;
+        }
+        let symbols: Vec<Symbol> = other
+            .symbols
+            .names
+            .iter()
+            .map(|name| self.symbols.intern(name))
+            .collect();
+        let title_base = offset(self.titles.len());
+        let tag_base = offset(self.tags.len());
+        self.titles.push_str(&other.titles);
+        self.tags
+            .extend(other.tags.iter().map(|tag| symbols[tag.0 as usize]));
+        self.items
+            .extend(other.items.into_iter().map(|item| CompactItem {
+                ext: symbols[item.ext.0 as usize],
+                title: item.title.start + title_base..item.title.end + title_base,
+                tags: item.tags.start + tag_base..item.tags.end + tag_base,
+                ..item
+            }));
+    }
+
+    /// Rewrites the items of the collections in `collection_ids` with `patch`, e.g. to apply
+    /// buffered writes.
+    ///
+    /// Patched titles and tags are appended to the packed buffers and the old ones are left in
+    /// place, so this is meant for a few items only.
+    pub fn patch<F>(&mut self, collection_ids: &HashSet<i64>, mut patch: F)
+    where
+        F: FnMut(&mut Item),
+    {
+        for index in 0..self.items.len() {
+            if !collection_ids.contains(&self.items[index].collection_id) {
+                continue;
+            }
+            let mut item = self.get(index).expect("Item should exist.").to_item();
+            patch(&mut item);
+            let tags: Vec<Symbol> = item.tags.iter().map(|tag| self.intern(tag)).collect();
+            let title_start = offset(self.titles.len());
+            self.titles.push_str(&item.title);
+            let tags_start = offset(self.tags.len());
+            self.tags.extend_from_slice(&tags);
+            let compact = &mut self.items[index];
+            compact.title = title_start..offset(self.titles.len());
+            compact.tags = tags_start..offset(self.tags.len());
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.items.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.items.is_empty()
+    }
+
+    pub fn get(&self, index: usize) -> Option<ItemRef<'_>> {
+        self.items
+            .get(index)
+            .map(|item| ItemRef { set: self, item })
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = ItemRef<'_>> {
+        self.items.iter().map(|item| ItemRef { set: self, item })
+    }
+}
+
+fn offset(len: usize) -> u32 {
+    u32::try_from(len).expect("Item set is too large.")
+}
+
+/// An item of an `ItemSet`.
+#[derive(Clone, Copy)]
+pub struct ItemRef<'a> {
+    set: &'a ItemSet,
+    item: &'a CompactItem,
+}
+
+impl<'a> ItemRef<'a> {
+    pub fn digest(&self) -> &'a [u8; DIGEST_LEN] {
+        &self.item.digest
+    }
+
+    /// Hex encoded hash, as used in the store and the db.
+    pub fn hash(&self) -> String {
+        hex::encode(self.item.digest)
+    }
+
+    pub fn title(&self) -> &'a str {
+        let title = &self.item.title;
+        &self.set.titles[title.start as usize..title.end as usize]
+    }
+
+    pub fn ext(&self) -> &'a str {
+        self.set.symbols.resolve(self.item.ext)
+    }
+
+    pub fn collection_id(&self) -> i64 {
+        self.item.collection_id
+    }
+
+    pub fn tags(&self) -> impl Iterator<Item = &'a str> {
+        let set = self.set;
+        let tags = &self.item.tags;
+        set.tags[tags.start as usize..tags.end as usize]
+            .iter()
+            .map(|tag| set.symbols.resolve(*tag))
+    }
+
+    /// Copies the item out into an owned `Item`.
+    pub fn to_item(&self) -> Item {
+        Item {
+            hash: self.hash(),
+            title: self.title().to_owned(),
+            ext: self.ext().to_owned(),
+            collection_id: self.collection_id(),
+            tags: self.tags().map(str::to_owned).collect(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[tokio::test]
+    async fn push_and_read() -> Result<()> {
+        // GIVEN
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        let mut set = ItemSet::default();
+        let incomplete = set.intern("meta:Incomplete");
+        let tag = set.intern("tag:A");
+
+        // WHEN
+        set.push(hash, "First", "mp4", 1, &[incomplete, tag])?;
+        set.push(hash2, "Second", "mp4", 2, &[incomplete])?;
+
+        // THEN
+        assert_eq!(set.len(), 2);
+        // Both tags and the shared ext are stored once
+        assert_eq!(set.symbols.len(), 3);
+        let first = set.get(0).expect("Item should exist.");
+        assert_eq!(first.hash(), hash);
+        assert_eq!(first.title(), "First");
+        assert_eq!(first.ext(), "mp4");
+        assert_eq!(
+            first.tags().collect::<Vec<_>>(),
+            vec!["meta:Incomplete", "tag:A"]
+        );
+        let second = set.get(1).expect("Item should exist.").to_item();
+        assert_eq!(second.hash, hash2);
+        assert_eq!(second.title, "Second");
+        assert_eq!(second.collection_id, 2);
+        assert_eq!(second.tags, vec![String::from("meta:Incomplete")]);
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn reject_invalid_hash() {
+        // GIVEN
+        let mut set = ItemSet::default();
+
+        // WHEN
+        let result = set.push("not a hash", "Title", "mp4", 1, &[]);
+
+        // THEN
+        assert!(result.is_err());
+        if let Err(error) = result {
+            assert_eq!(error.kind, ErrorKind::DB);
+        }
+        assert!(set.is_empty());
+    }
+
+    #[tokio::test]
+    async fn append_remaps_symbols() -> Result<()> {
+        // GIVEN
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        let mut set = ItemSet::default();
+        let tag = set.intern("tag:A");
+        set.push(hash, "First", "mp4", 1, &[tag])?;
+        let mut other = ItemSet::default();
+        // Interned in a different order, so symbol ids differ between the sets
+        let other_tag = other.intern("tag:B");
+        let other_shared_tag = other.intern("tag:A");
+        other.push(hash2, "Second", "mkv", 2, &[other_tag, other_shared_tag])?;
+
+        // WHEN
+        set.append(other);
+
+        // THEN
+        assert_eq!(set.len(), 2);
+        assert_eq!(set.symbols.len(), 4);
+        let second = set.get(1).expect("Item should exist.").to_item();
+        assert_eq!(second.hash, hash2);
+        assert_eq!(second.title, "Second");
+        assert_eq!(second.ext, "mkv");
+        assert_eq!(
+            second.tags,
+            vec![String::from("tag:B"), String::from("tag:A")]
+        );
+        assert_eq!(set.get(0).expect("Item should exist.").title(), "First");
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn patch_collections() -> Result<()> {
+        // GIVEN
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        let hash2 = "4effadeed3957d9dab1a645b9a7d01c18380d54e71d51148fdf84633";
+        let mut set = ItemSet::default();
+        let tag = set.intern("tag:A");
+        set.push(hash, "First", "mp4", 1, &[tag])?;
+        set.push(hash2, "Second", "mp4", 2, &[tag])?;
+
+        // WHEN
+        set.patch(&HashSet::from([2]), |item| {
+            item.title = String::from("Retitled");
+            item.tags.push(String::from("tag:B"));
+        });
+
+        // THEN
+        let first = set.get(0).expect("Item should exist.").to_item();
+        assert_eq!(first.title, "First");
+        assert_eq!(first.tags, vec![String::from("tag:A")]);
+        let second = set.get(1).expect("Item should exist.").to_item();
+        assert_eq!(second.title, "Retitled");
+        assert_eq!(
+            second.tags,
+            vec![String::from("tag:A"), String::from("tag:B")]
+        );
+        Ok(())
+    }
+}
@@ -1,21 +1,111 @@
+mod access;
+mod archive;
+mod backend;
+mod changes;
+mod config;
 mod db;
 mod error;
+mod external_sort;
+mod farm;
+#[cfg(feature = "fuse")]
+mod fuse;
+mod import_plan;
+mod item_set;
+mod lock;
+mod manifest;
+mod pool;
+mod query;
+#[cfg(feature = "s3")]
+mod s3;
+mod sample;
+mod saved_search;
+mod similar;
+mod stats;
+mod store;
+#[cfg(test)]
+mod test_utils;
 mod thumbnail;
 mod utils;
+mod view;
+#[cfg(target_os = "linux")]
+mod watch;
+mod write_buffer;
 
+use futures::{future, stream, TryStreamExt};
 use lazy_static::lazy_static;
 use sha2::{Digest, Sha224};
+#[cfg(target_os = "linux")]
+use std::time::Instant;
 use std::{
-    collections::{HashMap, VecDeque},
-    fs, io,
+    cell::RefCell,
+    cmp::Ordering,
+    collections::{BTreeSet, HashMap, HashSet, VecDeque},
+    fs,
+    io::{self, Read, Write},
+    num::NonZeroUsize,
+    ops::Range,
     path::Path,
     path::PathBuf,
+    pin::pin,
+    slice,
+    sync::{Arc, Mutex, Weak},
+    thread,
+    time::Duration,
+};
+use tokio::{
+    io::AsyncRead,
+    sync::{
+        broadcast::{self, error::TryRecvError},
+        Notify,
+    },
+    time::MissedTickBehavior,
 };
+use uuid::Uuid;
 
+use archive::{ArchiveMember, ArchiveSource};
+use changes::ChangeFeed;
+use config::Config;
 use db::DB;
+use farm::{FarmPlan, ViewFarm};
+use import_plan::SAMPLE_BYTES;
+use lock::{FileLock, LockMode, Writer, WriterLease};
+use manifest::{DirUpdate, ManifestEntry};
+use pool::ReadPool;
+use query::QueryCache;
+use sample::Rng;
+use saved_search::{IdSet, SavedSearches};
+use store::{Placement, Store};
+use utils::Diff;
+use write_buffer::WriteBuffer;
 
-pub use db::Item;
+pub use backend::{Backend, ObjectKey};
+pub use changes::{Change, ChangeEvent, DbVersion};
+pub use db::{ImportSession, Item};
 pub use error::{Error, ErrorKind, Result};
+pub use farm::LinkKind;
+pub use import_plan::{ImportPlan, Throughput};
+pub use item_set::{ItemRef, ItemSet};
+pub use query::{Page, Query};
+#[cfg(feature = "s3")]
+pub use s3::ObjectStoreBackend;
+pub use saved_search::SavedSearchInfo;
+pub use similar::SimilarCollection;
+pub use stats::Stats;
+pub use store::StoreLayout;
+pub use view::{ViewFile, ViewVersion};
+
+const SECONDS_PER_DAY: u64 = 24 * 60 * 60;
+
+/// Maximum number of files imported with one db commit while watching a folder or importing an
+/// archive.
+const IMPORT_BATCH_SIZE: usize = 256;
+
+/// Shortest interval at which the write buffer is checked for writes that became due, so that
+/// `write_buffer.max_delay_ms = 0` does not spin.
+const MIN_FLUSH_INTERVAL: Duration = Duration::from_millis(10);
+
+/// A difference between the objects in the store and the items in the db, as hash and ext.
+type StoreDiff = Diff<(String, String), (String, String)>;
 
 lazy_static! {
     /// Maps from supported MIME types from their default extension
@@ -26,10 +116,399 @@ lazy_static! {
     };
 }
 
+thread_local! {
+    /// libmagic cookie of the thread, loaded on first use. Cookies cannot be shared between
+    /// threads, so every thread that sniffs files loads its own.
+    static MAGIC_COOKIE: RefCell<Option<magic::Cookie>> = RefCell::new(None);
+}
+
+/// A handle to a vorg repo.
+///
+/// Handles are cheap to clone, and every clone works on the same repo: reads, e.g. of a server
+/// answering many requests, run concurrently on pooled read-only db connections, and share the
+/// write buffer and the query cache. Writes take turns on the single write connection.
+#[derive(Clone)]
 pub struct Repo {
-    db: DB,
+    inner: Arc<RepoInner>,
+}
+
+/// State shared by all handles of a repo.
+struct RepoInner {
     path: PathBuf,
-    magic_cookie: magic::Cookie,
+    config: Config,
+    /// Shared with the writer, which keeps view farms linked into it.
+    store: Arc<Store>,
+    cold_store: Option<Box<dyn Backend>>,
+    /// Read-only db connections, see `ReadPool`.
+    readers: ReadPool,
+    changes: ChangeFeed,
+    /// Shared with the background flush, see `Repo::flush_when_due`.
+    write_buffer: Arc<Mutex<WriteBuffer>>,
+    /// Wakes the background flush of the write buffer.
+    flush_due: Arc<Notify>,
+    query_cache: Mutex<QueryCache>,
+    /// Read-only connection used for nothing but reading versions: `PRAGMA data_version`, which
+    /// is only comparable between reads on the same connection, see `db_version`, and the
+    /// change generation.
+    version_db: tokio::sync::Mutex<DB>,
+    /// See `RepoWriter`. Shared with the background flush.
+    writer: Arc<tokio::sync::Mutex<RepoWriter>>,
+    /// Shared lock of `open.lock`, held while the repo is open, see `new`.
+    open_lock: FileLock,
+}
+
+/// Write connection of a repo and what writes keep up to date, used by one write at a time.
+struct RepoWriter {
+    db: DB,
+    store: Arc<Store>,
+    /// Changes not yet applied to view farms, see `refresh_view_farms`.
+    farm_changes: broadcast::Receiver<ChangeEvent>,
+    /// Collections changed since view farms were last updated. Changes are moved here from
+    /// `farm_changes` after every write, so that the feed does not overflow while the writer
+    /// lease is held elsewhere.
+    farm_collections: HashSet<i64>,
+    /// Whether `farm_changes` overflowed, so that every view farm must be synced.
+    farm_lagged: bool,
+    /// Saved searches, loaded on first use, see `refresh_saved_searches`.
+    saved_searches: Option<SavedSearches>,
+    /// Writer lease, held by operations that change the store.
+    lease: Writer,
+}
+
+impl Drop for RepoInner {
+    /// Flushes writes still buffered once the last handle is gone, see `Repo::close`.
+    fn drop(&mut self) {
+        let is_empty = self
+            .write_buffer
+            .lock()
+            .map_or(true, |write_buffer| write_buffer.is_empty());
+        if is_empty {
+            return;
+        }
+        let Ok(runtime) = tokio::runtime::Handle::try_current() else {
+            eprintln!("Buffered writes are lost, since the repo was dropped outside of a runtime.");
+            return;
+        };
+        let write_buffer = self.write_buffer.clone();
+        let writer = self.writer.clone();
+        runtime.spawn(async move {
+            if let Err(error) = writer.lock().await.flush(&write_buffer).await {
+                eprintln!("Failed to flush buffered writes: {error}");
+            }
+        });
+    }
+}
+
+impl RepoWriter {
+    fn new(db: DB, repo_path: &Path, store: Arc<Store>) -> Self {
+        RepoWriter {
+            farm_changes: db.subscribe(),
+            farm_collections: HashSet::new(),
+            farm_lagged: false,
+            db,
+            store,
+            saved_searches: None,
+            lease: Writer::new(repo_path),
+        }
+    }
+
+    /// Waits for the writer lease of the repo, see `lock::Writer`. Reports on stderr when
+    /// another process holds it.
+    async fn lease(&mut self) -> Result<WriterLease> {
+        if let Some(lease) = self.lease.try_lease()? {
+            return Ok(lease);
+        }
+        eprintln!("Waiting for another process to finish writing to the repo.");
+        self.lease.lease().await
+    }
+
+    /// Applies the writes of `write_buffer`, see `Repo::flush`.
+    async fn flush(&mut self, write_buffer: &Mutex<WriteBuffer>) -> Result<()> {
+        // Taken with the writer locked, so that concurrent flushes apply writes in order
+        let writes = write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.")
+            .take();
+        if !writes.is_empty() {
+            if let Err(error) = self.db.apply_writes(&writes).await {
+                // `apply_writes` rolled its transaction back, so the next write of any clone
+                // starts afresh and the restored writes are applied with it
+                write_buffer
+                    .lock()
+                    .expect("Write buffer lock is poisoned.")
+                    .restore(writes);
+                return Err(error);
+            }
+        }
+        self.refresh_saved_searches(false).await?;
+        self.refresh_view_farms().await
+    }
+
+    /// Brings the results of the saved searches up to date and stores those that changed. They
+    /// are loaded first with `load`, otherwise nothing happens until they are loaded.
+    ///
+    /// Changes of this repo are applied from the change feed, by checking each changed
+    /// collection against each search with indexed lookups. Results are recomputed in full if
+    /// the feed lagged or another connection committed in the meantime.
+    async fn refresh_saved_searches(&mut self, load: bool) -> Result<()> {
+        if self.saved_searches.is_none() && !load {
+            return Ok(());
+        }
+        // Read before the generation, so that a commit by another connection in between shows
+        // up in the next refresh
+        let data_version = self.db.get_data_version().await?;
+        let generation = self.db.get_generation().await?;
+        match &mut self.saved_searches {
+            None => {
+                let changes = self.db.subscribe();
+                let searches = self.db.get_saved_searches(generation).await?;
+                self.saved_searches = Some(SavedSearches {
+                    searches,
+                    changes,
+                    data_version,
+                });
+            }
+            Some(saved) => {
+                let mut full = saved.data_version != data_version;
+                let mut changed = BTreeSet::new();
+                let mut deleted = BTreeSet::new();
+                while !full {
+                    match saved.changes.try_recv() {
+                        Ok(event) => match event.change {
+                            Change::CollectionDeleted { collection_id } => {
+                                // Ids of deleted collections may be reused by later ones
+                                changed.remove(&collection_id);
+                                deleted.insert(collection_id);
+                            }
+                            Change::ItemAdded { .. } | Change::ItemDeleted { .. } => (),
+                            change => {
+                                changed.insert(change.collection_id());
+                            }
+                        },
+                        Err(TryRecvError::Lagged(_)) => full = true,
+                        Err(TryRecvError::Empty | TryRecvError::Closed) => break,
+                    }
+                }
+                saved.data_version = data_version;
+                if full {
+                    saved.changes = saved.changes.resubscribe();
+                    for search in &mut saved.searches {
+                        let ids = self
+                            .db
+                            .get_matching_collections(&search.query, None)
+                            .await?;
+                        search.results = IdSet::from_ids(ids);
+                        search.dirty = true;
+                    }
+                } else {
+                    for search in &mut saved.searches {
+                        for &collection_id in &deleted {
+                            search.dirty |= search.results.remove(collection_id);
+                        }
+                        for &collection_id in &changed {
+                            let matches = !self
+                                .db
+                                .get_matching_collections(&search.query, Some(collection_id))
+                                .await?
+                                .is_empty();
+                            search.dirty |= if matches {
+                                search.results.insert(collection_id)
+                            } else {
+                                search.results.remove(collection_id)
+                            };
+                        }
+                    }
+                }
+            }
+        }
+
+        if let Some(saved) = &mut self.saved_searches {
+            if saved.searches.iter().any(|search| search.dirty) {
+                self.db
+                    .update_saved_searches(&saved.searches, generation)
+                    .await?;
+                for search in &mut saved.searches {
+                    search.dirty = false;
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// Applies the changes committed since view farms were last updated to every farm.
+    ///
+    /// Only the links of the collections that changed are looked at, so keeping a farm current
+    /// costs a few indexed queries per change, however many items it links. If more changes
+    /// piled up than the change feed holds, every farm is synced instead, see
+    /// `sync_view_farms`. Links are only touched under the writer lease: if another process
+    /// holds it, the changes are kept for the next write.
+    async fn refresh_view_farms(&mut self) -> Result<()> {
+        loop {
+            match self.farm_changes.try_recv() {
+                Ok(event) => {
+                    self.farm_collections.insert(event.change.collection_id());
+                }
+                Err(TryRecvError::Lagged(_)) => self.farm_lagged = true,
+                Err(TryRecvError::Empty | TryRecvError::Closed) => break,
+            }
+        }
+        if self.farm_collections.is_empty() && !self.farm_lagged {
+            return Ok(());
+        }
+        let Some(_lease) = self.lease.try_lease()? else {
+            return Ok(());
+        };
+        if self.farm_lagged {
+            return self.sync_view_farms().await;
+        }
+
+        let collection_ids = std::mem::take(&mut self.farm_collections);
+        let result = self.refresh_farm_collections(&collection_ids).await;
+        if result.is_err() {
+            // Tried again with the next write
+            self.farm_collections.extend(collection_ids);
+        }
+        result
+    }
+
+    async fn refresh_farm_collections(&mut self, collection_ids: &HashSet<i64>) -> Result<()> {
+        for farm in self.db.get_view_farms().await? {
+            for &collection_id in collection_ids {
+                let recorded = self
+                    .db
+                    .get_farm_links(farm.farm_id, Some(collection_id))
+                    .await?;
+                let files = self
+                    .db
+                    .get_farm_files(&farm.query, Some(collection_id))
+                    .await?;
+                let candidates: Vec<String> = files
+                    .iter()
+                    .flat_map(|file| {
+                        [
+                            view::title_name(&file.title, &file.ext),
+                            view::hashed_name(&file.title, &file.hash, &file.ext),
+                        ]
+                    })
+                    .collect();
+                let mut taken = self
+                    .db
+                    .get_taken_farm_names(farm.farm_id, &candidates)
+                    .await?;
+                for link in &recorded {
+                    taken.remove(&link.name);
+                }
+                let plan = farm::plan(recorded, &files, &taken);
+                self.apply_farm_plan(&farm, plan, false).await?;
+            }
+        }
+        Ok(())
+    }
+
+    /// Syncs every view farm, see `Repo::sync_view_farms`.
+    async fn sync_view_farms(&mut self) -> Result<()> {
+        // Every change up to now is covered by the sync
+        self.farm_changes = self.farm_changes.resubscribe();
+        self.farm_collections.clear();
+        self.farm_lagged = false;
+        for farm in self.db.get_view_farms().await? {
+            self.sync_view_farm(&farm).await?;
+        }
+        Ok(())
+    }
+
+    async fn sync_view_farm(&mut self, farm: &ViewFarm) -> Result<()> {
+        let recorded = self.db.get_farm_links(farm.farm_id, None).await?;
+        let files = self.db.get_farm_files(&farm.query, None).await?;
+        let plan = farm::plan(recorded, &files, &HashSet::new());
+        self.apply_farm_plan(farm, plan, true).await
+    }
+
+    /// Removes and creates the links of `plan`, then records them. With `verify_kept`, kept
+    /// links that are missing or broken on disk are recreated too.
+    async fn apply_farm_plan(
+        &mut self,
+        farm: &ViewFarm,
+        plan: FarmPlan,
+        verify_kept: bool,
+    ) -> Result<()> {
+        for link in &plan.remove {
+            farm::remove_link(&farm.dir.join(&link.name))?;
+        }
+        if verify_kept {
+            for link in &plan.keep {
+                let path = farm.dir.join(&link.name);
+                // Follows symbolic links, so broken ones count as missing
+                if !path.exists() {
+                    if let Some(target) = self.find_object(&link.hash, &link.ext).await? {
+                        farm::create_link(&target, &path, farm.link)?;
+                    }
+                }
+            }
+        }
+        let mut added = Vec::with_capacity(plan.add.len());
+        for link in plan.add {
+            // Items only in the cold tier cannot be linked, a later sync picks them up
+            if let Some(target) = self.find_object(&link.hash, &link.ext).await? {
+                farm::create_link(&target, &farm.dir.join(&link.name), farm.link)?;
+                added.push(link);
+            }
+        }
+        self.db
+            .update_farm_links(farm.farm_id, &plan.remove, &added)
+            .await
+    }
+
+    /// Points the view farm links of the objects `hashes` to where the objects are now, after
+    /// they moved within the store or between tiers. Symbolic links would break otherwise, and
+    /// hard links would keep a stale copy alive. Links of objects that left the hot store are
+    /// removed from disk but stay recorded, so that they are restored once the objects are back.
+    async fn relink_farm_objects(&mut self, hashes: &[String]) -> Result<()> {
+        if hashes.is_empty() {
+            return Ok(());
+        }
+        for farm in self.db.get_view_farms().await? {
+            for hash in hashes {
+                for link in self.db.get_object_farm_links(farm.farm_id, hash).await? {
+                    let path = farm.dir.join(&link.name);
+                    match self.find_object(&link.hash, &link.ext).await? {
+                        Some(target) => farm::create_link(&target, &path, farm.link)?,
+                        None => farm::remove_link(&path)?,
+                    }
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// Path of an object in the hot store, if it is there, like `Repo::locate`.
+    async fn find_object(&mut self, hash: &str, ext: &str) -> Result<Option<PathBuf>> {
+        let manifest_dir = match self.store.placement() {
+            Placement::Hash => None,
+            Placement::FreeSpace => self.db.get_store_object(hash).await?.map(|entry| entry.dir),
+        };
+        Ok(self.store.find(manifest_dir.as_deref(), hash, ext))
+    }
+}
+
+/// Outcome of `Repo::tier`.
+#[derive(Debug, Default)]
+pub struct TierReport {
+    /// Number of items moved to the cold tier.
+    pub demoted: u64,
+    /// Number of items moved back to the hot store.
+    pub promoted: u64,
+    /// Items that failed verification and were left in place, one description each.
+    pub errors: Vec<String>,
+}
+
+/// A file added to the db but not yet moved into the store.
+struct StagedImport {
+    file: PathBuf,
+    hash: String,
+    ext: String,
+    /// Volume whose temporary folder `file` was received in, see `Store::receiving_volume`.
+    received_on: Option<usize>,
 }
 
 impl Repo {
@@ -39,11 +518,17 @@ impl Repo {
     /// If the provided path exists, it performs basic checks to make sure the repo is valid.
     /// For more thorough checks on repo integrity, see `check_data_integrity`.
     ///
+    /// Any number of processes may have a repo open at once. Reads never wait for each other
+    /// or for writes. Operations that change the store, e.g. imports, deletes and tiering, take
+    /// turns on the writer lease of the repo, waiting for each other rather than failing.
+    /// Opening a repo waits while another process creates it. Within a process, clone the
+    /// returned handle rather than opening the repo again.
+    ///
     /// # Errors
     ///
     /// - `ErrorKind::IO` if repo does not exist (determined by existence of vorg.db) and vorg
     ///   encountered IO errors when trying to create one, e.g. permission denied, folder creation
-    ///   failed, etc.
+    ///   failed, etc. Or if the lock files of the repo cannot be created or locked.
     /// - `ErrorKind::StoreFolder` or `ErrorKind::ThumbnailFolder` if repo exists and has invalid
     ///   file store or thumbnail store.
     /// - `ErrorKind::DB` if database (vorg.db) exists and is invalid. Or database does not exist
@@ -57,16 +542,132 @@ impl Repo {
 
         // Attempt to create the repo folder
         fs::create_dir_all(path)?;
-        if path.join("vorg.db").is_file() {
+        // A repo is created holding the open lock exclusively, so that other processes wait for
+        // it to be complete
+        let mode = if path.join("vorg.db").is_file() {
+            LockMode::Shared
+        } else {
+            LockMode::Exclusive
+        };
+        let mut open_lock = FileLock::acquire(&path.join(lock::OPEN_LOCK), mode).await?;
+        let (config, db) = if path.join("vorg.db").is_file() {
             // Repo exists, validate it
-            Repo::validate_repo(path).await
+            Repo::validate_repo(path).await?
         } else {
             // Repo doesn't exist, create it
-            Repo::create_repo(path).await
+            Repo::create_repo(path).await?
+        };
+        open_lock.set_mode(LockMode::Shared).await?;
+
+        // Fail on open rather than on the first import if libmagic is missing
+        Repo::with_magic_cookie(|_| ())?;
+        // Open up to a connection per core for concurrent reads, unless configured otherwise
+        let max_readers = match usize::try_from(config.read_pool_size) {
+            Ok(0) => thread::available_parallelism().map_or(1, NonZeroUsize::get),
+            size => size.unwrap_or(usize::MAX),
+        };
+        let flush_interval =
+            Duration::from_millis(config.write_buffer_max_delay_ms).max(MIN_FLUSH_INTERVAL);
+        let store = Arc::new(Store::new(path, &config));
+        let repo = Repo {
+            inner: Arc::new(RepoInner {
+                path: path.to_owned(),
+                store: Arc::clone(&store),
+                cold_store: Repo::open_cold_store(path, &config)?,
+                readers: ReadPool::new(db.path().to_owned(), max_readers),
+                changes: db.change_feed(),
+                write_buffer: Arc::new(Mutex::new(config.write_buffer())),
+                flush_due: Arc::new(Notify::new()),
+                query_cache: Mutex::new(config.query_cache()),
+                version_db: tokio::sync::Mutex::new(DB::open_reader(db.path()).await?),
+                writer: Arc::new(tokio::sync::Mutex::new(RepoWriter::new(db, path, store))),
+                config,
+                open_lock,
+            }),
+        };
+        repo.fill_manifest().await?;
+        tokio::spawn(Repo::flush_when_due(
+            Arc::downgrade(&repo.inner.write_buffer),
+            Arc::downgrade(&repo.inner.writer),
+            repo.inner.flush_due.clone(),
+            flush_interval,
+        ));
+        Ok(repo)
+    }
+
+    /// Fills the store manifest of a repo whose db was just migrated from V2, see
+    /// `DB::is_manifest_unfilled`, so that statistics count the bytes in the store right away.
+    ///
+    /// Objects are only stat'ed, not hashed, and recorded in one transaction. Their folders are
+    /// left unrecorded, so the next `check_manifest` lists them once and finds the objects
+    /// matching.
+    async fn fill_manifest(&self) -> Result<()> {
+        let mut writer = self.inner.writer.lock().await;
+        if !writer.db.is_manifest_unfilled().await? {
+            return Ok(());
+        }
+        let _lease = writer.lease().await?;
+        writer.db.begin_batch().await?;
+        let result: Result<()> = async {
+            // Read again under the lease, in case another process filled it meanwhile
+            if !writer.db.is_manifest_unfilled().await? {
+                return Ok(());
+            }
+            for (hash, ext) in writer.db.get_items_without_store_object().await? {
+                if let Some(path) = self.inner.store.locate(&hash, &ext) {
+                    writer
+                        .db
+                        .add_store_object(&ManifestEntry::read(&path, &hash, &ext)?)
+                        .await?;
+                }
+            }
+            Ok(())
+        }
+        .await;
+        if let Err(error) = result {
+            writer.db.rollback_batch().await?;
+            return Err(error);
+        }
+        writer.db.commit_batch().await
+    }
+
+    /// Flushes the write buffer of the repo whenever it is due, checked every `interval` and
+    /// whenever `flush_due` is notified, until every handle of the repo is dropped.
+    ///
+    /// This bounds the loss window of buffered writes even when no further write comes in to
+    /// trigger a flush. Failed flushes are reported on stderr and retried, since the writes stay
+    /// buffered. Only the write buffer and the writer are referenced, and only weakly, so that
+    /// the task ends once the last handle is dropped, which flushes one last time.
+    async fn flush_when_due(
+        write_buffer: Weak<Mutex<WriteBuffer>>,
+        writer: Weak<tokio::sync::Mutex<RepoWriter>>,
+        flush_due: Arc<Notify>,
+        interval: Duration,
+    ) {
+        let mut ticks = tokio::time::interval(interval);
+        ticks.set_missed_tick_behavior(MissedTickBehavior::Delay);
+        loop {
+            tokio::select! {
+                _ = ticks.tick() => (),
+                () = flush_due.notified() => (),
+            }
+            let (Some(write_buffer), Some(writer)) = (write_buffer.upgrade(), writer.upgrade())
+            else {
+                return;
+            };
+            let is_due = write_buffer
+                .lock()
+                .expect("Write buffer lock is poisoned.")
+                .is_due();
+            if is_due {
+                if let Err(error) = writer.lock().await.flush(&write_buffer).await {
+                    eprintln!("Failed to flush buffered writes: {error}");
+                }
+            }
         }
     }
 
-    async fn create_repo<T>(repo_path: T) -> Result<Self>
+    async fn create_repo<T>(repo_path: T) -> Result<(Config, DB)>
     where
         T: AsRef<Path>,
     {
@@ -80,30 +681,36 @@ impl Repo {
         let thumbnail_path = repo_path.join("thumbnail");
         fs::create_dir_all(&thumbnail_path)?;
 
+        // Record the store layout
+        let config = Config::default();
+        config.save(repo_path)?;
+
         // Create DB
-        Ok(Repo {
-            path: repo_path.to_owned(),
-            db: DB::new(repo_path.join("vorg.db")).await?,
-            magic_cookie: Repo::init_magic()?,
-        })
+        let db = DB::new(repo_path.join("vorg.db")).await?;
+        Ok((config, db))
     }
 
-    async fn validate_repo<T>(repo_path: T) -> Result<Self>
+    async fn validate_repo<T>(repo_path: T) -> Result<(Config, DB)>
     where
         T: AsRef<Path>,
     {
         let repo_path = repo_path.as_ref();
 
-        // Create store
-        let store_path = repo_path.join("store");
-        if !store_path.is_dir() {
-            return Err(Error {
-                msg: format!(
-                    "File store does not exist or is not a directory at {}.",
-                    store_path.display()
-                ),
-                kind: ErrorKind::StoreFolder,
-            });
+        // Load config
+        let config = Config::load(repo_path)?;
+
+        // Validate store volumes
+        for volume in &config.store_volumes {
+            let store_path = repo_path.join(&volume.path);
+            if !store_path.is_dir() {
+                return Err(Error {
+                    msg: format!(
+                        "File store does not exist or is not a directory at {}.",
+                        store_path.display()
+                    ),
+                    kind: ErrorKind::StoreFolder,
+                });
+            }
         }
 
         // Create thumbnail store
@@ -119,11 +726,35 @@ impl Repo {
         }
 
         // Create DB
-        Ok(Repo {
-            path: repo_path.to_owned(),
-            db: DB::new(repo_path.join("vorg.db")).await?,
-            magic_cookie: Repo::init_magic()?,
-        })
+        let mut db = DB::new(repo_path.join("vorg.db")).await?;
+        db.use_wal().await?;
+        Ok((config, db))
+    }
+
+    fn open_cold_store(repo_path: &Path, config: &Config) -> Result<Option<Box<dyn Backend>>> {
+        if let Some(cold_store) = &config.cold_store {
+            let cold_store_path = repo_path.join(cold_store);
+            fs::create_dir_all(&cold_store_path)?;
+            // The cold tier keeps the default layout, so that resharding the hot store leaves it
+            // alone.
+            return Ok(Some(Box::new(Store::single(
+                cold_store_path,
+                StoreLayout::default(),
+            ))));
+        }
+        if let Some(cold_bucket) = &config.cold_bucket {
+            #[cfg(feature = "s3")]
+            return Ok(Some(Box::new(ObjectStoreBackend::s3(
+                cold_bucket,
+                config.cold_endpoint.as_deref(),
+            )?)));
+            #[cfg(not(feature = "s3"))]
+            return Err(Error {
+                msg: format!("Cold bucket {cold_bucket} requires the s3 feature."),
+                kind: ErrorKind::Config,
+            });
+        }
+        Ok(None)
     }
 
     fn init_magic() -> Result<magic::Cookie> {
@@ -133,6 +764,38 @@ impl Repo {
         Ok(cookie)
     }
 
+    /// Calls `f` with the libmagic cookie of the current thread, loading it on first use.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Magic` if libmagic cannot be initialized.
+    fn with_magic_cookie<F, R>(f: F) -> Result<R>
+    where
+        F: FnOnce(&magic::Cookie) -> R,
+    {
+        MAGIC_COOKIE.with(|cookie| {
+            let mut cookie = cookie.borrow_mut();
+            if cookie.is_none() {
+                *cookie = Some(Repo::init_magic()?);
+            }
+            Ok(f(cookie
+                .as_ref()
+                .expect("libmagic cookie was just loaded.")))
+        })
+    }
+
+    /// MIME type of `file`, sniffed by libmagic.
+    fn sniff_file(file: &Path) -> Result<String> {
+        Repo::with_magic_cookie(|cookie| cookie.file(file).expect("Libmagic ffi should not fail."))
+    }
+
+    /// MIME type of content starting with `head`, sniffed by libmagic.
+    fn sniff_buffer(head: &[u8]) -> Result<String> {
+        Repo::with_magic_cookie(|cookie| {
+            cookie.buffer(head).expect("Libmagic ffi should not fail.")
+        })
+    }
+
     /// Imports a file or folder into the vorg repo.
     ///
     /// This process MOVES the imported file into vorg store, generates thumbnails of it so that it
@@ -156,7 +819,7 @@ impl Repo {
     /// If `file_path` points to a folder,
     /// Only `ErrorKind::FileNotFound` and `ErrorKind::IO` are returned. The other two types are
     /// suppressed. See stderr if those errors need to be known.
-    pub async fn import<T>(&mut self, file_path: T) -> Result<()>
+    pub async fn import<T>(&self, file_path: T) -> Result<()>
     where
         T: AsRef<Path>,
     {
@@ -172,125 +835,2009 @@ impl Repo {
             });
         }
 
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
         if file_path.is_dir() {
             // Folder recursive import
-            self.import_dir(file_path).await?;
+            self.import_session_with(&mut writer, file_path).await?;
         } else {
             // Single file
-            self.import_file(file_path).await?;
+            self.import_file(&mut writer, file_path).await?;
         }
 
         Ok(())
     }
 
-    async fn import_dir<T>(&mut self, dir: T) -> Result<()>
+    /// Plans importing a file or folder, without modifying the repo or the files to import.
+    ///
+    /// Files are walked like `import` walks them and classified by their type. Supported files
+    /// whose size matches an item in the store manifest are hashed to find items already in the
+    /// repo. Items without a manifest entry, e.g. those in the cold tier, have no known size, so
+    /// then files of other sizes are hashed up to `SAMPLE_BYTES` in all and looked up as well;
+    /// the rest are counted as unchecked. Sniffing, hashing and timing run on the blocking
+    /// thread pool. Comparing the device of each file with the devices of the volumes it may be
+    /// placed on predicts how many bytes will be copied rather than renamed. Hashing and copying
+    /// are timed on up to `SAMPLE_BYTES` of the files to estimate how long the import takes.
+    /// Copies are timed into the system temp folder, preferably from a file on another device,
+    /// and removed again.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::FileNotFound` when the file or folder to import cannot be found.
+    /// - `ErrorKind::IO` when a file cannot be read, or the copy cannot be timed.
+    pub async fn plan_import<T>(&self, path: T) -> Result<ImportPlan>
     where
         T: AsRef<Path>,
     {
-        let dir = dir.as_ref().to_owned();
+        let path = path.as_ref();
+        if !path.exists() {
+            return Err(Error {
+                msg: format!("The file to import cannot be found: {}.", path.display()),
+                kind: ErrorKind::FileNotFound,
+            });
+        }
+
+        let shares = self.inner.store.placement_shares()?;
+        let volume_devices = self
+            .inner
+            .store
+            .roots()
+            .iter()
+            .map(|root| Ok(import_plan::device_id(&fs::metadata(root)?)))
+            .collect::<Result<Vec<_>>>()?;
+        let temp_dir = std::env::temp_dir();
+        let temp_device = import_plan::device_id(&fs::metadata(&temp_dir)?);
+        let mut db = self.inner.readers.get().await?;
+        let known_sizes = db.get_item_sizes().await?;
+        // Files of any other size may be duplicates of these
+        let has_unsized_items = db.count_items_without_store_object().await? > 0;
+
+        // Sniffing and hashing block, so they run on the blocking thread pool
+        let walk_path = path.to_owned();
+        let walk = tokio::task::spawn_blocking(move || -> Result<_> {
+            let mut plan = ImportPlan::default();
+            // Files that may be duplicates, with their size and the bytes they add to
+            // `copy_bytes`
+            let mut candidates = Vec::new();
+            // Files of other sizes, hashed up to `SAMPLE_BYTES` in all
+            let mut hash_samples = Vec::new();
+            let mut sampled_bytes = 0;
+            // A file to time copies with, on another device than the temp folder if any is
+            let mut copy_sample: Option<(PathBuf, bool)> = None;
+            Repo::walk_import_source(&walk_path, &mut |file| {
+                let metadata = fs::metadata(file)?;
+                let size = metadata.len();
+                let mime_type = Repo::sniff_file(file)?;
+                if !SUPPORTED_MIMETYPES.contains_key(mime_type.as_str()) {
+                    plan.unsupported_files += 1;
+                    plan.unsupported_bytes += size;
+                    return Ok(());
+                }
+                plan.supported_files += 1;
+                plan.supported_bytes += size;
+
+                let device = import_plan::device_id(&metadata);
+                let mut copy_share = 0.0;
+                for (share, volume_device) in shares.iter().zip(&volume_devices) {
+                    if *volume_device != device && *share > 0.0 {
+                        copy_share += share;
+                    }
+                }
+                if copy_sample.as_ref().map_or(true, |(_, across)| !across) {
+                    copy_sample = Some((file.to_owned(), device != temp_device));
+                }
+                #[allow(
+                    clippy::cast_possible_truncation,
+                    clippy::cast_precision_loss,
+                    clippy::cast_sign_loss
+                )]
+                let copy_bytes = (size as f64 * copy_share).round() as u64;
+                plan.copy_bytes += copy_bytes;
+
+                if known_sizes.contains(&i64::try_from(size).unwrap_or(i64::MAX)) {
+                    candidates.push((file.to_owned(), size, copy_bytes));
+                } else if sampled_bytes < SAMPLE_BYTES {
+                    sampled_bytes += size;
+                    hash_samples.push((file.to_owned(), size, copy_bytes));
+                } else if has_unsized_items {
+                    plan.unchecked_files += 1;
+                    plan.unchecked_bytes += size;
+                }
+                Ok(())
+            })?;
+            Ok((plan, candidates, hash_samples, copy_sample))
+        });
+        let (mut plan, candidates, hash_samples, copy_sample) =
+            walk.await.expect("Import plan task panicked.")?;
+
+        let hashed = tokio::task::spawn_blocking(move || -> Result<_> {
+            let mut hashed = Vec::with_capacity(candidates.len() + hash_samples.len());
+            let mut hash_throughput = Throughput::default();
+            for (file, size, copy_bytes) in candidates {
+                let (hash, throughput) = import_plan::measure_hash(&file, u64::MAX)?;
+                hash_throughput.add(throughput);
+                hashed.push((Some(hash), size, copy_bytes));
+            }
+            for (file, size, copy_bytes) in hash_samples {
+                let remaining = SAMPLE_BYTES.saturating_sub(hash_throughput.bytes);
+                if remaining == 0 {
+                    hashed.push((None, size, copy_bytes));
+                    continue;
+                }
+                let (hash, throughput) = import_plan::measure_hash(&file, remaining)?;
+                hash_throughput.add(throughput);
+                // Only the hash of a whole file identifies an item, and only unsized items can
+                // have another size
+                let is_whole = throughput.bytes == size;
+                let hash = (has_unsized_items && is_whole).then_some(hash);
+                hashed.push((hash, size, copy_bytes));
+            }
+            Ok((hashed, hash_throughput))
+        });
+        let (hashed, hash_throughput) = hashed.await.expect("Import plan task panicked.")?;
+        plan.hash_throughput = hash_throughput;
+        for (hash, size, copy_bytes) in hashed {
+            let Some(hash) = hash else {
+                if has_unsized_items {
+                    plan.unchecked_files += 1;
+                    plan.unchecked_bytes += size;
+                }
+                continue;
+            };
+            // Like `import`, which rejects items already in the db wherever they are stored
+            if db.has_item(&hash).await? {
+                plan.duplicate_files += 1;
+                plan.duplicate_bytes += size;
+                // Duplicates are not moved into the store
+                plan.copy_bytes -= copy_bytes;
+            }
+        }
+        drop(db);
+
+        // Nothing needs to be timed if nothing is copied
+        if let Some((file, _)) = copy_sample.filter(|_| plan.copy_bytes > 0) {
+            let temp_path = temp_dir.join(format!("vorg-plan-{}", Uuid::new_v4()));
+            let timing = tokio::task::spawn_blocking(move || {
+                import_plan::measure_copy(&file, &temp_path, SAMPLE_BYTES)
+            });
+            plan.copy_throughput = timing.await.expect("Import plan task panicked.")?;
+        }
+        Ok(plan)
+    }
+
+    /// Visits the files `import` imports from `path`.
+    fn walk_import_source(path: &Path, visit: &mut dyn FnMut(&Path) -> Result<()>) -> Result<()> {
+        if !path.is_dir() {
+            return visit(path);
+        }
         let mut dir_stack = VecDeque::new();
-        dir_stack.push_front(dir);
+        dir_stack.push_front(path.to_owned());
         while let Some(current_dir) = dir_stack.pop_front() {
-            for entry in fs::read_dir(current_dir).expect("Error opening directory.") {
-                let entry = entry.expect("Error getting entry in directory.");
-                let path = entry.path();
+            for entry in fs::read_dir(current_dir)? {
+                let path = entry?.path();
                 if path.is_dir() {
                     dir_stack.push_front(path);
                 } else {
-                    let Err(error) = self.import_file(&path).await else {
-                        continue;
-                    };
-                    match error.kind {
-                        ErrorKind::IO => {
-                            // Do not suppress IO error, as those indicate import failure.
-                            return Err(error);
-                        }
-                        _ => {
-                            // Suppress all other errors, since those are either unsupported or
-                            // duplicates.
-                            eprintln!("Error encountered: {error}. Ignoring.");
-                        }
+                    visit(&path)?;
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// Imports every supported file under the folder `dir`, like `import` does, in a session
+    /// that can be resumed.
+    ///
+    /// The session is checkpointed in the db: the folders left to import, and the files done
+    /// with in the folder being imported. If the import is interrupted, importing `dir` again
+    /// continues where it stopped, without listing finished folders or sniffing and hashing
+    /// finished files again. Files are imported in batches, see `import_batch`.
+    ///
+    /// Returns the files imported and skipped over every run of the session.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::FileNotFound` when `dir` cannot be found.
+    /// - `ErrorKind::IO` when importing fails. The session is kept, so that it can be resumed.
+    ///
+    /// Unsupported files and duplicates are reported on stderr and skipped.
+    pub async fn import_session<T>(&self, dir: T) -> Result<ImportSession>
+    where
+        T: AsRef<Path>,
+    {
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        self.import_session_with(&mut writer, dir.as_ref()).await
+    }
+
+    /// Imports the folder `dir` in a session, see `import_session`.
+    async fn import_session_with(
+        &self,
+        writer: &mut RepoWriter,
+        dir: &Path,
+    ) -> Result<ImportSession> {
+        let source = Repo::session_source(dir)?;
+        let mut session = writer.db.open_import_session(&source).await?;
+        let mut pending_dirs = writer.db.get_session_dirs(session.session_id).await?;
+        while let Some(current_dir) = pending_dirs.pop() {
+            let mut subdirs = Vec::new();
+            let mut files = Vec::new();
+            // Folders removed since the session was interrupted have nothing left to import
+            if Path::new(&current_dir).is_dir() {
+                let done = writer
+                    .db
+                    .get_session_files(session.session_id, &current_dir)
+                    .await?;
+                for entry in fs::read_dir(&current_dir)? {
+                    let path = entry?.path();
+                    if path.is_dir() {
+                        subdirs.push(manifest::path_key(&path));
+                    } else if !done.contains(&Repo::file_name(&path)) {
+                        files.push(path);
                     }
                 }
             }
+
+            for batch in files.chunks(IMPORT_BATCH_SIZE) {
+                let imported = self.import_batch(writer, batch).await?;
+                let skipped = batch.len() as u64 - imported;
+                let names: Vec<String> = batch.iter().map(|file| Repo::file_name(file)).collect();
+                writer
+                    .db
+                    .record_session_files(
+                        session.session_id,
+                        &current_dir,
+                        &names,
+                        imported,
+                        skipped,
+                    )
+                    .await?;
+                session.imported += imported;
+                session.skipped += skipped;
+            }
+            writer
+                .db
+                .finish_session_dir(session.session_id, &current_dir, &subdirs)
+                .await?;
+            pending_dirs.extend(subdirs);
+        }
+        writer.db.finish_import_session(session.session_id).await?;
+        Ok(session)
+    }
+
+    /// The unfinished import session of the folder `dir`, if an earlier import of it was
+    /// interrupted.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::FileNotFound` when `dir` cannot be found.
+    pub async fn get_import_session<T>(&self, dir: T) -> Result<Option<ImportSession>>
+    where
+        T: AsRef<Path>,
+    {
+        let source = Repo::session_source(dir.as_ref())?;
+        let mut db = self.inner.readers.get().await?;
+        db.get_import_session(&source).await
+    }
+
+    /// Key of the import session of the folder `dir`, which is the same for every path to it.
+    fn session_source(dir: &Path) -> Result<String> {
+        let dir = fs::canonicalize(dir).map_err(|_| Error {
+            msg: format!("The folder to import cannot be found: {}.", dir.display()),
+            kind: ErrorKind::FileNotFound,
+        })?;
+        Ok(manifest::path_key(&dir))
+    }
+
+    fn file_name(path: &Path) -> String {
+        path.file_name()
+            .expect("Listed files must have a name.")
+            .to_string_lossy()
+            .into_owned()
+    }
+
+    async fn import_file<T>(&self, writer: &mut RepoWriter, file: T) -> Result<()>
+    where
+        T: AsRef<Path>,
+    {
+        let staged = self.stage_import(writer, file.as_ref()).await?;
+        self.store_import(writer, staged).await?;
+        writer.refresh_view_farms().await
+    }
+
+    /// Checks the type of `file`, hashes it and adds it to the db.
+    ///
+    /// The file is left in place, see `store_import`.
+    async fn stage_import(&self, writer: &mut RepoWriter, file: &Path) -> Result<StagedImport> {
+        // Check file type
+        let mime_type = Repo::sniff_file(file)?;
+        let ext = Repo::import_extension(&mime_type, file)?;
+
+        // Compute hash
+        let hash = Repo::hash(file).unwrap();
+
+        // Use the full file path as placeholder title.
+        let title = file.to_string_lossy().into_owned();
+
+        // Import into db
+        // This will propagate `ErrorKind::Duplicate` if a duplicate is imported.
+        writer.db.import_file(&title, &hash, &ext).await?;
+
+        Ok(StagedImport {
+            file: file.to_owned(),
+            hash,
+            ext,
+            received_on: None,
+        })
+    }
+
+    /// Like `stage_import`, for a member of `archive` that was copied to a temporary file on
+    /// `volume`.
+    ///
+    /// The temporary file is removed if the member is not imported.
+    async fn stage_member(
+        &self,
+        writer: &mut RepoWriter,
+        archive: &Path,
+        member: ArchiveMember,
+        volume: usize,
+    ) -> Result<StagedImport> {
+        // Use the archive path followed by the member path as placeholder title.
+        let title = format!("{}/{}", archive.display(), member.name.display());
+        let result = match Repo::sniff_buffer(&member.head)
+            .and_then(|mime_type| Repo::import_extension(&mime_type, Path::new(&title)))
+        {
+            Ok(ext) => writer
+                .db
+                .import_file(&title, &member.hash, &ext)
+                .await
+                .map(|()| ext),
+            Err(error) => Err(error),
+        };
+        match result {
+            Ok(ext) => Ok(StagedImport {
+                file: member.temp,
+                hash: member.hash,
+                ext,
+                received_on: Some(volume),
+            }),
+            Err(error) => {
+                member.discard()?;
+                Err(error)
+            }
+        }
+    }
+
+    /// The extension to store a file of `mime_type` under, taken from `name` if it has one.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Unsupported` if the type is not supported.
+    fn import_extension(mime_type: &str, name: &Path) -> Result<String> {
+        let Some(default_extension) = SUPPORTED_MIMETYPES.get(mime_type) else {
+            return Err(Error {
+                msg: format!(
+                    "The file to import has an supported type: {}.",
+                    name.display()
+                ),
+                kind: ErrorKind::Unsupported,
+            });
+        };
+        Ok(name.extension().map_or_else(
+            || String::from(*default_extension),
+            |extension| extension.to_string_lossy().into_owned(),
+        ))
+    }
+
+    /// Moves a file added to the db by `stage_import` into the store.
+    async fn store_import(&self, writer: &mut RepoWriter, staged: StagedImport) -> Result<()> {
+        let StagedImport {
+            file,
+            hash,
+            ext,
+            received_on,
+        } = staged;
+
+        // Move into store
+        let store = &self.inner.store;
+        let path = match received_on {
+            Some(volume) => store.insert_received(volume, file, &hash, &ext)?,
+            None => store.insert(file, &hash, &ext)?,
+        };
+        // A crash before this leaves the object out of the manifest, but in a store folder whose
+        // mtime changed, which the next `check_manifest` rescans.
+        writer
+            .db
+            .add_store_object(&ManifestEntry::read(&path, &hash, &ext)?)
+            .await?;
+
+        // TODO: Generate thumbnail
+
+        Ok(())
+    }
+
+    /// Imports `files` like `import` imports a folder, with one db commit for all of them.
+    ///
+    /// All files are added to the db in one transaction before any is moved into the store, so
+    /// a crash leaves the same state as a crash during a single import. Unsupported files and
+    /// duplicates are reported on stderr and skipped. The first IO error stops the batch, and is
+    /// returned once the files staged before it are imported. Any other error rolls the whole
+    /// batch back and is returned right away, leaving every file where it was.
+    ///
+    /// Returns the number of files imported.
+    async fn import_batch(&self, writer: &mut RepoWriter, files: &[PathBuf]) -> Result<u64> {
+        let mut failure = None;
+        let mut staged_imports = Vec::new();
+        writer.db.begin_batch().await?;
+        for file in files {
+            match self.stage_import(writer, file).await {
+                Ok(staged) => staged_imports.push(staged),
+                Err(error) if Repo::is_skipped(&error) => {
+                    eprintln!("Skipped {}: {error}", file.display());
+                }
+                Err(error) if error.kind == ErrorKind::IO => {
+                    failure = Some(error);
+                    break;
+                }
+                Err(error) => {
+                    writer.db.rollback_batch().await?;
+                    return Err(error);
+                }
+            }
+        }
+        writer.db.commit_batch().await?;
+
+        let imported = staged_imports.len() as u64;
+        if let Err(error) = self.store_imports(writer, staged_imports).await {
+            failure.get_or_insert(error);
+        }
+        failure.map_or(Ok(imported), Err)
+    }
+
+    /// Whether `error` only concerns the file being imported, which is then skipped rather than
+    /// stopping the import.
+    fn is_skipped(error: &Error) -> bool {
+        matches!(error.kind, ErrorKind::Unsupported | ErrorKind::Duplicate)
+    }
+
+    /// Moves files staged in one db batch into the store, with one db commit for their manifest
+    /// entries, then links them into view farms. Stops at the first error and returns it.
+    async fn store_imports(
+        &self,
+        writer: &mut RepoWriter,
+        staged_imports: Vec<StagedImport>,
+    ) -> Result<()> {
+        let mut result = Ok(());
+        writer.db.begin_batch().await?;
+        for staged in staged_imports {
+            result = self.store_import(writer, staged).await;
+            if result.is_err() {
+                break;
+            }
+        }
+        writer.db.commit_batch().await?;
+        // Keeps the change feed drained however large the import
+        let refreshed = writer.refresh_view_farms().await;
+        result.and(refreshed)
+    }
+
+    /// Imports the regular files of a zip or tar archive without extracting it first.
+    ///
+    /// Each member is streamed into a temporary file in the store while it is hashed, and its
+    /// type is detected from its leading bytes. The archive itself is left untouched. Tar
+    /// archives may be gzipped. Members are titled with the archive path followed by their path
+    /// in the archive, and are added to the db in batches of up to `IMPORT_BATCH_SIZE`.
+    ///
+    /// # Errors
+    ///
+    /// Like importing a folder with `import`:
+    /// - `ErrorKind::FileNotFound` when the archive cannot be found.
+    /// - `ErrorKind::IO` when the archive cannot be read or importing fails.
+    ///
+    /// Unsupported members and duplicates are reported on stderr and skipped. Additionally,
+    /// - `ErrorKind::Unsupported` when the archive is a zip64 archive.
+    pub async fn import_archive<T>(&self, archive: T) -> Result<()>
+    where
+        T: AsRef<Path>,
+    {
+        let archive = archive.as_ref();
+        if !archive.is_file() {
+            return Err(Error {
+                msg: format!(
+                    "The archive to import cannot be found: {}.",
+                    archive.display()
+                ),
+                kind: ErrorKind::FileNotFound,
+            });
+        }
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        self.import_members(
+            &mut writer,
+            ArchiveSource::File(archive.to_owned()),
+            archive,
+        )
+        .await
+    }
+
+    /// Imports the regular files of a tar archive read front to back from `reader`, e.g. a pipe,
+    /// like `import_archive`.
+    ///
+    /// Members are titled with `name` followed by their path in the archive.
+    ///
+    /// # Errors
+    ///
+    /// See `import_archive`. Additionally,
+    /// - `ErrorKind::Unsupported` when `reader` yields a zip archive, which cannot be streamed.
+    pub async fn import_tar<R>(&self, reader: R, name: &str) -> Result<()>
+    where
+        R: Read + Send + 'static,
+    {
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        let source = ArchiveSource::Stream(Box::new(reader));
+        self.import_members(&mut writer, source, Path::new(name))
+            .await
+    }
+
+    /// Imports content read from `reader`, e.g. stdin, reading it only once.
+    ///
+    /// The content is hashed while it is written to a temporary file on the volume with the most
+    /// available space, then added to the db and moved to its content address, like `import` does
+    /// with a file. Free space placement keeps it on that volume. With hash placement, its volume
+    /// is only known once it is hashed, so it is copied there if that is another one. Its type is
+    /// detected from the written file. `ext` defaults to the extension of `title`, or else to the
+    /// default extension of the detected type.
+    ///
+    /// Returns the hash of the imported content.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Unsupported` when the content has a currently unsupported type.
+    /// - `ErrorKind::Duplicate` when the content already exists in repo.
+    /// - `ErrorKind::IO` when reading the content or writing it into the store failed.
+    pub async fn import_stream(
+        &self,
+        reader: &mut (dyn AsyncRead + Unpin + Send),
+        title: &str,
+        ext: Option<&str>,
+    ) -> Result<String> {
+        let volume = self.inner.store.receiving_volume()?;
+        let temp_path = self.inner.store.temp_path(volume)?;
+        let mut file = fs::File::create(&temp_path)?;
+        let hash = backend::copy_hashed(reader, |chunk| Ok(file.write_all(chunk)?))
+            .await
+            .and_then(|hash| {
+                file.sync_all()?;
+                Ok(hash)
+            });
+        drop(file);
+
+        // The content is received into a temporary file of its own, so only adding it to the
+        // repo waits for the writer lease
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = match writer.lease().await {
+            Ok(lease) => lease,
+            Err(error) => {
+                fs::remove_file(&temp_path)?;
+                return Err(error);
+            }
+        };
+        let staged = match hash {
+            Ok(hash) => {
+                self.stage_stream(&mut writer, &temp_path, volume, hash, title, ext)
+                    .await
+            }
+            Err(error) => Err(error),
+        };
+        let staged = match staged {
+            Ok(staged) => staged,
+            Err(error) => {
+                fs::remove_file(&temp_path)?;
+                return Err(error);
+            }
+        };
+        let hash = staged.hash.clone();
+        self.store_import(&mut writer, staged).await?;
+        writer.refresh_view_farms().await?;
+        Ok(hash)
+    }
+
+    /// Checks the type of content written to `temp_path` by `import_stream` and adds it to the db.
+    async fn stage_stream(
+        &self,
+        writer: &mut RepoWriter,
+        temp_path: &Path,
+        volume: usize,
+        hash: String,
+        title: &str,
+        ext: Option<&str>,
+    ) -> Result<StagedImport> {
+        let mime_type = Repo::sniff_file(temp_path)?;
+        let detected_ext = Repo::import_extension(&mime_type, Path::new(title))?;
+        let ext = ext.map_or(detected_ext, str::to_owned);
+
+        // This will propagate `ErrorKind::Duplicate` if a duplicate is imported.
+        writer.db.import_file(title, &hash, &ext).await?;
+
+        Ok(StagedImport {
+            file: temp_path.to_owned(),
+            hash,
+            ext,
+            received_on: Some(volume),
+        })
+    }
+
+    async fn import_members(
+        &self,
+        writer: &mut RepoWriter,
+        source: ArchiveSource,
+        archive: &Path,
+    ) -> Result<()> {
+        let volume = self.inner.store.receiving_volume()?;
+        let temp_dir = self.inner.store.temp_dir(volume)?;
+        let (mut members, extraction) = archive::extract(source, temp_dir, IMPORT_BATCH_SIZE);
+        let mut failure = None;
+        while failure.is_none() {
+            // Wait for one member, then batch it with those copied in the meantime
+            let Some(member) = members.recv().await else {
+                break;
+            };
+            let mut batch = vec![member];
+            while batch.len() < IMPORT_BATCH_SIZE {
+                let Ok(member) = members.try_recv() else {
+                    break;
+                };
+                batch.push(member);
+            }
+
+            // Errors only stop the import here, so that the copies are removed below
+            let mut staged_imports = Vec::new();
+            let mut db_failure = writer.db.begin_batch().await.err();
+            let in_batch = db_failure.is_none();
+            for member in batch {
+                let staged = match member {
+                    Ok(member) if failure.is_some() || db_failure.is_some() => {
+                        member.discard().map(|()| None)
+                    }
+                    Ok(member) => self
+                        .stage_member(writer, archive, member, volume)
+                        .await
+                        .map(Some),
+                    Err(error) => Err(error),
+                };
+                match staged {
+                    Ok(staged) => staged_imports.extend(staged),
+                    Err(error) if Repo::is_skipped(&error) => {
+                        eprintln!("Skipped a member of {}: {error}", archive.display());
+                    }
+                    Err(error) if error.kind == ErrorKind::IO => {
+                        failure.get_or_insert(error);
+                    }
+                    Err(error) => {
+                        db_failure.get_or_insert(error);
+                    }
+                }
+            }
+            if db_failure.is_none() {
+                // A failed commit is rolled back
+                db_failure = writer.db.commit_batch().await.err();
+            } else if in_batch {
+                // The error that stopped the batch is the one to report
+                let _ = writer.db.rollback_batch().await;
+            }
+            if let Some(error) = db_failure {
+                for staged in staged_imports {
+                    fs::remove_file(staged.file)?;
+                }
+                failure = Some(error);
+                break;
+            }
+            if let Err(error) = self.store_imports(writer, staged_imports).await {
+                failure.get_or_insert(error);
+            }
+        }
+
+        // Stop copying and remove the copies that will not be imported
+        members.close();
+        while let Some(member) = members.recv().await {
+            if let Ok(member) = member {
+                member.discard()?;
+            }
+        }
+        let extracted = extraction
+            .await
+            .expect("Archive extraction should not panic.");
+        failure.map_or(extracted, Err)
+    }
+
+    /// Watches `dir` and imports files as they land in it, until an error occurs.
+    ///
+    /// Files already in `dir` are imported first. New files are found with inotify, and `dir`
+    /// is rescanned whenever the kernel drops events. A file is imported once it was closed by
+    /// its writer and did not change for `watch.settle_ms`, so that partial files are not
+    /// imported. Files that became ready together are imported as one batch, see
+    /// `import_batch`.
+    ///
+    /// # Errors
+    ///
+    /// Like importing a folder with `import`:
+    /// - `ErrorKind::FileNotFound` when `dir` cannot be found.
+    /// - `ErrorKind::IO` when watching `dir` or importing fails.
+    ///
+    /// Unsupported files and duplicates are reported on stderr and skipped.
+    #[cfg(target_os = "linux")]
+    pub async fn watch<T>(&self, dir: T) -> Result<()>
+    where
+        T: AsRef<Path>,
+    {
+        let dir = dir.as_ref();
+        if !dir.is_dir() {
+            return Err(Error {
+                msg: format!("The folder to watch cannot be found: {}.", dir.display()),
+                kind: ErrorKind::FileNotFound,
+            });
+        }
+
+        // Watch before the initial scan, so that no file falls in between
+        let mut folder_watch = watch::FolderWatch::new(dir)?;
+        let settle = Duration::from_millis(self.inner.config.watch_settle_ms);
+        let mut pending = watch::StableFiles::new(settle);
+        let mut events = vec![watch::WatchEvent::Rescan(dir.to_owned())];
+        loop {
+            let now = Instant::now();
+            for event in events {
+                match event {
+                    watch::WatchEvent::Created(path) => pending.observe(path, false, now),
+                    watch::WatchEvent::Closed(path) => pending.observe(path, true, now),
+                    watch::WatchEvent::Rescan(path) => {
+                        for file in watch::files_under(&path)? {
+                            pending.observe(file, true, now);
+                        }
+                    }
+                }
+            }
+            let ready = pending.take_ready(now);
+            if !ready.is_empty() {
+                // Released while waiting, so that others can write while the folder is quiet
+                self.flush_metadata().await?;
+                let mut writer = self.inner.writer.lock().await;
+                let _lease = writer.lease().await?;
+                for batch in ready.chunks(IMPORT_BATCH_SIZE) {
+                    self.import_batch(&mut writer, batch).await?;
+                }
+            }
+            // Wake up on the next events, or when the next pending file may have settled
+            events = match pending.next_deadline() {
+                Some(deadline) => {
+                    tokio::time::timeout_at(deadline.into(), folder_watch.wait_events())
+                        .await
+                        .unwrap_or_else(|_| Ok(Vec::new()))?
+                }
+                None => folder_watch.wait_events().await?,
+            };
+        }
+    }
+
+    /// Watching folders needs inotify, which is not available on this platform.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Unsupported` always.
+    #[cfg(not(target_os = "linux"))]
+    pub async fn watch<T>(&self, _dir: T) -> Result<()>
+    where
+        T: AsRef<Path>,
+    {
+        Err(Error {
+            msg: String::from("Watching folders is only supported on Linux."),
+            kind: ErrorKind::Unsupported,
+        })
+    }
+
+    /// Get all files. See `query_files` to get those that satisfy a filter, a page at a time.
+    ///
+    /// Pending buffered writes are applied to the result, see `flush`.
+    pub async fn get_files(&self) -> Result<Vec<Item>> {
+        let mut items = self.inner.readers.get().await?.get_items().await?;
+        self.patch_items(&mut items);
+        Ok(items)
+    }
+
+    /// Get all files as a compact `ItemSet`, ordered by hash.
+    ///
+    /// This takes several times less memory than `get_files` on large catalogues. Pending
+    /// buffered writes are applied to the result.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the items cannot be read.
+    pub async fn get_file_set(&self) -> Result<ItemSet> {
+        let mut db = self.inner.readers.get().await?;
+        let mut set = db.get_item_set().await?;
+        self.patch_item_set(&mut set);
+        Ok(set)
+    }
+
+    /// Get all files as a compact `ItemSet` like `get_file_set`, but ordered by collection id
+    /// and read with one connection per core. The result is consistent, see
+    /// `DB::scan_item_set`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the items cannot be read.
+    pub async fn scan_file_set(&self) -> Result<ItemSet> {
+        let partitions = thread::available_parallelism().map_or(1, NonZeroUsize::get);
+        let mut db = self.inner.readers.get().await?;
+        let mut set = db.scan_item_set(partitions).await?;
+        self.patch_item_set(&mut set);
+        Ok(set)
+    }
+
+    /// Get one page of the files that satisfy `query`, ordered by hash.
+    ///
+    /// Results are cached until the next change to titles, tags or items, so repeated queries,
+    /// e.g. going back to the first page, are served from memory. Pending buffered titles and
+    /// tags are taken into account by checking the collections they change against the filter
+    /// in memory, see `query::patch_page`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the query fails.
+    pub async fn query_files(&self, query: &Query, page: &Page) -> Result<Vec<Item>> {
+        let query = query.normalized();
+        // Taken before reading, so that a change made meanwhile does not outlive its generation
+        let generation = self.inner.version_db.lock().await.get_generation().await?;
+        let pending = if self.has_pending_metadata() {
+            self.pending_items(&mut self.inner.readers.get().await?)
+                .await?
+        } else {
+            Vec::new()
+        };
+        // Each pending item may take the place of an item of the page
+        let db_page = Page {
+            after: page.after.clone(),
+            limit: page
+                .limit
+                .saturating_add(u32::try_from(pending.len()).unwrap_or(u32::MAX)),
+        };
+        let cached = self
+            .inner
+            .query_cache
+            .lock()
+            .expect("Query cache lock is poisoned.")
+            .get(generation, &query, &db_page);
+        let items = match cached {
+            Some(items) => items,
+            None => {
+                let mut db = self.inner.readers.get().await?;
+                let items = db.query_items(&query, &db_page).await?;
+                self.inner
+                    .query_cache
+                    .lock()
+                    .expect("Query cache lock is poisoned.")
+                    .insert(generation, query.clone(), db_page, items.clone());
+                items
+            }
+        };
+        Ok(query::patch_page(items, &pending, &query, page))
+    }
+
+    /// Files of `count` collections picked uniformly at random among those that satisfy `query`,
+    /// in random order, e.g. to shuffle or to pick a random collection with a tag. Returns every
+    /// match if fewer than `count` match.
+    ///
+    /// Collections are sampled without sorting the matches: when most collections match, it
+    /// takes about `count` indexed lookups, and narrow filters fall back to a single pass over
+    /// their matches. Pending buffered writes are applied to the sampled items, and collections
+    /// they make miss the filter are left out. Collections that only match through pending
+    /// writes are not sampled until the writes are flushed.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the query fails.
+    pub async fn sample_files(&self, query: &Query, count: usize) -> Result<Vec<Item>> {
+        let query = query.normalized();
+        let mut db = self.inner.readers.get().await?;
+        let collection_ids = db
+            .sample_collections(&query, count, &mut Rng::new())
+            .await?;
+        let mut items = db.get_collection_items(&collection_ids).await?;
+        let pending: HashSet<i64> = self
+            .inner
+            .write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.")
+            .pending_collections()
+            .into_iter()
+            .collect();
+        self.patch_items(&mut items);
+        items.retain(|item| !pending.contains(&item.collection_id) || query.matches(item));
+        Ok(items)
+    }
+
+    /// Counts of collections, items, store bytes, items per extension and tags per namespace
+    /// and per tag, e.g. how many collections are still `meta:Incomplete`.
+    ///
+    /// The counts are kept up to date by triggers, in the same transaction as every import,
+    /// delete and tag change, so this reads a small table instead of scanning. Pending buffered
+    /// tags are counted against the current tags of their collections.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the statistics cannot be read.
+    pub async fn get_stats(&self) -> Result<Stats> {
+        let pending_tags = self
+            .inner
+            .write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.")
+            .pending_tags();
+        let mut db = self.inner.readers.get().await?;
+        let mut stats = db.get_stats().await?;
+        if pending_tags.is_empty() {
+            return Ok(stats);
+        }
+        let mut collection_ids: Vec<i64> = pending_tags.iter().map(|(id, _, _)| *id).collect();
+        collection_ids.sort_unstable();
+        collection_ids.dedup();
+        let current_tags: HashMap<i64, Vec<String>> = db
+            .get_collection_items(&collection_ids)
+            .await?
+            .into_iter()
+            .map(|item| (item.collection_id, item.tags))
+            .collect();
+        for (collection_id, tag, present) in pending_tags {
+            // Collections deleted meanwhile have no items left
+            let Some(tags) = current_tags.get(&collection_id) else {
+                continue;
+            };
+            if tags.contains(&tag) != present {
+                stats.count_tag(&tag, present);
+            }
+        }
+        Ok(stats)
+    }
+
+    /// Recounts the statistics of `get_stats` from the tables they describe, e.g. as a periodic
+    /// reconciliation. Returns whether the kept statistics had drifted.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if pending writes cannot be flushed or the recount fails.
+    pub async fn recount_stats(&self) -> Result<bool> {
+        self.flush_metadata().await?;
+        self.inner.writer.lock().await.db.recount_stats().await
+    }
+
+    /// Names of all tags, in order, including tags only added by pending buffered writes.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the query fails.
+    pub async fn get_tags(&self) -> Result<Vec<String>> {
+        let mut db = self.inner.readers.get().await?;
+        let mut names = db.get_tag_names().await?;
+        let pending_tags = self
+            .inner
+            .write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.")
+            .pending_tags();
+        let added = pending_tags
+            .into_iter()
+            .filter(|(_, _, present)| *present)
+            .map(|(_, tag, _)| tag);
+        names.extend(added);
+        names.sort();
+        names.dedup();
+        Ok(names)
+    }
+
+    /// First `limit` files of the collections tagged `tag`, ordered by title, to browse them as
+    /// a folder. Pending buffered writes are applied, see `patch_view`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the query fails.
+    pub async fn get_tag_view(&self, tag: &str, limit: u32) -> Result<Vec<ViewFile>> {
+        let mut db = self.inner.readers.get().await?;
+        let pending = self.pending_items(&mut db).await?;
+        let files = db
+            .get_tag_view(tag, view::padded_limit(limit, pending.len()))
+            .await?;
+        let query = Query {
+            tags: vec![tag.to_owned()],
+            title: None,
+        };
+        self.patch_view(&mut db, files, &pending, &query, limit)
+            .await
+    }
+
+    /// First `limit` files of the collections with all words of `text` in their title, in
+    /// order, ordered by title, to browse them as a folder. Pending buffered writes are applied,
+    /// see `patch_view`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the query fails.
+    pub async fn get_search_view(&self, text: &str, limit: u32) -> Result<Vec<ViewFile>> {
+        let query = Query {
+            tags: Vec::new(),
+            title: Some(text.to_owned()),
+        }
+        .normalized();
+        match query.title_phrase() {
+            Some(phrase) => {
+                let mut db = self.inner.readers.get().await?;
+                let pending = self.pending_items(&mut db).await?;
+                let files = db
+                    .get_search_view(&phrase, view::padded_limit(limit, pending.len()))
+                    .await?;
+                self.patch_view(&mut db, files, &pending, &query, limit)
+                    .await
+            }
+            None => Ok(Vec::new()),
+        }
+    }
+
+    /// Applies pending buffered writes to the files of a tag or search view read from the db,
+    /// and keeps the first `limit`: the files of the `pending` items are replaced by those still
+    /// matching `query`.
+    async fn patch_view(
+        &self,
+        db: &mut DB,
+        mut files: Vec<ViewFile>,
+        pending: &[Item],
+        query: &Query,
+        limit: u32,
+    ) -> Result<Vec<ViewFile>> {
+        if pending.is_empty() {
+            return Ok(files);
+        }
+        let pending_hashes: HashSet<&str> = pending.iter().map(|item| item.hash.as_str()).collect();
+        files.retain(|file| !pending_hashes.contains(file.hash.as_str()));
+        for item in pending.iter().filter(|item| query.matches(item)) {
+            let entry = db.get_store_object(&item.hash).await?;
+            files.push(ViewFile {
+                title: item.title.clone(),
+                hash: item.hash.clone(),
+                ext: item.ext.clone(),
+                size: entry
+                    .as_ref()
+                    .and_then(|entry| u64::try_from(entry.size).ok()),
+                mtime: entry.map(|entry| entry.mtime),
+            });
+        }
+        files.sort_by(|a, b| (&a.title, &a.hash).cmp(&(&b.title, &b.hash)));
+        files.truncate(usize::try_from(limit).unwrap_or(usize::MAX));
+        Ok(files)
+    }
+
+    /// Up to `limit` collections whose tags overlap most with those of `collection_id`, most
+    /// similar first, for "more like this" recommendations.
+    ///
+    /// Candidates come from a MinHash LSH index over tag sets, kept up to date with every tag
+    /// change, and are ranked by exact Jaccard similarity. A query takes a few indexed lookups
+    /// however many collections there are, but collections with little overlap may be missed.
+    /// Buffered tags of `collection_id` are flushed first, since they decide which collections
+    /// are candidates. Buffered tags of other collections count once flushed, buffered titles
+    /// right away.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if pending writes cannot be flushed or the query fails.
+    pub async fn get_similar_collections(
+        &self,
+        collection_id: i64,
+        limit: usize,
+    ) -> Result<Vec<SimilarCollection>> {
+        let has_pending_tags = self
+            .inner
+            .write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.")
+            .has_pending_tags(collection_id);
+        if has_pending_tags {
+            self.flush().await?;
+        }
+        let mut db = self.inner.readers.get().await?;
+        let mut similar = db.get_similar_collections(collection_id, limit).await?;
+        let write_buffer = self
+            .inner
+            .write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.");
+        for collection in &mut similar {
+            if let Some(title) = write_buffer.pending_title(collection.collection_id) {
+                title.clone_into(&mut collection.title);
+            }
+        }
+        Ok(similar)
+    }
+
+    /// Saves a view farm: the folder `dir`, kept as links into the store to the items that
+    /// satisfy `query`, named by title.
+    ///
+    /// The folder is created and filled right away, then kept current by every write, see
+    /// `refresh_view_farms`. Links are recreated when objects move. Hard links need `dir` to be
+    /// on the same filesystem as the store. Items that are only in the cold tier are not linked.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Duplicate` if a view farm is kept in `dir` already.
+    /// - `ErrorKind::IO` if the folder or a link cannot be created.
+    /// - `ErrorKind::DB` if the farm cannot be saved or the query fails.
+    pub async fn add_view_farm<T>(&self, dir: T, query: &Query, link: LinkKind) -> Result<()>
+    where
+        T: AsRef<Path>,
+    {
+        fs::create_dir_all(dir.as_ref())?;
+        let dir = fs::canonicalize(dir)?;
+        self.flush_metadata().await?;
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        let query = query.normalized();
+        let farm_id = writer
+            .db
+            .add_view_farm(&dir.to_string_lossy(), &query, link)
+            .await?;
+        let farm = ViewFarm {
+            farm_id,
+            dir,
+            query,
+            link,
+        };
+        writer.sync_view_farm(&farm).await
+    }
+
+    /// Removes the view farm kept in `dir` and its links. The folder is removed as well, unless
+    /// something else was put in it.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::FileNotFound` if no view farm is kept in `dir`.
+    /// - `ErrorKind::IO` if a link cannot be removed.
+    pub async fn remove_view_farm<T>(&self, dir: T) -> Result<()>
+    where
+        T: AsRef<Path>,
+    {
+        let dir = dir.as_ref();
+        let not_found = || Error {
+            msg: format!("No view farm is kept in {}.", dir.display()),
+            kind: ErrorKind::FileNotFound,
+        };
+        let dir = fs::canonicalize(dir).map_err(|_| not_found())?;
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        let farm = writer
+            .db
+            .get_view_farms()
+            .await?
+            .into_iter()
+            .find(|farm| farm.dir == dir)
+            .ok_or_else(not_found)?;
+        for link in writer.db.get_farm_links(farm.farm_id, None).await? {
+            farm::remove_link(&farm.dir.join(&link.name))?;
+        }
+        writer.db.remove_view_farm(farm.farm_id).await?;
+        // Fails if the folder is not empty, which is fine
+        let _ = fs::remove_dir(&farm.dir);
+        Ok(())
+    }
+
+    /// Flushes buffered titles and tags and applies the changes not yet applied to view farms.
+    ///
+    /// Farms are kept current by every write of this repo: imports, deletes and flushes apply
+    /// their changes to the farms as they commit, see `RepoWriter::refresh_view_farms`, and
+    /// objects moved by tiering, resharding or rebalancing are relinked. Changes held back while
+    /// another process had the writer lease are applied by this or the next write. Changes made
+    /// by other processes are only picked up by `sync_view_farms`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if a link cannot be created or removed.
+    /// - `ErrorKind::DB` if pending writes cannot be flushed or a query fails.
+    pub async fn refresh_view_farms(&self) -> Result<()> {
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        self.flush_with(&mut writer).await
+    }
+
+    /// Brings every view farm up to date with the db, by diffing its recorded links against
+    /// the results of its query.
+    ///
+    /// Unlike `refresh_view_farms`, this also picks up changes made by other processes, and
+    /// recreates links that went missing, e.g. because they were removed by hand. Only links that
+    /// differ are touched.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if a link cannot be created or removed.
+    /// - `ErrorKind::DB` if pending writes cannot be flushed or a query fails.
+    pub async fn sync_view_farms(&self) -> Result<()> {
+        self.flush_metadata().await?;
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        writer.sync_view_farms().await
+    }
+
+    /// Saves `query` as the search `name`, and returns it with its result count.
+    ///
+    /// Results of saved searches are stored in the db and kept up to date from the change feed,
+    /// so listing them does not run the query again. Buffered titles and tags are flushed first.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Duplicate` if a search is saved as `name` already.
+    /// - `ErrorKind::DB` if pending writes cannot be flushed or the search cannot be saved.
+    pub async fn save_search(&self, name: &str, query: &Query) -> Result<SavedSearchInfo> {
+        self.flush_metadata().await?;
+        let mut writer = self.inner.writer.lock().await;
+        writer.refresh_saved_searches(true).await?;
+        let search = writer
+            .db
+            .add_saved_search(name, &query.normalized())
+            .await?;
+        let info = SavedSearchInfo {
+            name: search.name.clone(),
+            query: search.query.clone(),
+            count: search.results.len(),
+        };
+        if let Some(saved) = &mut writer.saved_searches {
+            saved.searches.push(search);
+        }
+        Ok(info)
+    }
+
+    /// Removes the saved search `name`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::FileNotFound` if no search is saved as `name`.
+    /// - `ErrorKind::DB` if the search cannot be removed.
+    pub async fn remove_saved_search(&self, name: &str) -> Result<()> {
+        let mut writer = self.inner.writer.lock().await;
+        if !writer.db.remove_saved_search(name).await? {
+            return Err(Error {
+                msg: format!("No search is saved as {name}."),
+                kind: ErrorKind::FileNotFound,
+            });
+        }
+        if let Some(saved) = &mut writer.saved_searches {
+            saved.searches.retain(|search| search.name != name);
+        }
+        Ok(())
+    }
+
+    /// Saved searches with their result counts, ordered by name.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if pending writes cannot be flushed or the results cannot be updated.
+    pub async fn get_saved_searches(&self) -> Result<Vec<SavedSearchInfo>> {
+        self.flush_metadata().await?;
+        let mut writer = self.inner.writer.lock().await;
+        writer.refresh_saved_searches(true).await?;
+        let Some(saved) = &writer.saved_searches else {
+            return Ok(Vec::new());
+        };
+        let mut searches: Vec<SavedSearchInfo> = saved
+            .searches
+            .iter()
+            .map(|search| SavedSearchInfo {
+                name: search.name.clone(),
+                query: search.query.clone(),
+                count: search.results.len(),
+            })
+            .collect();
+        searches.sort_by(|a, b| a.name.cmp(&b.name));
+        Ok(searches)
+    }
+
+    /// Files of up to `limit` collections that satisfy the saved search `name`, ordered by
+    /// collection id and hash, starting after the collection `after`.
+    ///
+    /// Pages are read from the stored results, so their cost does not depend on the query.
+    /// Pass the collection id of the last file to get the next page.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::FileNotFound` if no search is saved as `name`.
+    /// - `ErrorKind::DB` if pending writes cannot be flushed or the files cannot be read.
+    pub async fn get_saved_search_files(
+        &self,
+        name: &str,
+        after: Option<i64>,
+        limit: usize,
+    ) -> Result<Vec<Item>> {
+        self.flush_metadata().await?;
+        let mut writer = self.inner.writer.lock().await;
+        writer.refresh_saved_searches(true).await?;
+        let search = writer
+            .saved_searches
+            .as_ref()
+            .and_then(|saved| saved.searches.iter().find(|search| search.name == name))
+            .ok_or_else(|| Error {
+                msg: format!("No search is saved as {name}."),
+                kind: ErrorKind::FileNotFound,
+            })?;
+        let collection_ids = search.results.page(after, limit).to_vec();
+        drop(writer);
+        let mut db = self.inner.readers.get().await?;
+        let mut items = db.get_collection_items(&collection_ids).await?;
+        self.patch_items(&mut items);
+        Ok(items)
+    }
+
+    /// Mounts a read-only filesystem at `mountpoint` to browse the repo by tag and title, and
+    /// serves it until it is unmounted.
+    ///
+    /// `tags/<tag>/` lists the files of the collections with that tag, and `search/<text>/` those
+    /// with the words of `text` in their title. Files are named after collection titles and read
+    /// straight from the store.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the filesystem cannot be mounted.
+    #[cfg(feature = "fuse")]
+    pub async fn mount<T>(&self, mountpoint: T) -> Result<()>
+    where
+        T: AsRef<Path>,
+    {
+        let runtime = tokio::runtime::Handle::current();
+        // The filesystem receives requests on this thread and answers them from tasks
+        tokio::task::block_in_place(|| fuse::mount(self, runtime, mountpoint.as_ref()))
+    }
+
+    /// Mounting needs FUSE support, which is behind the `fuse` feature.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Unsupported` always.
+    #[cfg(not(feature = "fuse"))]
+    pub async fn mount<T>(&self, _mountpoint: T) -> Result<()>
+    where
+        T: AsRef<Path>,
+    {
+        Err(Error {
+            msg: String::from("Mounting a repo requires the fuse feature."),
+            kind: ErrorKind::Unsupported,
+        })
+    }
+
+    /// Sets the title of a collection. The write is buffered, see `flush`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the buffer is due and cannot be flushed.
+    pub async fn set_title(&self, collection_id: i64, title: &str) -> Result<()> {
+        self.buffer_write(|write_buffer| write_buffer.set_title(collection_id, title))
+            .await
+    }
+
+    /// Adds a tag to a collection. The write is buffered, see `flush`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the buffer is due and cannot be flushed.
+    pub async fn add_tag(&self, collection_id: i64, tag: &str) -> Result<()> {
+        self.buffer_write(|write_buffer| write_buffer.set_tag(collection_id, tag, true))
+            .await
+    }
+
+    /// Removes a tag from a collection. The write is buffered, see `flush`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the buffer is due and cannot be flushed.
+    pub async fn remove_tag(&self, collection_id: i64, tag: &str) -> Result<()> {
+        self.buffer_write(|write_buffer| write_buffer.set_tag(collection_id, tag, false))
+            .await
+    }
+
+    /// Records that an item was viewed. The access is buffered, see `flush`.
+    ///
+    /// This does not wait for the db: once the buffer is due, it is flushed in the background.
+    pub fn mark_viewed(&self, hash: &str) {
+        let is_due = {
+            let mut write_buffer = self
+                .inner
+                .write_buffer
+                .lock()
+                .expect("Write buffer lock is poisoned.");
+            write_buffer.record_access(hash, utils::unix_time());
+            write_buffer.is_due()
+        };
+        if is_due {
+            self.inner.flush_due.notify_one();
+        }
+    }
+
+    /// Deletes an item from the db and its file from the store or the cold tier.
+    ///
+    /// The collection of the item is deleted with it if it has no other items.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::FileNotFound` if the item is not in the db.
+    /// - `ErrorKind::DB` if the item cannot be deleted from the db.
+    /// - `ErrorKind::IO` if the file cannot be removed.
+    pub async fn delete_item(&self, hash: &str, ext: &str) -> Result<()> {
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        if !writer.db.delete_item(hash).await? {
+            return Err(Error {
+                msg: format!("Item {hash}.{ext} cannot be found in the database."),
+                kind: ErrorKind::FileNotFound,
+            });
+        }
+        // The db goes first, so that a crash leaves an orphaned file rather than an item without
+        // a file. Both are reported by `check_data_integrity`.
+        let key = ObjectKey {
+            hash: hash.to_owned(),
+            ext: ext.to_owned(),
+        };
+        self.inner.store.delete(&key).await?;
+        if let Some(cold_store) = &self.inner.cold_store {
+            cold_store.delete(&key).await?;
+        }
+        writer.refresh_view_farms().await
+    }
+
+    /// Receives a `ChangeEvent` for every change committed to the db from now on.
+    ///
+    /// Buffered writes are published when they are flushed. A subscriber that lags more than
+    /// `CHANGE_FEED_CAPACITY` events behind gets `RecvError::Lagged` and should reload.
+    pub fn subscribe(&self) -> tokio::sync::broadcast::Receiver<ChangeEvent> {
+        self.inner.changes.subscribe()
+    }
+
+    /// Sequence number of the latest change, to skip events already reflected in a snapshot.
+    pub fn last_change_seq(&self) -> u64 {
+        self.inner.changes.last_seq()
+    }
+
+    /// Current version of the db, which changes with every commit of this repo or of another
+    /// process, to tell whether results read from the db are current.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the data version cannot be read.
+    pub async fn db_version(&self) -> Result<DbVersion> {
+        // Read before the data version, so that a change published in between shows up in the
+        // next version
+        let seq = self.inner.changes.last_seq();
+        let mut version_db = self.inner.version_db.lock().await;
+        let data_version = version_db.get_data_version().await?;
+        Ok(DbVersion { seq, data_version })
+    }
+
+    /// Version of the titles, tags and items seen through the repo, pending buffered writes
+    /// included, to tell whether a view read from it is current.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the change generation cannot be read.
+    pub async fn view_version(&self) -> Result<ViewVersion> {
+        // Read before the generation, so that a write flushed in between shows up in the
+        // generation
+        let buffer_revision = self
+            .inner
+            .write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.")
+            .revision();
+        let generation = self.inner.version_db.lock().await.get_generation().await?;
+        Ok(ViewVersion {
+            generation,
+            buffer_revision,
+        })
+    }
+
+    /// Flushes the write buffer if titles or tags are pending, for operations that evaluate
+    /// queries with the writer, e.g. view farms and saved searches, whose results are stored.
+    async fn flush_metadata(&self) -> Result<()> {
+        if self.has_pending_metadata() {
+            self.flush().await?;
+        }
+        Ok(())
+    }
+
+    /// Whether titles or tags are buffered, see `WriteBuffer::has_pending_metadata`.
+    fn has_pending_metadata(&self) -> bool {
+        self.inner
+            .write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.")
+            .has_pending_metadata()
+    }
+
+    /// Applies pending buffered writes to items read from the db, so that readers see their own
+    /// writes.
+    fn patch_items(&self, items: &mut [Item]) {
+        let write_buffer = self
+            .inner
+            .write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.");
+        for item in items {
+            write_buffer.patch(item);
+        }
+    }
+
+    /// Applies pending buffered writes to an `ItemSet` read from the db.
+    fn patch_item_set(&self, set: &mut ItemSet) {
+        let write_buffer = self
+            .inner
+            .write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.");
+        let pending: HashSet<i64> = write_buffer.pending_collections().into_iter().collect();
+        if !pending.is_empty() {
+            set.patch(&pending, |item| write_buffer.patch(item));
+        }
+    }
+
+    /// Items of the collections with pending buffered titles or tags, with the writes applied,
+    /// for reads that filter in the db and would otherwise miss or wrongly include them. The
+    /// buffer holds at most `write_buffer.max_pending` collections, so this stays small.
+    async fn pending_items(&self, db: &mut DB) -> Result<Vec<Item>> {
+        let collection_ids = self
+            .inner
+            .write_buffer
+            .lock()
+            .expect("Write buffer lock is poisoned.")
+            .pending_collections();
+        if collection_ids.is_empty() {
+            return Ok(Vec::new());
+        }
+        let mut items = db.get_collection_items(&collection_ids).await?;
+        self.patch_items(&mut items);
+        Ok(items)
+    }
+
+    async fn buffer_write<F>(&self, write: F) -> Result<()>
+    where
+        F: FnOnce(&mut WriteBuffer),
+    {
+        let is_due = {
+            let mut write_buffer = self
+                .inner
+                .write_buffer
+                .lock()
+                .expect("Write buffer lock is poisoned.");
+            write(&mut write_buffer);
+            write_buffer.is_due()
+        };
+        if is_due {
+            self.flush().await?;
+        }
+        Ok(())
+    }
+
+    /// Finds the file of an item in the store.
+    ///
+    /// With hash placement the volume of an object follows from its hash. With free space
+    /// placement it is taken from the store manifest, so that a lookup takes a single probe
+    /// either way. Objects not in the manifest are looked for on every volume.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::FileNotFound` if the item is missing from the store.
+    /// - `ErrorKind::DB` if the store manifest cannot be read.
+    pub async fn locate(&self, hash: &str, ext: &str) -> Result<PathBuf> {
+        self.find_object(hash, ext).await?.ok_or_else(|| Error {
+            msg: format!("Item {hash}.{ext} cannot be found in the store."),
+            kind: ErrorKind::FileNotFound,
+        })
+    }
+
+    /// Path of an object in the hot store, if it is there, see `locate`.
+    async fn find_object(&self, hash: &str, ext: &str) -> Result<Option<PathBuf>> {
+        let store = &self.inner.store;
+        let manifest_dir = match store.placement() {
+            Placement::Hash => None,
+            Placement::FreeSpace => {
+                let entry = self
+                    .inner
+                    .readers
+                    .get()
+                    .await?
+                    .get_store_object(hash)
+                    .await?;
+                entry.map(|entry| entry.dir)
+            }
+        };
+        Ok(store.find(manifest_dir.as_deref(), hash, ext))
+    }
+
+    /// Reads byte ranges of an item, e.g. to serve range requests. Ranges are requested
+    /// concurrently: from the hot store each is read on the blocking thread pool, from an object
+    /// store each is a separate request.
+    ///
+    /// Items are found in either the hot store or the cold tier. The access is buffered, see
+    /// `flush`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::FileNotFound` if the item is missing from the store.
+    /// - `ErrorKind::IO` if the item cannot be read.
+    pub async fn read_ranges(
+        &self,
+        hash: &str,
+        ext: &str,
+        ranges: &[Range<u64>],
+    ) -> Result<Vec<Vec<u8>>> {
+        let key = ObjectKey {
+            hash: hash.to_owned(),
+            ext: ext.to_owned(),
+        };
+        self.mark_viewed(hash);
+        let hot_ranges = match self.locate(hash, ext).await {
+            Ok(path) => {
+                let reads = ranges
+                    .iter()
+                    .map(|range| backend::read_file_range(path.clone(), range.clone()));
+                future::try_join_all(reads).await
+            }
+            Err(error) => Err(error),
+        };
+        match hot_ranges {
+            Err(error) if error.kind == ErrorKind::FileNotFound => match &self.inner.cold_store {
+                Some(cold_store) => cold_store.get_ranges(&key, ranges).await,
+                None => Err(error),
+            },
+            result => result,
+        }
+    }
+
+    /// Writes all buffered metadata writes and accesses to the db, in a single transaction.
+    ///
+    /// Writes are flushed automatically once `write_buffer.max_pending` of them are pending or
+    /// the oldest is `write_buffer.max_delay_ms` old, checked on every buffered write and by a
+    /// background task at that interval, so a crash loses at most that much. Writes still
+    /// buffered when the last handle is dropped are flushed in the background, see `close`. On
+    /// failure the writes stay buffered. Results of loaded saved searches are brought up to date
+    /// and stored as well.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the writes cannot be applied or saved searches cannot be updated.
+    pub async fn flush(&self) -> Result<()> {
+        let mut writer = self.inner.writer.lock().await;
+        self.flush_with(&mut writer).await
+    }
+
+    /// Flushes buffered writes and drops this handle.
+    ///
+    /// Dropping the last handle of a repo also flushes, but on a background task of the
+    /// runtime, which is lost if the runtime shuts down first, e.g. when `main` returns right
+    /// after. So hosts should close the last handle before exiting.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the writes cannot be applied. They are lost then.
+    pub async fn close(self) -> Result<()> {
+        self.flush().await
+    }
+
+    async fn flush_with(&self, writer: &mut RepoWriter) -> Result<()> {
+        writer.flush(&self.inner.write_buffer).await
+    }
+
+    /// Moves items between the hot store and the cold tier according to their last access.
+    ///
+    /// Items not accessed for `tier.cold_after_days` days that are at least `tier.cold_min_size`
+    /// bytes large move to the cold tier, and cold items accessed since move back. Every copy is
+    /// read back and verified by hash before the original is removed, and removed itself if it
+    /// does not match. `read_ranges` finds items in either tier, so tiering is transparent to
+    /// readers.
+    ///
+    /// Copies are made without holding the writer, so that imports and other writes go on
+    /// meanwhile. The writer is only taken to swap an item over to its copy.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Config` if no cold tier is configured.
+    /// - `ErrorKind::DB` if access statistics cannot be read.
+    /// - `ErrorKind::IO` if items cannot be copied or removed.
+    pub async fn tier(&self) -> Result<TierReport> {
+        let Some(cold_store) = &self.inner.cold_store else {
+            return Err(Error {
+                msg: String::from("The repo has no cold tier configured."),
+                kind: ErrorKind::Config,
+            });
+        };
+        // Buffered accesses count
+        self.flush().await?;
+        let cold_after = self
+            .inner
+            .config
+            .cold_after_days
+            .saturating_mul(SECONDS_PER_DAY);
+        let threshold =
+            utils::unix_time().saturating_sub(i64::try_from(cold_after).unwrap_or(i64::MAX));
+        let mut report = TierReport::default();
+
+        // Hot to cold
+        let cold_items = self
+            .inner
+            .readers
+            .get()
+            .await?
+            .get_items_accessed_before(threshold)
+            .await?;
+        for (hash, ext) in cold_items {
+            let Some(path) = self.find_object(&hash, &ext).await? else {
+                continue;
+            };
+            if fs::metadata(&path)?.len() < self.inner.config.cold_min_size {
+                continue;
+            }
+            // Copied and verified without the writer, which is only taken to remove the original
+            let mut file = tokio::fs::File::open(&path).await?;
+            let key = cold_store.put(&mut file, &ext).await?;
+            let cold_hash = backend::hash_object(cold_store.as_ref(), &key).await?;
+            if key.hash != hash || cold_hash != hash {
+                report.errors.push(format!(
+                    "Expected {hash}, but cold copy has hash {cold_hash}"
+                ));
+                // A corrupt copy is of no use, and neither is a copy of a corrupt original,
+                // unless it happens to be the object of another item
+                if cold_hash != key.hash || !self.has_item(&key.hash).await? {
+                    cold_store.delete(&key).await?;
+                }
+                continue;
+            }
+            let demoted = {
+                let mut writer = self.inner.writer.lock().await;
+                let _lease = writer.lease().await?;
+                // The item may have been deleted, or its object moved, meanwhile
+                let exists = writer.db.has_item(&hash).await?;
+                if let Some(path) = self.find_object(&hash, &ext).await?.filter(|_| exists) {
+                    fs::remove_file(path)?;
+                    writer.db.remove_store_object(&hash).await?;
+                    writer.relink_farm_objects(slice::from_ref(&hash)).await?;
+                }
+                exists
+            };
+            if !demoted {
+                cold_store.delete(&key).await?;
+                continue;
+            }
+            report.demoted += 1;
+        }
+
+        // Cold to hot
+        let hot_items = self
+            .inner
+            .readers
+            .get()
+            .await?
+            .get_items_accessed_since(threshold)
+            .await?;
+        for (hash, ext) in hot_items {
+            let key = ObjectKey { hash, ext };
+            if self.find_object(&key.hash, &key.ext).await?.is_some()
+                || !cold_store.exists(&key).await?
+            {
+                continue;
+            }
+            // The hash is known, so the copy goes straight to the volume it is placed on
+            let volume = self.inner.store.place(&key.hash)?;
+            let temp_path = self.inner.store.temp_path(volume)?;
+            let mut file = fs::File::create(&temp_path)?;
+            let copied_hash =
+                backend::copy_object(
+                    cold_store.as_ref(),
+                    &key,
+                    |chunk| Ok(file.write_all(chunk)?),
+                )
+                .await;
+            drop(file);
+            let copied_hash = match copied_hash {
+                Ok(copied_hash) if copied_hash == key.hash => copied_hash,
+                result => {
+                    fs::remove_file(&temp_path)?;
+                    let copied_hash = result?;
+                    report.errors.push(format!(
+                        "Expected {}, but cold copy has hash {copied_hash}",
+                        key.hash
+                    ));
+                    continue;
+                }
+            };
+            {
+                let mut writer = self.inner.writer.lock().await;
+                let _lease = writer.lease().await?;
+                if !writer.db.has_item(&key.hash).await? {
+                    fs::remove_file(&temp_path)?;
+                    continue;
+                }
+                let path =
+                    self.inner
+                        .store
+                        .insert_into(volume, &temp_path, &copied_hash, &key.ext)?;
+                let hot_hash = Repo::hash(&path)?;
+                if hot_hash != key.hash {
+                    fs::remove_file(&path)?;
+                    report.errors.push(format!(
+                        "Expected {}, but hot copy has hash {hot_hash}",
+                        key.hash
+                    ));
+                    continue;
+                }
+                writer
+                    .db
+                    .add_store_object(&ManifestEntry::read(&path, &key.hash, &key.ext)?)
+                    .await?;
+                writer
+                    .relink_farm_objects(slice::from_ref(&key.hash))
+                    .await?;
+            }
+            cold_store.delete(&key).await?;
+            report.promoted += 1;
         }
-        Ok(())
+
+        Ok(report)
     }
 
-    async fn import_file<T>(&mut self, file: T) -> Result<()>
-    where
-        T: AsRef<Path>,
-    {
-        let file = file.as_ref();
+    /// Whether an item with `hash` exists.
+    async fn has_item(&self, hash: &str) -> Result<bool> {
+        self.inner.readers.get().await?.has_item(hash).await
+    }
 
-        // Check file type
-        let mime_type = self
-            .magic_cookie
-            .file(file)
-            .expect("Libmagic ffi should not fail.");
-        let mime_result = SUPPORTED_MIMETYPES.get(mime_type.as_str());
-        if mime_result.is_none() {
-            return Err(Error {
-                msg: format!(
-                    "The file to import has an supported type: {}.",
-                    file.display()
-                ),
-                kind: ErrorKind::Unsupported,
-            });
+    /// Changes the layout of the file store to `layout`.
+    ///
+    /// The new layout is recorded in the repo configuration before any object is moved,
+    /// together with the layout being migrated away from. Lookups fall back to the previous
+    /// layout until the reshard finishes, so the repo stays usable throughout, also through
+    /// clones of this handle and by other processes, which pick up the new layout before their
+    /// next write, see `Store::reload_layouts`. Objects are moved shard by shard, `batch_size`
+    /// objects at a time, each batch under the writer lease. An interrupted reshard is resumed
+    /// by calling this again with the same layout.
+    ///
+    /// Returns the number of objects moved.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Config` if an unfinished reshard to a different layout exists.
+    /// - `ErrorKind::IO` if objects cannot be moved or the new layout cannot be recorded.
+    pub async fn reshard(&self, layout: StoreLayout, batch_size: usize) -> Result<u64> {
+        let store = &self.inner.store;
+        {
+            let mut writer = self.inner.writer.lock().await;
+            let _lease = writer.lease().await?;
+            // The configuration on disk may be newer than the one the repo was opened with
+            let mut config = Config::load(&self.inner.path)?;
+            if config.previous_store_layout.is_some() {
+                if config.store_layout != layout {
+                    return Err(Error {
+                        msg: format!(
+                            "An unfinished reshard to layout {} must be resumed first.",
+                            config.store_layout
+                        ),
+                        kind: ErrorKind::Config,
+                    });
+                }
+            } else {
+                if config.store_layout == layout {
+                    return Ok(0);
+                }
+                config.previous_store_layout =
+                    Some(std::mem::replace(&mut config.store_layout, layout));
+                config.store_generation += 1;
+                config.save(&self.inner.path)?;
+            }
+            store.reload_layouts()?;
         }
-        let default_extension = *mime_result.unwrap();
-
-        // Compute hash
-        let hash = Repo::hash(file).unwrap();
 
-        // Use the full file path as placeholder title.
-        let title = file.to_string_lossy().into_owned();
-
-        // Get extension
-        let ext = file.extension().map_or_else(
-            || String::from(default_extension),
-            |filename| filename.to_string_lossy().into_owned(),
-        );
+        let mut moved = 0;
+        for (volume, shard) in store.shards()? {
+            let objects: Vec<_> = store
+                .previous_layout_objects(volume, &shard)?
+                .into_iter()
+                .map(|(path, hash, ext)| (path, hash, ext, volume))
+                .collect();
+            moved += self.move_objects(&shard, &objects, batch_size).await?;
+        }
 
-        // Import into db
-        // This will propagate `ErrorKind::Duplicate` if a duplicate is imported.
-        self.db.import_file(&title, &ext, &hash).await?;
-
-        // Prepare to move into store
-        let store_subfolder = self.path.join("store").join(&hash[0..2]);
-        let store_path = store_subfolder.join(format!("{}.{}", &hash[2..], ext));
-
-        // Check/create store subfolder
-        fs::create_dir(&store_subfolder)?;
-
-        // Attempt rename first.
-        // If source and destination are on different file systems, fallback to copy and remove.
-        if let Err(error) = fs::rename(file, &store_path) {
-            // TODO: when io_error_more is stablized, use ErrorKind::CrossesDevices instead.
-            // This scenario cannot be easily tested. I just tried it and it seems to work.
-            // Avoid importing files from across device boundries is the most prudent choice.
-            if error.to_string().starts_with("Invalid cross-device link") {
-                fs::copy(file, &store_path)?;
-                fs::remove_file(file)?;
-            } else {
-                return Err(Error {
-                    msg: error.to_string(),
-                    kind: ErrorKind::IO,
-                });
-            }
+        // Close the dual lookup window
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        let mut config = Config::load(&self.inner.path)?;
+        if config.previous_store_layout.is_some() {
+            config.previous_store_layout = None;
+            config.store_generation += 1;
+            config.save(&self.inner.path)?;
         }
+        store.reload_layouts()?;
+        Ok(moved)
+    }
 
-        // TODO: Generate thumbnail
+    /// Moves objects onto the volume hash placement puts them on.
+    ///
+    /// This is needed after volumes are added, removed or reweighted. Objects are moved shard by
+    /// shard, `batch_size` objects at a time, each batch under the writer lease, so that it can
+    /// run in the background of other work. Lookups keep working throughout since they probe
+    /// every volume. With free space placement objects stay where they were written, so there
+    /// is nothing to rebalance.
+    ///
+    /// Returns the number of objects moved.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if objects cannot be moved.
+    pub async fn rebalance(&self, batch_size: usize) -> Result<u64> {
+        let store = &self.inner.store;
+        if store.placement() != Placement::Hash {
+            return Ok(0);
+        }
 
-        Ok(())
+        let mut moved = 0;
+        for (volume, shard) in store.shards()? {
+            let objects = store.misplaced_objects(volume, &shard)?;
+            moved += self.move_objects(&shard, &objects, batch_size).await?;
+        }
+        Ok(moved)
     }
 
-    /// Get files that satisfy the given filter.
+    /// Moves the objects of `shard`, given as path, hash, extension and target volume, to their
+    /// target volume in the current layout, `batch_size` at a time, and removes the folders left
+    /// empty in `shard`.
     ///
-    /// TODO: Add filtering.
+    /// Each batch holds the writer lease and records the new places in the store manifest in the
+    /// same transaction, releasing the lease in between so that other writers get a turn.
+    /// Objects that are gone by the time their batch runs, e.g. because another process moved
+    /// them, are skipped.
     ///
-    pub async fn get_files(&mut self) -> Result<Vec<Item>> {
-        self.db.get_items().await
+    /// Returns the number of objects moved.
+    async fn move_objects(
+        &self,
+        shard: &Path,
+        objects: &[(PathBuf, String, String, usize)],
+        batch_size: usize,
+    ) -> Result<u64> {
+        let store = &self.inner.store;
+        let mut moved = 0;
+        for batch in objects.chunks(batch_size.max(1)) {
+            let mut writer = self.inner.writer.lock().await;
+            let _lease = writer.lease().await?;
+            let mut moved_hashes = Vec::new();
+            writer.db.begin_batch().await?;
+            let result: Result<()> = async {
+                for (path, hash, ext, volume) in batch {
+                    if !path.is_file() {
+                        continue;
+                    }
+                    let store_path = store.insert_into(*volume, path, hash, ext)?;
+                    moved += 1;
+                    moved_hashes.push(hash.clone());
+                    writer
+                        .db
+                        .move_store_object(&ManifestEntry::read(&store_path, hash, ext)?)
+                        .await?;
+                }
+                Ok(())
+            }
+            .await;
+            // Objects moved before a failure must stay recorded where they are now
+            writer.db.commit_batch().await?;
+            // Symbolic links into the old places would break
+            let relinked = writer.relink_farm_objects(&moved_hashes).await;
+            result?;
+            relinked?;
+            drop(writer);
+            // Give other tasks a chance to use the repo between batches.
+            tokio::task::yield_now().await;
+        }
+
+        // Inserts create folders under the lease, so they must not be pruned without it
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        store::prune_empty_dirs(shard)?;
+        Ok(moved)
     }
 
     /**
@@ -307,33 +2854,137 @@ impl Repo {
      *
      * This can be really slow on large repos.
      * Do not run regularly and do not run on UI thread.
+     *
+     * The db is read from a single snapshot, so imports and other writes go on meanwhile.
+     * Differences caused by writes after the snapshot are checked again at the end and not
+     * reported.
      */
-    pub async fn check_data_integrity(&mut self) -> Result<String> {
+    pub async fn check_data_integrity(&self) -> Result<String> {
         let mut result = String::new();
 
-        let db_files = self.db.get_items().await?;
-
-        // Check store
-        let mut store_files = Vec::new();
+        // The db is read from a single snapshot, so the check runs alongside writers
+        let mut db = self.inner.readers.get().await?;
+        db.begin_snapshot().await?;
         let mut wrong_hash = Vec::new();
-        Repo::check_store_folder(&self.path.join("store"), &mut store_files, &mut wrong_hash)?;
+        let diffs = async {
+            // Check store
+            // Store objects are listed in hash order with bounded memory and hashed as the
+            // listing is diffed, so nothing proportional to the size of the store is held in
+            // memory
+            let sort_memory =
+                usize::try_from(self.inner.config.check_sort_memory).unwrap_or(usize::MAX);
+            let hot_files = self.inner.store.sorted_objects(sort_memory)?.map(|object| {
+                let object = object?;
+                let real_hash = Repo::hash(&object.path)?;
+                if object.hash != real_hash {
+                    wrong_hash.push(format!(
+                        "Expected {}, but real hash is {real_hash}",
+                        object.hash
+                    ));
+                }
+                Ok((object.hash, object.ext))
+            });
+
+            // Items in the cold tier count as present in the store
+            let mut cold_files = Vec::new();
+            if let Some(cold_store) = &self.inner.cold_store {
+                for key in cold_store.list("").await? {
+                    cold_files.push((key.hash, key.ext));
+                }
+            }
+            cold_files.sort();
+            let cold_files = cold_files.into_iter().map(Ok);
+            let store_files = utils::merge_sorted(hot_files, cold_files, |a, b| match (a, b) {
+                (Ok(a), Ok(b)) => a.cmp(b),
+                // Errors are passed on right away
+                (Err(_), _) => Ordering::Less,
+                (_, Err(_)) => Ordering::Greater,
+            });
+
+            // TODO: Check thumbnail
 
-        // TODO: Check thumbnail
+            utils::merge_diff_stream(
+                stream::iter(store_files),
+                db.stream_item_keys(),
+                |(store_hash, _), (db_hash, _)| store_hash.cmp(db_hash),
+                |(_, store_ext), (_, db_ext)| store_ext == db_ext,
+            )
+            .try_collect::<Vec<_>>()
+            .await
+        }
+        .await;
+        db.end_snapshot().await?;
+        drop(db);
 
         // Process result
-        store_files.sort();
-        let mut i = 0;
-        let mut j = 0;
-        while i < db_files.len() && j < store_files.len() {
-            let db_hash = &db_files[i].hash;
-            let db_ext = &db_files[i].ext;
-            let (store_hash, store_ext) = &store_files[j];
-            if db_hash == store_hash {
-                i += 1;
-                j += 1;
-
-                // Only check ext for full match
-                if db_ext != store_ext {
+        Repo::report_diffs(&mut result, self.settle_diffs(diffs?).await?);
+        for error in wrong_hash {
+            result.push_str(format!("hash: {error}\n").as_str());
+        }
+        // TODO: add thumbnail errors
+
+        Ok(result)
+    }
+
+    /// Drops the differences a check found between the store and its db snapshot that are due
+    /// to writes that went on while it ran: items deleted or stored by now, and objects whose
+    /// item was imported or that were removed by now. They are checked again holding the
+    /// writer lease, so that no import, delete or move is halfway done.
+    async fn settle_diffs(&self, diffs: Vec<StoreDiff>) -> Result<Vec<StoreDiff>> {
+        if diffs.iter().all(|diff| matches!(diff, Diff::Unequal(..))) {
+            return Ok(diffs);
+        }
+        let mut writer = self.inner.writer.lock().await;
+        let _lease = writer.lease().await?;
+        let mut settled = Vec::new();
+        for diff in diffs {
+            let error = match &diff {
+                Diff::Missing((hash, ext)) => {
+                    writer.db.has_item(hash).await? && !self.is_stored(hash, ext).await?
+                }
+                Diff::Unexpected((hash, ext)) => {
+                    !writer.db.has_item(hash).await? && self.is_stored(hash, ext).await?
+                }
+                Diff::Unequal(..) => true,
+            };
+            if error {
+                settled.push(diff);
+            }
+        }
+        Ok(settled)
+    }
+
+    /// Whether the object of an item is in either tier.
+    async fn is_stored(&self, hash: &str, ext: &str) -> Result<bool> {
+        if self.find_object(hash, ext).await?.is_some() {
+            return Ok(true);
+        }
+        match &self.inner.cold_store {
+            Some(cold_store) => {
+                let key = ObjectKey {
+                    hash: hash.to_owned(),
+                    ext: ext.to_owned(),
+                };
+                cold_store.exists(&key).await
+            }
+            None => Ok(false),
+        }
+    }
+
+    /// Appends the differences between the store and the db to the result of a check.
+    fn report_diffs(result: &mut String, diffs: Vec<StoreDiff>) {
+        for diff in diffs {
+            match diff {
+                Diff::Missing((db_hash, _)) => {
+                    result
+                        .push_str(format!("store: file not found in store: {db_hash}\n").as_str());
+                }
+                Diff::Unexpected((store_hash, _)) => {
+                    result.push_str(
+                        format!("store: redundant file in store: {store_hash}\n").as_str(),
+                    );
+                }
+                Diff::Unequal((_, store_ext), (_, db_ext)) => {
                     result.push_str(
                         format!(
                             "ext: different extensions: {db_ext} in db but {store_ext} in store\n",
@@ -341,82 +2992,209 @@ impl Repo {
                         .as_str(),
                     );
                 }
-
-                continue;
             }
-            if db_hash < store_hash {
-                i += 1;
-                result.push_str(format!("store: file not found in store: {db_hash}\n").as_str());
-                continue;
+        }
+    }
+
+    /// Quickly checks the integrity of the repository against the store manifest.
+    ///
+    /// Returns errors in the same format as `check_data_integrity`.
+    ///
+    /// The manifest records the hash, ext, size and mtime of every object in the hot store, and
+    /// the mtime of every store folder as of its last rescan. Adding, removing or renaming an
+    /// object changes the mtime of its folder, so only folders whose mtime changed are listed.
+    /// Objects in them are only hashed if their size or mtime differ from the manifest. Other
+    /// folders are only stat'ed, plus `check.spot_checks` random objects in them. The manifest
+    /// is then diffed against the db without touching the store.
+    ///
+    /// Changes that keep size, mtime and folder mtime, e.g. bit rot, are only found by spot
+    /// checks or `check_data_integrity`.
+    ///
+    /// Like `check_data_integrity`, this reads the db from snapshots while writes go on. The
+    /// writer is only waited for to record the rescanned folders.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if the manifest cannot be read or updated.
+    /// - `ErrorKind::IO` if the store cannot be read.
+    pub async fn check_manifest(&self) -> Result<String> {
+        let mut result = String::new();
+
+        // Changed folders are rescanned against a snapshot of the manifest, and only recording
+        // the rescan waits for the writer
+        let mut db = self.inner.readers.get().await?;
+        db.begin_snapshot().await?;
+        let rescan = self.rescan_store(&mut db).await;
+        db.end_snapshot().await?;
+        drop(db);
+        let (updates, removed_dirs, wrong_hash, wrong_hashes) = rescan?;
+        if !updates.is_empty() || !removed_dirs.is_empty() {
+            let mut writer = self.inner.writer.lock().await;
+            let _lease = writer.lease().await?;
+            for update in &updates {
+                writer
+                    .db
+                    .update_store_dir(&update.dir, update.mtime, &update.objects, &update.removed)
+                    .await?;
             }
-            // db_hash > store_hash
-            j += 1;
-            result.push_str(format!("store: redundant file in store: {store_hash}\n").as_str());
+            writer.db.remove_store_dirs(&removed_dirs).await?;
         }
-        while i < db_files.len() {
-            result.push_str(
-                format!("store: file not found in store: {}\n", &db_files[i].hash).as_str(),
-            );
-            i += 1;
+
+        // Diff the manifest against the db, again from a single snapshot
+        let mut db = self.inner.readers.get().await?;
+        db.begin_snapshot().await?;
+        let mut cold_files = HashMap::new();
+        let diffs = async {
+            // Items in the cold tier count as present in the store
+            if let Some(cold_store) = &self.inner.cold_store {
+                for key in cold_store.list("").await? {
+                    cold_files.insert(key.hash, key.ext);
+                }
+            }
+            let mut diffs = Vec::new();
+            let mut manifest_diffs = pin!(db.stream_manifest_diff());
+            while let Some((hash, item_ext, object_ext)) = manifest_diffs.try_next().await? {
+                let object_ext = match object_ext {
+                    Some(object_ext) => Some(object_ext),
+                    None => cold_files.remove(&hash),
+                };
+                match (item_ext, object_ext) {
+                    (Some(_), None) if wrong_hashes.contains(&hash) => (),
+                    (Some(item_ext), None) => diffs.push(Diff::Missing((hash, item_ext))),
+                    (None, Some(object_ext)) => diffs.push(Diff::Unexpected((hash, object_ext))),
+                    (Some(item_ext), Some(object_ext)) if item_ext != object_ext => {
+                        diffs.push(Diff::Unequal((hash.clone(), object_ext), (hash, item_ext)));
+                    }
+                    _ => (),
+                }
+            }
+            Ok(diffs)
         }
-        while j < store_files.len() {
-            result.push_str(
-                format!("store: redundant file in store: {}\n", &store_files[j].0).as_str(),
-            );
-            j += 1;
+        .await;
+        db.end_snapshot().await?;
+        drop(db);
+        Repo::report_diffs(&mut result, self.settle_diffs(diffs?).await?);
+
+        // Cold objects left over belong to no item, or to one that is in the hot store too
+        let mut redundant: Vec<String> = cold_files.into_keys().collect();
+        redundant.sort();
+        for hash in redundant {
+            result.push_str(format!("store: redundant file in store: {hash}\n").as_str());
         }
         for error in wrong_hash {
             result.push_str(format!("hash: {error}\n").as_str());
         }
-        // TODO: add thumbnail errors
 
         Ok(result)
     }
 
-    fn check_store_folder<T>(
-        dir_path: T,
-        found_files: &mut Vec<(String, String)>,
-        wrong_hash: &mut Vec<String>,
-    ) -> Result<()>
-    where
-        T: AsRef<Path>,
-    {
-        for entry in fs::read_dir(dir_path).expect("Error opening directory.") {
-            let entry = entry.expect("Error getting entry in directory.");
+    /// Rescans the store folders that changed since the manifest in `db` was last reconciled
+    /// with them, see `check_manifest`.
+    ///
+    /// Returns the updates of the changed folders, the folders that no longer exist, the
+    /// objects whose content does not match their hash, and the hashes of these objects.
+    async fn rescan_store(
+        &self,
+        db: &mut DB,
+    ) -> Result<(Vec<DirUpdate>, Vec<String>, Vec<String>, HashSet<String>)> {
+        // Find folders to rescan
+        let recorded = db.get_store_dirs().await?;
+        let mut scan = manifest::changed_dirs(self.inner.store.roots(), &recorded)?;
+        let mut changed: HashSet<String> = scan
+            .changed
+            .iter()
+            .map(|changed| manifest::path_key(&changed.dir))
+            .collect();
+        for entry in db
+            .sample_store_objects(self.inner.config.check_spot_checks)
+            .await?
+        {
+            if changed.contains(&entry.dir) || !scan.visited.contains(&entry.dir) {
+                continue;
+            }
             let path = entry.path();
-            if path.is_dir() {
-                Repo::check_store_folder(&path, found_files, wrong_hash)?;
-            } else {
-                let expected_hash = path
-                    .parent()
-                    .expect("Store item must have a parent")
-                    .file_name()
-                    .expect("Store item parent must have a filename.")
-                    .to_string_lossy()
-                    + path
-                        .file_stem()
-                        .expect("Store item must have a filestem.")
-                        .to_string_lossy();
-                let expected_hash = expected_hash.to_string();
-
-                // TODO: remove progress
-                println!("Checking {expected_hash}");
-
-                let real_hash = Repo::hash(&path)?;
-                if expected_hash != real_hash {
+            let unchanged = ManifestEntry::read(&path, &entry.hash, &entry.ext)
+                .is_ok_and(|current| entry.matches(&current));
+            if unchanged {
+                continue;
+            }
+            let dir = PathBuf::from(&entry.dir);
+            let Some(root) = self
+                .inner
+                .store
+                .roots()
+                .iter()
+                .find(|root| dir.starts_with(root))
+            else {
+                continue;
+            };
+            scan.changed.push(manifest::ChangedDir {
+                root: root.clone(),
+                dir: dir.clone(),
+                mtime: manifest::dir_mtime(&dir)?,
+            });
+            changed.insert(entry.dir);
+        }
+
+        // Rescan changed folders
+        let mut updates = Vec::new();
+        let mut wrong_hash = Vec::new();
+        let mut wrong_hashes = HashSet::new();
+        for changed_dir in &scan.changed {
+            let dir = manifest::path_key(&changed_dir.dir);
+            let mut expected: HashMap<String, ManifestEntry> = db
+                .get_dir_objects(&dir)
+                .await?
+                .into_iter()
+                .map(|entry| (entry.hash.clone(), entry))
+                .collect();
+            let mut objects = Vec::new();
+            let mut settled = manifest::is_settled(changed_dir.mtime);
+            for current in manifest::dir_objects(&changed_dir.root, &changed_dir.dir)? {
+                let known = match expected.remove(&current.hash) {
+                    Some(known) => Some(known),
+                    // Objects moved by a reshard or rebalance are found under their hash
+                    None => db.get_store_object(&current.hash).await?,
+                };
+                if let Some(known) = known.filter(|known| known.matches(&current)) {
+                    if known != current {
+                        objects.push(current);
+                    }
+                    continue;
+                }
+                let real_hash = Repo::hash(current.path())?;
+                if real_hash != current.hash {
                     wrong_hash.push(format!(
-                        "Expected {expected_hash}, but real hash is {real_hash}"
+                        "Expected {}, but real hash is {real_hash}",
+                        current.hash
                     ));
+                    // Keep the folder changed so that the object is hashed and reported again
+                    settled = false;
+                    wrong_hashes.insert(current.hash);
+                    continue;
                 }
-                let ext = path
-                    .extension()
-                    .expect("Store item must have an extension.")
-                    .to_string_lossy()
-                    .to_string();
-                found_files.push((expected_hash, ext));
+                objects.push(current);
+            }
+            let update = DirUpdate {
+                mtime: settled.then_some(changed_dir.mtime),
+                removed: expected.into_keys().collect(),
+                objects,
+                dir,
+            };
+            // Unsettled folders whose objects are recorded already have nothing to record
+            let unchanged = update.mtime.is_none()
+                && update.objects.is_empty()
+                && update.removed.is_empty()
+                && !recorded.contains_key(&update.dir);
+            if !unchanged {
+                updates.push(update);
             }
         }
-        Ok(())
+        let removed_dirs: Vec<String> = recorded
+            .into_keys()
+            .filter(|dir| !scan.visited.contains(dir))
+            .collect();
+        Ok((updates, removed_dirs, wrong_hash, wrong_hashes))
     }
 
     fn hash<T>(path: T) -> Result<String>
@@ -434,6 +3212,9 @@ impl Repo {
 #[cfg(test)]
 mod tests {
     use super::*;
+    use crate::test_utils::TempFolder;
+    use rstest::rstest;
+    use test_context::{test_context, AsyncTestContext};
 
     struct TestFixture<T>
     where
@@ -844,4 +3625,626 @@ mod tests {
     //             debug_fmt.starts_with("Repo { db: Placeholder debug implementation for vorgrs::db::DB")
     //         );
     //     }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_import_stream(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = Repo::new(ctx.path.join("repo")).await?;
+        let content = fs::read("resources/video/black.mp4")?;
+
+        // WHEN
+        let hash = repo
+            .import_stream(&mut content.as_slice(), "Recording", None)
+            .await?;
+
+        // THEN
+        assert_eq!(fs::read(repo.locate(&hash, "mp4").await?)?, content);
+        let files = repo.get_files().await?;
+        assert_eq!(files.len(), 1);
+        assert_eq!(files[0].hash, hash);
+        assert_eq!(files[0].title, "Recording");
+        assert_eq!(files[0].ext, "mp4");
+        assert_eq!(fs::read_dir(repo.inner.store.temp_dir(0)?)?.count(), 0);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_import_stream_free_space(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo_path = ctx.path.join("repo");
+        let repo = configured_repo(&repo_path, |config| {
+            fs::create_dir_all(repo_path.join("store2")).expect("Volume can be created.");
+            // Both volumes share a filesystem, so the weight decides which has more space
+            config.store_volumes.push(store::Volume {
+                path: PathBuf::from("store2"),
+                weight: 3,
+            });
+            config.store_placement = Placement::FreeSpace;
+        })
+        .await?;
+        let content = fs::read("resources/video/black.mp4")?;
+
+        // WHEN
+        let hash = repo
+            .import_stream(&mut content.as_slice(), "Recording", None)
+            .await?;
+
+        // THEN
+        // Received on the second volume and renamed into place there
+        let path = repo.locate(&hash, "mp4").await?;
+        assert_eq!(repo.inner.store.volume_of(&path), Some(1));
+        assert_eq!(fs::read_dir(repo.inner.store.temp_dir(1)?)?.count(), 0);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_import_stream_duplicate(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = Repo::new(ctx.path.join("repo")).await?;
+        let content = fs::read("resources/video/black.mp4")?;
+        let hash = repo
+            .import_stream(&mut content.as_slice(), "Recording", None)
+            .await?;
+
+        // WHEN
+        let result = repo
+            .import_stream(&mut content.as_slice(), "Recording again", Some("mkv"))
+            .await;
+
+        // THEN
+        assert_eq!(
+            result.map_err(|error| error.kind),
+            Err(ErrorKind::Duplicate)
+        );
+        let files = repo.get_files().await?;
+        assert_eq!(files.len(), 1);
+        assert_eq!(files[0].title, "Recording");
+        assert!(repo.locate(&hash, "mkv").await.is_err());
+        // The received copy is removed
+        assert_eq!(fs::read_dir(repo.inner.store.temp_dir(0)?)?.count(), 0);
+        Ok(())
+    }
+
+    /// Creates a repo at `path` with its config changed by `configure`.
+    async fn configured_repo(path: &Path, configure: impl FnOnce(&mut Config)) -> Result<Repo> {
+        Repo::new(path).await?;
+        let mut config = Config::load(path)?;
+        configure(&mut config);
+        config.save(path)?;
+        Repo::new(path).await
+    }
+
+    /// Copies the test video `name` into `dir`, since importing moves files.
+    fn copy_video(name: &str, dir: &Path) -> Result<PathBuf> {
+        fs::create_dir_all(dir)?;
+        let path = dir.join(name);
+        fs::copy(Path::new("resources/video").join(name), &path)?;
+        Ok(path)
+    }
+
+    #[rstest]
+    #[case("2/2", 1)]
+    #[case("3", 10)]
+    #[tokio::test]
+    async fn test_reshard(#[case] layout: &str, #[case] batch_size: usize) -> Result<()> {
+        let ctx = TempFolder::setup().await;
+        // GIVEN
+        let repo_path = ctx.path.join("repo");
+        let repo = Repo::new(&repo_path).await?;
+        let inbox = ctx.path.join("inbox");
+        copy_video("black.mp4", &inbox)?;
+        copy_video("gray.mp4", &inbox)?;
+        repo.import(&inbox).await?;
+        let layout: StoreLayout = layout.parse()?;
+
+        // WHEN
+        let moved = repo.reshard(layout.clone(), batch_size).await?;
+
+        // THEN
+        assert_eq!(moved, 2);
+        for file in repo.get_files().await? {
+            let path = repo.locate(&file.hash, &file.ext).await?;
+            assert!(path.ends_with(layout.relative_path(&file.hash, &file.ext)));
+            assert_eq!(Repo::hash(&path)?, file.hash);
+            // Moves are recorded in the manifest
+            let entry = repo
+                .inner
+                .readers
+                .get()
+                .await?
+                .get_store_object(&file.hash)
+                .await?;
+            assert_eq!(entry.map(|entry| entry.path()), Some(path));
+        }
+        let config = Config::load(&repo_path)?;
+        assert_eq!(config.store_layout, layout);
+        assert_eq!(config.previous_store_layout, None);
+
+        drop(repo);
+        ctx.teardown().await;
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_reshard_shared(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo_path = ctx.path.join("repo");
+        let repo = Repo::new(&repo_path).await?;
+        let clone = repo.clone();
+        // Stands in for another process, which loaded the layout before the reshard
+        let other = Repo::new(&repo_path).await?;
+        repo.import(copy_video("black.mp4", &ctx.path.join("inbox"))?)
+            .await?;
+        let layout: StoreLayout = "2/2".parse()?;
+
+        // WHEN
+        let moved = clone.reshard(layout.clone(), 10).await?;
+        other
+            .import(copy_video("gray.mp4", &ctx.path.join("other_inbox"))?)
+            .await?;
+
+        // THEN
+        assert_eq!(moved, 1);
+        let files = repo.get_files().await?;
+        assert_eq!(files.len(), 2);
+        for file in files {
+            let path = other.locate(&file.hash, &file.ext).await?;
+            assert!(path.ends_with(layout.relative_path(&file.hash, &file.ext)));
+            assert_eq!(repo.locate(&file.hash, &file.ext).await?, path);
+        }
+        assert_eq!(repo.reshard(layout, 10).await?, 0);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_view_farm_follows_writes(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = Repo::new(&ctx.path.join("repo")).await?;
+        let farm_dir = ctx.path.join("farm");
+        repo.add_view_farm(&farm_dir, &Query::default(), LinkKind::Symbolic)
+            .await?;
+        let farm_targets = || -> Result<Vec<PathBuf>> {
+            let mut targets = Vec::new();
+            for entry in fs::read_dir(&farm_dir)? {
+                targets.push(fs::read_link(entry?.path())?);
+            }
+            Ok(targets)
+        };
+
+        // WHEN
+        repo.import(copy_video("black.mp4", &ctx.path.join("inbox"))?)
+            .await?;
+        let file = repo.get_files().await?.remove(0);
+        let imported = repo.locate(&file.hash, &file.ext).await?;
+        repo.reshard("2/2".parse()?, 10).await?;
+        let resharded = repo.locate(&file.hash, &file.ext).await?;
+
+        // THEN
+        // Linked by the import and relinked by the reshard, without a refresh in between
+        assert_ne!(resharded, imported);
+        assert_eq!(farm_targets()?, vec![fs::canonicalize(&resharded)?]);
+        repo.delete_item(&file.hash, &file.ext).await?;
+        assert!(farm_targets()?.is_empty());
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_tier(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = configured_repo(&ctx.path.join("repo"), |config| {
+            config.cold_store = Some(PathBuf::from("cold"));
+            config.cold_after_days = 1;
+        })
+        .await?;
+        let content = fs::read("resources/video/black.mp4")?;
+        repo.import(copy_video("black.mp4", &ctx.path.join("inbox"))?)
+            .await?;
+        let hash = repo.get_files().await?[0].hash.clone();
+        backdate_accesses(&repo).await?;
+
+        // WHEN
+        // Not accessed since long ago, so it moves to the cold tier
+        let demoted = repo.tier().await?;
+        let in_hot_store = repo.locate(&hash, "mp4").await.is_ok();
+        let cold_read = repo.read_ranges(&hash, "mp4", &[0..16]).await?;
+        // The read is an access, so it moves back
+        repo.flush().await?;
+        let promoted = repo.tier().await?;
+
+        // THEN
+        assert_eq!((demoted.demoted, demoted.promoted), (1, 0));
+        assert!(demoted.errors.is_empty());
+        assert!(!in_hot_store);
+        assert_eq!(cold_read, vec![content[..16].to_vec()]);
+        assert_eq!((promoted.demoted, promoted.promoted), (0, 1));
+        assert!(promoted.errors.is_empty());
+        assert_eq!(fs::read(repo.locate(&hash, "mp4").await?)?, content);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_tier_corrupt_original(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = configured_repo(&ctx.path.join("repo"), |config| {
+            config.cold_store = Some(PathBuf::from("cold"));
+            config.cold_after_days = 1;
+        })
+        .await?;
+        repo.import(copy_video("black.mp4", &ctx.path.join("inbox"))?)
+            .await?;
+        let hash = repo.get_files().await?[0].hash.clone();
+        backdate_accesses(&repo).await?;
+        let path = repo.locate(&hash, "mp4").await?;
+        fs::OpenOptions::new()
+            .append(true)
+            .open(&path)?
+            .write_all(b"bit rot")?;
+
+        // WHEN
+        let report = repo.tier().await?;
+
+        // THEN
+        assert_eq!((report.demoted, report.promoted), (0, 0));
+        assert_eq!(report.errors.len(), 1);
+        assert!(path.is_file());
+        // The copy of the corrupt original is not kept
+        let cold_store = repo.inner.cold_store.as_ref().unwrap();
+        assert!(cold_store.list("").await?.is_empty());
+        Ok(())
+    }
+
+    /// Moves the last access of every item of `repo` a year back.
+    async fn backdate_accesses(repo: &Repo) -> Result<()> {
+        use sqlx::Connection;
+
+        let db_path = repo.inner.path.join("vorg.db");
+        let mut connection = sqlx::SqliteConnection::connect(&db_path.to_string_lossy()).await?;
+        sqlx::query("UPDATE item_access SET last_access = last_access - 365 * 24 * 60 * 60")
+            .execute(&mut connection)
+            .await?;
+        connection.close().await?;
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_fill_manifest(ctx: &TempFolder) -> Result<()> {
+        use sqlx::Connection;
+
+        // GIVEN
+        let repo_path = ctx.path.join("repo");
+        let repo = Repo::new(&repo_path).await?;
+        let video = copy_video("black.mp4", &ctx.path.join("inbox"))?;
+        let size = fs::metadata(&video)?.len();
+        repo.import(video).await?;
+        drop(repo);
+        // As left by migrating a V2 db, which predates the manifest
+        let db_path = repo_path.join("vorg.db");
+        let mut connection = sqlx::SqliteConnection::connect(&db_path.to_string_lossy()).await?;
+        sqlx::query("DELETE FROM store_manifest; DELETE FROM store_dirs")
+            .execute(&mut connection)
+            .await?;
+        connection.close().await?;
+
+        // WHEN
+        let repo = Repo::new(&repo_path).await?;
+
+        // THEN
+        assert_eq!(repo.get_stats().await?.store_bytes, size);
+        assert_eq!(repo.check_manifest().await?, "");
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_query_files_cache(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo_path = ctx.path.join("repo");
+        let repo = Repo::new(&repo_path).await?;
+        repo.import(copy_video("black.mp4", &ctx.path.join("inbox"))?)
+            .await?;
+        let collection_id = repo.get_files().await?[0].collection_id;
+        // Another handle to the repo, as another process would have
+        let other = Repo::new(&repo_path).await?;
+        let query = Query {
+            tags: vec![String::from("tag:Clip")],
+            title: None,
+        };
+        let page = Page {
+            after: None,
+            limit: 10,
+        };
+        let before = repo.query_files(&query, &page).await?;
+        // Recorded accesses of another handle keep cached results
+        let all = Page {
+            limit: 100,
+            ..page.clone()
+        };
+        repo.query_files(&Query::default(), &all).await?;
+        let hash = repo.get_files().await?[0].hash.clone();
+        other.read_ranges(&hash, "mp4", &[0..16]).await?;
+        other.flush().await?;
+        repo.query_files(&query, &page).await?;
+        let cached = repo.inner.query_cache.lock().unwrap().len();
+
+        // WHEN
+        repo.add_tag(collection_id, "tag:Clip").await?;
+        let after_own_change = repo.query_files(&query, &page).await?;
+        repo.flush().await?;
+        other.remove_tag(collection_id, "tag:Clip").await?;
+        other.flush().await?;
+        let after_other_change = repo.query_files(&query, &page).await?;
+
+        // THEN
+        assert!(before.is_empty());
+        assert_eq!(cached, 2);
+        assert_eq!(after_own_change.len(), 1);
+        assert_eq!(after_own_change[0].collection_id, collection_id);
+        assert!(after_other_change.is_empty());
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_plan_import(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = Repo::new(&ctx.path.join("repo")).await?;
+        repo.import(copy_video("black.mp4", &ctx.path.join("imported"))?)
+            .await?;
+        let inbox = ctx.path.join("inbox");
+        copy_video("black.mp4", &inbox)?;
+        copy_video("gray.mp4", &inbox)?;
+        fs::write(inbox.join("notes.txt"), "not a video")?;
+
+        // WHEN
+        let plan = repo.plan_import(&inbox).await?;
+
+        // THEN
+        assert_eq!(plan.supported_files, 2);
+        assert_eq!(plan.unsupported_files, 1);
+        assert_eq!(plan.duplicate_files, 1);
+        assert_eq!(plan.unchecked_files, 0);
+        assert!(plan.hash_throughput.bytes > 0);
+        // Nothing was written to the store or removed from the folder
+        assert_eq!(repo.get_files().await?.len(), 1);
+        assert_eq!(fs::read_dir(repo.inner.store.temp_dir(0)?)?.count(), 0);
+        assert_eq!(fs::read_dir(&inbox)?.count(), 3);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_reads_see_buffered_writes(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = configured_repo(&ctx.path.join("repo"), |config| {
+            config.write_buffer_max_delay_ms = 60_000;
+        })
+        .await?;
+        repo.import(copy_video("black.mp4", &ctx.path.join("inbox"))?)
+            .await?;
+        let collection_id = repo.get_files().await?[0].collection_id;
+        let query = Query {
+            tags: vec![String::from("tag:Clip")],
+            title: Some(String::from("night")),
+        };
+        let page = Page {
+            after: None,
+            limit: 10,
+        };
+        let before = repo.query_files(&query, &page).await?;
+
+        // WHEN
+        repo.set_title(collection_id, "Night drive").await?;
+        repo.add_tag(collection_id, "tag:Clip").await?;
+        let files = repo.query_files(&query, &page).await?;
+        let tag_view = repo.get_tag_view("tag:Clip", 10).await?;
+        let search_view = repo.get_search_view("drive", 10).await?;
+        let stats = repo.get_stats().await?;
+        let tags = repo.get_tags().await?;
+        let file_set = repo.get_file_set().await?;
+
+        // THEN
+        assert!(before.is_empty());
+        assert_eq!(files.len(), 1);
+        assert_eq!(files[0].title, "Night drive");
+        assert_eq!(tag_view.len(), 1);
+        assert_eq!(search_view, tag_view);
+        assert_eq!(stats.collections_per_tag.get("tag:Clip"), Some(&1));
+        assert!(tags.contains(&String::from("tag:Clip")));
+        let item = file_set.get(0).expect("Item should exist.");
+        assert_eq!(item.title(), "Night drive");
+        assert!(item.tags().any(|tag| tag == "tag:Clip"));
+        // Nothing was flushed to serve the reads
+        assert!(repo.has_pending_metadata());
+        Ok(())
+    }
+
+    #[cfg(target_os = "linux")]
+    async fn wait_for_files(repo: &Repo, count: usize) -> Result<()> {
+        while repo.get_files().await?.len() < count {
+            tokio::time::sleep(Duration::from_millis(50)).await;
+        }
+        Ok(())
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_watch(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = configured_repo(&ctx.path.join("repo"), |config| {
+            config.watch_settle_ms = 100;
+        })
+        .await?;
+        let inbox = ctx.path.join("inbox");
+        copy_video("black.mp4", &inbox)?;
+
+        // WHEN
+        // The first file is found by the initial scan, the second one by inotify
+        let watched = tokio::time::timeout(Duration::from_secs(10), async {
+            tokio::select! {
+                result = repo.watch(&inbox) => result,
+                result = async {
+                    wait_for_files(&repo, 1).await?;
+                    copy_video("gray.mp4", &inbox)?;
+                    wait_for_files(&repo, 2).await
+                } => result,
+            }
+        })
+        .await;
+
+        // THEN
+        watched.expect("Files landing in the watched folder should be imported.")?;
+        let files = repo.get_files().await?;
+        assert_eq!(files.len(), 2);
+        for file in &files {
+            assert!(repo.locate(&file.hash, &file.ext).await.is_ok());
+        }
+        assert_eq!(fs::read_dir(&inbox)?.count(), 0);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_import_archive(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = Repo::new(ctx.path.join("repo")).await?;
+        let content = fs::read("resources/video/black.mp4")?;
+        let archive = ctx.path.join("videos.tar");
+        let mut builder = tar::Builder::new(fs::File::create(&archive)?);
+        builder.append_path_with_name("resources/video/black.mp4", "clips/black.mp4")?;
+        builder.append_path_with_name("resources/video/fake-video.txt", "clips/fake-video.txt")?;
+        builder.finish()?;
+        drop(builder);
+
+        // WHEN
+        repo.import_archive(&archive).await?;
+
+        // THEN
+        let files = repo.get_files().await?;
+        assert_eq!(files.len(), 1);
+        assert_eq!(
+            files[0].title,
+            format!("{}/clips/black.mp4", archive.display())
+        );
+        assert_eq!(
+            fs::read(repo.locate(&files[0].hash, "mp4").await?)?,
+            content
+        );
+        // The archive is left untouched and nothing is left behind
+        assert!(archive.is_file());
+        assert_eq!(fs::read_dir(repo.inner.store.temp_dir(0)?)?.count(), 0);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_import_session(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = Repo::new(ctx.path.join("repo")).await?;
+        let inbox = ctx.path.join("inbox");
+        copy_video("black.mp4", &inbox)?;
+        copy_video("fake-video.txt", &inbox)?;
+        copy_video("gray.mp4", &inbox.join("nested"))?;
+
+        // WHEN
+        let session = repo.import_session(&inbox).await?;
+
+        // THEN
+        assert_eq!(
+            (session.imported, session.skipped, session.resumed),
+            (2, 1, false)
+        );
+        assert_eq!(repo.get_import_session(&inbox).await?, None);
+        assert_eq!(repo.get_files().await?.len(), 2);
+        // Only the unsupported file is left in place
+        assert!(!inbox.join("black.mp4").exists());
+        assert!(!inbox.join("nested/gray.mp4").exists());
+        assert!(inbox.join("fake-video.txt").is_file());
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_checks_while_writing(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo_path = ctx.path.join("repo");
+        let repo = Repo::new(&repo_path).await?;
+        repo.import(copy_video("black.mp4", &ctx.path.join("inbox"))?)
+            .await?;
+        // Another process is writing to the repo
+        let writing =
+            FileLock::acquire(&repo_path.join(lock::WRITE_LOCK), LockMode::Exclusive).await?;
+
+        // WHEN
+        let checks = tokio::time::timeout(Duration::from_secs(5), async {
+            Ok::<_, Error>((
+                repo.check_data_integrity().await?,
+                repo.check_manifest().await?,
+            ))
+        });
+        let (full, quick) = checks.await.expect("Checks waited for the writer.")?;
+
+        // THEN
+        assert_eq!(full, "");
+        assert_eq!(quick, "");
+        drop(writing);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn test_cloned_handles(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let repo = Repo::new(ctx.path.join("repo")).await?;
+        let inbox = ctx.path.join("inbox");
+        for name in ["black.mp4", "gray.mp4", "white.mp4"] {
+            copy_video(name, &inbox)?;
+        }
+        repo.import(&inbox).await?;
+        let files = repo.get_files().await?;
+
+        // WHEN
+        let reads = futures::future::try_join_all(files.iter().map(|file| {
+            let repo = repo.clone();
+            async move {
+                repo.set_title(file.collection_id, &format!("Clip {}", file.hash))
+                    .await?;
+                repo.add_tag(file.collection_id, "tag:Clip").await?;
+                let read = repo.read_ranges(&file.hash, &file.ext, &[0..16]).await?;
+                repo.flush().await?;
+                Ok::<_, Error>(read)
+            }
+        }))
+        .await?;
+
+        // THEN
+        for (file, read) in files.iter().zip(reads) {
+            let content = fs::read(repo.locate(&file.hash, &file.ext).await?)?;
+            assert_eq!(read, vec![content[..16].to_vec()]);
+        }
+        let updated = repo.get_files().await?;
+        assert_eq!(updated.len(), 3);
+        for file in &updated {
+            assert_eq!(file.title, format!("Clip {}", file.hash));
+            assert!(file.tags.contains(&String::from("tag:Clip")));
+        }
+        let query = Query {
+            tags: vec![String::from("tag:Clip")],
+            title: None,
+        };
+        let page = Page {
+            after: None,
+            limit: 10,
+        };
+        assert_eq!(repo.query_files(&query, &page).await?.len(), 3);
+        Ok(())
+    }
 }
@@ -0,0 +1,212 @@
+use crate::error::Result;
+use std::{
+    fs::{self, File},
+    path::{Path, PathBuf},
+    sync::{Arc, Weak},
+};
+
+/// Lock file every open repo holds shared, and a repo being created holds exclusive.
+pub const OPEN_LOCK: &str = "open.lock";
+
+/// Lock file of the writer lease, see `WriterLease`.
+pub const WRITE_LOCK: &str = "write.lock";
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum LockMode {
+    Shared,
+    Exclusive,
+}
+
+/// Advisory lock on a file, released when dropped or when the process exits.
+///
+/// Locks belong to the open file, not to the process, so two repos opened by the same process
+/// exclude each other like two processes do. Locking is a no-op on platforms without `flock`.
+#[derive(Debug)]
+pub struct FileLock {
+    file: File,
+    mode: LockMode,
+}
+
+impl FileLock {
+    /// Locks the file at `path` in `mode`, creating it if needed. Waits for conflicting locks of
+    /// other open files to be released.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the file cannot be created or locked.
+    pub async fn acquire(path: &Path, mode: LockMode) -> Result<Self> {
+        let file = open_lock_file(path)?;
+        let file = tokio::task::spawn_blocking(move || lock(&file, mode, true).map(|_| file))
+            .await
+            .expect("Lock task panicked.")?;
+        Ok(FileLock { file, mode })
+    }
+
+    /// Like `acquire`, but returns `None` instead of waiting if a conflicting lock is held.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the file cannot be created or locked.
+    pub fn try_acquire(path: &Path, mode: LockMode) -> Result<Option<Self>> {
+        let file = open_lock_file(path)?;
+        Ok(lock(&file, mode, false)?.then_some(FileLock { file, mode }))
+    }
+
+    /// Changes the mode of the lock, waiting for conflicting locks to be released. The lock is
+    /// released while it waits, so others may get in between.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the file cannot be locked. It is then left unlocked.
+    pub async fn set_mode(&mut self, mode: LockMode) -> Result<()> {
+        if self.mode == mode {
+            return Ok(());
+        }
+        let file = self.file.try_clone()?;
+        tokio::task::spawn_blocking(move || lock(&file, mode, true))
+            .await
+            .expect("Lock task panicked.")?;
+        self.mode = mode;
+        Ok(())
+    }
+}
+
+/// Exclusive lock of `write.lock`, held by one repo at a time while it changes the store.
+///
+/// Leases are shared by all nested operations of a repo: the file is locked by the first one and
+/// unlocked once the last of them is dropped.
+pub type WriterLease = Arc<FileLock>;
+
+/// Hands out the writer lease of a repo.
+#[derive(Debug)]
+pub struct Writer {
+    path: PathBuf,
+    lease: Weak<FileLock>,
+}
+
+impl Writer {
+    pub fn new(repo_path: &Path) -> Self {
+        Writer {
+            path: repo_path.join(WRITE_LOCK),
+            lease: Weak::new(),
+        }
+    }
+
+    /// The lease this repo holds already, or a new one once no other repo holds it.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the lock file cannot be created or locked.
+    pub async fn lease(&mut self) -> Result<WriterLease> {
+        if let Some(lease) = self.try_lease()? {
+            return Ok(lease);
+        }
+        let lease = Arc::new(FileLock::acquire(&self.path, LockMode::Exclusive).await?);
+        self.lease = Arc::downgrade(&lease);
+        Ok(lease)
+    }
+
+    /// Like `lease`, but returns `None` instead of waiting if another repo holds the lease, so
+    /// that callers can tell the user before they wait.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the lock file cannot be created or locked.
+    pub fn try_lease(&mut self) -> Result<Option<WriterLease>> {
+        if let Some(lease) = self.lease.upgrade() {
+            return Ok(Some(lease));
+        }
+        let Some(lock) = FileLock::try_acquire(&self.path, LockMode::Exclusive)? else {
+            return Ok(None);
+        };
+        let lease = Arc::new(lock);
+        self.lease = Arc::downgrade(&lease);
+        Ok(Some(lease))
+    }
+}
+
+fn open_lock_file(path: &Path) -> Result<File> {
+    Ok(fs::OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create(true)
+        .truncate(false)
+        .open(path)?)
+}
+
+/// Locks `file` in `mode`. Returns whether it was locked, which is only false if `wait` is false
+/// and a conflicting lock is held.
+#[cfg(unix)]
+fn lock(file: &File, mode: LockMode, wait: bool) -> std::io::Result<bool> {
+    use std::os::fd::AsRawFd;
+
+    let mut operation = match mode {
+        LockMode::Shared => libc::LOCK_SH,
+        LockMode::Exclusive => libc::LOCK_EX,
+    };
+    if !wait {
+        operation |= libc::LOCK_NB;
+    }
+    loop {
+        // SAFETY: the fd is valid for as long as `file` is borrowed.
+        if unsafe { libc::flock(file.as_raw_fd(), operation) } == 0 {
+            return Ok(true);
+        }
+        let error = std::io::Error::last_os_error();
+        match error.kind() {
+            std::io::ErrorKind::Interrupted => continue,
+            std::io::ErrorKind::WouldBlock => return Ok(false),
+            _ => return Err(error),
+        }
+    }
+}
+
+#[cfg(not(unix))]
+fn lock(_file: &File, _mode: LockMode, _wait: bool) -> std::io::Result<bool> {
+    Ok(true)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_utils::TempFolder;
+    use test_context::test_context;
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn share_and_exclude(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let path = ctx.path.join(OPEN_LOCK);
+        let shared = FileLock::acquire(&path, LockMode::Shared).await?;
+
+        // WHEN
+        let other_shared = FileLock::try_acquire(&path, LockMode::Shared)?;
+        let exclusive = FileLock::try_acquire(&path, LockMode::Exclusive)?;
+
+        // THEN
+        assert!(other_shared.is_some());
+        assert!(exclusive.is_none());
+        drop(shared);
+        drop(other_shared);
+        let mut exclusive = FileLock::try_acquire(&path, LockMode::Exclusive)?.unwrap();
+        assert!(FileLock::try_acquire(&path, LockMode::Shared)?.is_none());
+        exclusive.set_mode(LockMode::Shared).await?;
+        assert!(FileLock::try_acquire(&path, LockMode::Shared)?.is_some());
+
+        // Nested leases share the lock, which is released with the last of them
+        let mut writer = Writer::new(&ctx.path);
+        let lease = writer.lease().await?;
+        let nested = writer.lease().await?;
+        assert!(Arc::ptr_eq(&lease, &nested));
+        let write_path = ctx.path.join(WRITE_LOCK);
+        drop(lease);
+        assert!(FileLock::try_acquire(&write_path, LockMode::Exclusive)?.is_none());
+        drop(nested);
+        let other = FileLock::try_acquire(&write_path, LockMode::Exclusive)?;
+        assert!(other.is_some());
+        assert!(writer.try_lease()?.is_none());
+        drop(other);
+        assert!(writer.try_lease()?.is_some());
+        Ok(())
+    }
+}
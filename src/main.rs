@@ -1,5 +1,12 @@
-use std::{env, path::Path};
-use vorgrs::{Error, ErrorKind, Repo, Result};
+use std::{env, io, path::Path};
+use vorgrs::{Error, ErrorKind, LinkKind, Query, Repo, Result, StoreLayout};
+
+/// Number of objects moved per writer lease when resharding or rebalancing.
+const MOVE_BATCH_SIZE: usize = 1000;
+/// Number of collections read at once when listing the files of a saved search.
+const SEARCH_PAGE_SIZE: usize = 100;
+/// Number of similar collections listed unless `--limit` is given.
+const SIMILAR_LIMIT: usize = 10;
 
 #[tokio::main]
 async fn main() -> Result<()> {
@@ -8,7 +15,25 @@ async fn main() -> Result<()> {
         msg: String::from(
             "Usage:
     vorgrs import [vorg repo path] [file or folder to import]
-    vorgrs check [vorg repo path]",
+    vorgrs import [vorg repo path] - [--title title] [--ext extension]
+    vorgrs import [vorg repo path] [file or folder to import] --dry-run
+    vorgrs import-archive [vorg repo path] [zip or tar archive, or - for a tar on stdin]
+    vorgrs check [vorg repo path] [--full]
+    vorgrs reshard [vorg repo path] [store layout, e.g. 2/2]
+    vorgrs rebalance [vorg repo path]
+    vorgrs tier [vorg repo path]
+    vorgrs watch [vorg repo path] [folder to import from]
+    vorgrs mount [vorg repo path] [mountpoint]
+    vorgrs farm add [vorg repo path] [folder] [--tag tag]... [--title words] [--symlink]
+    vorgrs farm remove [vorg repo path] [folder]
+    vorgrs farm sync [vorg repo path]
+    vorgrs search save [vorg repo path] [name] [--tag tag]... [--title words]
+    vorgrs search remove [vorg repo path] [name]
+    vorgrs search list [vorg repo path]
+    vorgrs search show [vorg repo path] [name]
+    vorgrs similar [vorg repo path] [collection id] [--limit count]
+    vorgrs sample [vorg repo path] [count] [--tag tag]... [--title words]
+    vorgrs stats [vorg repo path] [--recount]",
         ),
         kind: ErrorKind::WrongArguments,
     };
@@ -23,25 +48,254 @@ async fn main() -> Result<()> {
             return Err(wrong_arg_error);
         }
 
-        let mut repo = Repo::new(Path::new(&args[2])).await.unwrap();
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
 
-        let path = Path::new(&args[3]);
-        repo.import(path).await.unwrap();
+        if args[3] == "-" {
+            // Content streamed on stdin has no file name to take a title or ext from
+            let title = flag_value(&args[4..], "--title").unwrap_or("stdin");
+            let ext = flag_value(&args[4..], "--ext");
+            let hash = repo
+                .import_stream(&mut tokio::io::stdin(), title, ext)
+                .await?;
+            println!("{hash}");
+        } else if args.get(4).is_some_and(|arg| arg == "--dry-run") {
+            let plan = repo.plan_import(Path::new(&args[3])).await?;
+            print!("{plan}");
+        } else if Path::new(&args[3]).is_dir() {
+            let dir = Path::new(&args[3]);
+            if let Some(session) = repo.get_import_session(dir).await? {
+                println!(
+                    "Resuming import: {} files imported, {} skipped so far",
+                    session.imported, session.skipped
+                );
+            }
+            let session = repo.import_session(dir).await?;
+            println!(
+                "Import done: {} files imported, {} skipped",
+                session.imported, session.skipped
+            );
+        } else {
+            let path = Path::new(&args[3]);
+            repo.import(path).await.unwrap();
+        }
+    } else if args[1] == "import-archive" {
+        if args.len() < 4 {
+            return Err(wrong_arg_error);
+        }
+
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
+
+        if args[3] == "-" {
+            repo.import_tar(io::stdin(), "stdin").await?;
+        } else {
+            repo.import_archive(Path::new(&args[3])).await?;
+        }
     } else if args[1] == "check" {
         if args.len() < 3 {
             return Err(wrong_arg_error);
         }
 
-        let mut repo = Repo::new(Path::new(&args[2])).await.unwrap();
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
 
-        let result = repo
-            .check_data_integrity()
-            .await
-            .expect("Error checking vorg repo.");
+        // The quick check trusts the store manifest, --full reads and hashes every object
+        let result = if args.get(3).is_some_and(|arg| arg == "--full") {
+            repo.check_data_integrity().await
+        } else {
+            repo.check_manifest().await
+        }
+        .expect("Error checking vorg repo.");
         eprint!("{result}");
+    } else if args[1] == "reshard" {
+        if args.len() < 4 {
+            return Err(wrong_arg_error);
+        }
+
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
+
+        let layout: StoreLayout = args[3].parse()?;
+        let moved = repo.reshard(layout, MOVE_BATCH_SIZE).await?;
+        eprintln!("Moved {moved} objects.");
+    } else if args[1] == "rebalance" {
+        if args.len() < 3 {
+            return Err(wrong_arg_error);
+        }
+
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
+
+        let moved = repo.rebalance(MOVE_BATCH_SIZE).await?;
+        eprintln!("Moved {moved} objects.");
+    } else if args[1] == "tier" {
+        if args.len() < 3 {
+            return Err(wrong_arg_error);
+        }
+
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
+
+        let report = repo.tier().await?;
+        for error in &report.errors {
+            eprintln!("{error}");
+        }
+        eprintln!(
+            "Moved {} items to the cold tier and {} items back.",
+            report.demoted, report.promoted
+        );
+    } else if args[1] == "watch" {
+        if args.len() < 4 {
+            return Err(wrong_arg_error);
+        }
+
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
+
+        // Only returns on errors
+        repo.watch(Path::new(&args[3])).await?;
+    } else if args[1] == "farm" {
+        if args.len() < 4 {
+            return Err(wrong_arg_error);
+        }
+
+        let repo = Repo::new(Path::new(&args[3])).await.unwrap();
+
+        match args[2].as_str() {
+            "add" if args.len() >= 5 => {
+                let query = Query {
+                    tags: flag_values(&args[5..], "--tag")
+                        .map(str::to_owned)
+                        .collect(),
+                    title: flag_value(&args[5..], "--title").map(str::to_owned),
+                };
+                let link = if args[5..].iter().any(|arg| arg == "--symlink") {
+                    LinkKind::Symbolic
+                } else {
+                    LinkKind::Hard
+                };
+                repo.add_view_farm(Path::new(&args[4]), &query, link)
+                    .await?;
+            }
+            "remove" if args.len() >= 5 => repo.remove_view_farm(Path::new(&args[4])).await?,
+            "sync" => repo.sync_view_farms().await?,
+            _ => return Err(wrong_arg_error),
+        }
+    } else if args[1] == "search" {
+        if args.len() < 4 {
+            return Err(wrong_arg_error);
+        }
+
+        let repo = Repo::new(Path::new(&args[3])).await.unwrap();
+
+        match args[2].as_str() {
+            "save" if args.len() >= 5 => {
+                let query = Query {
+                    tags: flag_values(&args[5..], "--tag")
+                        .map(str::to_owned)
+                        .collect(),
+                    title: flag_value(&args[5..], "--title").map(str::to_owned),
+                };
+                let search = repo.save_search(&args[4], &query).await?;
+                eprintln!("Saved {} with {} collections.", search.name, search.count);
+            }
+            "remove" if args.len() >= 5 => repo.remove_saved_search(&args[4]).await?,
+            "list" => {
+                for search in repo.get_saved_searches().await? {
+                    println!("{}\t{}", search.name, search.count);
+                }
+            }
+            "show" if args.len() >= 5 => {
+                let mut after = None;
+                loop {
+                    let files = repo
+                        .get_saved_search_files(&args[4], after, SEARCH_PAGE_SIZE)
+                        .await?;
+                    let Some(last) = files.last() else {
+                        break;
+                    };
+                    after = Some(last.collection_id);
+                    for file in &files {
+                        println!("{}.{}\t{}", file.hash, file.ext, file.title);
+                    }
+                }
+            }
+            _ => return Err(wrong_arg_error),
+        }
+    } else if args[1] == "similar" {
+        if args.len() < 4 {
+            return Err(wrong_arg_error);
+        }
+        let Ok(collection_id) = args[3].parse() else {
+            return Err(wrong_arg_error);
+        };
+        let limit = match flag_value(&args[4..], "--limit").map(str::parse) {
+            Some(Ok(limit)) => limit,
+            Some(Err(_)) => return Err(wrong_arg_error),
+            None => SIMILAR_LIMIT,
+        };
+
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
+
+        for similar in repo.get_similar_collections(collection_id, limit).await? {
+            println!(
+                "{}\t{:.2}\t{}",
+                similar.collection_id, similar.similarity, similar.title
+            );
+        }
+    } else if args[1] == "sample" {
+        if args.len() < 4 {
+            return Err(wrong_arg_error);
+        }
+        let Ok(count) = args[3].parse() else {
+            return Err(wrong_arg_error);
+        };
+
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
+
+        let query = Query {
+            tags: flag_values(&args[4..], "--tag")
+                .map(str::to_owned)
+                .collect(),
+            title: flag_value(&args[4..], "--title").map(str::to_owned),
+        };
+        for file in repo.sample_files(&query, count).await? {
+            println!("{}.{}\t{}", file.hash, file.ext, file.title);
+        }
+    } else if args[1] == "stats" {
+        if args.len() < 3 {
+            return Err(wrong_arg_error);
+        }
+
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
+
+        if args.get(3).is_some_and(|arg| arg == "--recount") && repo.recount_stats().await? {
+            eprintln!("Statistics had drifted and were recounted.");
+        }
+        print!("{}", repo.get_stats().await?);
+    } else if args[1] == "mount" {
+        if args.len() < 4 {
+            return Err(wrong_arg_error);
+        }
+
+        let repo = Repo::new(Path::new(&args[2])).await.unwrap();
+
+        // Returns once unmounted
+        repo.mount(Path::new(&args[3])).await?;
+        // Reads through the mount are recorded as accesses in the write buffer
+        repo.close().await?;
     } else {
         return Err(wrong_arg_error);
     }
 
     Ok(())
 }
+
+/// The values following every occurrence of `flag` in `args`.
+fn flag_values<'a>(args: &'a [String], flag: &'a str) -> impl Iterator<Item = &'a str> {
+    args.windows(2)
+        .filter(move |pair| pair[0] == flag)
+        .map(|pair| pair[1].as_str())
+}
+
+/// The value following `flag` in `args`, if any.
+fn flag_value<'a>(args: &'a [String], flag: &str) -> Option<&'a str> {
+    args.iter()
+        .position(|arg| arg == flag)
+        .and_then(|index| args.get(index + 1))
+        .map(String::as_str)
+}
@@ -0,0 +1,264 @@
+use crate::{
+    error::Result,
+    store::{self, StoreObject},
+};
+use std::{
+    collections::{HashMap, HashSet},
+    fs,
+    path::{Path, PathBuf},
+    time::{SystemTime, UNIX_EPOCH},
+};
+
+/// Directories modified this recently may be modified again within the same mtime tick, so their
+/// mtime is not recorded yet.
+const MTIME_SETTLE_NANOS: i64 = 2_000_000_000;
+
+/// A store object as recorded in the manifest.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct ManifestEntry {
+    pub hash: String,
+    pub ext: String,
+    /// Folder of the object.
+    pub dir: String,
+    /// File name of the object within `dir`.
+    pub name: String,
+    pub size: i64,
+    /// Modification time in nanoseconds since the unix epoch.
+    pub mtime: i64,
+}
+
+impl ManifestEntry {
+    /// Describes the object at `path` as it currently is on disk.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the object cannot be read.
+    pub fn read(path: &Path, hash: &str, ext: &str) -> Result<Self> {
+        let metadata = fs::metadata(path)?;
+        Ok(ManifestEntry {
+            hash: hash.to_owned(),
+            ext: ext.to_owned(),
+            dir: path_key(path.parent().expect("Store object must have a parent.")),
+            name: path
+                .file_name()
+                .expect("Store object must have a name.")
+                .to_string_lossy()
+                .into_owned(),
+            size: i64::try_from(metadata.len()).unwrap_or(i64::MAX),
+            mtime: mtime(&metadata)?,
+        })
+    }
+
+    pub fn path(&self) -> PathBuf {
+        Path::new(&self.dir).join(&self.name)
+    }
+
+    /// Whether the object on disk is unchanged since this entry was recorded, going by its size
+    /// and mtime.
+    pub fn matches(&self, current: &ManifestEntry) -> bool {
+        self.hash == current.hash
+            && self.ext == current.ext
+            && self.size == current.size
+            && self.mtime == current.mtime
+    }
+}
+
+/// A store folder whose content may have changed since the manifest was last reconciled with it.
+#[derive(Debug, PartialEq, Eq)]
+pub struct ChangedDir {
+    /// Root of the volume the folder is on.
+    pub root: PathBuf,
+    pub dir: PathBuf,
+    /// Modification time of the folder before it is rescanned.
+    pub mtime: i64,
+}
+
+/// Result of `changed_dirs`.
+#[derive(Debug, Default)]
+pub struct DirScan {
+    pub changed: Vec<ChangedDir>,
+    /// Every folder currently in the store. Recorded folders not in here no longer exist.
+    pub visited: HashSet<String>,
+}
+
+/// The result of rescanning a changed store folder, to be recorded with `DB::update_store_dir`.
+#[derive(Debug)]
+pub struct DirUpdate {
+    pub dir: String,
+    /// Mtime to record the folder with, or `None` to rescan it again next time.
+    pub mtime: Option<i64>,
+    /// Objects to add or update.
+    pub objects: Vec<ManifestEntry>,
+    /// Hashes of objects no longer in the folder.
+    pub removed: Vec<String>,
+}
+
+/// Finds the store folders that changed since their mtimes were recorded in `recorded`.
+///
+/// Adding, removing or renaming a file changes the mtime of its folder, so the content of a
+/// folder with an unchanged mtime is still what the manifest says. Unchanged folders are only
+/// stat'ed, and their subfolders are taken from `recorded`. Changed or unknown folders are listed
+/// to find their subfolders. Hidden folders, e.g. for unfinished writes, are skipped.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if a folder cannot be read.
+pub fn changed_dirs(roots: &[PathBuf], recorded: &HashMap<String, i64>) -> Result<DirScan> {
+    let mut children: HashMap<&Path, Vec<&Path>> = HashMap::new();
+    for dir in recorded.keys() {
+        let dir = Path::new(dir.as_str());
+        if let Some(parent) = dir.parent() {
+            children.entry(parent).or_default().push(dir);
+        }
+    }
+
+    let mut scan = DirScan::default();
+    for root in roots {
+        let mut dirs = vec![root.clone()];
+        while let Some(dir) = dirs.pop() {
+            let key = path_key(&dir);
+            let modified = dir_mtime(&dir)?;
+            if recorded.get(&key) == Some(&modified) {
+                if let Some(subdirs) = children.get(dir.as_path()) {
+                    dirs.extend(subdirs.iter().map(|subdir| subdir.to_path_buf()));
+                }
+            } else {
+                for entry in fs::read_dir(&dir)? {
+                    let path = entry?.path();
+                    if path.is_dir() && !store::is_hidden(&path) {
+                        dirs.push(path);
+                    }
+                }
+                scan.changed.push(ChangedDir {
+                    root: root.clone(),
+                    dir,
+                    mtime: modified,
+                });
+            }
+            scan.visited.insert(key);
+        }
+    }
+    Ok(scan)
+}
+
+/// Objects directly in `dir`, with their hash and ext derived from their path.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if the folder or an object cannot be read.
+pub fn dir_objects(root: &Path, dir: &Path) -> Result<Vec<ManifestEntry>> {
+    let mut objects = Vec::new();
+    for entry in fs::read_dir(dir)? {
+        let path = entry?.path();
+        if path.is_dir() || store::is_hidden(&path) {
+            continue;
+        }
+        let object = StoreObject::new(root, &path);
+        objects.push(ManifestEntry::read(&path, &object.hash, &object.ext)?);
+    }
+    Ok(objects)
+}
+
+/// Modification time of a folder in nanoseconds since the unix epoch.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if the folder cannot be read.
+pub fn dir_mtime(dir: &Path) -> Result<i64> {
+    mtime(&fs::metadata(dir)?)
+}
+
+/// Whether a folder mtime is old enough to be recorded, see `MTIME_SETTLE_NANOS`.
+pub fn is_settled(dir_mtime: i64) -> bool {
+    dir_mtime < nanos_since_epoch(SystemTime::now()) - MTIME_SETTLE_NANOS
+}
+
+/// Key of a folder in the manifest.
+pub fn path_key(path: &Path) -> String {
+    path.to_string_lossy().into_owned()
+}
+
+fn mtime(metadata: &fs::Metadata) -> Result<i64> {
+    Ok(nanos_since_epoch(metadata.modified()?))
+}
+
+fn nanos_since_epoch(time: SystemTime) -> i64 {
+    // Times before the epoch only come from broken clocks, treat them as the epoch
+    time.duration_since(UNIX_EPOCH).map_or(0, |duration| {
+        i64::try_from(duration.as_nanos()).unwrap_or(i64::MAX)
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_utils::TempFolder;
+    use test_context::test_context;
+
+    fn record(scan: &DirScan) -> HashMap<String, i64> {
+        scan.changed
+            .iter()
+            .map(|changed| (path_key(&changed.dir), changed.mtime))
+            .collect()
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn only_changed_dirs_are_listed(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let root = ctx.path.join("store");
+        for shard in ["50/a0", "50/b1", "f1/00"] {
+            fs::create_dir_all(root.join(shard))?;
+        }
+        fs::create_dir_all(root.join(".incoming"))?;
+        let roots = vec![root.clone()];
+        let first_scan = changed_dirs(&roots, &HashMap::new())?;
+        let recorded = record(&first_scan);
+
+        // WHEN
+        fs::write(root.join("50/b1/00.mp4"), "")?;
+        let second_scan = changed_dirs(&roots, &recorded)?;
+
+        // THEN
+        // The root, two shards and three subshards
+        assert_eq!(first_scan.changed.len(), 6);
+        assert!(!first_scan
+            .visited
+            .contains(&path_key(&root.join(".incoming"))));
+        assert_eq!(
+            second_scan
+                .changed
+                .iter()
+                .map(|changed| changed.dir.clone())
+                .collect::<Vec<_>>(),
+            vec![root.join("50/b1")]
+        );
+        assert_eq!(second_scan.visited, first_scan.visited);
+        let objects = dir_objects(&root, &root.join("50/b1"))?;
+        assert_eq!(objects.len(), 1);
+        assert_eq!(objects[0].hash, "50b100");
+        assert_eq!(objects[0].ext, "mp4");
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn removed_dirs_are_not_visited(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let root = ctx.path.join("store");
+        fs::create_dir_all(root.join("50/a0"))?;
+        fs::create_dir_all(root.join("f1"))?;
+        let roots = vec![root.clone()];
+        let recorded = record(&changed_dirs(&roots, &HashMap::new())?);
+
+        // WHEN
+        fs::remove_dir_all(root.join("50"))?;
+        let scan = changed_dirs(&roots, &recorded)?;
+
+        // THEN
+        assert!(scan.visited.contains(&path_key(&root.join("f1"))));
+        assert!(!scan.visited.contains(&path_key(&root.join("50"))));
+        assert!(!scan.visited.contains(&path_key(&root.join("50/a0"))));
+        Ok(())
+    }
+}
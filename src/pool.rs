@@ -0,0 +1,136 @@
+use crate::{db::DB, error::Result};
+use std::{
+    ops::{Deref, DerefMut},
+    sync::Mutex,
+};
+use tokio::sync::{Semaphore, SemaphorePermit};
+
+/// Read-only connections to the db of a repo, so that reads run concurrently with each other and
+/// with the write connection.
+///
+/// A read takes an idle connection, or opens one if none is idle, and hands it back when done.
+/// At most `size` connections are open at once, further reads wait for one to be handed back.
+/// Connections are kept open between reads, so a burst of reads opens them once and later reads
+/// reuse them.
+pub struct ReadPool {
+    path: String,
+    permits: Semaphore,
+    idle: Mutex<Vec<DB>>,
+}
+
+impl ReadPool {
+    pub fn new(path: String, size: usize) -> Self {
+        ReadPool {
+            path,
+            permits: Semaphore::new(size.max(1)),
+            idle: Mutex::new(Vec::new()),
+        }
+    }
+
+    /// A connection for one read, handed back when it is dropped. Waits while `size`
+    /// connections are in use.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::DB` if no connection is idle and a new one cannot be opened.
+    pub async fn get(&self) -> Result<PooledDB<'_>> {
+        let permit = self
+            .permits
+            .acquire()
+            .await
+            .expect("Read pool semaphore is never closed.");
+        let idle = self.idle.lock().expect("Read pool lock is poisoned.").pop();
+        let db = match idle {
+            Some(db) => db,
+            None => DB::open_reader(&self.path).await?,
+        };
+        Ok(PooledDB {
+            pool: self,
+            db: Some(db),
+            _permit: permit,
+        })
+    }
+
+    /// Number of connections kept open between reads.
+    pub fn idle(&self) -> usize {
+        self.idle.lock().expect("Read pool lock is poisoned.").len()
+    }
+}
+
+/// A connection taken from a `ReadPool`.
+pub struct PooledDB<'a> {
+    pool: &'a ReadPool,
+    /// Always set until dropped.
+    db: Option<DB>,
+    /// Released after the connection is handed back.
+    _permit: SemaphorePermit<'a>,
+}
+
+impl Deref for PooledDB<'_> {
+    type Target = DB;
+
+    fn deref(&self) -> &DB {
+        self.db
+            .as_ref()
+            .expect("Pooled connection is set until dropped.")
+    }
+}
+
+impl DerefMut for PooledDB<'_> {
+    fn deref_mut(&mut self) -> &mut DB {
+        self.db
+            .as_mut()
+            .expect("Pooled connection is set until dropped.")
+    }
+}
+
+impl Drop for PooledDB<'_> {
+    fn drop(&mut self) {
+        // A connection dropped amid a snapshot would hand it on to the next read
+        if let Some(db) = self.db.take().filter(|db| !db.in_transaction()) {
+            let mut idle = self.pool.idle.lock().expect("Read pool lock is poisoned.");
+            idle.push(db);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_utils::TempFolder;
+    use std::time::Duration;
+    use test_context::test_context;
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn reuse_connections(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let db_path = ctx.path.join("vorg.db");
+        let mut db = DB::new(&db_path).await?;
+        let hash = "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79";
+        db.import_file("Test title", hash, "mp4").await?;
+        let pool = ReadPool::new(db.path().to_owned(), 2);
+
+        // WHEN
+        let (mut first, mut second) = (pool.get().await?, pool.get().await?);
+        let (items, tags) = tokio::join!(first.get_items(), second.get_tag_names());
+        // The pool is exhausted until a connection is handed back
+        let third = tokio::time::timeout(Duration::from_millis(50), pool.get()).await;
+        assert!(third.is_err());
+        drop((first, second));
+
+        // THEN
+        assert_eq!(items?.len(), 1);
+        assert_eq!(tags?, vec![String::from("meta:Incomplete")]);
+        // Both connections are kept, and reused by the next reads
+        assert_eq!(pool.idle(), 2);
+        let mut reader = pool.get().await?;
+        assert_eq!(pool.idle(), 1);
+        // Readers cannot write
+        assert!(reader
+            .import_file("Another title", hash, "mkv")
+            .await
+            .is_err());
+        Ok(())
+    }
+}
@@ -0,0 +1,319 @@
+use crate::db::Item;
+use std::collections::{HashMap, HashSet};
+
+/// Filter over the items of a repo.
+#[derive(Clone, Debug, Default, PartialEq, Eq, Hash)]
+pub struct Query {
+    /// Items must have all of these tags.
+    pub tags: Vec<String>,
+    /// Items must have all words of this text in their title, in order.
+    pub title: Option<String>,
+}
+
+impl Query {
+    /// Returns an equivalent query in canonical form, so that equivalent queries share cache
+    /// entries: tags sorted and deduplicated, title trimmed, and an empty title dropped.
+    pub fn normalized(&self) -> Self {
+        let mut tags = self.tags.clone();
+        tags.sort();
+        tags.dedup();
+        let title = self
+            .title
+            .as_deref()
+            .map(str::trim)
+            .filter(|title| !title.is_empty())
+            .map(str::to_owned);
+        Query { tags, title }
+    }
+
+    /// The title filter as an FTS5 phrase, so that user input cannot inject FTS5 syntax.
+    pub fn title_phrase(&self) -> Option<String> {
+        self.title
+            .as_ref()
+            .map(|title| format!("\"{}\"", title.replace('"', "\"\"")))
+    }
+
+    /// Whether `item` satisfies a normalized query, for items whose buffered titles or tags are
+    /// not in the db yet, see `WriteBuffer::patch`.
+    ///
+    /// Titles are split into words like the default FTS5 tokenizer does, on anything but
+    /// letters and digits and ignoring case, except that diacritics are not folded.
+    pub fn matches(&self, item: &Item) -> bool {
+        let has_title = || {
+            let Some(title) = &self.title else {
+                return true;
+            };
+            let words = title_words(title);
+            words.is_empty()
+                || title_words(&item.title)
+                    .windows(words.len())
+                    .any(|window| window == words)
+        };
+        self.tags.iter().all(|tag| item.tags.contains(tag)) && has_title()
+    }
+}
+
+/// Lower case words of a title, see `Query::matches`.
+fn title_words(title: &str) -> Vec<String> {
+    title
+        .split(|c: char| !c.is_alphanumeric())
+        .filter(|word| !word.is_empty())
+        .map(str::to_lowercase)
+        .collect()
+}
+
+/// Applies pending writes to one page of query results read from the db, see `Repo::query_files`.
+///
+/// `items` must have been read with the limit of `page` raised by the number of `pending`
+/// items, which are the items of the collections with buffered titles or tags, already
+/// patched. Their rows in `items` are stale, so they are replaced by the pending items that
+/// still match.
+pub fn patch_page(items: Vec<Item>, pending: &[Item], query: &Query, page: &Page) -> Vec<Item> {
+    let pending_ids: HashSet<i64> = pending.iter().map(|item| item.collection_id).collect();
+    let mut items: Vec<Item> = items
+        .into_iter()
+        .filter(|item| !pending_ids.contains(&item.collection_id))
+        .collect();
+    let after = page.after.as_deref().unwrap_or("");
+    items.extend(
+        pending
+            .iter()
+            .filter(|item| item.hash.as_str() > after && query.matches(item))
+            .cloned(),
+    );
+    items.sort_by(|a, b| a.hash.cmp(&b.hash));
+    items.truncate(page.limit as usize);
+    items
+}
+
+/// Position in the results of a query, ordered by hash.
+#[derive(Clone, Debug, PartialEq, Eq, Hash)]
+pub struct Page {
+    /// Return items after this hash, i.e. the last hash of the previous page.
+    pub after: Option<String>,
+    pub limit: u32,
+}
+
+/// Bounded cache of query results.
+///
+/// Entries are only valid for the change generation they were computed at, see
+/// `DB::get_generation`. The generation counts changes to collections, their items and their
+/// tags, whether by this repo or by another process, which is everything a result is made of.
+/// Other commits, e.g. recorded accesses or manifest updates, keep the entries.
+#[derive(Debug)]
+pub struct QueryCache {
+    capacity: usize,
+    generation: Option<i64>,
+    entries: HashMap<(Query, Page), CacheEntry>,
+    clock: u64,
+}
+
+#[derive(Debug)]
+struct CacheEntry {
+    items: Vec<Item>,
+    last_used: u64,
+}
+
+impl QueryCache {
+    /// A cache that holds up to `capacity` results. A capacity of 0 disables caching.
+    pub fn new(capacity: usize) -> Self {
+        QueryCache {
+            capacity,
+            generation: None,
+            entries: HashMap::new(),
+            clock: 0,
+        }
+    }
+
+    /// Looks up the results of a normalized query at `generation`.
+    pub fn get(&mut self, generation: i64, query: &Query, page: &Page) -> Option<Vec<Item>> {
+        self.sync_generation(generation);
+        self.clock += 1;
+        let entry = self.entries.get_mut(&(query.clone(), page.clone()))?;
+        entry.last_used = self.clock;
+        Some(entry.items.clone())
+    }
+
+    /// Stores the results of a normalized query computed at `generation`.
+    ///
+    /// Evicts the least recently used entry if the cache is full.
+    pub fn insert(&mut self, generation: i64, query: Query, page: Page, items: Vec<Item>) {
+        if self.capacity == 0 {
+            return;
+        }
+        self.sync_generation(generation);
+        if self.entries.len() >= self.capacity {
+            let oldest = self
+                .entries
+                .iter()
+                .min_by_key(|(_, entry)| entry.last_used)
+                .map(|(key, _)| key.clone());
+            if let Some(oldest) = oldest {
+                self.entries.remove(&oldest);
+            }
+        }
+        self.clock += 1;
+        self.entries.insert(
+            (query, page),
+            CacheEntry {
+                items,
+                last_used: self.clock,
+            },
+        );
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    fn sync_generation(&mut self, generation: i64) {
+        if self.generation != Some(generation) {
+            self.entries.clear();
+            self.generation = Some(generation);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn tag_query(tag: &str) -> Query {
+        Query {
+            tags: vec![String::from(tag)],
+            title: None,
+        }
+    }
+
+    fn first_page() -> Page {
+        Page {
+            after: None,
+            limit: 10,
+        }
+    }
+
+    #[tokio::test]
+    async fn normalize() {
+        // GIVEN
+        let query = Query {
+            tags: vec![
+                String::from("tag:B"),
+                String::from("tag:A"),
+                String::from("tag:B"),
+            ],
+            title: Some(String::from("  say \"hi\" ")),
+        };
+
+        // WHEN
+        let normalized = query.normalized();
+
+        // THEN
+        assert_eq!(
+            normalized.tags,
+            vec![String::from("tag:A"), String::from("tag:B")]
+        );
+        assert_eq!(
+            normalized.title_phrase(),
+            Some(String::from("\"say \"\"hi\"\"\""))
+        );
+        assert_eq!(
+            Query {
+                tags: Vec::new(),
+                title: Some(String::from(" ")),
+            }
+            .normalized(),
+            Query::default()
+        );
+    }
+
+    fn item(hash: &str, collection_id: i64, title: &str, tags: &[&str]) -> Item {
+        Item {
+            hash: String::from(hash),
+            title: String::from(title),
+            ext: String::from("mp4"),
+            collection_id,
+            tags: tags.iter().map(|tag| String::from(*tag)).collect(),
+        }
+    }
+
+    #[tokio::test]
+    async fn match_items() {
+        // GIVEN
+        let query = Query {
+            tags: vec![String::from("tag:A")],
+            title: Some(String::from("Blue SKY")),
+        };
+
+        // THEN
+        assert!(query.matches(&item("a", 1, "The blue sky, at dawn", &["tag:A", "tag:B"])));
+        assert!(!query.matches(&item("a", 1, "The blue sky", &["tag:B"])));
+        assert!(!query.matches(&item("a", 1, "The sky is blue", &["tag:A"])));
+        assert!(!query.matches(&item("a", 1, "Blueberry sky", &["tag:A"])));
+    }
+
+    #[tokio::test]
+    async fn patch_pending_page() {
+        // GIVEN
+        let query = tag_query("tag:A");
+        let page = Page {
+            after: Some(String::from("b")),
+            limit: 2,
+        };
+        // Read with the limit raised by the number of pending items
+        let items = vec![
+            item("c", 1, "Untagged since", &["tag:A"]),
+            item("d", 2, "Kept", &["tag:A"]),
+            item("f", 3, "Next page", &["tag:A"]),
+        ];
+        let pending = vec![
+            item("a", 4, "Before the page", &["tag:A"]),
+            item("c", 1, "Untagged since", &[]),
+            item("e", 5, "Tagged since", &["tag:A"]),
+        ];
+
+        // WHEN
+        let patched = patch_page(items, &pending, &query, &page);
+
+        // THEN
+        let hashes: Vec<&str> = patched.iter().map(|item| item.hash.as_str()).collect();
+        assert_eq!(hashes, vec!["d", "e"]);
+    }
+
+    #[tokio::test]
+    async fn invalidate_on_new_generation() {
+        // GIVEN
+        let mut cache = QueryCache::new(10);
+        cache.insert(1, tag_query("tag:A"), first_page(), Vec::new());
+
+        // WHEN
+        let hit = cache.get(1, &tag_query("tag:A"), &first_page());
+        let stale = cache.get(2, &tag_query("tag:A"), &first_page());
+
+        // THEN
+        assert!(hit.is_some());
+        assert!(stale.is_none());
+        assert!(cache.is_empty());
+    }
+
+    #[tokio::test]
+    async fn evict_least_recently_used() {
+        // GIVEN
+        let mut cache = QueryCache::new(2);
+        cache.insert(1, tag_query("tag:A"), first_page(), Vec::new());
+        cache.insert(1, tag_query("tag:B"), first_page(), Vec::new());
+        cache.get(1, &tag_query("tag:A"), &first_page());
+
+        // WHEN
+        cache.insert(1, tag_query("tag:C"), first_page(), Vec::new());
+
+        // THEN
+        assert_eq!(cache.len(), 2);
+        assert!(cache.get(1, &tag_query("tag:A"), &first_page()).is_some());
+        assert!(cache.get(1, &tag_query("tag:B"), &first_page()).is_none());
+        assert!(cache.get(1, &tag_query("tag:C"), &first_page()).is_some());
+    }
+}
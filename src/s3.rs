@@ -0,0 +1,302 @@
+use crate::{
+    backend::{Backend, ObjectKey, CHUNK_SIZE},
+    error::{Error, ErrorKind, Result},
+};
+use async_trait::async_trait;
+use futures::TryStreamExt;
+use object_store::{aws::AmazonS3Builder, path::Path, ObjectStore};
+use sha2::{Digest, Sha224};
+use std::{ops::Range, sync::Arc};
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWriteExt};
+use uuid::Uuid;
+
+/// Largest object S3 copies in a single request.
+const COPY_LIMIT: u64 = 5 << 30;
+
+/// Backend on top of an S3 compatible object store.
+///
+/// Objects are stored as `<first two hash characters>/<hash>.<ext>`, so that listing by prefix
+/// only touches one key prefix. Uploads are streamed as multipart uploads into `uploads/` and
+/// moved to their content address once the hash is known. Moving copies the object, which S3
+/// does in one request only up to `COPY_LIMIT` bytes, so larger objects stay at their upload key
+/// and `refs/<first two hash characters>/<hash>.<ext>` records that key instead.
+pub struct ObjectStoreBackend {
+    store: Arc<dyn ObjectStore>,
+    copy_limit: u64,
+}
+
+impl ObjectStoreBackend {
+    /// Wraps any `object_store` implementation, e.g. `object_store::memory::InMemory` in tests.
+    pub fn new(store: Arc<dyn ObjectStore>) -> Self {
+        ObjectStoreBackend {
+            store,
+            copy_limit: COPY_LIMIT,
+        }
+    }
+
+    /// Keeps objects larger than `copy_limit` bytes at their upload key, e.g. to test large
+    /// uploads with a small in memory store.
+    #[must_use]
+    pub fn with_copy_limit(mut self, copy_limit: u64) -> Self {
+        self.copy_limit = copy_limit;
+        self
+    }
+
+    /// Connects to an S3 bucket.
+    ///
+    /// Credentials and region are taken from the usual `AWS_*` environment variables. `endpoint`
+    /// overrides the AWS endpoint, e.g. for MinIO.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Config` if the bucket cannot be configured.
+    pub fn s3(bucket: &str, endpoint: Option<&str>) -> Result<Self> {
+        let mut builder = AmazonS3Builder::from_env().with_bucket_name(bucket);
+        if let Some(endpoint) = endpoint {
+            builder = builder.with_endpoint(endpoint).with_allow_http(true);
+        }
+        let store = builder.build().map_err(|error| Error {
+            msg: error.to_string(),
+            kind: ErrorKind::Config,
+        })?;
+        Ok(ObjectStoreBackend::new(Arc::new(store)))
+    }
+
+    fn object_path(key: &ObjectKey) -> Path {
+        Path::from(format!("{}/{key}", &key.hash[..2]))
+    }
+
+    fn ref_path(key: &ObjectKey) -> Path {
+        Path::from(format!("refs/{}/{key}", &key.hash[..2]))
+    }
+
+    /// Where the content of an object is, following its ref if it has one. `None` if the object
+    /// does not exist.
+    async fn content_path(&self, key: &ObjectKey) -> Result<Option<Path>> {
+        let path = ObjectStoreBackend::object_path(key);
+        match self.store.head(&path).await {
+            Ok(_) => return Ok(Some(path)),
+            Err(object_store::Error::NotFound { .. }) => (),
+            Err(error) => return Err(error.into()),
+        }
+        match self.store.get(&ObjectStoreBackend::ref_path(key)).await {
+            Ok(result) => {
+                let upload_path = result.bytes().await?;
+                let upload_path = String::from_utf8_lossy(&upload_path);
+                Ok(Some(Path::from(upload_path.as_ref())))
+            }
+            Err(object_store::Error::NotFound { .. }) => Ok(None),
+            Err(error) => Err(error.into()),
+        }
+    }
+}
+
+#[async_trait]
+impl Backend for ObjectStoreBackend {
+    async fn put(
+        &self,
+        reader: &mut (dyn AsyncRead + Unpin + Send),
+        ext: &str,
+    ) -> Result<ObjectKey> {
+        let upload_path = Path::from(format!("uploads/{}", Uuid::new_v4()));
+        let (multipart_id, mut writer) = self.store.put_multipart(&upload_path).await?;
+
+        // The multipart writer cuts the stream into parts and uploads them concurrently.
+        let mut hasher = Sha224::new();
+        let mut size = 0;
+        let mut buffer = vec![0; CHUNK_SIZE];
+        let upload = async {
+            loop {
+                let read = reader.read(&mut buffer).await?;
+                if read == 0 {
+                    break;
+                }
+                hasher.update(&buffer[..read]);
+                size += read as u64;
+                writer.write_all(&buffer[..read]).await?;
+            }
+            writer.shutdown().await?;
+            Ok::<_, Error>(())
+        };
+        if let Err(error) = upload.await {
+            self.store
+                .abort_multipart(&upload_path, &multipart_id)
+                .await?;
+            return Err(error);
+        }
+        let hash = hex::encode(hasher.finalize());
+
+        let key = ObjectKey {
+            hash,
+            ext: ext.to_owned(),
+        };
+        if self.exists(&key).await? {
+            self.store.delete(&upload_path).await?;
+        } else if size <= self.copy_limit {
+            self.store
+                .rename(&upload_path, &ObjectStoreBackend::object_path(&key))
+                .await?;
+        } else {
+            self.store
+                .put(
+                    &ObjectStoreBackend::ref_path(&key),
+                    upload_path.to_string().into(),
+                )
+                .await?;
+        }
+        Ok(key)
+    }
+
+    async fn get_range(&self, key: &ObjectKey, range: Range<u64>) -> Result<Vec<u8>> {
+        let not_found = || Error {
+            msg: format!("Item {key} cannot be found in the object store."),
+            kind: ErrorKind::FileNotFound,
+        };
+        let path = self.content_path(key).await?.ok_or_else(not_found)?;
+        let size = match self.store.head(&path).await {
+            Ok(meta) => meta.size as u64,
+            Err(object_store::Error::NotFound { .. }) => return Err(not_found()),
+            Err(error) => return Err(error.into()),
+        };
+        let end = range.end.min(size);
+        if range.start >= end {
+            return Ok(Vec::new());
+        }
+        #[allow(clippy::cast_possible_truncation)]
+        let bytes = self
+            .store
+            .get_range(&path, range.start as usize..end as usize)
+            .await?;
+        Ok(bytes.to_vec())
+    }
+
+    async fn exists(&self, key: &ObjectKey) -> Result<bool> {
+        Ok(self.content_path(key).await?.is_some())
+    }
+
+    async fn delete(&self, key: &ObjectKey) -> Result<()> {
+        // The content goes before the ref, so that a failure leaves a ref to retry the delete with
+        let paths = match self.content_path(key).await? {
+            Some(path) if path != ObjectStoreBackend::object_path(key) => {
+                vec![path, ObjectStoreBackend::ref_path(key)]
+            }
+            _ => vec![ObjectStoreBackend::object_path(key)],
+        };
+        for path in paths {
+            match self.store.delete(&path).await {
+                Ok(()) | Err(object_store::Error::NotFound { .. }) => (),
+                Err(error) => return Err(error.into()),
+            }
+        }
+        Ok(())
+    }
+
+    async fn list(&self, prefix: &str) -> Result<Vec<ObjectKey>> {
+        // Without a shard to list, everything is listed, refs included. Upload keys have no
+        // extension and are skipped.
+        let list_prefixes = if prefix.len() >= 2 {
+            vec![
+                Some(Path::from(&prefix[..2])),
+                Some(Path::from(format!("refs/{}", &prefix[..2]))),
+            ]
+        } else {
+            vec![None]
+        };
+        let mut keys = Vec::new();
+        for list_prefix in &list_prefixes {
+            let listed: Vec<ObjectKey> = self
+                .store
+                .list(list_prefix.as_ref())
+                .try_filter_map(|meta| async move {
+                    let Some(file_name) = meta.location.filename() else {
+                        return Ok(None);
+                    };
+                    let key = file_name
+                        .split_once('.')
+                        .map(|(hash, ext)| ObjectKey {
+                            hash: hash.to_owned(),
+                            ext: ext.to_owned(),
+                        })
+                        .filter(|key| key.hash.starts_with(prefix));
+                    Ok(key)
+                })
+                .try_collect()
+                .await?;
+            keys.extend(listed);
+        }
+        keys.sort();
+        Ok(keys)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use object_store::memory::InMemory;
+
+    #[tokio::test]
+    async fn test_object_store_backend() -> Result<()> {
+        // GIVEN
+        // An in memory object store stands in for S3.
+        let backend = ObjectStoreBackend::new(Arc::new(InMemory::new()));
+        let content = b"some content";
+
+        // WHEN
+        let key = backend.put(&mut content.as_slice(), "mp4").await?;
+
+        // THEN
+        assert_eq!(key.hash, hex::encode(Sha224::digest(content)));
+        assert!(backend.exists(&key).await?);
+        assert_eq!(backend.get_range(&key, 5..100).await?, b"content");
+        assert_eq!(
+            backend.get_ranges(&key, &[0..4, 5..7]).await?,
+            vec![b"some".to_vec(), b"co".to_vec()]
+        );
+        assert_eq!(backend.list(&key.hash[..3]).await?, vec![key.clone()]);
+        assert_eq!(backend.list("").await?, vec![key.clone()]);
+
+        // WHEN
+        backend.delete(&key).await?;
+
+        // THEN
+        assert!(!backend.exists(&key).await?);
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn test_object_store_backend_above_copy_limit() -> Result<()> {
+        // GIVEN
+        // A small copy limit stands in for the 5 GiB limit of S3.
+        let store = Arc::new(InMemory::new());
+        let backend = ObjectStoreBackend::new(store.clone()).with_copy_limit(4);
+        let content = b"some content";
+
+        // WHEN
+        let key = backend.put(&mut content.as_slice(), "mp4").await?;
+
+        // THEN
+        // The object stays at its upload key, without a copy
+        let stored: Vec<String> = store
+            .list(None)
+            .map_ok(|meta| meta.location.to_string())
+            .try_collect()
+            .await?;
+        assert_eq!(stored.len(), 2);
+        assert!(stored.contains(&format!("refs/{}/{key}", &key.hash[..2])));
+        assert!(backend.exists(&key).await?);
+        assert_eq!(backend.get_range(&key, 5..100).await?, b"content");
+        assert_eq!(backend.list(&key.hash[..3]).await?, vec![key.clone()]);
+        assert_eq!(backend.list("").await?, vec![key.clone()]);
+        // A duplicate upload is dropped
+        assert_eq!(backend.put(&mut content.as_slice(), "mp4").await?, key);
+        assert_eq!(store.list(None).try_collect::<Vec<_>>().await?.len(), 2);
+
+        // WHEN
+        backend.delete(&key).await?;
+
+        // THEN
+        assert!(!backend.exists(&key).await?);
+        assert!(store.list(None).try_collect::<Vec<_>>().await?.is_empty());
+        Ok(())
+    }
+}
@@ -0,0 +1,121 @@
+use uuid::Uuid;
+
+/// Number of random collection ids probed per requested sample before falling back to a scan.
+///
+/// Probing finds a match in about `span / matches` tries, so this covers filters that match at
+/// least 1 in 32 collections, where a few probes per sample are much cheaper than a scan.
+pub const PROBES_PER_SAMPLE: usize = 32;
+
+/// Small pseudo-random generator (splitmix64), good enough to pick samples.
+#[derive(Clone, Debug)]
+pub struct Rng {
+    state: u64,
+}
+
+impl Rng {
+    /// A generator seeded from the random bits of a v4 uuid.
+    pub fn new() -> Self {
+        Rng::seeded(Uuid::new_v4().as_u128() as u64)
+    }
+
+    /// A generator that always yields the same numbers for the same `seed`.
+    pub fn seeded(seed: u64) -> Self {
+        Rng { state: seed }
+    }
+
+    pub fn next_u64(&mut self) -> u64 {
+        self.state = self.state.wrapping_add(0x9e37_79b9_7f4a_7c15);
+        let mut x = self.state;
+        x = (x ^ (x >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+        x = (x ^ (x >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+        x ^ (x >> 31)
+    }
+
+    /// A number in `0..bound`, with a bias of at most `bound / 2^64`.
+    pub fn below(&mut self, bound: u64) -> u64 {
+        ((u128::from(self.next_u64()) * u128::from(bound)) >> 64) as u64
+    }
+
+    /// Puts `items` in a uniformly random order.
+    pub fn shuffle<T>(&mut self, items: &mut [T]) {
+        for index in (1..items.len()).rev() {
+            let other = self.below(index as u64 + 1) as usize;
+            items.swap(index, other);
+        }
+    }
+}
+
+impl Default for Rng {
+    fn default() -> Self {
+        Rng::new()
+    }
+}
+
+/// Keeps a uniform sample of up to `size` of the values pushed to it, in constant memory.
+#[derive(Debug)]
+pub struct Reservoir<T> {
+    size: usize,
+    seen: u64,
+    sample: Vec<T>,
+}
+
+impl<T> Reservoir<T> {
+    pub fn new(size: usize) -> Self {
+        Reservoir {
+            size,
+            seen: 0,
+            sample: Vec::with_capacity(size),
+        }
+    }
+
+    /// Offers `value` to the sample, where it replaces a random value with probability
+    /// `size / values seen`.
+    pub fn push(&mut self, value: T, rng: &mut Rng) {
+        self.seen += 1;
+        if self.sample.len() < self.size {
+            self.sample.push(value);
+            return;
+        }
+        let index = rng.below(self.seen) as usize;
+        if index < self.size {
+            self.sample[index] = value;
+        }
+    }
+
+    /// The sample, in a random order.
+    pub fn into_sample(mut self, rng: &mut Rng) -> Vec<T> {
+        rng.shuffle(&mut self.sample);
+        self.sample
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn sample_uniformly() {
+        // GIVEN
+        let mut rng = Rng::seeded(7);
+        let mut counts = [0u32; 10];
+
+        // WHEN
+        for _ in 0..10_000 {
+            let mut reservoir = Reservoir::new(3);
+            for value in 0..10 {
+                reservoir.push(value, &mut rng);
+            }
+            for value in reservoir.into_sample(&mut rng) {
+                counts[value] += 1;
+            }
+        }
+
+        // THEN
+        // Every value is picked 3 times in 10, give or take a few percent
+        assert!(counts.iter().all(|&count| (2_800..3_200).contains(&count)));
+        let mut few = Reservoir::new(5);
+        few.push(1, &mut rng);
+        assert_eq!(few.into_sample(&mut rng), vec![1]);
+        assert!((0..1000).all(|_| rng.below(3) < 3));
+    }
+}
@@ -0,0 +1,168 @@
+use crate::{changes::ChangeEvent, query::Query};
+use tokio::sync::broadcast;
+
+/// Sorted set of collection ids, kept in the db delta and varint encoded.
+///
+/// Ids of new collections are larger than any before, so results mostly grow at the end.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct IdSet {
+    ids: Vec<i64>,
+}
+
+impl IdSet {
+    pub fn from_ids(mut ids: Vec<i64>) -> Self {
+        ids.sort_unstable();
+        ids.dedup();
+        IdSet { ids }
+    }
+
+    /// Adds `id`. Returns whether it was missing.
+    pub fn insert(&mut self, id: i64) -> bool {
+        match self.ids.binary_search(&id) {
+            Ok(_) => false,
+            Err(index) => {
+                self.ids.insert(index, id);
+                true
+            }
+        }
+    }
+
+    /// Removes `id`. Returns whether it was there.
+    pub fn remove(&mut self, id: i64) -> bool {
+        match self.ids.binary_search(&id) {
+            Ok(index) => {
+                self.ids.remove(index);
+                true
+            }
+            Err(_) => false,
+        }
+    }
+
+    pub fn contains(&self, id: i64) -> bool {
+        self.ids.binary_search(&id).is_ok()
+    }
+
+    pub fn len(&self) -> usize {
+        self.ids.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.ids.is_empty()
+    }
+
+    /// Up to `limit` ids larger than `after`, in order.
+    pub fn page(&self, after: Option<i64>, limit: usize) -> &[i64] {
+        let start = after.map_or(0, |after| self.ids.partition_point(|&id| id <= after));
+        let end = start.saturating_add(limit).min(self.ids.len());
+        &self.ids[start..end]
+    }
+
+    /// Encodes the differences between consecutive ids as zigzag LEB128 varints, which takes a
+    /// byte or two per id for dense results.
+    pub fn encode(&self) -> Vec<u8> {
+        let mut bytes = Vec::with_capacity(self.ids.len() * 2);
+        let mut previous = 0i64;
+        for &id in &self.ids {
+            let delta = id.wrapping_sub(previous);
+            let mut value = ((delta << 1) ^ (delta >> 63)) as u64;
+            previous = id;
+            loop {
+                let byte = (value & 0x7f) as u8;
+                value >>= 7;
+                if value == 0 {
+                    bytes.push(byte);
+                    break;
+                }
+                bytes.push(byte | 0x80);
+            }
+        }
+        bytes
+    }
+
+    /// Decodes what `encode` wrote. Returns `None` if `bytes` are not a valid encoding.
+    pub fn decode(bytes: &[u8]) -> Option<Self> {
+        let mut ids = Vec::new();
+        let mut previous = 0i64;
+        let mut value = 0u64;
+        let mut shift = 0;
+        for &byte in bytes {
+            if shift >= 64 {
+                return None;
+            }
+            value |= u64::from(byte & 0x7f) << shift;
+            shift += 7;
+            if byte & 0x80 != 0 {
+                continue;
+            }
+            let delta = (value >> 1) as i64 ^ -((value & 1) as i64);
+            previous = previous.wrapping_add(delta);
+            ids.push(previous);
+            value = 0;
+            shift = 0;
+        }
+        if shift != 0 || ids.windows(2).any(|pair| pair[0] >= pair[1]) {
+            return None;
+        }
+        Some(IdSet { ids })
+    }
+}
+
+/// A saved search with the ids of the collections that satisfy it.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct SavedSearch {
+    pub search_id: i64,
+    pub name: String,
+    pub query: Query,
+    pub results: IdSet,
+    /// Whether the results changed since they were last written to the db.
+    pub dirty: bool,
+}
+
+/// Saved searches loaded by a repo, and what is needed to keep them current.
+#[derive(Debug)]
+pub struct SavedSearches {
+    pub searches: Vec<SavedSearch>,
+    /// Changes of this repo not yet applied to the results.
+    pub changes: broadcast::Receiver<ChangeEvent>,
+    /// Data version of the db connection when the results were last brought up to date. It
+    /// changes when other connections commit.
+    pub data_version: i64,
+}
+
+/// Name, query and result count of a saved search, see `Repo::get_saved_searches`.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct SavedSearchInfo {
+    pub name: String,
+    pub query: Query,
+    pub count: usize,
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn update_and_encode_id_sets() {
+        // GIVEN
+        let mut ids = IdSet::from_ids(vec![300, 1, 7, 7, 1_000_000]);
+
+        // WHEN
+        let inserted = ids.insert(8);
+        let inserted_again = ids.insert(8);
+        let removed = ids.remove(300);
+        let bytes = ids.encode();
+
+        // THEN
+        assert!(inserted);
+        assert!(!inserted_again);
+        assert!(removed);
+        assert!(!ids.contains(300));
+        assert_eq!(ids.page(None, 2), &[1, 7]);
+        assert_eq!(ids.page(Some(7), 10), &[8, 1_000_000]);
+        // One byte for each small delta, three for the large one
+        assert_eq!(bytes.len(), 6);
+        assert_eq!(IdSet::decode(&bytes), Some(ids));
+        assert_eq!(IdSet::decode(&[0x80]), None);
+        assert_eq!(IdSet::decode(&[]), Some(IdSet::default()));
+    }
+}
@@ -0,0 +1,119 @@
+use std::{cmp::Ordering, collections::HashMap};
+
+/// Number of LSH bands, and of MinHash values per band.
+///
+/// Collections whose tag sets have a Jaccard similarity of 0.5 share a band with probability
+/// 1 - (1 - 0.5^3)^10 ≈ 0.74, at 0.8 with 0.999 and at 0.3 with 0.24.
+pub const BANDS: usize = 10;
+pub const ROWS: usize = 3;
+
+/// Most collections taken from one bucket as candidates, so that buckets of common tag sets,
+/// e.g. only `meta:Incomplete`, do not make a query scan them whole.
+pub const CANDIDATES_PER_BAND: i64 = 100;
+
+/// A collection similar to another, by the Jaccard similarity of their tag sets.
+#[derive(Clone, Debug, PartialEq)]
+pub struct SimilarCollection {
+    pub collection_id: i64,
+    pub title: String,
+    /// Size of the intersection of the tag sets over the size of their union, from 0 to 1.
+    pub similarity: f64,
+}
+
+/// Bucket of each LSH band for a collection with the tags `tag_ids`, or none without tags.
+///
+/// The MinHash signature has one value per row of each band: the smallest hash of any tag under
+/// that row's hash function. A band's bucket hashes its rows, so collections share a bucket
+/// when their minimums agree on the whole band. Hashes are fixed, since buckets are stored.
+pub fn band_buckets(tag_ids: &[i64]) -> Vec<i64> {
+    if tag_ids.is_empty() {
+        return Vec::new();
+    }
+    let mut signature = [u64::MAX; BANDS * ROWS];
+    for &tag_id in tag_ids {
+        for (index, min) in signature.iter_mut().enumerate() {
+            let seed = mix(index as u64 + 1);
+            *min = (*min).min(mix(tag_id as u64 ^ seed));
+        }
+    }
+    signature
+        .chunks(ROWS)
+        .enumerate()
+        .map(|(band, rows)| {
+            rows.iter()
+                .fold(band as u64, |bucket, &row| mix(bucket ^ row)) as i64
+        })
+        .collect()
+}
+
+/// Jaccard similarity of two sorted sets of tag ids.
+pub fn jaccard(a: &[i64], b: &[i64]) -> f64 {
+    let (mut i, mut j, mut shared) = (0, 0, 0);
+    while i < a.len() && j < b.len() {
+        match a[i].cmp(&b[j]) {
+            Ordering::Less => i += 1,
+            Ordering::Greater => j += 1,
+            Ordering::Equal => {
+                shared += 1;
+                i += 1;
+                j += 1;
+            }
+        }
+    }
+    let union = a.len() + b.len() - shared;
+    if union == 0 {
+        return 0.0;
+    }
+    shared as f64 / union as f64
+}
+
+/// The `limit` candidates most similar to `tag_ids` by exact Jaccard similarity, most similar
+/// first and by collection id among equals. Tag ids must be sorted.
+pub fn rank(tag_ids: &[i64], candidates: &HashMap<i64, Vec<i64>>, limit: usize) -> Vec<(i64, f64)> {
+    let mut ranked: Vec<(i64, f64)> = candidates
+        .iter()
+        .map(|(&collection_id, tags)| (collection_id, jaccard(tag_ids, tags)))
+        .filter(|&(_, similarity)| similarity > 0.0)
+        .collect();
+    ranked.sort_by(|a, b| b.1.total_cmp(&a.1).then(a.0.cmp(&b.0)));
+    ranked.truncate(limit);
+    ranked
+}
+
+/// Finalizer of splitmix64, a cheap hash with good avalanche.
+fn mix(mut x: u64) -> u64 {
+    x ^= x >> 30;
+    x = x.wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    x ^= x >> 27;
+    x = x.wrapping_mul(0x94d0_49bb_1331_11eb);
+    x ^ (x >> 31)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn rank_by_tag_overlap() {
+        // GIVEN
+        let tags = vec![1, 2, 3, 4];
+        let candidates = HashMap::from([
+            (10, vec![1, 2, 3, 4]),
+            (11, vec![1, 2, 3, 5]),
+            (12, vec![1, 2, 3]),
+            (13, vec![6, 7]),
+        ]);
+
+        // WHEN
+        let ranked = rank(&tags, &candidates, 2);
+
+        // THEN
+        assert_eq!(ranked, vec![(10, 1.0), (12, 0.75)]);
+        assert_eq!(band_buckets(&tags), band_buckets(&[1, 2, 3, 4]));
+        assert_eq!(band_buckets(&tags).len(), BANDS);
+        assert!(band_buckets(&[]).is_empty());
+        // Disjoint tag sets end up in different buckets of every band
+        let other = band_buckets(&[6, 7]);
+        assert!(band_buckets(&tags).iter().zip(&other).all(|(a, b)| a != b));
+    }
+}
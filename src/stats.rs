@@ -0,0 +1,168 @@
+use std::{collections::BTreeMap, fmt};
+
+/// Tag of collections whose metadata still needs to be filled in.
+pub const INCOMPLETE_TAG: &str = "meta:Incomplete";
+
+/// Counts kept up to date by triggers on every import, delete and tag change, see
+/// `Repo::get_stats`.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct Stats {
+    pub collections: u64,
+    pub items: u64,
+    /// Bytes of the objects in the store manifest, i.e. in the hot store.
+    pub store_bytes: u64,
+    pub items_per_ext: BTreeMap<String, u64>,
+    /// Tags on collections per namespace, the part of a tag before `:`, e.g. `studio`.
+    pub tags_per_namespace: BTreeMap<String, u64>,
+    pub collections_per_tag: BTreeMap<String, u64>,
+}
+
+impl Stats {
+    /// Builds statistics from `(kind, key, value)` rows of the stats table. Zero counts, e.g. of
+    /// an extension whose last item was deleted, are left out.
+    pub fn from_rows<T>(rows: T) -> Self
+    where
+        T: IntoIterator<Item = (String, String, i64)>,
+    {
+        let mut stats = Stats::default();
+        for (kind, key, value) in rows {
+            let Ok(value) = u64::try_from(value) else {
+                continue;
+            };
+            if value == 0 {
+                continue;
+            }
+            match kind.as_str() {
+                "collections" => stats.collections = value,
+                "items" => stats.items = value,
+                "store_bytes" => stats.store_bytes = value,
+                "ext" => {
+                    stats.items_per_ext.insert(key, value);
+                }
+                "namespace" => {
+                    stats.tags_per_namespace.insert(key, value);
+                }
+                "tag" => {
+                    stats.collections_per_tag.insert(key, value);
+                }
+                _ => (),
+            }
+        }
+        stats
+    }
+
+    /// Counts `tag` being added to a collection if `added`, or removed from it otherwise, like
+    /// the triggers of the stats table do, e.g. for buffered tags.
+    pub fn count_tag(&mut self, tag: &str, added: bool) {
+        let namespace = tag.split_once(':').map_or("", |(namespace, _)| namespace);
+        for (counts, key) in [
+            (&mut self.collections_per_tag, tag),
+            (&mut self.tags_per_namespace, namespace),
+        ] {
+            let count = counts.entry(key.to_owned()).or_insert(0);
+            *count = if added {
+                *count + 1
+            } else {
+                count.saturating_sub(1)
+            };
+            if *count == 0 {
+                counts.remove(key);
+            }
+        }
+    }
+
+    /// Number of collections tagged `meta:Incomplete`.
+    pub fn incomplete(&self) -> u64 {
+        self.collections_per_tag
+            .get(INCOMPLETE_TAG)
+            .copied()
+            .unwrap_or(0)
+    }
+}
+
+impl fmt::Display for Stats {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        writeln!(f, "collections: {}", self.collections)?;
+        writeln!(f, "items: {}", self.items)?;
+        writeln!(f, "store bytes: {}", self.store_bytes)?;
+        writeln!(f, "incomplete: {}", self.incomplete())?;
+        for (ext, count) in &self.items_per_ext {
+            writeln!(f, "ext {ext}: {count}")?;
+        }
+        for (namespace, count) in &self.tags_per_namespace {
+            let namespace = if namespace.is_empty() {
+                "(none)"
+            } else {
+                namespace.as_str()
+            };
+            writeln!(f, "namespace {namespace}: {count}")?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn row(kind: &str, key: &str, value: i64) -> (String, String, i64) {
+        (kind.to_owned(), key.to_owned(), value)
+    }
+
+    #[test]
+    fn build_from_rows() {
+        // GIVEN
+        let rows = vec![
+            row("collections", "", 2),
+            row("items", "", 3),
+            row("store_bytes", "", 1024),
+            row("ext", "mp4", 3),
+            row("ext", "mkv", 0),
+            row("namespace", "meta", 1),
+            row("tag", "meta:Incomplete", 1),
+        ];
+
+        // WHEN
+        let stats = Stats::from_rows(rows);
+
+        // THEN
+        assert_eq!(stats.items, 3);
+        assert_eq!(stats.store_bytes, 1024);
+        assert_eq!(stats.incomplete(), 1);
+        assert_eq!(
+            stats.to_string(),
+            "collections: 2
+items: 3
+store bytes: 1024
+incomplete: 1
+ext mp4: 3
+namespace meta: 1
+"
+        );
+    }
+
+    #[test]
+    fn count_tags() {
+        // GIVEN
+        let mut stats = Stats::from_rows(vec![
+            row("namespace", "meta", 1),
+            row("tag", "meta:Incomplete", 1),
+        ]);
+
+        // WHEN
+        stats.count_tag("meta:Incomplete", false);
+        stats.count_tag("studio:A", true);
+        stats.count_tag("untagged", true);
+
+        // THEN
+        assert_eq!(stats.incomplete(), 0);
+        assert_eq!(
+            stats.collections_per_tag.into_iter().collect::<Vec<_>>(),
+            vec![(String::from("studio:A"), 1), (String::from("untagged"), 1)]
+        );
+        assert_eq!(
+            stats.tags_per_namespace.into_iter().collect::<Vec<_>>(),
+            vec![(String::new(), 1), (String::from("studio"), 1)]
+        );
+    }
+}
@@ -0,0 +1,1163 @@
+use crate::{
+    config::{Config, CONFIG_FILE_NAME},
+    error::{Error, ErrorKind, Result},
+    external_sort::{ExternalSorter, SortedRecords, SpillRecord},
+    utils,
+};
+use sha2::{Digest, Sha224};
+use std::{
+    fmt, fs,
+    io::{self, Write},
+    iter, mem,
+    os::unix::fs::MetadataExt,
+    path::{Path, PathBuf},
+    str::FromStr,
+    sync::{RwLock, RwLockWriteGuard},
+    time::SystemTime,
+};
+use uuid::Uuid;
+
+/// Describes how content addresses are fanned out into nested shard folders of the file store.
+///
+/// Each level consumes the given number of leading hex characters of the hash and the remainder
+/// of the hash becomes the file stem. The historical layout is a single level of two characters,
+/// i.e. `store/50/a04dc1...66d8bc.mp4`, which is written as `2`. A layout of `2/2` stores the same
+/// object at `store/50/a0/4dc1...66d8bc.mp4`.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct StoreLayout {
+    prefix_lens: Vec<usize>,
+}
+
+impl StoreLayout {
+    /// Maximum number of nested shard folders.
+    pub const MAX_LEVELS: usize = 3;
+    /// Maximum number of hex characters consumed by a single level.
+    pub const MAX_PREFIX_LEN: usize = 4;
+
+    /// Creates a layout from the prefix length of each level.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::Config` if there are no levels, more than `MAX_LEVELS` levels, or a level
+    ///   consumes zero or more than `MAX_PREFIX_LEN` characters.
+    pub fn new(prefix_lens: Vec<usize>) -> Result<Self> {
+        if prefix_lens.is_empty() || prefix_lens.len() > StoreLayout::MAX_LEVELS {
+            return Err(Error {
+                msg: format!(
+                    "Store layout must have between 1 and {} levels.",
+                    StoreLayout::MAX_LEVELS
+                ),
+                kind: ErrorKind::Config,
+            });
+        }
+        if prefix_lens
+            .iter()
+            .any(|len| *len == 0 || *len > StoreLayout::MAX_PREFIX_LEN)
+        {
+            return Err(Error {
+                msg: format!(
+                    "Store layout levels must use between 1 and {} characters.",
+                    StoreLayout::MAX_PREFIX_LEN
+                ),
+                kind: ErrorKind::Config,
+            });
+        }
+        Ok(StoreLayout { prefix_lens })
+    }
+
+    /// Number of nested shard folders.
+    pub fn levels(&self) -> usize {
+        self.prefix_lens.len()
+    }
+
+    /// Path of an object relative to the store root.
+    pub fn relative_path(&self, hash: &str, ext: &str) -> PathBuf {
+        let mut path = PathBuf::new();
+        let mut offset = 0;
+        for len in &self.prefix_lens {
+            path.push(&hash[offset..offset + len]);
+            offset += len;
+        }
+        path.push(format!("{}.{ext}", &hash[offset..]));
+        path
+    }
+
+    /// Recovers the hash and extension of an object from its path relative to the store root.
+    ///
+    /// Returns `None` if the path is not laid out according to this layout, e.g. the object was
+    /// written with a different layout.
+    pub fn parse_relative_path(&self, relative_path: &Path) -> Option<(String, String)> {
+        let components: Vec<&str> = relative_path
+            .components()
+            .map(|component| component.as_os_str().to_str())
+            .collect::<Option<_>>()?;
+        let (file_name, folders) = components.split_last()?;
+        if folders.len() != self.levels() {
+            return None;
+        }
+
+        let mut hash = String::new();
+        for (folder, len) in folders.iter().zip(&self.prefix_lens) {
+            if folder.len() != *len || !folder.bytes().all(|byte| byte.is_ascii_hexdigit()) {
+                return None;
+            }
+            hash.push_str(folder);
+        }
+        let (stem, ext) = file_name.rsplit_once('.')?;
+        hash.push_str(stem);
+        Some((hash, ext.to_owned()))
+    }
+}
+
+impl Default for StoreLayout {
+    fn default() -> Self {
+        StoreLayout {
+            prefix_lens: vec![2],
+        }
+    }
+}
+
+impl fmt::Display for StoreLayout {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let prefix_lens: Vec<String> = self.prefix_lens.iter().map(ToString::to_string).collect();
+        write!(f, "{}", prefix_lens.join("/"))
+    }
+}
+
+impl FromStr for StoreLayout {
+    type Err = Error;
+
+    fn from_str(s: &str) -> Result<Self> {
+        let prefix_lens = s
+            .split('/')
+            .map(|level| {
+                level.trim().parse::<usize>().map_err(|_| Error {
+                    msg: format!("Invalid store layout \"{s}\"."),
+                    kind: ErrorKind::Config,
+                })
+            })
+            .collect::<Result<Vec<_>>>()?;
+        StoreLayout::new(prefix_lens)
+    }
+}
+
+/// How the volume of a new object is chosen.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum Placement {
+    /// Weighted rendezvous hashing of the content address.
+    ///
+    /// Lookups compute the volume directly. Adding or removing a volume only relocates the
+    /// objects that belong on it, see `Repo::rebalance`.
+    #[default]
+    Hash,
+    /// The volume with the most available space, scaled by its weight.
+    ///
+    /// Objects stay on the volume they were written to, which lookups take from the store
+    /// manifest.
+    FreeSpace,
+}
+
+impl fmt::Display for Placement {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Placement::Hash => write!(f, "hash"),
+            Placement::FreeSpace => write!(f, "free_space"),
+        }
+    }
+}
+
+impl FromStr for Placement {
+    type Err = Error;
+
+    fn from_str(s: &str) -> Result<Self> {
+        match s {
+            "hash" => Ok(Placement::Hash),
+            "free_space" => Ok(Placement::FreeSpace),
+            _ => Err(Error {
+                msg: format!("Invalid store placement \"{s}\"."),
+                kind: ErrorKind::Config,
+            }),
+        }
+    }
+}
+
+/// A root folder of the file store, usually on a disk of its own.
+///
+/// Written as `[weight] path`, e.g. `2 /mnt/disk2/vorg`. Relative paths are relative to the repo
+/// root. The weight defaults to 1.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Volume {
+    pub path: PathBuf,
+    pub weight: u32,
+}
+
+impl Default for Volume {
+    fn default() -> Self {
+        Volume {
+            path: PathBuf::from("store"),
+            weight: 1,
+        }
+    }
+}
+
+impl fmt::Display for Volume {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{} {}", self.weight, self.path.display())
+    }
+}
+
+impl FromStr for Volume {
+    type Err = Error;
+
+    fn from_str(s: &str) -> Result<Self> {
+        let s = s.trim();
+        let (weight, path) = match s.split_once(char::is_whitespace) {
+            Some((weight, path)) if weight.bytes().all(|byte| byte.is_ascii_digit()) => {
+                (weight.parse().unwrap_or(0), path.trim())
+            }
+            _ => (1, s),
+        };
+        if weight == 0 || path.is_empty() {
+            return Err(Error {
+                msg: format!("Invalid store volume \"{s}\"."),
+                kind: ErrorKind::Config,
+            });
+        }
+        Ok(Volume {
+            path: PathBuf::from(path),
+            weight,
+        })
+    }
+}
+
+/// A file found by walking the store.
+///
+/// Objects are ordered by hash, so that walks can be diffed against the db.
+#[derive(Clone, Debug, PartialEq, Eq, PartialOrd, Ord)]
+pub struct StoreObject {
+    /// Hash given by the path of the object: its shard folders followed by its file stem.
+    pub hash: String,
+    pub ext: String,
+    pub path: PathBuf,
+}
+
+impl StoreObject {
+    /// Describes the file at `path` in the store rooted at `root`.
+    ///
+    /// Concatenating the shard folders and the file stem yields the hash for any layout, including
+    /// a reshard in progress.
+    pub fn new(root: &Path, path: &Path) -> Self {
+        let shard_folders = path
+            .parent()
+            .expect("Store object must have a parent.")
+            .strip_prefix(root)
+            .expect("Store object must be within its volume.");
+        let mut hash = String::new();
+        for folder in shard_folders {
+            hash.push_str(&folder.to_string_lossy());
+        }
+        hash.push_str(&path.file_stem().unwrap_or_default().to_string_lossy());
+        StoreObject {
+            hash,
+            ext: path
+                .extension()
+                .unwrap_or_default()
+                .to_string_lossy()
+                .into_owned(),
+            path: path.to_owned(),
+        }
+    }
+}
+
+impl SpillRecord for StoreObject {
+    fn memory_size(&self) -> usize {
+        mem::size_of::<Self>() + self.hash.len() + self.ext.len() + self.path.as_os_str().len()
+    }
+
+    fn write_line(&self, writer: &mut dyn Write) -> io::Result<()> {
+        // Hashes and exts never contain tabs. The path goes last so that it may.
+        writeln!(
+            writer,
+            "{}\t{}\t{}",
+            self.hash,
+            self.ext,
+            self.path.display()
+        )
+    }
+
+    fn read_line(line: &str) -> Option<Self> {
+        let mut fields = line.splitn(3, '\t');
+        Some(StoreObject {
+            hash: fields.next()?.to_owned(),
+            ext: fields.next()?.to_owned(),
+            path: PathBuf::from(fields.next()?),
+        })
+    }
+}
+
+/// The content addressed file store of a repo, spread over one or more volumes.
+///
+/// Volumes and placement are fixed while the repo is open, but a reshard by any handle or
+/// process changes the layouts, see `reload_layouts`.
+pub struct Store {
+    /// Root of the repo the layouts are reloaded from, `None` for a store outside of a repo, e.g.
+    /// a cold tier.
+    repo_path: Option<PathBuf>,
+    volumes: Vec<Volume>,
+    roots: Vec<PathBuf>,
+    placement: Placement,
+    layouts: RwLock<Layouts>,
+}
+
+/// Layouts of a store as of a `Config::store_generation`.
+#[derive(Clone, Debug)]
+struct Layouts {
+    current: StoreLayout,
+    /// See `Config::previous_store_layout`.
+    previous: Option<StoreLayout>,
+    generation: u64,
+    /// Stamp of the configuration file they were loaded from, so that reloading only parses it
+    /// after it changed.
+    config_stamp: Option<ConfigStamp>,
+}
+
+impl Store {
+    pub fn new<T>(repo_path: T, config: &Config) -> Self
+    where
+        T: AsRef<Path>,
+    {
+        let repo_path = repo_path.as_ref();
+        Store {
+            roots: config
+                .store_volumes
+                .iter()
+                .map(|volume| repo_path.join(&volume.path))
+                .collect(),
+            volumes: config.store_volumes.clone(),
+            placement: config.store_placement,
+            layouts: RwLock::new(Layouts {
+                current: config.store_layout.clone(),
+                previous: config.previous_store_layout.clone(),
+                generation: config.store_generation,
+                config_stamp: config_stamp(repo_path),
+            }),
+            repo_path: Some(repo_path.to_owned()),
+        }
+    }
+
+    /// A store with a single volume at `root`, e.g. a cold tier.
+    pub fn single<T>(root: T, layout: StoreLayout) -> Self
+    where
+        T: AsRef<Path>,
+    {
+        let root = root.as_ref();
+        Store {
+            repo_path: None,
+            volumes: vec![Volume {
+                path: root.to_owned(),
+                weight: 1,
+            }],
+            roots: vec![root.to_owned()],
+            placement: Placement::Hash,
+            layouts: RwLock::new(Layouts {
+                current: layout,
+                previous: None,
+                generation: 0,
+                config_stamp: None,
+            }),
+        }
+    }
+
+    /// Layout new objects are written with.
+    pub fn layout(&self) -> StoreLayout {
+        self.layouts().current
+    }
+
+    /// Layout a reshard in progress moves objects away from, if any.
+    pub fn previous_layout(&self) -> Option<StoreLayout> {
+        self.layouts().previous
+    }
+
+    /// Picks up the layouts of the repo configuration if a reshard changed them since they were
+    /// loaded, in this process or another one. Returns whether they changed.
+    ///
+    /// The configuration is only parsed if the file changed, so this is cheap enough to call on
+    /// every lookup that misses and before every insert.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the configuration cannot be read.
+    /// - `ErrorKind::Config` if the configuration is malformed.
+    pub fn reload_layouts(&self) -> Result<bool> {
+        let Some(repo_path) = &self.repo_path else {
+            return Ok(false);
+        };
+        let config_stamp = config_stamp(repo_path);
+        if config_stamp == self.layouts().config_stamp {
+            return Ok(false);
+        }
+        let config = Config::load(repo_path)?;
+        let mut layouts = self.layouts_mut();
+        let changed = config.store_generation != layouts.generation;
+        *layouts = Layouts {
+            current: config.store_layout,
+            previous: config.previous_store_layout,
+            generation: config.store_generation,
+            config_stamp,
+        };
+        Ok(changed)
+    }
+
+    fn layouts(&self) -> Layouts {
+        self.layouts
+            .read()
+            .expect("Store layouts lock is poisoned.")
+            .clone()
+    }
+
+    fn layouts_mut(&self) -> RwLockWriteGuard<'_, Layouts> {
+        self.layouts
+            .write()
+            .expect("Store layouts lock is poisoned.")
+    }
+
+    /// Root folders of all volumes, in configuration order.
+    pub fn roots(&self) -> &[PathBuf] {
+        &self.roots
+    }
+
+    pub fn placement(&self) -> Placement {
+        self.placement
+    }
+
+    /// Volume an object belongs on according to weighted rendezvous hashing.
+    ///
+    /// Volumes are identified by their configured path rather than their resolved root, so that
+    /// moving the repo does not change placement.
+    pub fn hashed_volume(&self, hash: &str) -> usize {
+        let mut best_volume = 0;
+        let mut best_score = f64::NEG_INFINITY;
+        for (index, volume) in self.volumes.iter().enumerate() {
+            let digest = Sha224::new()
+                .chain_update(volume.path.to_string_lossy().as_bytes())
+                .chain_update(hash.as_bytes())
+                .finalize();
+            let bits = u64::from_be_bytes(digest[..8].try_into().expect("Digest is long enough."));
+            // Map the top 53 bits into (0, 1), which is exactly representable as an f64.
+            #[allow(clippy::cast_precision_loss)]
+            let unit = ((bits >> 11) as f64 + 0.5) / (1_u64 << 53) as f64;
+            let score = -f64::from(volume.weight) / unit.ln();
+            if score > best_score {
+                best_volume = index;
+                best_score = score;
+            }
+        }
+        best_volume
+    }
+
+    /// Volume a new object is written to.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the available space of a volume cannot be determined.
+    pub fn place(&self, hash: &str) -> Result<usize> {
+        match self.placement {
+            Placement::Hash => Ok(self.hashed_volume(hash)),
+            Placement::FreeSpace => self.receiving_volume(),
+        }
+    }
+
+    /// Volume to receive new content on before its hash is known, e.g. a streamed import: the
+    /// one with the most available space by weight.
+    ///
+    /// Free space placement leaves received objects there, so they are renamed into place.
+    /// Hash placement moves them to their volume, which copies them if it is another one.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the available space of a volume cannot be determined.
+    pub fn receiving_volume(&self) -> Result<usize> {
+        let mut best_volume = 0;
+        let mut best_space = 0;
+        for (index, (volume, root)) in self.volumes.iter().zip(&self.roots).enumerate() {
+            let space = available_space(root)?.saturating_mul(u64::from(volume.weight));
+            if space > best_space {
+                best_volume = index;
+                best_space = space;
+            }
+        }
+        Ok(best_volume)
+    }
+
+    /// Moves `file`, a temporary file received on `volume`, into the store under its content
+    /// address, see `receiving_volume`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the shard folder cannot be created or the file cannot be moved.
+    pub fn insert_received<T>(
+        &self,
+        volume: usize,
+        file: T,
+        hash: &str,
+        ext: &str,
+    ) -> Result<PathBuf>
+    where
+        T: AsRef<Path>,
+    {
+        match self.placement {
+            Placement::Hash => self.insert(file, hash, ext),
+            // Writing the file took space, so placing it again could pick another volume
+            Placement::FreeSpace => self.insert_into(volume, file, hash, ext),
+        }
+    }
+
+    /// Expected share of new objects written to each volume, in configuration order.
+    ///
+    /// Hash placement spreads objects by weight. Free space placement writes new objects to the
+    /// volume that currently has the most space.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the available space of a volume cannot be determined.
+    pub fn placement_shares(&self) -> Result<Vec<f64>> {
+        match self.placement {
+            Placement::Hash => {
+                let total_weight: u32 = self.volumes.iter().map(|volume| volume.weight).sum();
+                Ok(self
+                    .volumes
+                    .iter()
+                    .map(|volume| f64::from(volume.weight) / f64::from(total_weight))
+                    .collect())
+            }
+            Placement::FreeSpace => {
+                let target = self.place("")?;
+                Ok((0..self.roots.len())
+                    .map(|volume| if volume == target { 1.0 } else { 0.0 })
+                    .collect())
+            }
+        }
+    }
+
+    /// Path of an object on `volume`, laid out with the current layout.
+    pub fn object_path(&self, volume: usize, hash: &str, ext: &str) -> PathBuf {
+        self.roots[volume].join(self.layouts().current.relative_path(hash, ext))
+    }
+
+    /// Volume whose root contains `path`, e.g. a folder recorded in the store manifest.
+    pub fn volume_of(&self, path: &Path) -> Option<usize> {
+        self.roots.iter().position(|root| path.starts_with(root))
+    }
+
+    /// Finds an existing object.
+    ///
+    /// The volume given by hash placement is tried first, so that lookups take a single probe in
+    /// the common case. Other volumes are probed after that, for objects written with free space
+    /// placement or not yet rebalanced. While a reshard is in progress, objects that have not
+    /// been moved yet are found through the previous layout.
+    pub fn locate(&self, hash: &str, ext: &str) -> Option<PathBuf> {
+        let hashed_volume = self.hashed_volume(hash);
+        let other_volumes = (0..self.roots.len()).filter(|volume| *volume != hashed_volume);
+        let volumes: Vec<usize> = iter::once(hashed_volume).chain(other_volumes).collect();
+        self.locate_on_any(&volumes, hash, ext)
+    }
+
+    /// Finds an existing object, probing the volume of `manifest_dir` first if the store manifest
+    /// records the object, then every volume as `locate` does.
+    pub fn find(&self, manifest_dir: Option<&str>, hash: &str, ext: &str) -> Option<PathBuf> {
+        let recorded_volume = manifest_dir.and_then(|dir| self.volume_of(Path::new(dir)));
+        let path = recorded_volume.and_then(|volume| self.locate_on(volume, hash, ext));
+        path.or_else(|| self.locate(hash, ext))
+    }
+
+    /// Finds an existing object on `volume` only, e.g. the volume the store manifest records it
+    /// on.
+    pub fn locate_on(&self, volume: usize, hash: &str, ext: &str) -> Option<PathBuf> {
+        self.locate_on_any(&[volume], hash, ext)
+    }
+
+    fn locate_on_any(&self, volumes: &[usize], hash: &str, ext: &str) -> Option<PathBuf> {
+        let probe = || {
+            let layouts = self.layouts();
+            let layouts = iter::once(&layouts.current).chain(layouts.previous.as_ref());
+            layouts
+                .flat_map(|layout| {
+                    volumes
+                        .iter()
+                        .map(|volume| self.roots[*volume].join(layout.relative_path(hash, ext)))
+                })
+                .find(|path| path.is_file())
+        };
+        // On a miss, a reshard may have moved the object since the layouts were loaded
+        probe().or_else(|| self.reload_layouts().unwrap_or(false).then(probe).flatten())
+    }
+
+    /// Moves `file` into the store under its content address, on the volume chosen by placement.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the shard folder cannot be created or the file cannot be moved.
+    pub fn insert<T>(&self, file: T, hash: &str, ext: &str) -> Result<PathBuf>
+    where
+        T: AsRef<Path>,
+    {
+        let volume = self.place(hash)?;
+        self.insert_into(volume, file, hash, ext)
+    }
+
+    /// Moves `file` into the store under its content address, on `volume`.
+    ///
+    /// The layouts are reloaded first, so that an object is never written with a layout a
+    /// reshard of another process is moving away from. Inserts hold the writer lease, which
+    /// reshards record new layouts under.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the shard folder cannot be created or the file cannot be moved.
+    pub fn insert_into<T>(&self, volume: usize, file: T, hash: &str, ext: &str) -> Result<PathBuf>
+    where
+        T: AsRef<Path>,
+    {
+        // Never write with a layout a reshard is moving away from
+        self.reload_layouts()?;
+        let store_path = self.object_path(volume, hash, ext);
+        fs::create_dir_all(
+            store_path
+                .parent()
+                .expect("Store object must have a parent."),
+        )?;
+        move_file(file, &store_path)?;
+        Ok(store_path)
+    }
+
+    /// Lists objects of one top level shard on `volume` that are still laid out with the
+    /// previous layout.
+    ///
+    /// Returns the current path, hash and extension of each object. Returns nothing if no
+    /// reshard is in progress.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the shard cannot be read.
+    pub fn previous_layout_objects<T>(
+        &self,
+        volume: usize,
+        shard: T,
+    ) -> Result<Vec<(PathBuf, String, String)>>
+    where
+        T: AsRef<Path>,
+    {
+        match &self.layouts().previous {
+            Some(previous_layout) => self.shard_objects(volume, shard, previous_layout),
+            None => Ok(Vec::new()),
+        }
+    }
+
+    /// Lists objects of one top level shard on `volume` that hash placement puts on another
+    /// volume.
+    ///
+    /// Returns the current path, hash, extension and target volume of each object.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the shard cannot be read.
+    pub fn misplaced_objects<T>(
+        &self,
+        volume: usize,
+        shard: T,
+    ) -> Result<Vec<(PathBuf, String, String, usize)>>
+    where
+        T: AsRef<Path>,
+    {
+        Ok(self
+            .shard_objects(volume, shard, &self.layouts().current)?
+            .into_iter()
+            .filter_map(|(path, hash, ext)| {
+                let target = self.hashed_volume(&hash);
+                (target != volume).then_some((path, hash, ext, target))
+            })
+            .collect())
+    }
+
+    fn shard_objects<T>(
+        &self,
+        volume: usize,
+        shard: T,
+        layout: &StoreLayout,
+    ) -> Result<Vec<(PathBuf, String, String)>>
+    where
+        T: AsRef<Path>,
+    {
+        let mut objects = Vec::new();
+        walk_files(shard, &mut |path| {
+            let relative_path = path
+                .strip_prefix(&self.roots[volume])
+                .expect("Store object must be within its volume.");
+            if let Some((hash, ext)) = layout.parse_relative_path(relative_path) {
+                objects.push((path.to_owned(), hash, ext));
+            }
+            Ok(())
+        })?;
+        Ok(objects)
+    }
+
+    /// Hash and extension of every object whose hash starts with `prefix`, ordered by hash.
+    ///
+    /// Only shards that can contain such objects are walked.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when a shard cannot be read.
+    pub fn objects_with_prefix(&self, prefix: &str) -> Result<Vec<(String, String)>> {
+        let layouts = self.layouts();
+        let mut objects = Vec::new();
+        for (volume, shard) in self.shards()? {
+            let shard_name = shard
+                .file_name()
+                .expect("Shard must have a name.")
+                .to_string_lossy();
+            if !shard_name.starts_with(prefix) && !prefix.starts_with(shard_name.as_ref()) {
+                continue;
+            }
+            for layout in iter::once(&layouts.current).chain(layouts.previous.as_ref()) {
+                objects.extend(
+                    self.shard_objects(volume, &shard, layout)?
+                        .into_iter()
+                        .filter(|(_, hash, _)| hash.starts_with(prefix))
+                        .map(|(_, hash, ext)| (hash, ext)),
+                );
+            }
+        }
+        objects.sort();
+        objects.dedup();
+        Ok(objects)
+    }
+
+    /// A fresh path for a temporary file on `volume`.
+    ///
+    /// Temporary files live in the hidden `.incoming` folder of the volume, so that they can be
+    /// renamed into place cheaply and are skipped by walks over the store.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the folder for temporary files cannot be created.
+    pub fn temp_path(&self, volume: usize) -> Result<PathBuf> {
+        Ok(self.temp_dir(volume)?.join(Uuid::new_v4().to_string()))
+    }
+
+    /// The folder for temporary files on `volume`, see `temp_path`.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the folder cannot be created.
+    pub fn temp_dir(&self, volume: usize) -> Result<PathBuf> {
+        let temp_dir = self.roots[volume].join(".incoming");
+        fs::create_dir_all(&temp_dir)?;
+        Ok(temp_dir)
+    }
+
+    /// Every file of every volume in hash order, using at most about `memory_cap` bytes for
+    /// sorting.
+    ///
+    /// Outside of a reshard, all volumes share one layout, so shards can be walked in order and
+    /// only need to be sorted one by one. Otherwise, and if the store contains folders that are
+    /// not shards of the layout, every file goes through one external sort, which spills to the
+    /// hidden `.incoming` folder of the first volume.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when the store cannot be walked or sort runs cannot be written. Errors
+    ///   while walking shards are yielded by the iterator.
+    pub fn sorted_objects(
+        &self,
+        memory_cap: usize,
+    ) -> Result<Box<dyn Iterator<Item = Result<StoreObject>> + Send + '_>> {
+        let mut shard_names: Vec<String> = self
+            .shards()?
+            .iter()
+            .map(|(_, shard)| {
+                shard
+                    .file_name()
+                    .expect("Shard must have a name.")
+                    .to_string_lossy()
+                    .into_owned()
+            })
+            .collect();
+        let layouts = self.layouts();
+        let shard_len = layouts.current.prefix_lens[0];
+        let shards_in_order = layouts.previous.is_none()
+            && shard_names
+                .iter()
+                .all(|name| name.len() == shard_len && name.chars().all(|c| c.is_ascii_hexdigit()));
+
+        if !shards_in_order {
+            let mut sorter = ExternalSorter::new(self.temp_path(0)?, memory_cap);
+            for root in &self.roots {
+                walk_files(root, &mut |path| sorter.push(StoreObject::new(root, path)))?;
+            }
+            return Ok(Box::new(sorter.finish()?));
+        }
+
+        // Files directly in a volume root are in no shard, so they are merged in separately
+        let mut stray_sorter = ExternalSorter::new(self.temp_path(0)?, memory_cap);
+        for root in &self.roots {
+            for entry in fs::read_dir(root)? {
+                let path = entry?.path();
+                if !path.is_dir() && !is_hidden(&path) {
+                    stray_sorter.push(StoreObject::new(root, &path))?;
+                }
+            }
+        }
+        let stray_objects = stray_sorter.finish()?;
+
+        shard_names.sort();
+        shard_names.dedup();
+        let sharded_objects = shard_names.into_iter().flat_map(move |shard_name| {
+            match self.sort_shard(&shard_name, memory_cap) {
+                Ok(objects) => {
+                    Box::new(objects) as Box<dyn Iterator<Item = Result<StoreObject>> + Send>
+                }
+                Err(error) => Box::new(iter::once(Err(error))),
+            }
+        });
+        Ok(Box::new(utils::merge_sorted(
+            sharded_objects,
+            stray_objects,
+            |a, b| match (a, b) {
+                (Ok(a), Ok(b)) => a.cmp(b),
+                // Errors are passed on right away
+                (Err(_), _) => std::cmp::Ordering::Less,
+                (_, Err(_)) => std::cmp::Ordering::Greater,
+            },
+        )))
+    }
+
+    /// Objects of the top level shard `shard_name` of every volume, in hash order.
+    fn sort_shard(
+        &self,
+        shard_name: &str,
+        memory_cap: usize,
+    ) -> Result<SortedRecords<StoreObject>> {
+        let mut sorter = ExternalSorter::new(self.temp_path(0)?, memory_cap);
+        for root in &self.roots {
+            let shard = root.join(shard_name);
+            if shard.is_dir() {
+                walk_files(&shard, &mut |path| {
+                    sorter.push(StoreObject::new(root, path))
+                })?;
+            }
+        }
+        sorter.finish()
+    }
+
+    /// Top level shard folders of every volume, with the index of their volume.
+    ///
+    /// Shards are in ascending order within each volume.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` when a volume root cannot be read.
+    pub fn shards(&self) -> Result<Vec<(usize, PathBuf)>> {
+        let mut shards = Vec::new();
+        for (volume, root) in self.roots.iter().enumerate() {
+            let mut volume_shards = Vec::new();
+            for entry in fs::read_dir(root)? {
+                let path = entry?.path();
+                if path.is_dir() && !is_hidden(&path) {
+                    volume_shards.push(path);
+                }
+            }
+            volume_shards.sort();
+            shards.extend(volume_shards.into_iter().map(|shard| (volume, shard)));
+        }
+        Ok(shards)
+    }
+}
+
+/// Inode and modification time of a configuration file. `Config::save` replaces the file, so
+/// the inode changes on every save even if the modification time does not.
+type ConfigStamp = (u64, SystemTime);
+
+/// Stamp of the configuration file of the repo at `repo_path`, `None` if it has none.
+fn config_stamp(repo_path: &Path) -> Option<ConfigStamp> {
+    let metadata = fs::metadata(repo_path.join(CONFIG_FILE_NAME)).ok()?;
+    Some((metadata.ino(), metadata.modified().ok()?))
+}
+
+/// Space available to unprivileged users on the file system containing `path`, in bytes.
+#[cfg(unix)]
+fn available_space(path: &Path) -> Result<u64> {
+    use std::{ffi::CString, os::unix::ffi::OsStrExt};
+
+    let path = CString::new(path.as_os_str().as_bytes()).map_err(|_| Error {
+        msg: format!("Invalid volume path {}.", path.display()),
+        kind: ErrorKind::IO,
+    })?;
+    // SAFETY: `path` is a valid NUL terminated string and `stat` is a valid out pointer.
+    let mut stat: libc::statvfs = unsafe { std::mem::zeroed() };
+    if unsafe { libc::statvfs(path.as_ptr(), &mut stat) } != 0 {
+        return Err(std::io::Error::last_os_error().into());
+    }
+    #[allow(clippy::useless_conversion)]
+    Ok(u64::from(stat.f_bavail) * u64::from(stat.f_frsize))
+}
+
+/// Space available on the file system containing `path`.
+///
+/// Not supported on this platform, every volume is reported as equally empty.
+#[cfg(not(unix))]
+fn available_space(_path: &Path) -> Result<u64> {
+    Ok(u64::MAX)
+}
+
+/// Whether the name of `path` starts with a dot. Hidden entries of the store are not objects.
+pub fn is_hidden(path: &Path) -> bool {
+    path.file_name()
+        .is_some_and(|name| name.to_string_lossy().starts_with('.'))
+}
+
+/// Recursively visits every regular file under `dir`, skipping hidden entries.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` when a folder cannot be read, or any error returned by `visit`.
+pub fn walk_files<T>(dir: T, visit: &mut dyn FnMut(&Path) -> Result<()>) -> Result<()>
+where
+    T: AsRef<Path>,
+{
+    for entry in fs::read_dir(dir)? {
+        let path = entry?.path();
+        if is_hidden(&path) {
+            continue;
+        }
+        if path.is_dir() {
+            walk_files(&path, visit)?;
+        } else {
+            visit(&path)?;
+        }
+    }
+    Ok(())
+}
+
+/// Removes `dir` and every folder beneath it that does not contain any file.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` when a folder cannot be read or removed.
+pub fn prune_empty_dirs<T>(dir: T) -> Result<bool>
+where
+    T: AsRef<Path>,
+{
+    let dir = dir.as_ref();
+    let mut is_empty = true;
+    for entry in fs::read_dir(dir)? {
+        let path = entry?.path();
+        if !path.is_dir() || !prune_empty_dirs(&path)? {
+            is_empty = false;
+        }
+    }
+    if is_empty {
+        fs::remove_dir(dir)?;
+    }
+    Ok(is_empty)
+}
+
+/// Moves a file, falling back to copy and remove if `from` and `to` are on different file systems.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` when the file cannot be moved.
+pub fn move_file<T1, T2>(from: T1, to: T2) -> Result<()>
+where
+    T1: AsRef<Path>,
+    T2: AsRef<Path>,
+{
+    let from = from.as_ref();
+    let to = to.as_ref();
+
+    // Attempt rename first.
+    if let Err(error) = fs::rename(from, to) {
+        // TODO: when io_error_more is stablized, use ErrorKind::CrossesDevices instead.
+        // This scenario cannot be easily tested. I just tried it and it seems to work.
+        // Avoid importing files from across device boundries is the most prudent choice.
+        if error.to_string().starts_with("Invalid cross-device link") {
+            fs::copy(from, to)?;
+            fs::remove_file(from)?;
+        } else {
+            return Err(Error {
+                msg: error.to_string(),
+                kind: ErrorKind::IO,
+            });
+        }
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_utils::TempFolder;
+    use rstest::rstest;
+    use test_context::AsyncTestContext;
+
+    static HASH: &str = "50a04dc1cbd3d8edd5ad7acbcaad95362fe1c47c212f7b6b2b66d8bc";
+
+    #[rstest]
+    #[case("2", "50/a04dc1cbd3d8edd5ad7acbcaad95362fe1c47c212f7b6b2b66d8bc.mp4")]
+    #[case(
+        "2/2",
+        "50/a0/4dc1cbd3d8edd5ad7acbcaad95362fe1c47c212f7b6b2b66d8bc.mp4"
+    )]
+    #[case(
+        "3/3",
+        "50a/04d/c1cbd3d8edd5ad7acbcaad95362fe1c47c212f7b6b2b66d8bc.mp4"
+    )]
+    #[case(
+        "1/1/1",
+        "5/0/a/04dc1cbd3d8edd5ad7acbcaad95362fe1c47c212f7b6b2b66d8bc.mp4"
+    )]
+    #[tokio::test]
+    async fn layout_round_trip(#[case] layout: &str, #[case] expected_path: &str) -> Result<()> {
+        // GIVEN
+        let layout: StoreLayout = layout.parse()?;
+
+        // WHEN
+        let path = layout.relative_path(HASH, "mp4");
+
+        // THEN
+        assert_eq!(path, PathBuf::from(expected_path));
+        assert_eq!(
+            layout.parse_relative_path(&path),
+            Some((String::from(HASH), String::from("mp4")))
+        );
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn layout_rejects_other_layouts() -> Result<()> {
+        // GIVEN
+        let old_layout: StoreLayout = "2".parse()?;
+        let new_layout: StoreLayout = "2/2".parse()?;
+
+        // WHEN
+        let old_path = old_layout.relative_path(HASH, "mp4");
+        let new_path = new_layout.relative_path(HASH, "mp4");
+
+        // THEN
+        assert_eq!(new_layout.parse_relative_path(&old_path), None);
+        assert_eq!(old_layout.parse_relative_path(&new_path), None);
+        Ok(())
+    }
+
+    fn test_store(volumes: &[(&str, u32)]) -> Store {
+        let config = Config {
+            store_volumes: volumes
+                .iter()
+                .map(|(path, weight)| Volume {
+                    path: PathBuf::from(path),
+                    weight: *weight,
+                })
+                .collect(),
+            ..Config::default()
+        };
+        Store::new("repo", &config)
+    }
+
+    fn test_hashes() -> Vec<String> {
+        (0..4000)
+            .map(|index: i32| hex::encode(Sha224::digest(index.to_string())))
+            .collect()
+    }
+
+    #[tokio::test]
+    async fn hash_placement_follows_weights() {
+        // GIVEN
+        let store = test_store(&[("a", 1), ("b", 1), ("c", 2)]);
+
+        // WHEN
+        let mut counts = [0; 3];
+        for hash in test_hashes() {
+            counts[store.hashed_volume(&hash)] += 1;
+        }
+
+        // THEN
+        assert!((900..1100).contains(&counts[0]));
+        assert!((900..1100).contains(&counts[1]));
+        assert!((1800..2200).contains(&counts[2]));
+        assert_eq!(
+            store
+                .placement_shares()
+                .expect("Hash placement needs no IO."),
+            vec![0.25, 0.25, 0.5]
+        );
+    }
+
+    #[tokio::test]
+    async fn hash_placement_is_consistent() {
+        // GIVEN
+        let before = test_store(&[("a", 1), ("b", 1)]);
+        let after = test_store(&[("a", 1), ("b", 1), ("c", 1)]);
+
+        // THEN
+        // Adding a volume only moves objects onto the new volume.
+        for hash in test_hashes() {
+            let volume = after.hashed_volume(&hash);
+            assert!(volume == 2 || volume == before.hashed_volume(&hash));
+        }
+    }
+
+    #[rstest]
+    #[case("")]
+    #[case("0")]
+    #[case("5")]
+    #[case("2/2/2/2")]
+    #[case("two")]
+    #[tokio::test]
+    async fn layout_invalid(#[case] layout: &str) {
+        // WHEN
+        let result = layout.parse::<StoreLayout>();
+
+        // THEN
+        assert!(result.is_err());
+        if let Err(error) = result {
+            assert_eq!(error.kind, ErrorKind::Config);
+        }
+    }
+
+    #[rstest]
+    #[case("2", "")]
+    #[case("2", "2")]
+    #[tokio::test]
+    async fn sorted_objects(#[case] layout: &str, #[case] previous_layout: &str) -> Result<()> {
+        let ctx = TempFolder::setup().await;
+        // GIVEN
+        let root = ctx.path.join("store");
+        let store = Store::single(&root, layout.parse()?);
+        if !previous_layout.is_empty() {
+            store.layouts_mut().previous = Some(previous_layout.parse()?);
+        }
+        let mut hashes = test_hashes();
+        for hash in &hashes {
+            let path = store.object_path(0, hash, "mp4");
+            fs::create_dir_all(path.parent().expect("Object must have a parent."))?;
+            fs::write(path, hash)?;
+        }
+        // A stray file outside of any shard
+        fs::write(root.join("ff.mp4"), "")?;
+        hashes.push(String::from("ff"));
+        hashes.sort();
+
+        // WHEN
+        // A tiny memory cap makes every shard spill
+        let objects = store
+            .sorted_objects(1)?
+            .map(|object| object.map(|object| object.hash))
+            .collect::<Result<Vec<_>>>();
+
+        // THEN
+        assert_eq!(objects?, hashes);
+
+        ctx.teardown().await;
+        Ok(())
+    }
+}
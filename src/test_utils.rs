@@ -0,0 +1,29 @@
+use std::fs;
+use test_context::AsyncTestContext;
+use tokio::time::{sleep, Duration};
+use uuid::Uuid;
+
+/// A uniquely named folder in the working directory, removed after the test.
+pub struct TempFolder {
+    pub path: std::path::PathBuf,
+}
+
+#[async_trait::async_trait]
+impl AsyncTestContext for TempFolder {
+    async fn setup() -> TempFolder {
+        let uuid = Uuid::new_v4();
+        let temp_dir_path =
+            String::from("temp-") + uuid.hyphenated().encode_lower(&mut Uuid::encode_buffer());
+        let temp_dir = std::path::PathBuf::from(temp_dir_path);
+        fs::create_dir(&temp_dir).expect("Failed to create temp dir for testing.");
+        TempFolder { path: temp_dir }
+    }
+
+    async fn teardown(self) {
+        if let Err(_) = fs::remove_dir_all(&self.path) {
+            // If the first try failed, wait a bit and retry
+            sleep(Duration::from_millis(200)).await;
+            fs::remove_dir_all(&self.path).expect("Failed to teardown temp test directory.")
+        };
+    }
+}
@@ -1,3 +1,11 @@
+use futures::{stream, Stream, StreamExt};
+use std::{
+    cmp::Ordering,
+    iter::Peekable,
+    pin::Pin,
+    time::{SystemTime, UNIX_EPOCH},
+};
+
 #[derive(PartialEq, Debug)]
 pub enum ListCompareResult<T> {
     Missing(T),
@@ -6,6 +14,200 @@ pub enum ListCompareResult<T> {
     Identical,
 }
 
+/// A difference between two sorted sequences, see `merge_diff`.
+#[derive(PartialEq, Debug)]
+pub enum Diff<A, B> {
+    /// Only in the expected sequence.
+    Missing(B),
+    /// Only in the actual sequence.
+    Unexpected(A),
+    /// In both, but the two records are not equal.
+    Unequal(A, B),
+}
+
+/// Which side(s) a merge step consumes.
+enum MergeStep {
+    Actual,
+    Expected,
+    Both,
+}
+
+fn merge_step<A, B, C>(
+    actual: Option<&A>,
+    expected: Option<&B>,
+    compare: &mut C,
+) -> Option<MergeStep>
+where
+    C: FnMut(&A, &B) -> Ordering,
+{
+    match (actual, expected) {
+        (None, None) => None,
+        (Some(_), None) => Some(MergeStep::Actual),
+        (None, Some(_)) => Some(MergeStep::Expected),
+        (Some(actual), Some(expected)) => Some(match compare(actual, expected) {
+            Ordering::Less => MergeStep::Actual,
+            Ordering::Greater => MergeStep::Expected,
+            Ordering::Equal => MergeStep::Both,
+        }),
+    }
+}
+
+/// Lazily diffs `actual` against `expected`, both sorted in ascending order of `compare`.
+///
+/// Records are matched with `compare`, and matching records are checked with `equal`. Every
+/// difference is yielded in order, and only one record of each side is held at a time.
+pub fn merge_diff<IA, IB, C, E>(
+    actual: IA,
+    expected: IB,
+    compare: C,
+    equal: E,
+) -> MergeDiff<IA::IntoIter, IB::IntoIter, C, E>
+where
+    IA: IntoIterator,
+    IB: IntoIterator,
+    C: FnMut(&IA::Item, &IB::Item) -> Ordering,
+    E: FnMut(&IA::Item, &IB::Item) -> bool,
+{
+    MergeDiff {
+        actual: actual.into_iter().peekable(),
+        expected: expected.into_iter().peekable(),
+        compare,
+        equal,
+    }
+}
+
+/// Iterator returned by `merge_diff`.
+pub struct MergeDiff<IA, IB, C, E>
+where
+    IA: Iterator,
+    IB: Iterator,
+{
+    actual: Peekable<IA>,
+    expected: Peekable<IB>,
+    compare: C,
+    equal: E,
+}
+
+impl<IA, IB, C, E> Iterator for MergeDiff<IA, IB, C, E>
+where
+    IA: Iterator,
+    IB: Iterator,
+    C: FnMut(&IA::Item, &IB::Item) -> Ordering,
+    E: FnMut(&IA::Item, &IB::Item) -> bool,
+{
+    type Item = Diff<IA::Item, IB::Item>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        loop {
+            let step = merge_step(self.actual.peek(), self.expected.peek(), &mut self.compare)?;
+            match step {
+                MergeStep::Actual => return self.actual.next().map(Diff::Unexpected),
+                MergeStep::Expected => return self.expected.next().map(Diff::Missing),
+                MergeStep::Both => {
+                    let actual = self.actual.next()?;
+                    let expected = self.expected.next()?;
+                    if !(self.equal)(&actual, &expected) {
+                        return Some(Diff::Unequal(actual, expected));
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// Like `merge_diff`, but over fallible streams, e.g. rows streamed from the db.
+///
+/// The first error of either stream is yielded and ends the diff.
+pub fn merge_diff_stream<A, B, Er, SA, SB, C, E>(
+    actual: SA,
+    expected: SB,
+    compare: C,
+    equal: E,
+) -> impl Stream<Item = std::result::Result<Diff<A, B>, Er>>
+where
+    SA: Stream<Item = std::result::Result<A, Er>> + Unpin,
+    SB: Stream<Item = std::result::Result<B, Er>> + Unpin,
+    C: FnMut(&A, &B) -> Ordering,
+    E: FnMut(&A, &B) -> bool,
+{
+    let state = Some((actual.peekable(), expected.peekable(), compare, equal));
+    stream::unfold(state, |state| async move {
+        let (mut actual, mut expected, mut compare, mut equal) = state?;
+        loop {
+            // Errors are passed on as soon as they are peeked, so only records are merged
+            let peeked_actual = match Pin::new(&mut actual).peek().await {
+                Some(Err(_)) => return Some((actual.next().await?.map(Diff::Unexpected), None)),
+                peeked => peeked.and_then(|record| record.as_ref().ok()),
+            };
+            let peeked_expected = match Pin::new(&mut expected).peek().await {
+                Some(Err(_)) => return Some((expected.next().await?.map(Diff::Missing), None)),
+                peeked => peeked.and_then(|record| record.as_ref().ok()),
+            };
+            let diff = match merge_step(peeked_actual, peeked_expected, &mut compare)? {
+                MergeStep::Actual => actual.next().await?.map(Diff::Unexpected),
+                MergeStep::Expected => expected.next().await?.map(Diff::Missing),
+                MergeStep::Both => {
+                    let (Some(Ok(actual_record)), Some(Ok(expected_record))) =
+                        (actual.next().await, expected.next().await)
+                    else {
+                        unreachable!("Both records were peeked as records.");
+                    };
+                    if equal(&actual_record, &expected_record) {
+                        continue;
+                    }
+                    Ok(Diff::Unequal(actual_record, expected_record))
+                }
+            };
+            return Some((diff, Some((actual, expected, compare, equal))));
+        }
+    })
+}
+
+/// Merges two iterators, both sorted in ascending order of `compare`, into one sorted iterator.
+pub fn merge_sorted<IA, IB, C>(
+    a: IA,
+    b: IB,
+    compare: C,
+) -> MergeSorted<IA::IntoIter, IB::IntoIter, C>
+where
+    IA: IntoIterator,
+    IB: IntoIterator<Item = IA::Item>,
+    C: FnMut(&IA::Item, &IA::Item) -> Ordering,
+{
+    MergeSorted {
+        a: a.into_iter().peekable(),
+        b: b.into_iter().peekable(),
+        compare,
+    }
+}
+
+/// Iterator returned by `merge_sorted`.
+pub struct MergeSorted<IA, IB, C>
+where
+    IA: Iterator,
+    IB: Iterator<Item = IA::Item>,
+{
+    a: Peekable<IA>,
+    b: Peekable<IB>,
+    compare: C,
+}
+
+impl<IA, IB, C> Iterator for MergeSorted<IA, IB, C>
+where
+    IA: Iterator,
+    IB: Iterator<Item = IA::Item>,
+    C: FnMut(&IA::Item, &IA::Item) -> Ordering,
+{
+    type Item = IA::Item;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        match merge_step(self.a.peek(), self.b.peek(), &mut self.compare)? {
+            MergeStep::Actual | MergeStep::Both => self.a.next(),
+            MergeStep::Expected => self.b.next(),
+        }
+    }
+}
+
 /// Compare `list_a` against `list_b`, both sorted by a key given by `compare_key` in ascending
 /// order.
 ///
@@ -16,7 +218,7 @@ pub enum ListCompareResult<T> {
 /// If an item exists in both, the item is checked with `equality_check`. If those two items does
 /// not pass, returns `ListCompareResult::Unequal`, containing the item in `list_b`.
 ///
-/// Only the first detected problem is returned.
+/// Only the first detected problem is returned. See `merge_diff` for all of them.
 pub fn compare_lists<'a, T, C>(
     list_a: &'a [T],
     list_b: &'a [T],
@@ -27,33 +229,31 @@ where
     T: Clone,
     C: PartialOrd + Clone,
 {
-    if list_a.len() == 0 && list_b.len() == 0 {
-        return ListCompareResult::Identical;
-    }
-    if list_a.len() == 0 {
-        return ListCompareResult::Missing(&list_b[0]);
+    let first_diff = merge_diff(
+        list_a,
+        list_b,
+        |item_a, item_b| {
+            compare_key(item_a)
+                .partial_cmp(compare_key(item_b))
+                .unwrap_or(Ordering::Equal)
+        },
+        |item_a, item_b| equality_check(item_a, item_b),
+    )
+    .next();
+    match first_diff {
+        None => ListCompareResult::Identical,
+        Some(Diff::Missing(item)) => ListCompareResult::Missing(item),
+        Some(Diff::Unexpected(item)) => ListCompareResult::Unexpected(item),
+        Some(Diff::Unequal(_, item)) => ListCompareResult::Unequal(item),
     }
-    for (index, item_a) in list_a.iter().enumerate() {
-        if index >= list_b.len() {
-            return ListCompareResult::Unexpected(item_a);
-        }
-        let item_b = &list_b[index];
-        let key_a = compare_key(item_a);
-        let key_b = compare_key(item_b);
-        if key_a > key_b {
-            return ListCompareResult::Missing(item_b);
-        }
-        if key_a < key_b {
-            return ListCompareResult::Unexpected(item_a);
-        }
-        if !equality_check(item_a, item_b) {
-            return ListCompareResult::Unequal(item_b);
-        }
-    }
-    if list_a.len() < list_b.len() {
-        return ListCompareResult::Missing(&list_b[list_a.len()]);
-    }
-    ListCompareResult::Identical
+}
+
+/// Current time as seconds since the unix epoch.
+pub fn unix_time() -> i64 {
+    let duration = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .expect("System clock should be after the unix epoch.");
+    i64::try_from(duration.as_secs()).expect("Unix time should fit in an i64.")
 }
 
 #[cfg(test)]
@@ -120,4 +320,68 @@ mod tests {
         // THEN
         assert_eq!(debug, "Identical");
     }
+
+    #[tokio::test]
+    async fn merge_diff_all() {
+        // GIVEN
+        let actual = [(1, "a"), (2, "b"), (4, "d"), (6, "f")];
+        let expected = [(2, "b"), (3, "c"), (4, "x"), (5, "e")];
+
+        // WHEN
+        let diffs: Vec<_> = merge_diff(
+            actual,
+            expected,
+            |actual, expected| actual.0.cmp(&expected.0),
+            |actual, expected| actual.1 == expected.1,
+        )
+        .collect();
+
+        // THEN
+        assert_eq!(
+            diffs,
+            vec![
+                Diff::Unexpected((1, "a")),
+                Diff::Missing((3, "c")),
+                Diff::Unequal((4, "d"), (4, "x")),
+                Diff::Missing((5, "e")),
+                Diff::Unexpected((6, "f")),
+            ]
+        );
+    }
+
+    #[tokio::test]
+    async fn merge_diff_streams() {
+        // GIVEN
+        let actual = stream::iter([Ok(1), Ok(2), Ok(4)]);
+        let expected = stream::iter([Ok("1"), Ok("3"), Err("broken"), Ok("4")]);
+
+        // WHEN
+        let diffs: Vec<_> = merge_diff_stream(
+            actual,
+            expected,
+            |actual, expected: &&str| actual.to_string().as_str().cmp(expected),
+            |_, _| true,
+        )
+        .collect()
+        .await;
+
+        // THEN
+        assert_eq!(
+            diffs,
+            vec![
+                Ok(Diff::Unexpected(2)),
+                Ok(Diff::Missing("3")),
+                Err("broken")
+            ]
+        );
+    }
+
+    #[tokio::test]
+    async fn merge_two_sorted() {
+        // WHEN
+        let merged: Vec<_> = merge_sorted([1, 3, 3, 6], [2, 3, 7], |a, b| a.cmp(b)).collect();
+
+        // THEN
+        assert_eq!(merged, vec![1, 2, 3, 3, 3, 6, 7]);
+    }
 }
@@ -0,0 +1,120 @@
+use std::collections::HashMap;
+
+/// Number of hash characters added to the names of files whose titles collide.
+const HASH_SUFFIX_LEN: usize = 8;
+
+/// An item as a file of a tag or search view, named after the title of its collection.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct ViewFile {
+    pub title: String,
+    pub hash: String,
+    pub ext: String,
+    /// Size in bytes from the store manifest, if the object is in it.
+    pub size: Option<u64>,
+    /// Modification time in nanoseconds since the unix epoch from the store manifest.
+    pub mtime: Option<i64>,
+}
+
+/// Version of the titles, tags and items seen through a repo, to tell whether a view read from
+/// it is current, see `Repo::view_version`.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct ViewVersion {
+    /// Change generation of the db, which counts changes to collections, their items and their
+    /// tags, by any process.
+    pub generation: i64,
+    /// `WriteBuffer::revision` of the repo, since views see pending buffered writes.
+    pub buffer_revision: u64,
+}
+
+/// Number of files to read from the db for a view of `limit` files, since each of `pending`
+/// items with buffered writes may drop out of the files read once they are patched.
+pub fn padded_limit(limit: u32, pending: usize) -> u32 {
+    limit.saturating_add(u32::try_from(pending).unwrap_or(u32::MAX))
+}
+
+/// Makes `name` usable as a single path component: separators and NULs are replaced, and names
+/// that are empty or mean the current or parent folder are replaced as a whole.
+pub fn sanitize(name: &str) -> String {
+    match name {
+        "" | "." | ".." => String::from("_"),
+        _ => name.replace(['/', '\0'], "_"),
+    }
+}
+
+/// Name of a file of a view: `<title>.<ext>`.
+pub fn title_name(title: &str, ext: &str) -> String {
+    sanitize(&format!("{title}.{ext}"))
+}
+
+/// Name of a file of a view whose title collides with another: `<title> (<hash start>).<ext>`.
+pub fn hashed_name(title: &str, hash: &str, ext: &str) -> String {
+    let hash = &hash[..HASH_SUFFIX_LEN.min(hash.len())];
+    sanitize(&format!("{title} ({hash}).{ext}"))
+}
+
+/// Names of `files` in a view, in the same order, see `title_name`.
+///
+/// Files whose names would collide are named by `hashed_name`, all of them rather than all but
+/// the first, so that a name does not depend on the order of the listing.
+pub fn file_names(files: &[ViewFile]) -> Vec<String> {
+    let names: Vec<String> = files
+        .iter()
+        .map(|file| title_name(&file.title, &file.ext))
+        .collect();
+    let mut counts: HashMap<&str, usize> = HashMap::new();
+    for name in &names {
+        *counts.entry(name.as_str()).or_default() += 1;
+    }
+    files
+        .iter()
+        .zip(&names)
+        .map(|(file, name)| {
+            if counts[name.as_str()] == 1 {
+                return name.clone();
+            }
+            hashed_name(&file.title, &file.hash, &file.ext)
+        })
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn view_file(title: &str, hash: &str, ext: &str) -> ViewFile {
+        ViewFile {
+            title: title.to_owned(),
+            hash: hash.to_owned(),
+            ext: ext.to_owned(),
+            size: None,
+            mtime: None,
+        }
+    }
+
+    #[test]
+    fn name_files_after_titles() {
+        // GIVEN
+        let files = vec![
+            view_file("scene", "aaaaaaaaaa", "mp4"),
+            view_file("AC/DC live", "bbbbbbbbbb", "mp4"),
+            view_file("scene", "cccccccccc", "mp4"),
+            view_file("scene", "dddddddddd", "mkv"),
+        ];
+
+        // WHEN
+        let names = file_names(&files);
+
+        // THEN
+        assert_eq!(
+            names,
+            vec![
+                "scene (aaaaaaaa).mp4",
+                "AC_DC live.mp4",
+                "scene (cccccccc).mp4",
+                "scene.mkv",
+            ]
+        );
+        assert_eq!(sanitize(".."), "_");
+        assert_eq!(sanitize("a\0b"), "a_b");
+    }
+}
@@ -0,0 +1,406 @@
+use crate::error::Result;
+use std::{
+    collections::HashMap,
+    fs,
+    path::{Path, PathBuf},
+    time::{Duration, Instant, SystemTime},
+};
+use tokio::io::unix::AsyncFd;
+
+/// Files in a watched folder waiting until they are complete enough to import.
+///
+/// A file is ready once its writer closed it and its size and mtime did not change for the
+/// settle time. The settle time catches writers that reopen files, and files found by a rescan,
+/// whose writers may still be busy.
+#[derive(Debug)]
+pub struct StableFiles {
+    settle: Duration,
+    files: HashMap<PathBuf, Candidate>,
+}
+
+#[derive(Debug)]
+struct Candidate {
+    closed: bool,
+    size: u64,
+    mtime: Option<SystemTime>,
+    /// When the file was last seen changing.
+    since: Instant,
+}
+
+impl StableFiles {
+    pub fn new(settle: Duration) -> Self {
+        StableFiles {
+            settle,
+            files: HashMap::new(),
+        }
+    }
+
+    /// Records activity on `path`. `closed` is whether the writer is known to be done with it.
+    pub fn observe(&mut self, path: PathBuf, closed: bool, now: Instant) {
+        let metadata = fs::metadata(&path).ok();
+        self.files.insert(
+            path,
+            Candidate {
+                closed,
+                size: metadata.as_ref().map_or(0, fs::Metadata::len),
+                mtime: metadata.and_then(|metadata| metadata.modified().ok()),
+                since: now,
+            },
+        );
+    }
+
+    /// Removes and returns the files that are ready, in path order.
+    ///
+    /// Files that disappeared are dropped.
+    pub fn take_ready(&mut self, now: Instant) -> Vec<PathBuf> {
+        let mut ready = Vec::new();
+        self.files.retain(|path, candidate| {
+            let Ok(metadata) = fs::metadata(path) else {
+                return false;
+            };
+            let mtime = metadata.modified().ok();
+            if metadata.len() != candidate.size || mtime != candidate.mtime {
+                candidate.size = metadata.len();
+                candidate.mtime = mtime;
+                candidate.since = now;
+            }
+            if candidate.closed && now.duration_since(candidate.since) >= self.settle {
+                ready.push(path.clone());
+                return false;
+            }
+            true
+        });
+        ready.sort();
+        ready
+    }
+
+    /// When the first file that was closed may become ready, if any.
+    pub fn next_deadline(&self) -> Option<Instant> {
+        self.files
+            .values()
+            .filter(|candidate| candidate.closed)
+            .map(|candidate| candidate.since + self.settle)
+            .min()
+    }
+
+    pub fn len(&self) -> usize {
+        self.files.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.files.is_empty()
+    }
+}
+
+/// Every file under `dir`, including those in subfolders.
+///
+/// # Errors
+///
+/// - `ErrorKind::IO` if a folder cannot be read.
+pub fn files_under(dir: &Path) -> Result<Vec<PathBuf>> {
+    let mut files = Vec::new();
+    let mut dirs = vec![dir.to_owned()];
+    while let Some(dir) = dirs.pop() {
+        for entry in fs::read_dir(dir)? {
+            let path = entry?.path();
+            if path.is_dir() {
+                dirs.push(path);
+            } else {
+                files.push(path);
+            }
+        }
+    }
+    Ok(files)
+}
+
+/// Something that happened in a watched folder.
+#[derive(Debug, PartialEq, Eq)]
+pub enum WatchEvent {
+    /// A file was created and may still be written to.
+    Created(PathBuf),
+    /// A file was closed after writing, or moved in.
+    Closed(PathBuf),
+    /// Events were lost or a folder appeared, every file under this folder must be looked at.
+    Rescan(PathBuf),
+}
+
+/// Watches a folder and its subfolders with inotify.
+pub struct FolderWatch {
+    fd: AsyncFd<std::os::fd::OwnedFd>,
+    root: PathBuf,
+    dirs: HashMap<i32, PathBuf>,
+}
+
+impl FolderWatch {
+    /// Starts watching `root` and every folder below it. Must be called within a tokio runtime.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if inotify cannot be set up, e.g. because the watch limit is reached.
+    pub fn new(root: &Path) -> Result<Self> {
+        use std::os::fd::FromRawFd;
+
+        // SAFETY: inotify_init1 has no preconditions. A non-negative result is a new fd we own.
+        let fd = unsafe { libc::inotify_init1(libc::IN_NONBLOCK | libc::IN_CLOEXEC) };
+        if fd < 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+        let mut watch = FolderWatch {
+            // SAFETY: `fd` was just opened and is not owned by anything else.
+            fd: AsyncFd::new(unsafe { std::os::fd::OwnedFd::from_raw_fd(fd) })?,
+            root: root.to_owned(),
+            dirs: HashMap::new(),
+        };
+        watch.add_dirs(root)?;
+        Ok(watch)
+    }
+
+    /// Watches `dir` and every folder below it. Folders watched already are not duplicated.
+    fn add_dirs(&mut self, dir: &Path) -> Result<()> {
+        use std::{ffi::CString, os::fd::AsRawFd, os::unix::ffi::OsStrExt};
+
+        let mut dirs = vec![dir.to_owned()];
+        while let Some(dir) = dirs.pop() {
+            let path =
+                CString::new(dir.as_os_str().as_bytes()).map_err(|_| crate::error::Error {
+                    msg: format!("Invalid folder path {}.", dir.display()),
+                    kind: crate::error::ErrorKind::IO,
+                })?;
+            let mask = libc::IN_CREATE | libc::IN_CLOSE_WRITE | libc::IN_MOVED_TO;
+            // SAFETY: the fd is a valid inotify fd and `path` is NUL terminated.
+            let wd = unsafe { libc::inotify_add_watch(self.fd.as_raw_fd(), path.as_ptr(), mask) };
+            if wd < 0 {
+                return Err(std::io::Error::last_os_error().into());
+            }
+            self.dirs.insert(wd, dir.clone());
+            for entry in fs::read_dir(&dir)? {
+                let path = entry?.path();
+                if path.is_dir() {
+                    dirs.push(path);
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// Waits until the inotify fd is readable, and returns the events that happened since the
+    /// last call. Returns once there is at least one event.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the events cannot be read or a new folder cannot be watched.
+    pub async fn wait_events(&mut self) -> Result<Vec<WatchEvent>> {
+        loop {
+            // Cleared before reading, so that events arriving during the read wake us again
+            self.fd.readable().await?.clear_ready();
+            let events = self.read_events()?;
+            if !events.is_empty() {
+                return Ok(events);
+            }
+        }
+    }
+
+    /// Returns the events that happened since the last call, without blocking.
+    ///
+    /// # Errors
+    ///
+    /// - `ErrorKind::IO` if the events cannot be read or a new folder cannot be watched.
+    pub fn read_events(&mut self) -> Result<Vec<WatchEvent>> {
+        use std::os::fd::AsRawFd;
+
+        const EVENT_SIZE: usize = std::mem::size_of::<libc::inotify_event>();
+        let mut events = Vec::new();
+        // Large enough for many events, and aligned for `inotify_event`
+        let mut buffer = [0u64; 1024];
+        loop {
+            // SAFETY: the fd is a valid inotify fd and the buffer is valid for its length.
+            let len = unsafe {
+                libc::read(
+                    self.fd.as_raw_fd(),
+                    buffer.as_mut_ptr().cast(),
+                    std::mem::size_of_val(&buffer),
+                )
+            };
+            if len < 0 {
+                let error = std::io::Error::last_os_error();
+                if error.kind() == std::io::ErrorKind::WouldBlock {
+                    return Ok(events);
+                }
+                return Err(error.into());
+            }
+            let bytes = &as_bytes(&buffer)[..len as usize];
+            let mut offset = 0;
+            while offset + EVENT_SIZE <= bytes.len() {
+                // SAFETY: the kernel wrote a whole `inotify_event` at `offset`.
+                let event: libc::inotify_event =
+                    unsafe { std::ptr::read_unaligned(bytes[offset..].as_ptr().cast()) };
+                let name_start = offset + EVENT_SIZE;
+                let name_end = name_start + event.len as usize;
+                let name = &bytes[name_start..name_end];
+                let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+                offset = name_end;
+                self.handle_event(&event, name, &mut events)?;
+            }
+        }
+    }
+
+    fn handle_event(
+        &mut self,
+        event: &libc::inotify_event,
+        name: &[u8],
+        events: &mut Vec<WatchEvent>,
+    ) -> Result<()> {
+        use std::{ffi::OsStr, os::unix::ffi::OsStrExt};
+
+        if event.mask & libc::IN_Q_OVERFLOW != 0 {
+            // Folders created while events were dropped are picked up by the rescan
+            self.add_dirs(&self.root.clone())?;
+            events.push(WatchEvent::Rescan(self.root.clone()));
+            return Ok(());
+        }
+        if event.mask & libc::IN_IGNORED != 0 {
+            self.dirs.remove(&event.wd);
+            return Ok(());
+        }
+        let Some(dir) = self.dirs.get(&event.wd) else {
+            return Ok(());
+        };
+        let path = dir.join(OsStr::from_bytes(name));
+        if event.mask & libc::IN_ISDIR != 0 {
+            // Files may have landed before the folder was watched
+            if path.is_dir() {
+                self.add_dirs(&path)?;
+                events.push(WatchEvent::Rescan(path));
+            }
+        } else if event.mask & libc::IN_CREATE != 0 {
+            events.push(WatchEvent::Created(path));
+        } else {
+            events.push(WatchEvent::Closed(path));
+        }
+        Ok(())
+    }
+}
+
+fn as_bytes(buffer: &[u64]) -> &[u8] {
+    // SAFETY: any initialized memory can be viewed as bytes, and the length covers the buffer.
+    unsafe { std::slice::from_raw_parts(buffer.as_ptr().cast(), std::mem::size_of_val(buffer)) }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_utils::TempFolder;
+    use test_context::test_context;
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn ready_once_closed_and_settled(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let settle = Duration::from_secs(2);
+        let mut files = StableFiles::new(settle);
+        let open = ctx.path.join("open.mp4");
+        let closed = ctx.path.join("closed.mp4");
+        let gone = ctx.path.join("gone.mp4");
+        fs::write(&open, "partial")?;
+        fs::write(&closed, "complete")?;
+        let start = Instant::now();
+        files.observe(open.clone(), false, start);
+        files.observe(closed.clone(), true, start);
+        files.observe(gone, true, start);
+
+        // WHEN
+        let early = files.take_ready(start + Duration::from_secs(1));
+        fs::write(&closed, "complete and then some")?;
+        let grown = files.take_ready(start + Duration::from_secs(3));
+        let settled = files.take_ready(start + Duration::from_secs(5));
+
+        // THEN
+        assert!(early.is_empty());
+        // Growing restarts the settle time
+        assert!(grown.is_empty());
+        assert_eq!(settled, vec![closed]);
+        // The open file stays pending, the missing one is dropped
+        assert_eq!(files.len(), 1);
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn watch_files_and_new_folders(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let mut watch = FolderWatch::new(&ctx.path)?;
+
+        // WHEN
+        fs::write(ctx.path.join("a.mp4"), "a")?;
+        fs::create_dir(ctx.path.join("sub"))?;
+        let first = watch.read_events()?;
+        fs::write(ctx.path.join("sub").join("b.mp4"), "b")?;
+        let second = watch.read_events()?;
+
+        // THEN
+        assert_eq!(
+            first,
+            vec![
+                WatchEvent::Created(ctx.path.join("a.mp4")),
+                WatchEvent::Closed(ctx.path.join("a.mp4")),
+                WatchEvent::Rescan(ctx.path.join("sub")),
+            ]
+        );
+        assert_eq!(
+            second,
+            vec![
+                WatchEvent::Created(ctx.path.join("sub").join("b.mp4")),
+                WatchEvent::Closed(ctx.path.join("sub").join("b.mp4")),
+            ]
+        );
+        Ok(())
+    }
+
+    #[test_context(TempFolder)]
+    #[tokio::test]
+    async fn wait_for_events(ctx: &TempFolder) -> Result<()> {
+        // GIVEN
+        let mut watch = FolderWatch::new(&ctx.path)?;
+        let path = ctx.path.join("a.mp4");
+
+        // WHEN
+        let (events, ()) = tokio::join!(watch.wait_events(), async {
+            tokio::time::sleep(Duration::from_millis(100)).await;
+            fs::write(&path, "a").expect("Failed to write the watched file.");
+        });
+
+        // THEN
+        // Waking up on the creation already, the close may come with it or on the next wait
+        let mut events = events?;
+        if events.len() == 1 {
+            events.extend(watch.wait_events().await?);
+        }
+        assert_eq!(
+            events,
+            vec![WatchEvent::Created(path.clone()), WatchEvent::Closed(path)]
+        );
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn next_deadline_of_closed_files() {
+        // GIVEN
+        let settle = Duration::from_secs(2);
+        let mut files = StableFiles::new(settle);
+        let start = Instant::now();
+
+        // WHEN
+        files.observe(PathBuf::from("open.mp4"), false, start);
+        let open_only = files.next_deadline();
+        files.observe(
+            PathBuf::from("late.mp4"),
+            true,
+            start + Duration::from_secs(1),
+        );
+        files.observe(PathBuf::from("early.mp4"), true, start);
+
+        // THEN
+        assert_eq!(open_only, None);
+        assert_eq!(files.next_deadline(), Some(start + settle));
+    }
+}
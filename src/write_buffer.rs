@@ -0,0 +1,317 @@
+use crate::{
+    access::{Access, AccessLog},
+    db::Item,
+};
+use std::{
+    collections::HashMap,
+    time::{Duration, Instant},
+};
+
+/// Writes taken out of a `WriteBuffer`, to be applied to the db in a single transaction.
+#[derive(Debug, Default, PartialEq)]
+pub struct PendingWrites {
+    /// New title of each collection.
+    pub titles: Vec<(i64, String)>,
+    /// Collection, tag name, and whether the collection should have the tag.
+    pub tags: Vec<(i64, String, bool)>,
+    /// Item hash and the accesses of that item.
+    pub accesses: Vec<(String, Access)>,
+}
+
+impl PendingWrites {
+    pub fn is_empty(&self) -> bool {
+        self.titles.is_empty() && self.tags.is_empty() && self.accesses.is_empty()
+    }
+}
+
+/// Coalesces small metadata writes in memory so that they reach the db in batches.
+///
+/// Only the final state of each write target is kept: retitling a collection twice keeps the
+/// last title, and adding then removing a tag keeps the removal. The buffer is due for a flush
+/// once it holds `max_pending` targets or its oldest write is `max_delay` old, which bounds the
+/// writes lost if the process dies without flushing.
+#[derive(Debug)]
+pub struct WriteBuffer {
+    titles: HashMap<i64, String>,
+    tags: HashMap<(i64, String), bool>,
+    access_log: AccessLog,
+    oldest: Option<Instant>,
+    /// Number of title and tag writes buffered so far, see `revision`.
+    revision: u64,
+    max_pending: usize,
+    max_delay: Duration,
+}
+
+impl WriteBuffer {
+    pub fn new(max_pending: usize, max_delay: Duration) -> Self {
+        WriteBuffer {
+            titles: HashMap::new(),
+            tags: HashMap::new(),
+            access_log: AccessLog::default(),
+            oldest: None,
+            revision: 0,
+            max_pending,
+            max_delay,
+        }
+    }
+
+    pub fn set_title(&mut self, collection_id: i64, title: &str) {
+        self.touch();
+        self.revision += 1;
+        self.titles.insert(collection_id, title.to_owned());
+    }
+
+    /// Adds `tag` to a collection if `present`, removes it otherwise.
+    pub fn set_tag(&mut self, collection_id: i64, tag: &str, present: bool) {
+        self.touch();
+        self.revision += 1;
+        self.tags.insert((collection_id, tag.to_owned()), present);
+    }
+
+    pub fn record_access(&mut self, hash: &str, at: i64) {
+        self.touch();
+        self.access_log.record(hash, at);
+    }
+
+    fn touch(&mut self) {
+        self.oldest.get_or_insert_with(Instant::now);
+    }
+
+    /// Number of distinct write targets pending.
+    pub fn len(&self) -> usize {
+        self.titles.len() + self.tags.len() + self.access_log.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Whether titles or tags are pending, which unlike accesses change query results.
+    pub fn has_pending_metadata(&self) -> bool {
+        !self.titles.is_empty() || !self.tags.is_empty()
+    }
+
+    /// Changes with every title or tag write, so that results patched with pending writes can
+    /// tell whether they are current. Flushing leaves it as is, since the db takes over the
+    /// writes.
+    pub fn revision(&self) -> u64 {
+        self.revision
+    }
+
+    /// Collections with pending titles or tags, in order.
+    pub fn pending_collections(&self) -> Vec<i64> {
+        let mut collection_ids: Vec<i64> = self
+            .titles
+            .keys()
+            .copied()
+            .chain(self.tags.keys().map(|(collection_id, _)| *collection_id))
+            .collect();
+        collection_ids.sort_unstable();
+        collection_ids.dedup();
+        collection_ids
+    }
+
+    /// Pending tag writes: collection, tag name, and whether the collection should have the tag.
+    pub fn pending_tags(&self) -> Vec<(i64, String, bool)> {
+        self.tags
+            .iter()
+            .map(|((collection_id, tag), present)| (*collection_id, tag.clone(), *present))
+            .collect()
+    }
+
+    /// Whether tags of `collection_id` are pending.
+    pub fn has_pending_tags(&self, collection_id: i64) -> bool {
+        self.tags.keys().any(|(id, _)| *id == collection_id)
+    }
+
+    /// Pending title of `collection_id`, if any.
+    pub fn pending_title(&self, collection_id: i64) -> Option<&str> {
+        self.titles.get(&collection_id).map(String::as_str)
+    }
+
+    /// Whether the buffer has reached its size or age limit.
+    pub fn is_due(&self) -> bool {
+        self.len() >= self.max_pending
+            || self
+                .oldest
+                .is_some_and(|oldest| oldest.elapsed() >= self.max_delay)
+    }
+
+    /// Removes and returns all pending writes.
+    pub fn take(&mut self) -> PendingWrites {
+        self.oldest = None;
+        PendingWrites {
+            titles: self.titles.drain().collect(),
+            tags: self
+                .tags
+                .drain()
+                .map(|((collection_id, tag), present)| (collection_id, tag, present))
+                .collect(),
+            accesses: self.access_log.take(),
+        }
+    }
+
+    /// Puts writes back after they failed to be applied.
+    ///
+    /// Writes buffered since `take` win over the restored ones.
+    pub fn restore(&mut self, writes: PendingWrites) {
+        for (collection_id, title) in writes.titles {
+            self.titles.entry(collection_id).or_insert(title);
+        }
+        for (collection_id, tag, present) in writes.tags {
+            self.tags.entry((collection_id, tag)).or_insert(present);
+        }
+        for (hash, access) in writes.accesses {
+            self.access_log.restore(&hash, access);
+        }
+        if !self.is_empty() {
+            self.touch();
+        }
+    }
+
+    /// Applies pending writes to an item read from the db, so that readers see their own writes.
+    pub fn patch(&self, item: &mut Item) {
+        if let Some(title) = self.titles.get(&item.collection_id) {
+            item.title.clone_from(title);
+        }
+        for ((collection_id, tag), present) in &self.tags {
+            if *collection_id != item.collection_id {
+                continue;
+            }
+            let has_tag = item.tags.contains(tag);
+            if *present && !has_tag {
+                item.tags.push(tag.clone());
+            } else if !*present && has_tag {
+                item.tags.retain(|item_tag| item_tag != tag);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn test_item() -> Item {
+        Item {
+            hash: String::from("09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79"),
+            title: String::from("Old title"),
+            ext: String::from("mp4"),
+            collection_id: 1,
+            tags: vec![String::from("meta:Incomplete")],
+        }
+    }
+
+    #[tokio::test]
+    async fn coalesce() {
+        // GIVEN
+        let mut buffer = WriteBuffer::new(100, Duration::from_secs(60));
+
+        // WHEN
+        buffer.set_title(1, "First");
+        buffer.set_title(1, "Second");
+        buffer.set_tag(1, "tag:A", true);
+        buffer.set_tag(1, "tag:A", false);
+
+        // THEN
+        assert_eq!(buffer.len(), 2);
+        assert!(!buffer.is_due());
+        assert_eq!(
+            buffer.take(),
+            PendingWrites {
+                titles: vec![(1, String::from("Second"))],
+                tags: vec![(1, String::from("tag:A"), false)],
+                accesses: Vec::new(),
+            }
+        );
+        assert!(buffer.is_empty());
+    }
+
+    #[tokio::test]
+    async fn due_by_size_and_age() {
+        // GIVEN
+        let mut by_size = WriteBuffer::new(2, Duration::from_secs(60));
+        let mut by_age = WriteBuffer::new(100, Duration::ZERO);
+
+        // WHEN
+        by_size.set_tag(1, "tag:A", true);
+        by_size.set_tag(2, "tag:A", true);
+        by_age.set_title(1, "Title");
+
+        // THEN
+        assert!(by_size.is_due());
+        assert!(by_age.is_due());
+    }
+
+    #[tokio::test]
+    async fn patch_reads() {
+        // GIVEN
+        let mut buffer = WriteBuffer::new(100, Duration::from_secs(60));
+        buffer.set_title(1, "New title");
+        buffer.set_tag(1, "meta:Incomplete", false);
+        buffer.set_tag(1, "tag:A", true);
+        buffer.set_tag(2, "tag:B", true);
+        let mut item = test_item();
+
+        // WHEN
+        buffer.patch(&mut item);
+
+        // THEN
+        assert_eq!(item.title, "New title");
+        assert_eq!(item.tags, vec![String::from("tag:A")]);
+    }
+
+    #[tokio::test]
+    async fn list_pending_collections() {
+        // GIVEN
+        let mut buffer = WriteBuffer::new(100, Duration::from_secs(60));
+        buffer.set_tag(3, "tag:A", true);
+        buffer.set_title(1, "Title");
+        buffer.set_tag(1, "tag:A", false);
+        buffer.record_access(
+            "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79",
+            0,
+        );
+
+        // THEN
+        assert_eq!(buffer.pending_collections(), vec![1, 3]);
+        assert!(buffer.has_pending_tags(3));
+        assert!(!buffer.has_pending_tags(2));
+        assert_eq!(buffer.pending_title(1), Some("Title"));
+    }
+
+    #[tokio::test]
+    async fn count_revisions() {
+        // GIVEN
+        let mut buffer = WriteBuffer::new(100, Duration::from_secs(60));
+
+        // WHEN
+        buffer.set_title(1, "Title");
+        buffer.set_tag(1, "tag:A", true);
+        buffer.record_access(
+            "09c683231bb0e88e84a8408fdbfe174c70d83d03e0604eb612631e79",
+            0,
+        );
+        let before_take = buffer.revision();
+        buffer.take();
+
+        // THEN
+        assert_eq!(before_take, 2);
+        assert_eq!(buffer.revision(), 2);
+    }
+
+    #[tokio::test]
+    async fn restore_keeps_newer_writes() {
+        // GIVEN
+        let mut buffer = WriteBuffer::new(100, Duration::from_secs(60));
+        buffer.set_title(1, "Old");
+        let writes = buffer.take();
+        buffer.set_title(1, "New");
+
+        // WHEN
+        buffer.restore(writes);
+
+        // THEN
+        assert_eq!(buffer.take().titles, vec![(1, String::from("New"))]);
+    }
+}